@@ -1,29 +1,69 @@
+#define _GNU_SOURCE // splice, copy_file_range
 #include "client.h"
 #include "enum.h"
 #include "file_io.h"
 #include "logger.h"
+#include "mcast.h"
+#include "peer.h"
+#include "pipeline.h"
+#include "ratelimit.h"
+#include "tracker.h"
 #include "utils.h"
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/unistd.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
 /*
 1. Load a metainfo file (functionality is already available in the file_io API).
   a. Check for the existence of the associated downloaded file.
-  b. Check which blocks are correct using the SHA256 hashes in the metainfo file.
-2. For each server peer in the metainfo file:
-  a. Connect to that server peer.
-  b. For each incorrect block in the downloaded file (the hash does not match in 1b).
-    i. Send a request to the server peer.
-    ii. If the server responds with the block, store it to the downloaded file.
-    iii. Otherwise, if the server signals the unavailablity of the block, do nothing.
-  c. Close the connection.
-3. Terminate.
+  b. Check which blocks are correct using the SHA256 hashes in the metainfo file. With -b only the
+  holes of the file are known to be missing at startup; a thread checks the other blocks while
+  the missing ones are downloaded, and they are not requested before they are checked.
+2. Until the file (or, with -p, the blocks covering the requested byte ranges) is complete or the
+deadline passes:
+  a. Choose a peer with peer_select, so fast peers get most of the requests. Only the nearest peers
+  (by locality label) are candidates while one of them can take the request; farther ones are added
+  when the near ones delivered less than near_rate during a whole window.
+  b. Connect to that server peer if we are not connected yet, giving up after peer_timeout as for a
+  request, run the TLS handshake when encrypting (see tls.h), and agree on the protocol version and the
+  capabilities to use with MSG_HELLO. A legacy peer sends MSG_BITFIELD right away, or closes the connection:
+  as a server that restarts does that too, connect to it again with MSG_HELLO first, and only take it for a
+  legacy peer when it closes CLIENT__LEGACY_CLOSES connections in a row. Then only use the messages of
+  version 0 with it, until a connection to it fails.
+  c. Send a request for the first missing blocks the peer has not signaled as unavailable, up to
+  CLIENT__REQUEST_BLOCKS in one message, and receive the answers in order.
+    i. If the server responds with the block, hand it to the pipeline, whose threads verify it
+    and store it to the downloaded file while we go on with the next request. In zero-copy mode
+    the block is spliced straight into the file and the pipeline verifies it there.
+    ii. Otherwise, if the server signals the unavailablity of the block, remember it.
+    iii. If the block does not arrive before peer_timeout, drop the connection. The block is
+    still missing so it goes to whichever peer is chosen next.
+  d. Update the statistics of the peer (rtt, throughput, NA rate, failures).
+  Requests are not issued, and the socket is not read, faster than the rate limits allow.
+  e. If the peer failed or sent corrupted blocks, do not use it again until its backoff expires, nor at all
+  once it sent CLIENT__MAX_CORRUPT corrupted blocks.
+  With a tracker, only the peers it lists as live are connected to, and the list is refreshed
+  every CLIENT__TRACKER_INTERVAL; the peers it knows and the metainfo file does not are added.
+  With -U the requests to a connected peer go over UDP (see udp.h), unless it does not answer there.
+  With -u a server thread serves the torrent meanwhile, each block as soon as it is stored.
+  With -s the stored blocks are also written in order to a stream, and only the blocks at most
+  stream_ahead bytes past what was written can be requested, closest first.
+3. Close the connections and terminate.
 */
 
 char client__is_completed(struct fio_torrent_t *const t) {
@@ -35,159 +75,2228 @@ char client__is_completed(struct fio_torrent_t *const t) {
     return 1;
 }
 
-int client_init(struct fio_torrent_t *t) {
+static volatile sig_atomic_t client__reload = 0; ///< Counts SIGHUPs, each download rereads the control file when it changes
+
+static void client__on_sighup(int signum) {
+    (void)signum;
+    client__reload++;
+}
+
+/**
+ * Read the rate limits from the control file of the settings, if any.
+ * The file holds the global and the per-peer limits in bytes per second, as accepted by utils_parse_rate.
+ */
+static void client__read_control_file(struct client_t *c) {
+    if (c->config->control_file == NULL)
+        return;
+
+    FILE *f = fopen(c->config->control_file, "r");
+    if (f == NULL) {
+        log_printf(LOG_INFO, "Cannot open control file %s: %s", c->config->control_file, strerror(errno));
+        errno = 0;
+        return;
+    }
+
+    char global[32], peer[32];
+    double global_rate, peer_rate;
+    const int r = fscanf(f, "%31s %31s", global, peer);
+    fclose(f);
+
+    if (r != 2 || utils_parse_rate(global, &global_rate) || utils_parse_rate(peer, &peer_rate)) {
+        log_printf(LOG_INFO, "Control file %s must contain the global and the per-peer rate", c->config->control_file);
+        return;
+    }
+
+    log_printf(LOG_INFO, "Rate limits set to %.0f B/s, %.0f B/s per peer", global_rate, peer_rate);
+
+    ratelimit_set_rate(c->limit, global_rate);
+    for (uint64_t i = 0; i < c->torrent->peer_count; i++) {
+        ratelimit_set_rate(&c->peers[i].limit, peer_rate);
+    }
+}
+
+/**
+ * Set up the state of the peer t->peers[i]
+ */
+static void client__init_peer(struct client_t *c, const uint64_t i) {
+    const struct fio_peer_information_t *info = &c->torrent->peers[i];
+    struct client__peer_t *p = &c->peers[i];
+
+    p->sock = -1;
+    p->cursor = 0;
+    p->na_map = NULL;
+    p->backoff = 0;
+    p->retry_at = 0;
+    p->corrupt = 0;
+    p->corrupted = 0;
+    p->self = info->unix_path[0] != '\0'
+                  ? c->config->unix_path != NULL && !strcmp(info->unix_path, c->config->unix_path)
+                  : c->config->relay_port != 0 && info->peer_port == htons(c->config->relay_port) && info->peer_address[0] == 127;
+    p->distance = PEER_LOCALITY_LEVELS;
+    p->live = 1;
+    p->gossip_until = 0;
+    p->no_pex = 0;
+    p->legacy = 0;
+    p->hello_closed = 0;
+    p->capabilities = 0;
+    p->depth = 1;
+    p->have_next = 0;
+    p->no_udp = info->unix_path[0] != '\0';
+    p->file = -1;
+    peer_stats_init(&p->stats);
+    ratelimit_init(&p->limit, c->config->peer_rate);
+}
+
+/**
+ * Find a peer, adding it if it is new and there is room for it
+ * @param source where the peer was learnt from, for the log
+ * @return the index of the peer or t->peer_count if there is no room
+ */
+static uint64_t client__add_peer(struct client_t *c, const struct fio_peer_information_t *info, const char *source) {
+    struct fio_torrent_t *t = c->torrent;
+    uint64_t i = 0;
+
+    while (i < t->peer_count && (t->peers[i].peer_port != info->peer_port ||
+                                 memcmp(t->peers[i].peer_address, info->peer_address, sizeof(info->peer_address)) ||
+                                 strcmp(t->peers[i].unix_path, info->unix_path))) {
+        i++;
+    }
+
+    if (i < t->peer_count)
+        return i;
+
+    if (t->peer_count == c->peer_capacity) {
+        log_printf(LOG_DEBUG, "No room for more peers from %s", source);
+        return i;
+    }
+
+    t->peers[i] = *info;
+    client__init_peer(c, i);
+    t->peer_count++;
+
+    log_printf(LOG_INFO, "New peer %d.%d.%d.%d:%d from %s", info->peer_address[0], info->peer_address[1],
+               info->peer_address[2], info->peer_address[3], ntohs(info->peer_port), source);
+    return i;
+}
+
+/**
+ * Ask the tracker for the live peers. The others are not connected to until a later answer lists them.
+ * If the tracker does not answer, the peers stay as they are.
+ */
+static void client__query_tracker(struct client_t *c) {
+    struct fio_torrent_t *t = c->torrent;
+    struct fio_peer_information_t found[TRACKER_MAX_PEERS];
+    size_t count;
+
+    c->tracker_at = utils_now() + CLIENT__TRACKER_INTERVAL;
+
+    if (tracker_query(&c->tracker, t->downloaded_file_hash, found, TRACKER_MAX_PEERS, &count))
+        return;
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        c->peers[i].live = 0;
+    }
+
+    for (size_t j = 0; j < count; j++) {
+        const uint64_t i = client__add_peer(c, &found[j], "the tracker");
+
+        if (i < t->peer_count)
+            c->peers[i].live = 1;
+    }
+
+    log_printf(LOG_DEBUG, "The tracker lists %lu live peers", count);
+}
+
+/**
+ * Compute the distance of every peer from this host and the initial reach.
+ * The labels come from the metainfo file, and from the locality file of the settings, if any. Each line of
+ * that file holds a name and a label: "self eu-west/r12/node7" for this host, "host:port eu-west/r3/node1"
+ * to set or override the label of a peer. Lines starting with '#' are ignored.
+ */
+static void client__read_locality(struct client_t *c) {
+    struct fio_torrent_t *t = c->torrent;
+    const char *path = c->config->locality;
+    FILE *f = path != NULL ? fopen(path, "r") : NULL;
+
+    if (path != NULL && f == NULL) {
+        log_printf(LOG_INFO, "Cannot open locality file %s: %s", path, strerror(errno));
+        errno = 0;
+    }
+
+    char line[1024];
+    char name[1024];
+    char label[FIO_MAX_LOCALITY];
+    char self[FIO_MAX_LOCALITY] = "";
+
+    // the label of this host first, the distances are measured from it
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%1023s %63s", name, label) == 2 && strcmp(name, "self") == 0)
+            strcpy(self, label);
+    }
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        c->peers[i].distance = peer_distance(self, t->peers[i].locality);
+    }
+
+    if (f != NULL) {
+        rewind(f);
+
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "%1023s %63s", name, label) != 2 || name[0] == '#' || strcmp(name, "self") == 0)
+                continue;
+
+            char *const colon = strrchr(name, ':');
+
+            if (colon == NULL) {
+                log_printf(LOG_INFO, "Locality file %s: %s is not host:port", path, name);
+                continue;
+            }
+
+            *colon = '\0';
+
+            struct addrinfo hints = {0};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+
+            struct addrinfo *result;
+            const int r = getaddrinfo(name, colon + 1, &hints, &result);
+
+            if (r != 0) {
+                log_printf(LOG_INFO, "Locality file %s: cannot resolve %s: %s", path, name, gai_strerror(r));
+                continue;
+            }
+
+            const struct sockaddr_in *addr_in = (struct sockaddr_in *)result->ai_addr;
+            const uint32_t addr = ntohl(addr_in->sin_addr.s_addr);
+
+            for (uint64_t i = 0; i < t->peer_count; i++) {
+                const struct fio_peer_information_t *info = &t->peers[i];
+
+                if (info->peer_port == addr_in->sin_port && info->peer_address[0] == (uint8_t)(addr >> 24) &&
+                    info->peer_address[1] == (uint8_t)(addr >> 16) && info->peer_address[2] == (uint8_t)(addr >> 8) &&
+                    info->peer_address[3] == (uint8_t)addr) {
+                    c->peers[i].distance = peer_distance(self, label);
+                }
+            }
+
+            freeaddrinfo(result);
+        }
+
+        fclose(f);
+    }
+
+    c->reach = PEER_LOCALITY_LEVELS;
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        if (!c->peers[i].self && c->peers[i].distance < c->reach)
+            c->reach = c->peers[i].distance;
+    }
+
+    if (self[0] != '\0')
+        log_printf(LOG_INFO, "Locality %s, using peers up to distance %d first", self, c->reach);
+}
+
+/**
+ * Once per CLIENT__REACH_WINDOW, widen the reach to the next farther peers if the client kept the peers
+ * in reach busy and still received less than near_rate. The reach never shrinks back.
+ */
+static void client__update_reach(struct client_t *c, const double now) {
+    if (c->config->near_rate <= 0 || c->reach >= PEER_LOCALITY_LEVELS || now - c->reach_since < CLIENT__REACH_WINDOW)
+        return;
+
+    uint64_t bytes = 0;
+    int next = PEER_LOCALITY_LEVELS;
+
+    for (uint64_t i = 0; i < c->torrent->peer_count; i++) {
+        const struct client__peer_t *p = &c->peers[i];
+        bytes += p->stats.bytes;
+
+        if (!p->self && p->distance > c->reach && p->distance < next)
+            next = p->distance;
+    }
+
+    const double rate = (double)(bytes - c->reach_bytes) / (now - c->reach_since);
+
+    if (!c->reach_idle && rate < c->config->near_rate) {
+        log_printf(LOG_INFO, "Only %.0f B/s from the peers up to distance %d, also using those at distance %d",
+                   rate, c->reach, next);
+        c->reach = next;
+    }
+
+    c->reach_since = now;
+    c->reach_bytes = bytes;
+    c->reach_idle = 0;
+}
+
+void client_config_init(struct client_config_t *config) {
+    config->deadline = CLIENT_DEFAULT_DEADLINE;
+    config->rate = 0;
+    config->peer_rate = 0;
+    config->control_file = NULL;
+    config->zero_copy = 0;
+    config->reorder_bytes = CLIENT_DEFAULT_REORDER_BYTES;
+    config->flush_delay = CLIENT_DEFAULT_FLUSH_DELAY;
+    config->background_check = 0;
+    config->ranges = NULL;
+    config->stream = NULL;
+    config->stream_ahead = CLIENT_DEFAULT_STREAM_AHEAD;
+    config->shared_limit = NULL;
+    config->connections = NULL;
+    config->relay_port = 0;
+    config->locality = NULL;
+    config->near_rate = 0;
+    config->tracker = NULL;
+    config->compress = 0;
+    config->udp = 0;
+    config->unix_path = NULL;
+    config->multicast = NULL;
+    config->tls = NULL;
+
+    // leave a core for the network thread
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    config->verifiers = cpus > 2 ? (size_t)cpus - 1 : 1;
+}
+
+/**
+ * Completion callback of the pipeline, called from its threads
+ */
+static void client__on_block_done(void *arg, struct pipeline_job_t *job, int result) {
+    struct client_t *c = arg;
+    struct client__peer_t *p = job->context;
+
+    if (result == PIPELINE_STORED) {
+        __atomic_sub_fetch(&c->missing, 1, __ATOMIC_RELAXED);
+        sem_post(&c->stored);
+    } else if (result == PIPELINE_CORRUPTED && p != NULL) {
+        __atomic_add_fetch(&p->corrupt, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->corrupt, 1, __ATOMIC_RELAXED);
+    } else {
+        // not the fault of a peer (or received from the multicast group), but the block is missing again
+        __atomic_add_fetch(&c->corrupt, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&c->pending[job->block_number], 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&c->in_flight, 1, __ATOMIC_RELEASE);
+    sem_post(&c->progress);
+}
+
+/**
+ * Wait for a semaphore, at most for the given time
+ */
+static void client__wait_sem(sem_t *sem, double seconds) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    const double end = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9 + seconds;
+    ts.tv_sec = (time_t)end;
+    ts.tv_nsec = (long)((end - (double)ts.tv_sec) * 1e9);
+
+    while (sem_timedwait(sem, &ts) && errno == EINTR)
+        errno = 0;
+    errno = 0;
+}
+
+/**
+ * Wait until a block leaves the pipeline, at most for the given time
+ */
+static void client__wait_progress(struct client_t *c, double seconds) {
+    client__wait_sem(&c->progress, seconds);
+}
+
+/**
+ * Tells whether a block is part of the download
+ */
+static char client__wanted(const struct client_t *c, const uint64_t k) {
+    return c->wanted == NULL || c->wanted[k];
+}
+
+/**
+ * Check the next unchecked block of the file, if any. A block found missing may be behind the cursors
+ * of the peers, so it is recorded in c->rewind.
+ * @return 0 if a block was checked or -1 if there is nothing left to check
+ */
+static int client__check_next(struct client_t *c) {
+    struct fio_torrent_t *t = c->torrent;
+
+    while (1) {
+        const uint64_t k = __atomic_fetch_add(&c->check_next, 1, __ATOMIC_RELAXED);
+
+        if (k >= t->block_count)
+            return -1;
+
+        if (!client__wanted(c, k) || __atomic_load_n(&t->block_unchecked[k], __ATOMIC_ACQUIRE) == FIO_BLOCK_CHECKED)
+            continue;
+
+        if (fio_check_block(t, k)) {
+            log_printf(LOG_INFO, "Cannot check block %lu, downloading it again: %s", k, strerror(errno));
+            errno = 0;
+        }
+
+        if (__atomic_load_n(&t->block_map[k], __ATOMIC_RELAXED)) {
+            __atomic_sub_fetch(&c->missing, 1, __ATOMIC_RELAXED);
+            sem_post(&c->stored);
+        } else {
+            uint64_t rewind = __atomic_load_n(&c->rewind, __ATOMIC_RELAXED);
+            while (k < rewind && !__atomic_compare_exchange_n(&c->rewind, &rewind, k, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+        }
+
+        __atomic_sub_fetch(&c->unchecked, 1, __ATOMIC_RELEASE);
+        sem_post(&c->progress);
+        return 0;
+    }
+}
+
+/**
+ * Thread checking the blocks of the file in order while the network thread downloads the missing ones
+ */
+static void *client__checker(void *arg) {
+    struct client_t *c = arg;
+    const double start = utils_now();
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED) && client__check_next(c) == 0)
+        ;
+
+    log_printf(LOG_INFO, "File checked in %.3f s", utils_now() - start);
+    return NULL;
+}
+
+/**
+ * Rewind the cursors of the peers to the blocks that the checks found missing
+ */
+static void client__collect_checks(struct client_t *c) {
+    const uint64_t rewind = __atomic_exchange_n(&c->rewind, UINT64_MAX, __ATOMIC_ACQUIRE);
+
+    if (rewind == UINT64_MAX)
+        return;
+
+    for (uint64_t i = 0; i < c->torrent->peer_count; i++) {
+        if (c->peers[i].cursor > rewind)
+            c->peers[i].cursor = rewind;
+    }
+}
+
+/**
+ * Write a stored block to c->out. sendfile moves it from the page cache without a copy to user space;
+ * if out does not support it, fall back to pread and write.
+ */
+static int client__emit_block(struct client_t *c, const uint64_t k, char *use_sendfile) {
+    const int fd = fileno(c->torrent->downloaded_file_stream);
+    off_t offset = (off_t)(k * FIO_MAX_BLOCK_SIZE);
+    size_t left = fio_get_block_size(c->torrent, k);
+
+    while (left > 0 && *use_sendfile) {
+        const ssize_t n = sendfile(c->out, fd, &offset, left);
+
+        if (n < 0 && errno == EINTR) {
+            errno = 0;
+            continue;
+        }
+
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            errno = 0;
+            *use_sendfile = 0;
+            break;
+        }
+
+        if (n <= 0)
+            return -1;
+
+        left -= (size_t)n;
+    }
+
+    if (left == 0)
+        return 0;
+
+    uint8_t buffer[FIO_MAX_BLOCK_SIZE];
+    ssize_t got;
+
+    while ((got = pread(fd, buffer, left, offset)) < 0 && errno == EINTR)
+        errno = 0;
+
+    if (got != (ssize_t)left)
+        return -1;
+
+    for (size_t done = 0; done < left;) {
+        const ssize_t n = write(c->out, buffer + done, left - done);
+
+        if (n < 0 && errno == EINTR) {
+            errno = 0;
+            continue;
+        }
+
+        if (n <= 0)
+            return -1;
+
+        done += (size_t)n;
+    }
+
+    return 0;
+}
+
+/**
+ * Thread writing the file to c->out in order, as soon as each block is stored.
+ * Each block written moves the request window of client__next_block forward.
+ */
+static void *client__streamer(void *arg) {
+    struct client_t *c = arg;
+    struct fio_torrent_t *t = c->torrent;
+    char use_sendfile = 1;
+    double waited = 0; // time the consumer could have been given data but the next block was missing
+
+    for (uint64_t k = 0; k < t->block_count;) {
+        if (__atomic_load_n(&t->block_map[k], __ATOMIC_ACQUIRE)) {
+            if (client__emit_block(c, k, &use_sendfile)) {
+                log_printf(LOG_INFO, "Cannot write block %lu to the stream: %s", k, strerror(errno));
+                errno = 0;
+                __atomic_store_n(&c->stream_failed, 1, __ATOMIC_RELEASE);
+                sem_post(&c->progress);
+                return NULL;
+            }
+
+            k++;
+            __atomic_store_n(&c->stream_pos, k, __ATOMIC_RELEASE);
+            sem_post(&c->progress);
+            continue;
+        }
+
+        if (__atomic_load_n(&c->stop, __ATOMIC_RELAXED))
+            break;
+
+        const double start = utils_now();
+        client__wait_sem(&c->stored, 1);
+        waited += utils_now() - start;
+    }
+
+    log_printf(LOG_INFO, "Streamed %lu of %lu blocks, waited %.3f s for missing blocks",
+               __atomic_load_n(&c->stream_pos, __ATOMIC_RELAXED), t->block_count, waited);
+    return NULL;
+}
+
+int client__parse_ranges(const struct fio_torrent_t *t, const char *ranges, uint8_t *wanted) {
+    char *copy = strdup(ranges);
+    if (copy == NULL) {
+        log_printf(LOG_DEBUG, "Strdup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    char *saveptr;
+
+    for (char *range = strtok_r(copy, ",", &saveptr); range != NULL; range = strtok_r(NULL, ",", &saveptr)) {
+        char *dash = strchr(range, '-');
+        double first, last = (double)(t->downloaded_file_size - 1);
+
+        if (dash == NULL) {
+            ret = -1;
+            break;
+        }
+
+        *dash = '\0';
+
+        if (utils_parse_rate(range, &first) || (dash[1] != '\0' && utils_parse_rate(dash + 1, &last)) ||
+            first > last || first >= (double)t->downloaded_file_size) {
+            ret = -1;
+            break;
+        }
+
+        if (last >= (double)t->downloaded_file_size)
+            last = (double)(t->downloaded_file_size - 1);
+
+        // blocks are FIO_MAX_BLOCK_SIZE long but the last one, see fio_get_block_size
+        const uint64_t first_block = (uint64_t)first / FIO_MAX_BLOCK_SIZE;
+        const uint64_t last_block = (uint64_t)last / FIO_MAX_BLOCK_SIZE;
+
+        assert(last_block < t->block_count);
+        assert((uint64_t)last < last_block * FIO_MAX_BLOCK_SIZE + fio_get_block_size(t, last_block));
+
+        log_printf(LOG_INFO, "Bytes %.0f to %.0f are in blocks %lu to %lu", first, last, first_block, last_block);
+
+        for (uint64_t k = first_block; k <= last_block; k++) {
+            wanted[k] = 1;
+        }
+    }
+
+    free(copy);
+
+    if (ret)
+        log_printf(LOG_INFO, "Invalid byte ranges %s for a file of %lu bytes", ranges, t->downloaded_file_size);
+
+    return ret;
+}
+
+void client_setup(const struct client_config_t *config) {
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid()); // used by peer_select and the backoff jitter
+
+    if (config->control_file == NULL)
+        return;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = client__on_sighup;
+    sa.sa_flags = SA_RESTART; // the blocking calls of the downloads go on, their loops see the counter later
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGHUP, &sa, NULL)) {
+        log_printf(LOG_INFO, "Cannot install the SIGHUP handler: %s", strerror(errno));
+        errno = 0;
+    }
+}
+
+int client_init(struct fio_torrent_t *t, const struct client_config_t *config) {
     if (t->downloaded_file_size == 0) {
         log_message(LOG_INFO, "Nothing to download! File size is 0");
         return 0;
     }
 
-    if (client__is_completed(t)) {
-        log_message(LOG_INFO, "File is complete!");
-        return 0;
+    if (config->ranges == NULL && config->stream == NULL && client__is_completed(t)) {
+        log_message(LOG_INFO, "File is complete!");
+        return 0;
+    }
+
+    if (config->ranges != NULL && config->stream != NULL) {
+        log_message(LOG_INFO, "Byte ranges cannot be streamed");
+        return -1;
+    }
+
+    int out = -1;
+
+    if (config->stream != NULL) {
+        // a FIFO blocks here until the consumer opens it
+        out = strcmp(config->stream, "-") ? open(config->stream, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+                                          : STDOUT_FILENO;
+
+        if (out < 0) {
+            log_printf(LOG_INFO, "Cannot open %s: %s", config->stream, strerror(errno));
+            return -1;
+        }
+
+        signal(SIGPIPE, SIG_IGN); // a consumer that goes away is reported by write
+    }
+
+    struct client_t c = {0};
+    c.torrent = t;
+    c.config = config;
+    c.out = out;
+    c.window = config->stream_ahead >= FIO_MAX_BLOCK_SIZE ? (uint64_t)(config->stream_ahead / FIO_MAX_BLOCK_SIZE) : 1;
+    c.tracker_at = HUGE_VAL;
+    c.peer_capacity = t->peer_count;
+
+    // room for the peers learnt from the tracker and from the other peers
+    struct fio_peer_information_t *grown = realloc(t->peers, sizeof(struct fio_peer_information_t) *
+                                                                 (t->peer_count + CLIENT__LEARNT_PEERS));
+
+    if (grown == NULL) {
+        log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+        errno = 0;
+    } else {
+        t->peers = grown;
+        c.peer_capacity = t->peer_count + CLIENT__LEARNT_PEERS;
+    }
+
+    if (config->tracker != NULL) {
+        if (tracker_parse_address(config->tracker, &c.tracker))
+            log_message(LOG_INFO, "Using the peers of the metainfo file only");
+        else
+            c.tracker_at = 0;
+    }
+
+    c.peers = malloc(sizeof(struct client__peer_t) * c.peer_capacity);
+    c.usable = malloc(sizeof(uint8_t) * c.peer_capacity);
+    c.scores = malloc(sizeof(double) * c.peer_capacity);
+    c.pending = calloc(t->block_count, sizeof(uint8_t));
+    c.wanted = config->ranges != NULL ? calloc(t->block_count, sizeof(uint8_t)) : NULL;
+
+    if (c.peers == NULL || c.usable == NULL || c.scores == NULL || c.pending == NULL ||
+        (config->ranges != NULL && c.wanted == NULL)) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        free(c.peers);
+        free(c.usable);
+        free(c.scores);
+        free(c.pending);
+        free(c.wanted);
+        return -1;
+    }
+
+    if ((config->ranges != NULL && client__parse_ranges(t, config->ranges, c.wanted)) || sem_init(&c.progress, 0, 0) ||
+        sem_init(&c.stored, 0, 0)) {
+        log_printf(LOG_DEBUG, "Client setup failed: %s", strerror(errno));
+        free(c.peers);
+        free(c.usable);
+        free(c.scores);
+        free(c.pending);
+        free(c.wanted);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        client__init_peer(&c, i);
+    }
+
+    client__read_locality(&c);
+
+    ratelimit_init(&c.own_limit, config->rate);
+    c.limit = config->shared_limit != NULL ? config->shared_limit : &c.own_limit;
+    c.reload_seen = client__reload;
+
+    client__read_control_file(&c);
+
+    c.rewind = UINT64_MAX;
+
+    for (uint64_t k = 0; k < t->block_count; k++) {
+        if (!client__wanted(&c, k))
+            continue;
+        if (!t->block_map[k])
+            c.missing++;
+        if (t->block_unchecked != NULL && t->block_unchecked[k] != FIO_BLOCK_CHECKED)
+            c.unchecked++;
+    }
+
+    if (t->block_unchecked != NULL)
+        log_printf(LOG_INFO, "%lu blocks missing, %lu to check", c.missing - c.unchecked, c.unchecked);
+
+    c.pipe[0] = c.pipe[1] = -1;
+
+    if (config->zero_copy && pipe(c.pipe)) {
+        log_printf(LOG_INFO, "Cannot create a pipe, zero-copy receive disabled: %s", strerror(errno));
+        errno = 0;
+        c.pipe[0] = c.pipe[1] = -1;
+    }
+
+    c.udp.sock = -1;
+
+    if (config->udp && udp_open(&c.udp, 0)) {
+        log_message(LOG_INFO, "Cannot open a UDP socket, downloading over TCP");
+        c.udp.sock = -1;
+    }
+
+    int ret = -1;
+
+    // the reorder buffer gets its own buffers, so holding blocks does not starve the network thread
+    const size_t reorder_blocks = (size_t)(config->reorder_bytes / FIO_MAX_BLOCK_SIZE);
+
+    // the consumer of a stream, or the downstream peers of a relay, wait for the next block,
+    // so only coalesce what is already queued
+    const double flush_delay = c.out >= 0 || config->relay_port != 0 ? 0 : config->flush_delay;
+
+    if (pipeline_init(&c.pipeline, CLIENT__PIPELINE_BUFFERS + reorder_blocks, config->verifiers,
+                      reorder_blocks, flush_delay, client__on_block_done, &c) == 0) {
+        const char checking = c.unchecked > 0 && pthread_create(&c.checker, NULL, client__checker, &c) == 0;
+        const char streaming = c.out >= 0 && pthread_create(&c.streamer, NULL, client__streamer, &c) == 0;
+
+        if (c.out >= 0 && !streaming) {
+            log_message(LOG_INFO, "Cannot start the streamer thread");
+        } else {
+            ret = client__start(&c);
+        }
+
+        if (ret) {
+            log_printf(LOG_DEBUG, "Client failed");
+        }
+
+        // once everything is stored the streamer still has to write the end of the file
+        if (c.missing > 0)
+            __atomic_store_n(&c.stop, 1, __ATOMIC_RELAXED);
+
+        if (checking)
+            pthread_join(c.checker, NULL);
+
+        if (streaming)
+            pthread_join(c.streamer, NULL);
+    }
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        ratelimit_destroy(&c.peers[i].limit);
+    }
+
+    free(c.peers);
+    free(c.usable);
+    free(c.scores);
+    free(c.pending);
+    free(c.wanted);
+    free(c.deflated);
+    sem_destroy(&c.progress);
+    sem_destroy(&c.stored);
+    ratelimit_destroy(&c.own_limit);
+
+    if (c.out >= 0 && c.out != STDOUT_FILENO)
+        close(c.out);
+
+    if (c.pipe[0] >= 0) {
+        close(c.pipe[0]);
+        close(c.pipe[1]);
+    }
+
+    if (c.udp.sock >= 0)
+        udp_close(&c.udp);
+
+    log_printf(LOG_DEBUG, "Finished");
+    return ret;
+}
+
+/**
+ * Connect to a peer on this host through its Unix socket
+ * @return socket descriptor or -1 on error
+ */
+static int client__connect_unix(const char *path) {
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        log_printf(LOG_DEBUG, "Failed to create a socket %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "Connecting to %s", path);
+
+    struct sockaddr_un srv_addr;
+    memset(&srv_addr, 0, sizeof(struct sockaddr_un));
+    srv_addr.sun_family = AF_UNIX;
+    strncpy(srv_addr.sun_path, path, sizeof(srv_addr.sun_path) - 1);
+
+    if (connect(s, (struct sockaddr *)&srv_addr, sizeof(srv_addr))) {
+        log_printf(LOG_INFO, "Connection failed for peer %s: %s", path, strerror(errno));
+        errno = 0;
+        close(s);
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "Connected! Socket %i", s);
+    return s;
+}
+
+int client__connect(struct fio_torrent_t *t, const uint64_t i, const double deadline) {
+    if (t->peers[i].unix_path[0] != '\0')
+        return client__connect_unix(t->peers[i].unix_path);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        log_printf(LOG_DEBUG, "Failed to create a socket %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    char ip_address[20];
+    if (!sprintf(ip_address, "%d.%d.%d.%d",
+                 t->peers[i].peer_address[0], t->peers[i].peer_address[1],
+                 t->peers[i].peer_address[2], t->peers[i].peer_address[3])) {
+        log_printf(LOG_DEBUG, "Library call failed (sprintf) at %s:%d", __FILE__, __LINE__);
+        close(s);
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "Connecting to %s %u", ip_address,
+               ntohs(t->peers[i].peer_port));
+
+    struct sockaddr_in srv_addr;
+    memset(&srv_addr, 0, sizeof(struct sockaddr_in));
+    srv_addr.sin_family = AF_INET;
+    srv_addr.sin_addr.s_addr = inet_addr(ip_address);
+    srv_addr.sin_port = t->peers[i].peer_port;
+
+    // non-blocking while connecting, so that a peer that drops the SYNs only holds us until the deadline
+    const int flags = fcntl(s, F_GETFL);
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
+        log_printf(LOG_DEBUG, "fcntl failed: %s", strerror(errno));
+        errno = 0;
+        close(s);
+        return -1;
+    }
+
+    if (connect(s, (struct sockaddr *)&srv_addr, sizeof(srv_addr))) {
+        if (errno != EINPROGRESS)
+            error = errno;
+        else if (utils_poll_deadline(s, POLLOUT, deadline))
+            error = errno;
+        else if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &length))
+            error = errno;
+    }
+
+    if (!error && fcntl(s, F_SETFL, flags))
+        error = errno;
+
+    if (error) {
+        log_printf(LOG_INFO, "Connection failed for peer %s %u: %s", ip_address,
+                   ntohs(t->peers[i].peer_port), strerror(error));
+        close(s);
+        errno = error == ETIMEDOUT ? error : 0;
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "Connected! Socket %i", s);
+    return s;
+}
+
+int client__next_block(struct client_t *c, struct client__peer_t *p, uint64_t *block_number) {
+    struct fio_torrent_t *t = c->torrent;
+
+    // when streaming, only the blocks close to what the consumer reads next can be requested
+    const uint64_t end = c->out >= 0 ? __atomic_load_n(&c->stream_pos, __ATOMIC_ACQUIRE) + c->window : t->block_count;
+
+    // stored blocks stay stored and NA answers are kept, so the cursor never has to go back,
+    // except when a pending block fails (see client__collect_failures)
+    for (; p->cursor < t->block_count; p->cursor++) {
+        const uint64_t k = p->cursor;
+
+        if (k >= end) {
+            c->window_full = 1;
+            return -1;
+        }
+
+        if (!client__wanted(c, k) || __atomic_load_n(&t->block_map[k], __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&c->pending[k], __ATOMIC_ACQUIRE))
+            continue;
+
+        // the block may already be in the file, client__collect_checks rewinds the cursor if it is not
+        if (t->block_unchecked != NULL && __atomic_load_n(&t->block_unchecked[k], __ATOMIC_ACQUIRE) != FIO_BLOCK_CHECKED)
+            continue;
+
+        if (p->na_map != NULL && (p->na_map[k / 8] >> (k % 8)) & 1)
+            continue;
+
+        *block_number = k;
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Remember that a peer does not have a block
+ */
+static int client__mark_na(struct fio_torrent_t *t, struct client__peer_t *p, const uint64_t k) {
+    if (p->na_map == NULL) {
+        p->na_map = calloc((t->block_count + 7) / 8, sizeof(uint8_t));
+        if (p->na_map == NULL) {
+            log_printf(LOG_DEBUG, "Calloc failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    p->na_map[k / 8] |= (uint8_t)(1u << (k % 8));
+    return 0;
+}
+
+/**
+ * Take the tokens for the next chunk of a block from the global and the peer rate limits, waiting
+ * if needed. Time spent waiting for tokens is not the peer's fault, so it pushes *deadline back and
+ * is added to *throttled.
+ * @return size of the chunk, at most length
+ */
+static size_t client__throttle(struct client_t *c, struct client__peer_t *p, size_t length,
+                               double *deadline, double *throttled) {
+    if (client__reload != c->reload_seen) {
+        c->reload_seen = client__reload;
+        client__read_control_file(c);
+    }
+
+    size_t chunk = length;
+    if ((c->limit->rate > 0 || p->limit.rate > 0) && chunk > CLIENT__RATE_CHUNK)
+        chunk = CLIENT__RATE_CHUNK;
+
+    const double wait_global = ratelimit_acquire(c->limit, (double)chunk);
+    const double wait_peer = ratelimit_acquire(&p->limit, (double)chunk);
+    const double wait = wait_global > wait_peer ? wait_global : wait_peer;
+
+    if (wait > 0) {
+        utils_sleep(wait);
+        *deadline += wait;
+        *throttled += wait;
+    }
+
+    return chunk;
+}
+
+/**
+ * Receive from a peer in chunks paced by the rate limits
+ */
+static ssize_t client__recv(struct client_t *c, struct client__peer_t *p, void *buffer, size_t length,
+                            double *deadline, double *throttled, size_t *received) {
+    char *ptr = (char *)buffer;
+    size_t total = 0;
+
+    while (total < length) {
+        const size_t chunk = client__throttle(c, p, length - total, deadline, throttled);
+
+        size_t got;
+        const ssize_t r = utils_recv_all_deadline(p->sock, ptr, chunk, *deadline, &got);
+        total += got;
+        ptr += got;
+
+        if (r < 1) {
+            *received = total;
+            return r;
+        }
+    }
+
+    *received = total;
+    return (ssize_t)total;
+}
+
+/**
+ * Move a block from the socket of a peer to its place in the downloaded file through c->pipe,
+ * without copying it to user space. Paced by the rate limits like client__recv.
+ */
+static ssize_t client__splice(struct client_t *c, struct client__peer_t *p, const uint64_t k, size_t length,
+                              double *deadline, double *throttled, size_t *received) {
+    const int fd = fileno(c->torrent->downloaded_file_stream);
+    loff_t offset = (loff_t)(k * FIO_MAX_BLOCK_SIZE);
+    size_t total = 0;
+
+    while (total < length) {
+        *received = total;
+
+        const size_t chunk = client__throttle(c, p, length - total, deadline, throttled);
+
+        if (utils_poll_deadline(p->sock, POLLIN, *deadline))
+            return -1;
+
+        const ssize_t n = splice(p->sock, NULL, c->pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n == 0)
+            return 0;
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+            return -1;
+        }
+
+        for (ssize_t left = n; left > 0;) {
+            const ssize_t w = splice(c->pipe[0], NULL, fd, &offset, (size_t)left, SPLICE_F_MOVE);
+
+            if (w <= 0) {
+                // the pipe may still hold part of the block, it cannot be used for the next one
+                log_printf(LOG_INFO, "Cannot splice to the downloaded file: %s", strerror(errno));
+                close(c->pipe[0]);
+                close(c->pipe[1]);
+                c->pipe[0] = c->pipe[1] = -1;
+                errno = EIO;
+                return -1;
+            }
+
+            left -= w;
+        }
+
+        total += (size_t)n;
+    }
+
+    *received = total;
+    return (ssize_t)total;
+}
+
+/**
+ * Read the bitmap of a MSG_BITFIELD, whose header was received, into the na_map of a peer
+ * @return 1 on success, or 0 or -1 as utils_recv_all_deadline
+ */
+static ssize_t client__read_bitfield(struct client_t *c, struct client__peer_t *p, const struct utils_message_t *msg,
+                                     const double deadline) {
+    struct fio_torrent_t *t = c->torrent;
+
+    if (msg->block_number != t->block_count) {
+        log_message(LOG_INFO, "MSG_BITFIELD for another file, dropping peer!");
+        errno = EBADMSG;
+        return -1;
+    }
+
+    const size_t bytes = (t->block_count + 7) / 8;
+
+    if (p->na_map == NULL && (p->na_map = malloc(bytes)) == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    const ssize_t b = utils_recv_all_deadline(p->sock, p->na_map, bytes, deadline, NULL);
+
+    if (b != (ssize_t)bytes) // the map is garbage now, but the connection is dropped anyway
+        return b < 0 ? -1 : 0;
+
+    uint64_t available = 0;
+
+    for (size_t i = 0; i < bytes; i++) {
+        p->na_map[i] = (uint8_t)~p->na_map[i];
+        available += (uint64_t)__builtin_popcount((uint8_t)~p->na_map[i]);
+    }
+
+    p->cursor = 0;
+    log_printf(LOG_DEBUG, "Peer has %lu of %lu blocks", available, t->block_count);
+    return 1;
+}
+
+/**
+ * Receive the compressed data of a MSG_RESPONSE_DEFLATE, whose header was received, and inflate it into a block,
+ * which must be whole. Paced by the rate limits like client__recv, on the compressed size.
+ */
+static ssize_t client__inflate(struct client_t *c, struct client__peer_t *p, struct fio_block_t *block,
+                               double *deadline, double *throttled, size_t *received) {
+    uint32_t size;
+    *received = 0;
+
+    const ssize_t r = utils_recv_all_deadline(p->sock, &size, sizeof(size), *deadline, NULL);
+
+    if (r != sizeof(size))
+        return r < 0 ? -1 : 0;
+
+    if (size > compressBound(FIO_MAX_BLOCK_SIZE)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (c->deflated == NULL && (c->deflated = malloc(compressBound(FIO_MAX_BLOCK_SIZE))) == NULL)
+        return -1;
+
+    const ssize_t n = client__recv(c, p, c->deflated, size, deadline, throttled, received);
+
+    if (n < 1)
+        return n;
+
+    const double start = utils_now();
+    uLongf length = block->size;
+    const int z = uncompress(block->data, &length, c->deflated, size);
+    c->inflate_time += utils_now() - start;
+
+    if (z != Z_OK || length != block->size) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return (ssize_t)block->size;
+}
+
+/**
+ * Copy a block answered with MSG_RESPONSE_FILE from the file of the peer to its place in the downloaded file with
+ * copy_file_range, which shares the extents where the filesystem can (reflink) and never goes through user space.
+ * Where the kernel cannot copy between these files, the block is read into its buffer instead, from then on.
+ * @param stored set if the block was copied to the file, cleared if it was read into block->data
+ * @return the size of the block or -1 on error
+ */
+static ssize_t client__copy(struct client_t *c, struct client__peer_t *p, const uint64_t k, struct fio_block_t *block,
+                            char *stored) {
+    const int fd = fileno(c->torrent->downloaded_file_stream);
+    const loff_t offset = (loff_t)(k * FIO_MAX_BLOCK_SIZE);
+    loff_t in = offset;
+    loff_t out = offset;
+    size_t total = 0;
+
+    while (!c->copy_read && total < block->size) {
+        const ssize_t n = copy_file_range(p->file, &in, fd, &out, block->size - total, 0);
+
+        if (n > 0) {
+            total += (size_t)n;
+        } else if (n == 0) { // the file of the peer is shorter than it should
+            errno = EBADMSG;
+            return -1;
+        } else if (errno == EINTR) {
+            errno = 0;
+        } else if (total == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            log_printf(LOG_INFO, "Cannot copy from the file of the peer (%s), reading the blocks", strerror(errno));
+            errno = 0;
+            c->copy_read = 1;
+        } else {
+            return -1;
+        }
+    }
+
+    *stored = !c->copy_read;
+
+    while (c->copy_read && total < block->size) {
+        const ssize_t n = pread(p->file, block->data + total, block->size - total, offset + (loff_t)total);
+
+        if (n == 0)
+            errno = EBADMSG;
+        if (n < 1)
+            return -1;
+
+        total += (size_t)n;
+    }
+
+    c->copied += total;
+    return (ssize_t)total;
+}
+
+/**
+ * Receive the next message of a peer other than MSG_BITFIELD and MSG_HAVE, which are applied to its na_map
+ * on the way: blocks it does not have are not requested, and blocks it gets later become requestable again.
+ * @return same as utils_recv_all_deadline, for RAW_MESSAGE_SIZE bytes
+ */
+static ssize_t client__recv_message(struct client_t *c, struct client__peer_t *p, struct utils_message_t *msg,
+                                    const double deadline) {
+    struct fio_torrent_t *t = c->torrent;
+
+    while (1) {
+        const ssize_t r = utils_recv_all_deadline(p->sock, msg, RAW_MESSAGE_SIZE, deadline, NULL);
+
+        if (r != RAW_MESSAGE_SIZE || msg->magic_number != MAGIC_NUMBER)
+            return r;
+
+        if (msg->message_code == MSG_HAVE) {
+            const uint64_t k = msg->block_number;
+
+            if (k < t->block_count && p->na_map != NULL)
+                p->na_map[k / 8] &= (uint8_t)~(1 << (k % 8));
+            if (k < p->cursor)
+                p->cursor = k;
+            continue;
+        }
+
+        if (msg->message_code != MSG_BITFIELD)
+            return r;
+
+        const ssize_t b = client__read_bitfield(c, p, msg, deadline);
+
+        if (b < 1)
+            return b;
+    }
+}
+
+/**
+ * Send a request for one block with MSG_REQUEST, for consecutive ones with MSG_REQUEST_RANGE, or else with
+ * MSG_REQUEST_LIST. A peer with CAP_CLIENT_HAVE first gets MSG_HAVE for the blocks we stored since the last request.
+ * @return 0 on success or -1 on error
+ */
+static int client__send_request(struct client_t *c, struct client__peer_t *p, const uint64_t *blocks, const size_t count) {
+    assert(count > 0 && count <= REQUEST_MAX_BLOCKS);
+
+    // do not issue requests while over the limits
+    const double wait_global = ratelimit_delay(c->limit);
+    const double wait_peer = ratelimit_delay(&p->limit);
+    utils_sleep(wait_global > wait_peer ? wait_global : wait_peer);
+
+    char buffer[CLIENT__HAVE_BATCH * RAW_MESSAGE_SIZE + RAW_MESSAGE_SIZE + REQUEST_MAX_BLOCKS * sizeof(uint64_t)];
+    size_t length = 0;
+
+    while (p->capabilities & CAP_CLIENT_HAVE && length < CLIENT__HAVE_BATCH * RAW_MESSAGE_SIZE &&
+           p->have_next < c->torrent->block_count) {
+        const uint64_t k = __atomic_load_n(&c->torrent->stored_log[p->have_next], __ATOMIC_ACQUIRE);
+
+        if (k == UINT64_MAX) // not stored yet, or not written to the log yet
+            break;
+
+        struct utils_message_t *have = (struct utils_message_t *)(buffer + length);
+        have->magic_number = MAGIC_NUMBER;
+        have->message_code = MSG_HAVE;
+        have->block_number = k;
+        length += RAW_MESSAGE_SIZE;
+        p->have_next++;
+    }
+
+    struct utils_message_t *message = (struct utils_message_t *)(buffer + length);
+    const size_t haves = length / RAW_MESSAGE_SIZE;
+    length += RAW_MESSAGE_SIZE;
+
+    message->magic_number = MAGIC_NUMBER;
+    message->message_code = MSG_REQUEST;
+    message->block_number = blocks[0];
+
+    if (count > 1 && blocks[count - 1] - blocks[0] == count - 1) {
+        const uint64_t n = count;
+        message->message_code = MSG_REQUEST_RANGE;
+        memcpy(buffer + length, &n, sizeof(n));
+        length += sizeof(n);
+    } else if (count > 1) {
+        message->message_code = MSG_REQUEST_LIST;
+        message->block_number = count;
+        memcpy(buffer + length, blocks, sizeof(uint64_t) * count);
+        length += sizeof(uint64_t) * count;
+    }
+
+    log_printf(LOG_INFO, "requesting magic_number = %x, message_code = %u, block_number = %lu, %lu blocks, %lu MSG_HAVE",
+               message->magic_number, message->message_code, message->block_number, count, haves);
+
+    if (utils_send_all(p->sock, buffer, length) < 0) {
+        log_printf(LOG_DEBUG, "Could not send %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Receive the answer to the request of a block into the buffer of a pipeline job
+ * @param start when the answer started to be waited for (utils_now): the request was sent then, or the
+ * answer of the previous block of the same request was received
+ * @return same as client__request_block
+ */
+static int client__fetch_block(struct client_t *c, struct client__peer_t *p, const uint64_t k, struct pipeline_job_t *job,
+                               const double start) {
+    struct fio_torrent_t *t = c->torrent;
+
+    double deadline = start + peer_timeout(&p->stats);
+    double throttled = 0; // seconds spent waiting for the rate limits
+
+    // recieve block
+    ssize_t recv_count;
+    char buffer[RAW_MESSAGE_SIZE];
+    recv_count = client__recv_message(c, p, (struct utils_message_t *)buffer, deadline);
+
+    if (recv_count == 0) {
+        log_printf(LOG_DEBUG, "Connection closed");
+        return -1;
+    } else if (recv_count == -1 && errno == ETIMEDOUT) {
+        log_printf(LOG_INFO, "Peer did not answer the request for block %lu in time", k);
+        errno = 0;
+        peer_stats_record_stall(&p->stats, utils_now() - start, 0);
+        return -1;
+    } else if (recv_count == -1) {
+        log_printf(LOG_DEBUG, "Could not recieve %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    const double rtt = utils_now() - start;
+
+    struct utils_message_t *response_msg = (struct utils_message_t *)buffer;
+    log_printf(LOG_INFO, "Recieved magic_number = %x, message_code = %u, block_number = %lu ",
+               response_msg->magic_number, response_msg->message_code, response_msg->block_number);
+
+    if (response_msg->magic_number != MAGIC_NUMBER || response_msg->block_number != k) {
+        log_printf(LOG_INFO, "Magic number or block number wrong, dropping peer!");
+        return -1;
+    }
+
+    if (response_msg->message_code == MSG_RESPONSE_NA) {
+        log_printf(LOG_INFO, "Block %lu not available at this peer", k);
+        peer_stats_record_na(&p->stats);
+        if (client__mark_na(t, p, k))
+            return -1;
+        return 1;
+    }
+
+    const char deflated = response_msg->message_code == MSG_RESPONSE_DEFLATE && p->capabilities & CAP_DEFLATE;
+    const char copied = response_msg->message_code == MSG_RESPONSE_FILE && p->file >= 0;
+
+    if (response_msg->message_code != MSG_RESPONSE_OK && !deflated && !copied) {
+        log_printf(LOG_INFO, "Message code wrong, dropping peer!");
+        return -1;
+    }
+
+    struct fio_block_t *block = &job->block;
+    log_printf(LOG_INFO, "Response is correct!");
+    block->size = fio_get_block_size(t, k);
+    size_t received;
+
+    if (copied) {
+        received = 0; // nothing crossed the socket
+        recv_count = client__copy(c, p, k, block, &job->stored);
+    } else if (deflated) {
+        job->stored = 0;
+        recv_count = client__inflate(c, p, block, &deadline, &throttled, &received);
+    } else if (c->config->zero_copy && c->pipe[0] >= 0 && tls_kernel_recv(p->sock)) {
+        job->stored = 1;
+        recv_count = client__splice(c, p, k, block->size, &deadline, &throttled, &received);
+    } else {
+        job->stored = 0;
+        recv_count = client__recv(c, p, &block->data, block->size, &deadline, &throttled, &received);
+    }
+
+    if (recv_count == 0) {
+        log_printf(LOG_DEBUG, "Connection closed");
+        return -1;
+    } else if (recv_count == -1 && errno == ETIMEDOUT) {
+        // the connection is closed by the caller, so whatever arrives late is discarded
+        log_printf(LOG_INFO, "Peer stalled after %lu of %lu bytes of block %lu", received, block->size, k);
+        errno = 0;
+        peer_stats_record_stall(&p->stats, utils_now() - start - throttled, received);
+        return -1;
+    } else if (recv_count == -1) {
+        log_printf(LOG_DEBUG, "Could not recieve %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    peer_stats_record_block(&p->stats, rtt, utils_now() - start - throttled, block->size);
+    c->wire_bytes += received;
+
+    return 0;
+}
+
+/**
+ * CAP_* to ask for in the handshake, CAP_FILE only to a peer reached through its Unix socket
+ */
+static uint32_t client__capabilities(const struct client_t *c, const struct client__peer_t *p) {
+    return CLIENT__CAPABILITIES | (c->config->compress ? CAP_DEFLATE : 0) |
+           (c->config->relay_port != 0 && c->torrent->stored_log != NULL ? CAP_CLIENT_HAVE : 0) |
+           (c->torrent->peers[p - c->peers].unix_path[0] != '\0' ? CAP_FILE : 0);
+}
+
+/**
+ * Agree with a newly connected peer on the protocol version and the capabilities to use, and read the
+ * availability of its blocks if it sends it. Legacy peers close the connection on MSG_HELLO: a peer that
+ * does it CLIENT__LEGACY_CLOSES times in a row is marked so, to be connected to again without a handshake.
+ * @return 0 on success, 1 if the peer must be connected to again right away or -1 if the connection must be
+ * dropped
+ */
+static int client__handshake(struct client_t *c, struct client__peer_t *p) {
+    char buffer[RAW_MESSAGE_SIZE + sizeof(struct utils_hello_t)];
+    struct utils_message_t *msg = (struct utils_message_t *)buffer;
+    struct utils_hello_t *hello = (struct utils_hello_t *)(buffer + RAW_MESSAGE_SIZE);
+
+    p->capabilities = 0;
+    p->depth = 1;
+    p->have_next = 0;
+
+    if (p->legacy)
+        return 0;
+
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_HELLO;
+    msg->block_number = 0;
+    hello->version = PROTOCOL_VERSION;
+    hello->capabilities = client__capabilities(c, p);
+    hello->depth = CLIENT__REQUEST_BLOCKS;
+    hello->block_size = FIO_MAX_BLOCK_SIZE;
+
+    if (utils_send_all(p->sock, buffer, sizeof(buffer)) <= 0) {
+        log_printf(LOG_DEBUG, "Cannot send MSG_HELLO: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    const double deadline = utils_now() + peer_timeout(&p->stats);
+    const ssize_t r = utils_recv_all_deadline(p->sock, msg, RAW_MESSAGE_SIZE, deadline, NULL);
+
+    // servers from before the handshake either send MSG_BITFIELD right away, or drop us (with a reset, as
+    // the rest of MSG_HELLO is unread), which a new one may do too when it goes away: try it once more
+    if (r == RAW_MESSAGE_SIZE && msg->magic_number == MAGIC_NUMBER && msg->message_code == MSG_BITFIELD) {
+        log_message(LOG_INFO, "Legacy peer, connecting again without a handshake");
+        p->legacy = 1;
+        return 1;
+    }
+
+    if (r == 0 || (r < 0 && errno == ECONNRESET)) {
+        errno = 0;
+        p->hello_closed++;
+        p->legacy = p->hello_closed >= CLIENT__LEGACY_CLOSES;
+        log_printf(LOG_INFO, "Peer closed the connection on MSG_HELLO, connecting again %s",
+                   p->legacy ? "without a handshake" : "with it");
+        return 1;
+    }
+
+    if (r != RAW_MESSAGE_SIZE || msg->magic_number != MAGIC_NUMBER || msg->message_code != MSG_HELLO ||
+        utils_recv_all_deadline(p->sock, hello, sizeof(*hello), deadline, NULL) != (ssize_t)sizeof(*hello) ||
+        hello->version == 0 || hello->block_size != FIO_MAX_BLOCK_SIZE) {
+        log_message(LOG_INFO, "Bad answer to MSG_HELLO, dropping peer!");
+        errno = 0;
+        return -1;
+    }
+
+    p->hello_closed = 0;
+    p->capabilities = hello->capabilities & client__capabilities(c, p);
+
+    if (p->capabilities & CAP_RANGE)
+        p->depth = hello->depth < 1 ? 1 : hello->depth > CLIENT__REQUEST_BLOCKS ? CLIENT__REQUEST_BLOCKS : hello->depth;
+
+    log_printf(LOG_DEBUG, "Peer speaks version %u with capabilities %x, %u blocks per request",
+               hello->version, p->capabilities, p->depth);
+
+    // the availability of its blocks comes right after, know it before choosing what to request
+    if (p->capabilities & CAP_AVAILABILITY) {
+        if (utils_recv_all_deadline(p->sock, msg, RAW_MESSAGE_SIZE, deadline, NULL) != RAW_MESSAGE_SIZE ||
+            msg->magic_number != MAGIC_NUMBER || msg->message_code != MSG_BITFIELD ||
+            client__read_bitfield(c, p, msg, deadline) < 1) {
+            log_message(LOG_INFO, "Missing MSG_BITFIELD, dropping peer!");
+            errno = 0;
+            return -1;
+        }
     }
 
-    if (client__start(t)) {
-        log_printf(LOG_DEBUG, "Client failed");
+    return 0;
+}
+
+/**
+ * Ask a peer that agreed on CAP_FILE for its file, see MSG_FILE
+ * @return 0 on success, also if the peer could not give it (its blocks are then received as usual), or -1 if
+ * the connection must be dropped
+ */
+static int client__receive_file(struct client_t *c, struct client__peer_t *p) {
+    struct utils_message_t msg;
+    msg.magic_number = MAGIC_NUMBER;
+    msg.message_code = MSG_FILE;
+    msg.block_number = 0;
+
+    if (utils_send_all(p->sock, &msg, RAW_MESSAGE_SIZE) <= 0) {
+        log_printf(LOG_DEBUG, "Cannot send MSG_FILE: %s", strerror(errno));
+        errno = 0;
         return -1;
     }
 
-    log_printf(LOG_DEBUG, "Finished");
+    const double deadline = utils_now() + peer_timeout(&p->stats);
+
+    if (utils_recv_fd_deadline(p->sock, &msg, RAW_MESSAGE_SIZE, deadline, &p->file) != RAW_MESSAGE_SIZE ||
+        msg.magic_number != MAGIC_NUMBER || (msg.message_code == MSG_FILE) != (p->file >= 0) ||
+        (msg.message_code != MSG_FILE && msg.message_code != MSG_RESPONSE_NA)) {
+        log_message(LOG_INFO, "Bad answer to MSG_FILE, dropping peer!");
+        errno = 0;
+
+        if (p->file >= 0)
+            close(p->file);
+        p->file = -1;
+        return -1;
+    }
+
+    if (p->file < 0)
+        log_printf(LOG_INFO, "Peer %lu cannot give its file, receiving the blocks", (uint64_t)(p - c->peers));
+    else
+        log_printf(LOG_INFO, "Got the file of peer %lu, copying the blocks from it", (uint64_t)(p - c->peers));
     return 0;
 }
 
-int client__start(struct fio_torrent_t *t) {
-    for (uint64_t i = 0; i < t->peer_count; i++) {
+/**
+ * Receive the answer to the request of a block and hand the block to the pipeline
+ * @return same as client__request_block
+ */
+static int client__receive_block(struct client_t *c, struct client__peer_t *p, const uint64_t k, const double start) {
+    assert(!c->pending[k]);
 
-        int s = socket(AF_INET, SOCK_STREAM, 0);
+    // blocks while the verifiers and the writer are behind
+    struct pipeline_job_t *job = pipeline_get(&c->pipeline);
 
-        if (s < 0) {
-            log_printf(LOG_DEBUG, "Failed to create a socket %s", strerror(errno));
-            errno = 0;
-            return -1;
-        }
+    const int r = client__fetch_block(c, p, k, job, start);
+
+    if (r) {
+        pipeline_release(&c->pipeline, job);
+        return r;
+    }
+
+    job->torrent = c->torrent;
+    job->block_number = k;
+    job->context = p;
+
+    if (c->first_block == 0)
+        c->first_block = utils_now();
+
+    __atomic_store_n(&c->pending[k], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->in_flight, 1, __ATOMIC_RELAXED);
+    pipeline_submit(&c->pipeline, job);
+
+    return 0;
+}
+
+int client__request_block(struct client_t *c, struct client__peer_t *p, const uint64_t k) {
+    assert(p->sock >= 0);
 
-        char ip_address[20];
-        if (!sprintf(ip_address, "%d.%d.%d.%d",
-                     t->peers[i].peer_address[0], t->peers[i].peer_address[1],
-                     t->peers[i].peer_address[2], t->peers[i].peer_address[3])) {
-            log_printf(LOG_DEBUG, "Library call failed (sprintf) at %s:%d", __FILE__, __LINE__);
+    if (client__send_request(c, p, &k, 1))
+        return -1;
+
+    return client__receive_block(c, p, k, utils_now());
+}
+
+int client__request_blocks(struct client_t *c, struct client__peer_t *p, const uint64_t *blocks, const size_t count) {
+    assert(p->sock >= 0);
+
+    if (client__send_request(c, p, blocks, count))
+        return -1;
+
+    double start = utils_now();
+
+    for (size_t i = 0; i < count; i++) {
+        if (client__receive_block(c, p, blocks[i], start) < 0)
             return -1;
-        }
 
-        log_printf(LOG_DEBUG, "Connecting to %s %u", ip_address,
-                   ntohs(t->peers[i].peer_port));
+        start = utils_now();
+    }
+
+    return 0;
+}
+
+/**
+ * A request over UDP, for client__on_udp_block
+ */
+struct client__udp_request_t {
+    struct client_t *c;
+    struct client__peer_t *p;
+    const uint64_t *blocks;
+    struct pipeline_job_t *jobs[CLIENT__UDP_BLOCKS]; // NULL once handed to the pipeline or released
+    double start;                                    // when the request was sent or the last block completed
+    char failed;                                     // client__mark_na failed
+};
 
-        struct sockaddr_in srv_addr;
-        memset(&srv_addr, 0, sizeof(struct sockaddr_in));
-        srv_addr.sin_family = AF_INET;
-        srv_addr.sin_addr.s_addr = inet_addr(ip_address);
-        srv_addr.sin_port = t->peers[i].peer_port;
+/**
+ * Called by udp_fetch when a block of the request is settled
+ */
+static void client__on_udp_block(void *arg, size_t index, int available) {
+    struct client__udp_request_t *r = arg;
+    struct client_t *c = r->c;
+    const uint64_t k = r->blocks[index];
+    struct pipeline_job_t *job = r->jobs[index];
+    r->jobs[index] = NULL;
 
-        if (connect(s, (struct sockaddr *)&srv_addr, sizeof(srv_addr))) {
-            log_printf(LOG_INFO, "Connection failed for peer %s %u: %s", ip_address,
-                       ntohs(t->peers[i].peer_port), strerror(errno));
-            log_printf(LOG_INFO, "Trying try next peer");
-            errno = 0;
-            close(s);
+    if (!available) {
+        log_printf(LOG_INFO, "Block %lu not available at this peer", k);
+        peer_stats_record_na(&r->p->stats);
+        if (client__mark_na(c->torrent, r->p, k))
+            r->failed = 1;
+        pipeline_release(&c->pipeline, job);
+        return;
+    }
+
+    const double now = utils_now();
+    peer_stats_record_block(&r->p->stats, now - r->start, now - r->start, job->block.size);
+    c->wire_bytes += job->block.size;
+    r->start = now;
+
+    job->stored = 0;
+    job->torrent = c->torrent;
+    job->block_number = k;
+    job->context = r->p;
+
+    if (c->first_block == 0)
+        c->first_block = now;
+
+    __atomic_store_n(&c->pending[k], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->in_flight, 1, __ATOMIC_RELAXED);
+    pipeline_submit(&c->pipeline, job);
+}
+
+int client__request_blocks_udp(struct client_t *c, const uint64_t i, const uint64_t *blocks, const size_t count) {
+    assert(c->udp.sock >= 0 && count <= CLIENT__UDP_BLOCKS);
+
+    struct fio_torrent_t *t = c->torrent;
+    struct client__udp_request_t r = {c, &c->peers[i], blocks, {NULL}, 0, 0};
+    uint8_t *data[CLIENT__UDP_BLOCKS];
+
+    for (size_t j = 0; j < count; j++) {
+        assert(!c->pending[blocks[j]]);
+
+        // blocks while the verifiers and the writer are behind
+        r.jobs[j] = pipeline_get(&c->pipeline);
+        r.jobs[j]->block.size = fio_get_block_size(t, blocks[j]);
+        data[j] = r.jobs[j]->block.data;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr, t->peers[i].peer_address, sizeof(addr.sin_addr));
+    addr.sin_port = t->peers[i].peer_port;
+
+    r.start = utils_now();
+    const int n = udp_fetch(&c->udp, t, &addr, blocks, count, data, peer_timeout(&r.p->stats), client__on_udp_block, &r);
+
+    for (size_t j = 0; j < count; j++) {
+        if (r.jobs[j] != NULL)
+            pipeline_release(&c->pipeline, r.jobs[j]);
+    }
+
+    if (n < 0) {
+        log_printf(LOG_INFO, "Peer %lu does not answer over UDP, using TCP", i);
+        r.p->no_udp = 1;
+        return 1;
+    }
+
+    if (r.failed)
+        return -1;
+
+    if ((size_t)n < count) {
+        peer_stats_record_stall(&r.p->stats, utils_now() - r.start, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Called by mcast_receive to know whether a block is still needed
+ */
+static char client__multicast_need(void *arg, uint64_t k) {
+    const struct client_t *c = arg;
+    const struct fio_torrent_t *t = c->torrent;
+
+    // an unchecked block may already be in the file, the checker settles it
+    return client__wanted(c, k) && !__atomic_load_n(&t->block_map[k], __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&c->pending[k], __ATOMIC_ACQUIRE) &&
+           (t->block_unchecked == NULL || __atomic_load_n(&t->block_unchecked[k], __ATOMIC_ACQUIRE) == FIO_BLOCK_CHECKED);
+}
+
+/**
+ * Called by mcast_receive when a block is in the file: verify it there
+ */
+static void client__on_multicast_block(void *arg, uint64_t k) {
+    struct client_t *c = arg;
+    struct pipeline_job_t *job = pipeline_get(&c->pipeline);
+
+    job->stored = 1;
+    job->block.size = fio_get_block_size(c->torrent, k);
+    job->torrent = c->torrent;
+    job->block_number = k;
+    job->context = NULL;
+
+    if (c->first_block == 0)
+        c->first_block = utils_now();
+
+    c->multicast_blocks++;
+    __atomic_store_n(&c->pending[k], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->in_flight, 1, __ATOMIC_RELAXED);
+    pipeline_submit(&c->pipeline, job);
+}
+
+int client__receive_multicast(struct client_t *c) {
+    struct sockaddr_in group;
+    struct in_addr interface;
+
+    if (mcast_parse(c->config->multicast, &group, &interface)) {
+        log_printf(LOG_INFO, "Invalid multicast group %s, expected group:port[,interface]", c->config->multicast);
+        return -1;
+    }
+
+    if (mcast_receive(&group, interface, c->torrent, client__multicast_need, client__on_multicast_block, c) < 0)
+        return -1;
+
+    // the blocks that fail verification are requested to the peers
+    while (__atomic_load_n(&c->in_flight, __ATOMIC_ACQUIRE) > 0) {
+        client__wait_progress(c, 1);
+    }
+
+    log_printf(LOG_INFO, "%lu blocks from the multicast group, %lu left to the peers", c->multicast_blocks,
+               __atomic_load_n(&c->missing, __ATOMIC_ACQUIRE));
+    return 0;
+}
+
+/**
+ * Find the next blocks to request to a peer, as client__next_block, leaving its cursor on the first one
+ * @param blocks where the block numbers are stored
+ * @param max room in blocks
+ * @return number of blocks found, 0 if the peer cannot provide any missing block
+ */
+static size_t client__next_blocks(struct client_t *c, struct client__peer_t *p, uint64_t *blocks, const size_t max) {
+    size_t count = 0;
+
+    while (count < max && !client__next_block(c, p, &blocks[count])) {
+        p->cursor = blocks[count] + 1;
+        count++;
+    }
+
+    if (count > 0)
+        p->cursor = blocks[0];
+
+    return count;
+}
+
+/**
+ * Close the connection to a peer, if any, and give its slot back to the connection budget
+ */
+static void client__disconnect(struct client_t *c, struct client__peer_t *p) {
+    if (p->sock < 0)
+        return;
+
+    log_printf(LOG_DEBUG, "Closing socket %i", p->sock);
+    tls_close(p->sock);
+    if (close(p->sock)) {
+        log_printf(LOG_DEBUG, "Failed to close socket %i: %s", p->sock, strerror(errno));
+        errno = 0;
+    }
+    p->sock = -1;
+
+    if (p->file >= 0)
+        close(p->file);
+    p->file = -1;
+
+    if (c->config->connections != NULL)
+        sem_post(c->config->connections);
+}
+
+/**
+ * Tells whether the connection budget shared with other downloads allows one more connection
+ */
+static char client__can_connect(const struct client_t *c) {
+    int value;
+    return c->config->connections == NULL || (sem_getvalue(c->config->connections, &value) == 0 && value > 0);
+}
+
+/**
+ * Keep a peer out of the selection for a while after it failed. The delay doubles after each
+ * consecutive failure, and is randomized between 50% and 100% so that clients that lost the
+ * same seeder do not all come back at the same time. Whether it speaks MSG_HELLO is found out again.
+ */
+static void client__backoff(struct client__peer_t *p) {
+    p->legacy = 0;
+    p->hello_closed = 0;
+
+    if (p->backoff == 0)
+        p->backoff = CLIENT__BACKOFF_MIN;
+    else if (p->backoff * 2 < CLIENT__BACKOFF_MAX)
+        p->backoff *= 2;
+    else
+        p->backoff = CLIENT__BACKOFF_MAX;
+
+    const double jitter = 0.5 + 0.5 * (double)rand() / (double)RAND_MAX;
+    p->retry_at = utils_now() + p->backoff * jitter;
+
+    log_printf(LOG_DEBUG, "Retrying peer in %.3f s", p->retry_at - utils_now());
+}
+
+/**
+ * Blocks that failed in the pipeline are missing again, behind the cursors of the peers.
+ * Rewind the cursors and charge the corrupted blocks to the peers that sent them: a peer that sent some
+ * backs off as if its connection failed, and one that sent CLIENT__MAX_CORRUPT is not used anymore.
+ */
+static void client__collect_failures(struct client_t *c) {
+    const uint64_t corrupt = __atomic_load_n(&c->corrupt, __ATOMIC_ACQUIRE);
+
+    if (corrupt == c->corrupt_seen)
+        return;
+
+    c->corrupt_seen = corrupt;
+
+    for (uint64_t i = 0; i < c->torrent->peer_count; i++) {
+        struct client__peer_t *p = &c->peers[i];
+        const uint64_t n = __atomic_exchange_n(&p->corrupt, 0, __ATOMIC_RELAXED);
+
+        p->cursor = 0;
+
+        if (n == 0)
             continue;
+
+        p->stats.failures += n;
+        p->corrupted += n;
+
+        if (p->corrupted >= CLIENT__MAX_CORRUPT) {
+            log_printf(LOG_INFO, "Peer %lu sent %lu corrupted blocks, not using it anymore", i, p->corrupted);
+            client__disconnect(c, p);
+        } else {
+            log_printf(LOG_INFO, "Peer %lu sent %lu corrupted blocks", i, n);
+            client__backoff(p);
         }
+    }
+}
 
-        log_printf(LOG_DEBUG, "Connected! Socket %i", s);
+/**
+ * Exchange peers with a connected peer: send it the peers we got blocks from, and this process if it serves
+ * the torrent (address 0.0.0.0, the peer uses the address of the connection), and add those it sends back.
+ * @return 0 on success or -1 if the peer did not answer properly
+ */
+static int client__exchange_peers(struct client_t *c, struct client__peer_t *p) {
+    struct fio_torrent_t *t = c->torrent;
+    char buffer[RAW_MESSAGE_SIZE + PEX_MAX_PEERS * sizeof(struct tracker_peer_t)];
+    struct utils_message_t *msg = (struct utils_message_t *)buffer;
+    struct tracker_peer_t *list = (struct tracker_peer_t *)(buffer + RAW_MESSAGE_SIZE);
+    size_t count = 0;
 
-        if (client__handle_connection(t, s)) {
-            log_printf(LOG_INFO, "Something went wrong with peer: %s %u", ip_address,
-                       ntohs(t->peers[i].peer_port));
+    if (c->config->relay_port != 0) {
+        memset(list[count].address, 0, sizeof(list[count].address));
+        list[count++].port = htons(c->config->relay_port);
+    }
+
+    // start at a random peer, so that different peers hear of different ones
+    const uint64_t first = (uint64_t)rand() % t->peer_count;
 
-            log_printf(LOG_INFO, "Trying next peer");
-            close(s);
+    for (uint64_t n = 0; n < t->peer_count && count < PEX_MAX_PEERS; n++) {
+        const uint64_t i = (first + n) % t->peer_count;
+        const struct client__peer_t *q = &c->peers[i];
+
+        if (q == p || q->self || q->stats.responses_ok == 0 || q->backoff > 0 || t->peers[i].unix_path[0] != '\0')
             continue;
-        }
 
-        log_printf(LOG_DEBUG, "Closing socket %i", s);
-        if (close(s)) {
-            log_printf(LOG_DEBUG, "Failed to close socket %i: %s", s, strerror(errno));
-            errno = 0;
-            return -1;
+        memcpy(list[count].address, t->peers[i].peer_address, sizeof(list[count].address));
+        list[count++].port = t->peers[i].peer_port;
+    }
+
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_PEX;
+    msg->block_number = count;
+
+    if (utils_send_all(p->sock, buffer, RAW_MESSAGE_SIZE + count * sizeof(struct tracker_peer_t)) <= 0) {
+        log_printf(LOG_DEBUG, "Cannot send MSG_PEX: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    const double deadline = utils_now() + peer_timeout(&p->stats);
+
+    if (client__recv_message(c, p, msg, deadline) != RAW_MESSAGE_SIZE ||
+        msg->magic_number != MAGIC_NUMBER || msg->message_code != MSG_PEX || msg->block_number > PEX_MAX_PEERS) {
+        log_message(LOG_DEBUG, "Bad answer to MSG_PEX");
+        errno = 0;
+        return -1;
+    }
+
+    count = msg->block_number;
+
+    if (utils_recv_all_deadline(p->sock, list, count * sizeof(struct tracker_peer_t), deadline, NULL) !=
+        (ssize_t)(count * sizeof(struct tracker_peer_t))) {
+        log_message(LOG_DEBUG, "Truncated MSG_PEX");
+        errno = 0;
+        return -1;
+    }
+
+    const double now = utils_now();
+
+    for (size_t j = 0; j < count; j++) {
+        struct fio_peer_information_t info = {0};
+        memcpy(info.peer_address, list[j].address, sizeof(info.peer_address));
+        info.peer_port = list[j].port;
+
+        if (info.peer_address[0] == 0) // not a usable address
+            continue;
+
+        const uint64_t i = client__add_peer(c, &info, "peer exchange");
+
+        if (i < t->peer_count)
+            c->peers[i].gossip_until = now + CLIENT__PEX_TTL;
+    }
+
+    log_printf(LOG_DEBUG, "Got %lu peers by peer exchange", count);
+    return 0;
+}
+
+/**
+ * Every CLIENT__PEX_INTERVAL, exchange peers with the next connected peer
+ */
+static void client__gossip(struct client_t *c) {
+    struct fio_torrent_t *t = c->torrent;
+
+    c->pex_at = utils_now() + CLIENT__PEX_INTERVAL;
+
+    for (uint64_t n = 0; n < t->peer_count; n++) {
+        const uint64_t i = (c->pex_next + n) % t->peer_count;
+        struct client__peer_t *p = &c->peers[i];
+
+        // legacy peers may know MSG_PEX, until they show they do not
+        if (p->sock < 0 || p->no_pex || !(p->legacy || p->capabilities & CAP_PEX))
+            continue;
+
+        c->pex_next = i + 1;
+
+        if (client__exchange_peers(c, p)) { // probably an older server, the connection is out of sync now
+            p->no_pex = 1;
+            client__disconnect(c, p);
         }
 
-        if (client__is_completed(t)) {
-            log_message(LOG_INFO, "File is complete!");
-            return 0;
+        return;
+    }
+}
+
+/**
+ * Called when no peer can be used right now. Waits for the next peer to come out of its backoff.
+ * If every peer has already answered NA for every missing block, forget the answers and retry
+ * them later, as they may have gotten more blocks since. With a tracker, wake up to ask it again
+ * within CLIENT__TRACKER_RETRY, as it may know other peers.
+ * @return 0 if there is something to wait for or -1 if the deadline passed
+ */
+static int client__wait(struct client_t *c, const double deadline) {
+    struct fio_torrent_t *t = c->torrent;
+    const double now = utils_now();
+    double wake_up = deadline;
+    char live = 0;
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        if (c->peers[i].corrupted >= CLIENT__MAX_CORRUPT)
+            continue;
+
+        if (c->peers[i].retry_at > now && c->peers[i].retry_at < wake_up)
+            wake_up = c->peers[i].retry_at;
+
+        live |= (c->peers[i].live || c->peers[i].gossip_until > now) && !c->peers[i].self;
+    }
+
+    if (c->tracker_at < HUGE_VAL && c->tracker_at > now + CLIENT__TRACKER_RETRY) // the tracker may know new peers
+        c->tracker_at = now + CLIENT__TRACKER_RETRY;
+
+    if (!live && c->tracker_at < HUGE_VAL) {
+        log_message(LOG_DEBUG, "No live peer, waiting for the tracker");
+        wake_up = c->tracker_at;
+    } else if (wake_up == deadline) { // nobody is backing off, so everybody said NA
+        log_message(LOG_INFO, "No peer can provide the missing blocks, asking again later");
+
+        for (uint64_t i = 0; i < t->peer_count; i++) {
+            struct client__peer_t *p = &c->peers[i];
+
+            if (p->corrupted >= CLIENT__MAX_CORRUPT)
+                continue;
+
+            free(p->na_map);
+            p->na_map = NULL;
+            p->cursor = 0;
+            client__backoff(p);
+
+            if (p->retry_at < wake_up)
+                wake_up = p->retry_at;
         }
     }
 
+    if (c->tracker_at < wake_up)
+        wake_up = c->tracker_at;
+
+    if (wake_up >= deadline) {
+        return -1;
+    }
+
+    utils_sleep(wake_up - now);
     return 0;
 }
 
-int client__handle_connection(struct fio_torrent_t *t, const int s) {
+int client__start(struct client_t *c) {
+    struct fio_torrent_t *t = c->torrent;
+    struct client__peer_t *peers = c->peers;
 
-    for (uint64_t k = 0; k < t->block_count; k++) {
+    const double deadline = c->config->deadline > 0 ? utils_now() + c->config->deadline : HUGE_VAL;
 
-        if (!t->block_map[k]) { // if hash is incorrect, we download the block
+    c->started = utils_now();
+    c->reach_since = c->started;
 
-            struct utils_message_t message;
-            message.magic_number = MAGIC_NUMBER;
-            message.message_code = MSG_REQUEST;
-            message.block_number = k;
+    if (c->config->multicast != NULL && client__receive_multicast(c))
+        log_message(LOG_INFO, "Downloading from the peers only");
 
-            log_printf(LOG_INFO, "requesting magic_number = %x, message_code = %u, block_number = %lu",
-                       message.magic_number, message.message_code, message.block_number);
+    while (__atomic_load_n(&c->missing, __ATOMIC_ACQUIRE) > 0) {
 
-            if (utils_send_all(s, &message, RAW_MESSAGE_SIZE) < 0) {
-                log_printf(LOG_DEBUG, "Could not send %s", strerror(errno));
-                errno = 0;
-                return -1; // try next peer
+        client__collect_failures(c);
+        client__collect_checks(c);
+
+        if (client__reload != c->reload_seen) {
+            c->reload_seen = client__reload;
+            client__read_control_file(c);
+        }
+
+        const double now = utils_now();
+
+        if (now >= deadline) {
+            log_message(LOG_INFO, "Deadline reached, giving up");
+            break;
+        }
+
+        if (__atomic_load_n(&c->stream_failed, __ATOMIC_ACQUIRE)) {
+            log_message(LOG_INFO, "The stream was closed, giving up");
+            break;
+        }
+
+        c->window_full = 0;
+
+        client__update_reach(c, now);
+
+        if (now >= c->tracker_at)
+            client__query_tracker(c);
+
+        if (now >= c->pex_at)
+            client__gossip(c);
+
+        const char can_connect = client__can_connect(c);
+        char no_slot = 0; // some peers could be used if the connection budget allowed it
+        int nearest = PEER_LOCALITY_LEVELS; // distance of the nearest peer that could be used
+
+        for (uint64_t i = 0; i < t->peer_count; i++) {
+            uint64_t k;
+            c->usable[i] = !peers[i].self && (peers[i].live || peers[i].sock >= 0 || peers[i].gossip_until > now) &&
+                           peers[i].retry_at <= now && peers[i].corrupted < CLIENT__MAX_CORRUPT &&
+                           !client__next_block(c, &peers[i], &k);
+            c->scores[i] = peer_score(&peers[i].stats);
+
+            if (c->usable[i] && peers[i].distance < nearest)
+                nearest = peers[i].distance;
+
+            if (c->usable[i] && peers[i].sock < 0 && !can_connect) {
+                c->usable[i] = 0;
+                no_slot = 1;
             }
+        }
 
-            // recieve block
-            ssize_t recv_count;
-            char buffer[RAW_MESSAGE_SIZE];
-            recv_count = utils_recv_all(s, &buffer, RAW_MESSAGE_SIZE);
+        // farther peers only get the requests the nearer ones cannot take right now
+        const int reach = nearest > c->reach ? nearest : c->reach;
 
-            if (recv_count == 0) {
-                log_printf(LOG_DEBUG, "Connection closed");
-                return -1; // try next peer
-            } else if (recv_count == -1) {
-                log_printf(LOG_DEBUG, "Could not recieve %s", strerror(errno));
-                errno = 0;
-                return -1; // try next peer
+        for (uint64_t i = 0; i < t->peer_count; i++) {
+            if (peers[i].distance > reach)
+                c->usable[i] = 0;
+        }
+
+        const size_t i = peer_select(c->scores, c->usable, t->peer_count);
+
+        if (i == t->peer_count) {
+            c->reach_idle = 1;
+
+            if (__atomic_load_n(&c->unchecked, __ATOMIC_ACQUIRE) > 0) { // nothing to request yet, help the checker
+                if (client__check_next(c))
+                    client__wait_progress(c, deadline - now < 1 ? deadline - now : 1);
+                continue;
+            }
+
+            if (c->window_full) { // wait for the consumer to read what is stored
+                client__wait_progress(c, deadline - now < 1 ? deadline - now : 1);
+                continue;
+            }
+
+            if (no_slot) { // wait for another download to close a connection
+                client__wait_progress(c, CLIENT__SLOT_WAIT);
+                continue;
             }
 
-            struct utils_message_t *response_msg = (struct utils_message_t *)buffer;
-            log_printf(LOG_INFO, "Recieved magic_number = %x, message_code = %u, block_number = %lu ",
-                       response_msg->magic_number, response_msg->message_code, response_msg->block_number);
+            if (__atomic_load_n(&c->in_flight, __ATOMIC_ACQUIRE) > 0) { // the rest is in the pipeline
+                client__wait_progress(c, deadline - now < 1 ? deadline - now : 1);
+                continue;
+            }
 
-            if (response_msg->magic_number != MAGIC_NUMBER ||
-                response_msg->message_code != MSG_RESPONSE_OK ||
-                response_msg->block_number != k) {
-                log_printf(LOG_INFO, "Magic number, messagecode or block number wrong, trying next peer!");
-                return -1; // try next peer
+            if (client__wait(c, deadline)) {
+                log_message(LOG_INFO, "Deadline reached, giving up");
+                break;
             }
+            continue;
+        }
 
-            struct fio_block_t block;
-            log_printf(LOG_INFO, "Response is correct!");
-            block.size = fio_get_block_size(t, k);
-            recv_count = utils_recv_all(s, &block.data, block.size);
+        struct client__peer_t *p = &peers[i];
 
-            if (recv_count == 0) {
-                log_printf(LOG_DEBUG, "Connection closed");
-                return -1; // try next peer
-            } else if (recv_count == -1) {
-                log_printf(LOG_DEBUG, "Could not recieve %s", strerror(errno));
+        if (p->sock < 0) {
+            if (c->config->connections != NULL && sem_trywait(c->config->connections)) {
                 errno = 0;
-                return -1; // try next peer
+                continue; // another download took the last slot
             }
 
-            if (fio_store_block(t, k, &block)) {
-                log_printf(LOG_DEBUG, "Failed to store block %i: %s", k, strerror(errno));
-                errno = 0;
+            const double start = utils_now();
+            p->sock = client__connect(t, i, start + peer_timeout(&p->stats));
+
+            if (p->sock < 0) {
+                if (errno == ETIMEDOUT) {
+                    errno = 0;
+                    peer_stats_record_stall(&p->stats, utils_now() - start, 0);
+                }
+                if (c->config->connections != NULL)
+                    sem_post(c->config->connections);
+                peer_stats_record_failure(&p->stats);
+                client__backoff(p);
+                log_printf(LOG_INFO, "Trying next peer");
+                continue;
             }
 
-            log_printf(LOG_DEBUG, "Block %i stored saved", k);
+            char host[INET_ADDRSTRLEN]; // the certificate of the peer must hold its address
+
+            if (c->config->tls != NULL && t->peers[i].unix_path[0] == '\0' &&
+                (inet_ntop(AF_INET, t->peers[i].peer_address, host, sizeof(host)) == NULL ||
+                 tls_connect(c->config->tls, p->sock, host, utils_now() + TLS_HANDSHAKE_TIMEOUT))) {
+                client__disconnect(c, p);
+                peer_stats_record_failure(&p->stats);
+                client__backoff(p);
+                continue;
+            }
+
+            const int r = client__handshake(c, p);
+
+            if (r) {
+                client__disconnect(c, p);
+
+                if (r < 0) {
+                    peer_stats_record_failure(&p->stats);
+                    client__backoff(p);
+                }
+                continue;
+            }
+
+            if (p->capabilities & CAP_FILE && client__receive_file(c, p)) {
+                client__disconnect(c, p);
+                peer_stats_record_failure(&p->stats);
+                client__backoff(p);
+                continue;
+            }
+        }
+
+        // over UDP once the peer accepted a TCP connection: a dead peer is found out at once, not after
+        // the UDP retries
+        if (c->udp.sock >= 0 && !p->no_udp) {
+            uint64_t blocks[CLIENT__UDP_BLOCKS];
+            const size_t count = client__next_blocks(c, p, blocks, CLIENT__UDP_BLOCKS);
+
+            if (count == 0)
+                continue;
+
+            const int r = client__request_blocks_udp(c, i, blocks, count);
+
+            if (r < 0) {
+                log_printf(LOG_INFO, "Something went wrong with peer %lu, trying next peer", i);
+                peer_stats_record_failure(&p->stats);
+                client__backoff(p);
+            } else if (r == 0) {
+                p->backoff = 0;
+            }
+            continue;
+        }
+
+        uint64_t blocks[CLIENT__REQUEST_BLOCKS];
+        const size_t count = client__next_blocks(c, p, blocks, p->depth);
+
+        if (count == 0)
+            continue;
+
+        if (client__request_blocks(c, p, blocks, count) < 0) {
+            log_printf(LOG_INFO, "Something went wrong with peer %lu, trying next peer", i);
+            peer_stats_record_failure(&p->stats);
+            client__disconnect(c, p);
+            client__backoff(p);
+            continue;
+        }
+
+        p->backoff = 0;
+    }
+
+    if (pipeline_destroy(&c->pipeline)) {
+        log_message(LOG_DEBUG, "Failed to stop the pipeline");
+    }
+
+    client__collect_failures(c);
+
+    if (c->missing == 0)
+        log_message(LOG_INFO, c->wanted != NULL ? "Requested ranges are complete!" : "File is complete!");
+    else
+        log_printf(LOG_INFO, "%lu blocks still missing", c->missing);
+
+    if (c->first_block > 0)
+        log_printf(LOG_INFO, "First block received after %.3f s, finished after %.3f s",
+                   c->first_block - c->started, utils_now() - c->started);
+
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        bytes += peers[i].stats.bytes;
+    }
+
+    struct rusage usage;
+    if (bytes > 0 && getrusage(RUSAGE_SELF, &usage) == 0) {
+        const double user = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6;
+        const double sys = (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+        const double gib = (double)bytes / (1024.0 * 1024.0 * 1024.0);
+
+        log_printf(LOG_INFO, "Received %lu bytes%s, CPU %.3f s user %.3f s system, %.3f s per GiB",
+                   bytes, c->pipe[0] >= 0 ? " (zero-copy)" : "", user, sys, (user + sys) / gib);
+    }
+
+    if (c->udp.sock >= 0 && c->udp.received > 0)
+        log_printf(LOG_INFO, "UDP: %lu datagrams sent, %lu received, %lu duplicates", c->udp.sent, c->udp.received,
+                   c->udp.duplicates);
+
+    if (c->copied > 0)
+        log_printf(LOG_INFO, "Same host: %lu bytes %s the files of the peers", c->copied,
+                   c->copy_read ? "read from" : "copied from");
+
+    if (c->deflated != NULL && c->wire_bytes > 0)
+        log_printf(LOG_INFO, "Compression: %lu bytes of blocks took %lu on the wire (ratio %.2f), %.3f s decompressing",
+                   bytes, c->wire_bytes, (double)bytes / (double)c->wire_bytes, c->inflate_time);
+
+    uint64_t by_distance[PEER_LOCALITY_LEVELS + 1] = {0};
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        by_distance[peers[i].distance] += peers[i].stats.bytes;
+    }
+
+    if (by_distance[PEER_LOCALITY_LEVELS] < bytes) { // some peers have a known locality
+        for (int d = 0; d <= PEER_LOCALITY_LEVELS; d++) {
+            if (by_distance[d] > 0)
+                log_printf(LOG_INFO, "%lu bytes from peers at distance %d", by_distance[d], d);
+        }
+    }
+
+    for (uint64_t i = 0; i < t->peer_count; i++) {
+        struct client__peer_t *p = &peers[i];
 
-        } // block hash
+        if (p->stats.requests || p->stats.failures) {
+            log_printf(LOG_INFO, "Peer %lu: %lu requests, %lu bytes, %.0f B/s, rtt %.6f s, %lu NA, %lu stalls, %lu failures",
+                       i, p->stats.requests, p->stats.bytes, p->stats.throughput, p->stats.rtt,
+                       p->stats.responses_na, p->stats.stalls, p->stats.failures);
+        }
 
-    } // for
+        client__disconnect(c, p);
+        free(p->na_map);
+        p->na_map = NULL;
+    }
 
     return 0;
 }
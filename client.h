@@ -1,29 +1,320 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 #include "file_io.h"
+#include "peer.h"
+#include "pipeline.h"
+#include "ratelimit.h"
+#include "tls.h"
+#include "udp.h"
+#include <netinet/in.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 /**
- * Main function for the client 
+ * Bounds of the delay before reconnecting to a peer that failed, in seconds.
+ * The delay doubles after each consecutive failure.
+ */
+#define CLIENT__BACKOFF_MIN 0.5
+#define CLIENT__BACKOFF_MAX 30.0
+
+/**
+ * Corrupted blocks after which a peer is not used anymore
+ */
+#define CLIENT__MAX_CORRUPT 8
+
+/**
+ * Connections in a row a peer closes on MSG_HELLO before it is taken for a legacy one
+ */
+#define CLIENT__LEGACY_CLOSES 2
+
+/**
+ * Default value of client_config_t.deadline
+ */
+#define CLIENT_DEFAULT_DEADLINE 300.0
+
+/**
+ * Blocks are read in chunks of this size when a rate limit is set
+ */
+#define CLIENT__RATE_CHUNK 0x2000
+
+/**
+ * Number of received blocks that can be waiting to be verified or written
+ */
+#define CLIENT__PIPELINE_BUFFERS 64
+
+/**
+ * Most blocks asked for in one request, see MSG_REQUEST_RANGE
+ */
+#define CLIENT__REQUEST_BLOCKS 16
+
+/**
+ * CAP_* asked for in the handshake, with CAP_DEFLATE if client_config_t.compress is set and CAP_CLIENT_HAVE
+ * in a relay
+ */
+#define CLIENT__CAPABILITIES (CAP_RANGE | CAP_AVAILABILITY | CAP_PEX)
+
+/**
+ * Most blocks asked for in one request over UDP, see udp_fetch
+ */
+#define CLIENT__UDP_BLOCKS 32
+
+/**
+ * Most MSG_HAVE sent before a request, see CAP_CLIENT_HAVE
+ */
+#define CLIENT__HAVE_BATCH 64
+
+/**
+ * Default size of the reorder buffer of the writer, in bytes, and how long it may hold a block
+ */
+#define CLIENT_DEFAULT_REORDER_BYTES (2 * 1024 * 1024)
+#define CLIENT_DEFAULT_FLUSH_DELAY 0.2
+
+/**
+ * How long to wait before trying again when the connection budget is used up, in seconds
+ */
+#define CLIENT__SLOT_WAIT 0.1
+
+/**
+ * Default value of client_config_t.stream_ahead
+ */
+#define CLIENT_DEFAULT_STREAM_AHEAD (16 * 1024 * 1024)
+
+/**
+ * How often the throughput from the peers in reach is compared with client_config_t.near_rate, in seconds
+ */
+#define CLIENT__REACH_WINDOW 1.0
+
+/**
+ * How often the tracker is asked for live peers, in seconds, and how soon again when no peer can be used
+ */
+#define CLIENT__TRACKER_INTERVAL 10.0
+#define CLIENT__TRACKER_RETRY 1.0
+
+/**
+ * Number of peers learnt from the tracker or by peer exchange that can be added to those of the metainfo file
+ */
+#define CLIENT__LEARNT_PEERS 256
+
+/**
+ * Seconds between two peer exchanges, each with one of the connected peers, and how long a peer heard of
+ * that way is considered live
+ */
+#define CLIENT__PEX_INTERVAL 2.0
+#define CLIENT__PEX_TTL 60.0
+
+/**
+ * Client settings, initialize with client_config_init
+ */
+struct client_config_t {
+    double deadline;          // seconds to keep retrying before giving up, 0 to retry until the file is complete
+    double rate;              // global download limit in bytes per second, 0 for no limit
+    double peer_rate;         // download limit for each peer in bytes per second, 0 for no limit
+    const char *control_file; // if not NULL, the limits are read from this file at startup and on SIGHUP
+    size_t verifiers;         // number of threads checking the SHA-256 of the received blocks
+    char zero_copy;           // splice the blocks from the sockets into the file instead of copying them
+    double reorder_bytes;     // memory for verified blocks waiting to be coalesced into larger writes, 0 for none
+    double flush_delay;       // seconds a verified block may wait for its neighbours before it is written
+    char background_check;    // load the torrent with fio_create_torrent_unchecked and check the file while downloading
+    const char *ranges;       // if not NULL, only download these byte ranges, see client__parse_ranges
+    const char *stream;       // if not NULL, also write the file in order to this path as it arrives, "-" for stdout
+    double stream_ahead;      // bytes that may be requested ahead of what was written to stream
+    struct ratelimit_t *shared_limit; // if not NULL, global limit shared with other downloads, used instead of rate
+    sem_t *connections;               // if not NULL, budget of open connections shared with other downloads
+    uint16_t relay_port;              // port where this process serves the torrent while downloading it, 0 if none
+    const char *locality;             // if not NULL, file with the locality label of this host and of peers, see client__read_locality
+    double near_rate;                 // bytes per second below which farther peers are also used, 0 to only use them when the near ones cannot serve
+    const char *tracker;              // if not NULL, "host:port" of the tracker giving the live peers, see tracker.h
+    char compress;                    // ask the peers to send the blocks compressed when it pays (CAP_DEFLATE)
+    char udp;                         // download over UDP from the peers that answer there, see udp.h
+    const char *unix_path;            // Unix socket where this process serves the torrent while downloading it, NULL if none
+    const char *multicast;            // if not NULL, "group:port[,interface]" to receive the file from first, see mcast.h
+    const struct tls_t *tls;          // if not NULL, settings from tls_init_client: the TCP peers speak TLS
+};
+
+/**
+ * State kept by the client for each peer of the metainfo file
+ */
+struct client__peer_t {
+    int sock;                  // connected socket or -1
+    struct peer_stats_t stats; // used to choose who gets the next request
+    uint64_t cursor;           // blocks before this one are either stored or not available at this peer
+    uint8_t *na_map;           // bitmap of the blocks answered with MSG_RESPONSE_NA, NULL until the first one
+    double backoff;            // delay before the next reconnection, 0 if the last attempt succeeded
+    double retry_at;           // do not use the peer before this time (utils_now)
+    struct ratelimit_t limit;  // per-peer download limit
+    uint64_t corrupt;          // corrupted blocks not yet counted in stats, updated by the pipeline threads
+    uint64_t corrupted;        // corrupted blocks counted so far, the peer is dropped at CLIENT__MAX_CORRUPT
+    char self;                 // the peer is this process (relay_port on a loopback address), never used
+    int distance;              // peer_distance from this host, PEER_LOCALITY_LEVELS if either label is unknown
+    char live;                 // listed in the last answer of the tracker, or always set without a tracker
+    double gossip_until;       // another peer said this one is live, until then (utils_now)
+    char no_pex;               // the peer did not answer MSG_PEX, do not ask it again
+    char legacy;               // the peer does not know MSG_HELLO, connect to it without a handshake until it fails
+    char hello_closed;         // connections in a row the peer closed on MSG_HELLO, legacy at CLIENT__LEGACY_CLOSES
+    uint32_t capabilities;     // CAP_* agreed in the handshake of the current connection, 0 with a legacy peer
+    uint16_t depth;            // most blocks in a request to the peer, 1 unless it has CAP_RANGE
+    uint64_t have_next;        // next entry of torrent->stored_log to announce to the peer, with CAP_CLIENT_HAVE
+    char no_udp;               // the peer did not answer over UDP, or is reached through a Unix socket: use TCP
+    int file;                  // read-only descriptor of the file of the peer, given with MSG_FILE, or -1
+};
+
+/**
+ * State of a download
+ */
+struct client_t {
+    struct fio_torrent_t *torrent;
+    const struct client_config_t *config;
+    struct client__peer_t *peers; // torrent->peer_count peers, room for peer_capacity
+    uint64_t peer_capacity;       // torrent->peers, peers, usable and scores can grow up to this size
+    uint8_t *usable;              // scratch space for peer_select
+    double *scores;               // scratch space for peer_select
+    uint64_t missing;             // number of blocks not in block_map, updated by the pipeline threads
+    struct ratelimit_t own_limit; // global download limit, unless shared with other downloads
+    struct ratelimit_t *limit;    // own_limit or config->shared_limit
+    int reload_seen;              // SIGHUPs already handled
+    struct pipeline_t pipeline;   // verifies and writes the received blocks
+    uint8_t *pending;             // blocks received but not yet verified and written
+    uint8_t *wanted;              // blocks covering the requested ranges, NULL to download the whole file
+    uint64_t in_flight;           // number of blocks in pending
+    uint64_t corrupt;             // corrupted blocks so far, updated by the pipeline threads
+    uint64_t corrupt_seen;        // value of corrupt last time the peers were updated
+    sem_t progress;               // posted each time a block leaves the pipeline
+    int pipe[2];                  // used to splice the blocks into the file in zero-copy mode, -1 if unused
+    uint64_t unchecked;           // blocks of the file not checked yet, when torrent->block_unchecked is set
+    uint64_t check_next;          // next block to check, taken atomically by the checker and the network thread
+    uint64_t rewind;              // lowest block found missing by a check since the cursors were rewound
+    pthread_t checker;            // checks the blocks of the file while the missing ones are downloaded
+    char stop;                    // tells the checker to give up
+    double started;               // when the download started (utils_now)
+    double first_block;           // when the first block was received, 0 before
+    int out;                      // where the file is streamed, -1 if not streaming
+    uint64_t stream_pos;          // next block to write to out, updated by the streamer
+    uint64_t window;              // number of blocks that may be requested from stream_pos on
+    char window_full;             // client__next_block stopped at the end of the window
+    char stream_failed;           // out cannot be written anymore, set by the streamer
+    sem_t stored;                 // posted each time a block is stored, for the streamer
+    pthread_t streamer;           // writes the stored blocks to out in order
+    int reach;                    // peers farther than this distance are only used when no nearer one can be
+    double reach_since;           // start of the current throughput window (utils_now)
+    uint64_t reach_bytes;         // bytes received before the current throughput window
+    char reach_idle;              // the client waited during the current throughput window
+    struct sockaddr_in tracker;   // address of config->tracker
+    double tracker_at;            // when to ask the tracker again (utils_now), HUGE_VAL without a tracker
+    double pex_at;                // when to exchange peers again (utils_now)
+    uint64_t pex_next;            // peer to exchange with next, in turn
+    uint8_t *deflated;            // where compressed blocks are received, NULL until the first one
+    uint64_t wire_bytes;          // bytes of blocks received, as sent by the peers
+    double inflate_time;          // seconds spent decompressing blocks
+    struct udp_t udp;             // socket for the peers reached over UDP, sock is -1 unless config->udp
+    uint64_t copied;              // bytes of blocks copied from the files of the peers on this host (MSG_RESPONSE_FILE)
+    char copy_read;               // copy_file_range does not work between the files, the blocks are read instead
+    uint64_t multicast_blocks;    // blocks received from the multicast group
+};
+
+/**
+ * Set the default settings
+ * @param config the settings to initialize
+ */
+void client_config_init(struct client_config_t *config);
+
+/**
+ * Set up what the downloads of the process share, once before the first client_init: seed rand, and install
+ * the SIGHUP handler if the settings name a control file
+ * @param config settings initialized with client_config_init
+ */
+void client_setup(const struct client_config_t *config);
+
+/**
+ * Main function for the client
  * @param torrent Pointer to the torrent structure previously created with utils_create_torrent_struct
+ * @param config settings initialized with client_config_init
  * @return 0 for succes or -1 for errors
  */
-int client_init(struct fio_torrent_t *torrent);
+int client_init(struct fio_torrent_t *torrent, const struct client_config_t *config);
 
-/** 
- * Handle connections to the peers
+/**
+ * Mark the blocks covering a list of byte ranges as wanted
+ * @param t the torrent
+ * @param ranges comma separated "first-last" byte offsets, both included, with optional K, M and G suffixes.
+ * The last offset may be omitted to mean the end of the file, e.g. "0-4095,1G-"
+ * @param wanted array of t->block_count flags, set for each block overlapping a range
+ * @return 0 on success or -1 if the ranges are not valid
+ */
+int client__parse_ranges(const struct fio_torrent_t *t, const char *ranges, uint8_t *wanted);
+
+/**
+ * Connect to a peer of the metainfo file
  * @param t pointer to struct created with utils_create_torrent_struct
- * @param s descriptor to the connection
- * @param 
+ * @param i index of the peer in t->peers
+ * @param deadline absolute time, as returned by utils_now, when we stop waiting for the peer to accept
+ * @return socket descriptor or -1 on error, with errno ETIMEDOUT if the deadline passed
  */
-int client__handle_connection(struct fio_torrent_t *t, const int s);
+int client__connect(struct fio_torrent_t *t, const uint64_t i, const double deadline);
 
 /**
- * Check if torrent is completed 
+ * Find the next block to request to a peer, advancing its cursor
+ * @param c download state
+ * @param p the peer
+ * @param block_number where the block number is stored
+ * @return 0 if there is a block to request or -1 if the peer cannot provide any missing block
+ */
+int client__next_block(struct client_t *c, struct client__peer_t *p, uint64_t *block_number);
+
+/**
+ * Request a block to a connected peer and hand it to the pipeline, honoring the rate limits
+ * @param c download state
+ * @param p the peer, p->sock must be connected
+ * @param k block number
+ * @return 0 if the block was received, 1 if the peer does not have it or -1 if the connection must be dropped.
+ * The block is only in block_map once the pipeline has verified and written it.
+ */
+int client__request_block(struct client_t *c, struct client__peer_t *p, const uint64_t k);
+
+/**
+ * Request several blocks to a connected peer in one message, then receive them in order and hand them to the
+ * pipeline as client__request_block does
+ * @param c download state
+ * @param p the peer, p->sock must be connected
+ * @param blocks the block numbers, in increasing order
+ * @param count number of blocks, at most REQUEST_MAX_BLOCKS
+ * @return 0 if every block was either received or answered as not available, or -1 if the connection must
+ * be dropped
+ */
+int client__request_blocks(struct client_t *c, struct client__peer_t *p, const uint64_t *blocks, const size_t count);
+
+/**
+ * Request blocks to a peer over UDP and hand each one to the pipeline as soon as it is complete
+ * @param c download state, c->udp must be open
+ * @param i index of the peer
+ * @param blocks the block numbers
+ * @param count number of blocks, at most CLIENT__UDP_BLOCKS
+ * @return 0 if every block was either received or answered as not available, 1 if the peer does not answer
+ * over UDP (TCP must be used), or -1 if the peer stopped sending
+ */
+int client__request_blocks_udp(struct client_t *c, const uint64_t i, const uint64_t *blocks, const size_t count);
+
+/**
+ * Receive what the multicast group of config->multicast sends and hand each complete block to the pipeline,
+ * before the rest is requested to the peers
+ * @param c download state
+ * @return 0 on success or -1 if the group cannot be joined
+ */
+int client__receive_multicast(struct client_t *c);
+
+/**
+ * Check if torrent is completed
  * @param t pointer to struct created with utils_create_torrent_struct
  * @return 1 if completed, 0 if not completed
  */
 char client__is_completed(struct fio_torrent_t *const t);
 
-int client__start(struct fio_torrent_t *t);
+/**
+ * Download the missing blocks, giving each request to the peer chosen by peer_select.
+ * Peers that fail are retried with a jittered exponential backoff until the file is complete
+ * or the deadline of the settings passes.
+ * @param c download state, see client_init
+ * @return 0 if no error or -1 if error
+ */
+int client__start(struct client_t *c);
 
-#endif
\ No newline at end of file
+#endif
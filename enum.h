@@ -8,6 +8,77 @@ static const uint8_t MSG_REQUEST = 0;
 static const uint8_t MSG_RESPONSE_OK = 1;
 static const uint8_t MSG_RESPONSE_NA = 2;
 
-enum { RAW_MESSAGE_SIZE = 13 };
+// tracker datagrams, see tracker.h
+static const uint8_t MSG_TRACKER_ANNOUNCE = 3;
+static const uint8_t MSG_TRACKER_QUERY = 4;
+static const uint8_t MSG_TRACKER_PEERS = 5;
+
+// peer exchange, in both directions: block_number is the number of tracker_peer_t that follow
+static const uint8_t MSG_PEX = 6;
+
+// block availability, from a server to a client: MSG_BITFIELD is sent right after the answer to MSG_HELLO,
+// with block_number set to the number of blocks and followed by (block_number + 7) / 8 bytes, where bit k % 8
+// of byte k / 8 tells whether block k is available. MSG_HAVE then announces each block stored afterwards, in
+// block_number. Both may come before any response. With CAP_CLIENT_HAVE, the client also sends MSG_HAVE for
+// the blocks it stored before its requests.
+static const uint8_t MSG_BITFIELD = 7;
+static const uint8_t MSG_HAVE = 8;
+
+// several blocks in one request: MSG_REQUEST_RANGE asks for block_number and the blocks after it, their count
+// in the uint64_t that follows; MSG_REQUEST_LIST is followed by block_number uint64_t block numbers. The server
+// answers each block in order, as for MSG_REQUEST, and only reads the next request after the last answer.
+static const uint8_t MSG_REQUEST_RANGE = 9;
+static const uint8_t MSG_REQUEST_LIST = 10;
+
+// handshake, sent by a client right after it connects and followed by a utils_hello_t with what it supports.
+// The server answers with a MSG_HELLO carrying what both support, and the connection only uses that from then
+// on. A legacy server closes the connection instead, and a legacy client never sends it: such a connection is
+// version 0 and only uses MSG_REQUEST, MSG_RESPONSE_OK, MSG_RESPONSE_NA and MSG_PEX.
+static const uint8_t MSG_HELLO = 11;
+
+static const uint16_t PROTOCOL_VERSION = 1;
+
+// capabilities in utils_hello_t
+static const uint32_t CAP_RANGE = 1;        // MSG_REQUEST_RANGE and MSG_REQUEST_LIST
+static const uint32_t CAP_AVAILABILITY = 2; // MSG_BITFIELD after the handshake, then MSG_HAVE
+static const uint32_t CAP_PEX = 4;          // MSG_PEX
+static const uint32_t CAP_DEFLATE = 8;      // MSG_RESPONSE_DEFLATE
+static const uint32_t CAP_CLIENT_HAVE = 16; // the client serves the torrent and sends MSG_HAVE for the blocks it stores
+static const uint32_t CAP_FILE = 32;        // MSG_FILE, only over a Unix socket
+
+// a block compressed with zlib, instead of MSG_RESPONSE_OK when it pays: followed by a uint32_t with the size of
+// the compressed data, then the data, which must inflate to the whole block
+static const uint8_t MSG_RESPONSE_DEFLATE = 12;
+
+// metainfo exchange, needs no handshake: block_number is a chunk of the block hashes or METAINFO_HEADER, followed
+// by the identifier of the torrent. Answered with MSG_METAINFO and the same block_number, see metainfo.h, or with
+// MSG_RESPONSE_NA if the server does not serve that torrent.
+static const uint8_t MSG_METAINFO = 13;
+
+// UDP transport, on the UDP port of the same number as the TCP one, see udp.h
+static const uint8_t MSG_UDP_REQUEST = 14;
+static const uint8_t MSG_UDP_DATA = 15;
+static const uint8_t MSG_UDP_ACK = 16;
+static const uint8_t MSG_UDP_DONE = 17;
+
+// same-host transfer, with CAP_FILE: a client sends MSG_FILE after the handshake and the server answers right away
+// with MSG_FILE, carrying a read-only descriptor of the downloaded file as SCM_RIGHTS ancillary data, or with
+// MSG_RESPONSE_NA. From then on it answers each available block with MSG_RESPONSE_FILE and no data: the client
+// copies the block from that descriptor, at the offset of the block, and verifies it as any other.
+static const uint8_t MSG_FILE = 18;
+static const uint8_t MSG_RESPONSE_FILE = 19;
+
+// multicast distribution, on the port of the group, see mcast.h
+static const uint8_t MSG_MCAST_DATA = 20;
+static const uint8_t MSG_MCAST_STATUS = 21;
+static const uint8_t MSG_MCAST_NAK = 22;
+static const uint8_t MSG_MCAST_DONE = 23;
+
+// UDP transport: the answer to a MSG_UDP_REQUEST without the cookie of its source, see udp.h
+static const uint8_t MSG_UDP_COOKIE = 24;
+
+enum { RAW_MESSAGE_SIZE = 13,
+       PEX_MAX_PEERS = 16,        // most peers in a MSG_PEX
+       REQUEST_MAX_BLOCKS = 64 }; // most blocks in a MSG_REQUEST_RANGE or MSG_REQUEST_LIST
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
  *
  * This file must be linked with -lssl -lcrypto (provided in the libssl-dev debian package).
  */
+#define _GNU_SOURCE // pwritev, SEEK_DATA and SEEK_HOLE
 #include "file_io.h"
 #include "logger.h"
 #include <assert.h>
@@ -12,6 +13,9 @@
 #include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /**
@@ -107,8 +111,81 @@ static int fio__read_hash_from_file(fio_sha256_hash_t hash, FILE *const f) {
     return 0;
 }
 
-int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name, struct fio_torrent_t *const torrent,
-                                          const char *const downloaded_file_name) {
+/**
+ * Computes the hash of a block of zeros, which is what a hole, or the space past the end of the file, reads as.
+ */
+static void fio__zero_block_hash(const uint64_t size, fio_sha256_hash_t digest) {
+    static const uint8_t zeros[FIO_MAX_BLOCK_SIZE];
+
+    SHA256(zeros, size, digest);
+}
+
+/**
+ * Marks the blocks of the downloaded file as missing or unchecked without reading them, from the size the
+ * file had before it was extended and from the holes in it (SEEK_DATA, SEEK_HOLE). On file systems without
+ * holes support every block of the old file is unchecked.
+ */
+static int fio__classify_blocks(struct fio_torrent_t *const torrent, const off_t old_size) {
+    const int fd = fileno(torrent->downloaded_file_stream);
+    const uint64_t last = torrent->block_count - 1;
+    uint64_t k = 0;
+
+    // a missing block is still correct if it is supposed to be all zeros
+    fio_sha256_hash_t zero_hash, last_zero_hash;
+    fio__zero_block_hash(FIO_MAX_BLOCK_SIZE, zero_hash);
+    fio__zero_block_hash(fio_get_block_size(torrent, last), last_zero_hash);
+
+    while (k < torrent->block_count) {
+        const off_t start = (off_t)(k * FIO_MAX_BLOCK_SIZE);
+        const off_t end = (off_t)torrent->downloaded_file_size;
+        off_t data = start < old_size ? lseek(fd, start, SEEK_DATA) : end;
+
+        if (data < 0) {
+            if (errno != ENXIO) {
+                return -1;
+            }
+            errno = 0;
+            data = end; // only holes after start
+        }
+
+        if (data >= old_size) {
+            data = end; // what ftruncate added is a hole too
+        }
+
+        // blocks that end before the next data are missing
+        for (; k < torrent->block_count && (off_t)(k * FIO_MAX_BLOCK_SIZE + fio_get_block_size(torrent, k)) <= data; k++) {
+            torrent->block_map[k] = memcmp(torrent->block_hashes[k], k == last ? last_zero_hash : zero_hash,
+                                           SHA256_DIGEST_LENGTH) == 0;
+            torrent->block_unchecked[k] = FIO_BLOCK_CHECKED;
+        }
+
+        if (data >= old_size) {
+            continue;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+
+        if (hole < 0 || hole > old_size) {
+            errno = 0;
+            hole = old_size;
+        }
+
+        // blocks that have data are checked later
+        for (; k < torrent->block_count && (off_t)(k * FIO_MAX_BLOCK_SIZE) < hole; k++) {
+            torrent->block_map[k] = 0;
+            torrent->block_unchecked[k] = FIO_BLOCK_UNCHECKED;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Loads a metainfo file and opens the downloaded file. Blocks are verified now or, if unchecked is set,
+ * classified by fio__classify_blocks.
+ */
+static int fio__create_torrent(const char *const metainfo_file_name, struct fio_torrent_t *const torrent,
+                               const char *const downloaded_file_name, const char unchecked) {
 
     assert(metainfo_file_name != NULL);
     assert(torrent != NULL);
@@ -254,6 +331,42 @@ int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name,
             buffer[strlen(buffer) - 1] = '\0';
         }
 
+        // Split the optional locality label
+
+        char *label = strpbrk(buffer, " \t");
+        torrent->peers[i].locality[0] = '\0';
+
+        if (label != NULL) {
+            *label++ = '\0';
+            label += strspn(label, " \t");
+            label[strcspn(label, " \t\r")] = '\0';
+
+            if (strlen(label) >= FIO_MAX_LOCALITY) {
+                errno = EBADMSG;
+                return -1;
+            }
+
+            strcpy(torrent->peers[i].locality, label);
+        }
+
+        // A socket on this host
+
+        torrent->peers[i].unix_path[0] = '\0';
+
+        if (!strncmp(buffer, "unix:", 5)) {
+            if (buffer[5] == '\0' || strlen(buffer + 5) >= FIO_MAX_UNIX_PATH) {
+                errno = EBADMSG;
+                return -1;
+            }
+
+            memset(torrent->peers[i].peer_address, 0, sizeof(torrent->peers[i].peer_address));
+            torrent->peers[i].peer_port = 0;
+            strcpy(torrent->peers[i].unix_path, buffer + 5);
+
+            log_printf(LOG_DEBUG, "\tUnix socket %s %s", torrent->peers[i].unix_path, torrent->peers[i].locality);
+            continue;
+        }
+
         // 'Parse' host and port
 
         char *const colon = strrchr(buffer, ':');
@@ -299,12 +412,13 @@ int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name,
 
         torrent->peers[i].peer_port = addr_in->sin_port;
 
-        log_printf(LOG_DEBUG, "\t... to %d.%d.%d.%d %d",
+        log_printf(LOG_DEBUG, "\t... to %d.%d.%d.%d %d %s",
                    torrent->peers[i].peer_address[0],
                    torrent->peers[i].peer_address[1],
                    torrent->peers[i].peer_address[2],
                    torrent->peers[i].peer_address[3],
-                   torrent->peers[i].peer_port);
+                   torrent->peers[i].peer_port,
+                   torrent->peers[i].locality);
 
         freeaddrinfo(result);
     }
@@ -343,12 +457,32 @@ int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name,
         return -1;
     }
 
+    struct stat st;
+
+    if (fstat(fileno(torrent->downloaded_file_stream), &st)) {
+        return -1;
+    }
+
     if (ftruncate(fileno(torrent->downloaded_file_stream), file_size)) {
         return -1;
     }
 
     // Populate block_map
 
+    torrent->block_unchecked = NULL;
+    torrent->stored_log = NULL;
+    torrent->stored_count = 0;
+
+    if (unchecked) {
+        torrent->block_unchecked = malloc(sizeof(uint8_t) * torrent->block_count);
+
+        if (torrent->block_unchecked == NULL) {
+            return -1;
+        }
+
+        return torrent->block_count > 0 ? fio__classify_blocks(torrent, st.st_size < file_size ? st.st_size : file_size) : 0;
+    }
+
     for (uint64_t block_number = 0; block_number < torrent->block_count; block_number++) {
 
         struct fio_block_t block;
@@ -366,6 +500,99 @@ int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name,
     return 0;
 }
 
+int fio_create_torrent_from_metainfo_file(const char *const metainfo_file_name, struct fio_torrent_t *const torrent,
+                                          const char *const downloaded_file_name) {
+    return fio__create_torrent(metainfo_file_name, torrent, downloaded_file_name, 0);
+}
+
+int fio_create_torrent_unchecked(const char *const metainfo_file_name, struct fio_torrent_t *const torrent,
+                                 const char *const downloaded_file_name) {
+    return fio__create_torrent(metainfo_file_name, torrent, downloaded_file_name, 1);
+}
+
+int fio_log_stored(struct fio_torrent_t *const torrent) {
+    assert(torrent != NULL);
+
+    torrent->stored_log = malloc(sizeof(uint64_t) * (torrent->block_count ? torrent->block_count : 1));
+
+    if (torrent->stored_log == NULL) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < torrent->block_count; i++) {
+        torrent->stored_log[i] = UINT64_MAX;
+    }
+
+    torrent->stored_count = 0;
+    return 0;
+}
+
+/**
+ * Appends a block to stored_log, if enabled. Called after its block_map is set, so a reader that takes
+ * the count before looking at block_map misses no block.
+ */
+static void fio__log_stored(struct fio_torrent_t *const torrent, const uint64_t block_number) {
+    if (torrent->stored_log == NULL) {
+        return;
+    }
+
+    const uint64_t i = __atomic_fetch_add(&torrent->stored_count, 1, __ATOMIC_ACQ_REL);
+
+    if (i < torrent->block_count) {
+        __atomic_store_n(&torrent->stored_log[i], block_number, __ATOMIC_RELEASE);
+    }
+}
+
+int fio_check_block(struct fio_torrent_t *const torrent, const uint64_t block_number) {
+    assert(torrent != NULL);
+    assert(torrent->downloaded_file_stream != NULL);
+    assert(torrent->block_unchecked != NULL);
+    assert(block_number < torrent->block_count);
+
+    const uint64_t offset64 = block_number * FIO_MAX_BLOCK_SIZE;
+
+    const off_t offset = (off_t)offset64;
+
+    if (offset < 0 || (uint64_t)offset != offset64) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct fio_block_t block;
+    block.size = fio_get_block_size(torrent, block_number);
+
+    for (size_t done = 0; done < block.size;) {
+        const ssize_t r = pread(fileno(torrent->downloaded_file_stream), block.data + done, block.size - done,
+                                offset + (off_t)done);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (r <= 0) {
+            if (r == 0) {
+                errno = EIO; // somebody truncated the file
+            }
+            __atomic_store_n(&torrent->block_unchecked[block_number], FIO_BLOCK_CHECKED, __ATOMIC_RELEASE);
+            return -1;
+        }
+
+        done += (size_t)r;
+    }
+
+    const int correct = fio__verify_block(&block, torrent->block_hashes[block_number]) == 0;
+
+    // readers that see the block checked must also see its block_map
+    __atomic_store_n(&torrent->block_map[block_number], correct, __ATOMIC_RELEASE);
+    __atomic_store_n(&torrent->block_unchecked[block_number], FIO_BLOCK_CHECKED, __ATOMIC_RELEASE);
+
+    if (correct) {
+        fio__log_stored(torrent, block_number);
+    }
+
+    return 0;
+}
+
 uint64_t fio_get_block_size(const struct fio_torrent_t *const torrent, const uint64_t block_number) {
     assert(torrent != NULL);
     assert(block_number < torrent->block_count);
@@ -373,7 +600,8 @@ uint64_t fio_get_block_size(const struct fio_torrent_t *const torrent, const uin
     // While a zero-length file may be valid, it does not have any block for which to ask its size.
     assert(torrent->downloaded_file_size > 0);
 
-    const uint64_t last_block_size = torrent->downloaded_file_size % FIO_MAX_BLOCK_SIZE;
+    // the last block is full when the size is a multiple of FIO_MAX_BLOCK_SIZE
+    const uint64_t last_block_size = (torrent->downloaded_file_size - 1) % FIO_MAX_BLOCK_SIZE + 1;
 
     return block_number + 1 == torrent->block_count ? last_block_size : FIO_MAX_BLOCK_SIZE;
 }
@@ -416,6 +644,69 @@ int fio_load_block(const struct fio_torrent_t *const torrent, const uint64_t blo
     return 0;
 }
 
+int fio_read_blocks(const struct fio_torrent_t *const torrent, const uint64_t first_block, uint8_t *const *const data,
+                    const size_t count) {
+    assert(torrent != NULL);
+    assert(torrent->downloaded_file_stream != NULL);
+    assert(data != NULL);
+    assert(count > 0 && count <= FIO_MAX_READ_BLOCKS);
+    assert(first_block + count <= torrent->block_count);
+
+    const uint64_t offset64 = first_block * FIO_MAX_BLOCK_SIZE;
+
+    const off_t offset = (off_t)offset64;
+
+    if (offset < 0 || (uint64_t)offset != offset64) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct iovec iov[FIO_MAX_READ_BLOCKS];
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = data[i];
+        iov[i].iov_len = fio_get_block_size(torrent, first_block + i);
+        total += iov[i].iov_len;
+    }
+
+    const int fd = fileno(torrent->downloaded_file_stream);
+    struct iovec *next = iov;
+    int left = (int)count;
+    size_t done = 0;
+
+    while (done < total) {
+        const ssize_t r = preadv(fd, next, left, offset + (off_t)done);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (r == 0) { // the file was truncated under our noses, see fio_load_block
+            errno = EIO;
+            return -1;
+        }
+
+        done += (size_t)r;
+
+        // skip what was read
+        size_t n = (size_t)r;
+        while (left > 0 && n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (uint8_t *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
 int fio_store_block(struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block) {
 
     assert(torrent != NULL);
@@ -454,6 +745,131 @@ int fio_store_block(struct fio_torrent_t *const torrent, const uint64_t block_nu
     }
 
     torrent->block_map[block_number] = 1;
+    fio__log_stored(torrent, block_number);
+
+    return 0;
+}
+
+int fio_verify_block(const struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block) {
+    assert(torrent != NULL);
+    assert(block_number < torrent->block_count);
+    assert(block != NULL);
+
+    if (block->size != fio_get_block_size(torrent, block_number) ||
+        fio__verify_block(block, torrent->block_hashes[block_number])) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int fio_write_block(struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block) {
+    return fio_write_blocks(torrent, block_number, &block, 1);
+}
+
+int fio_write_blocks(struct fio_torrent_t *const torrent, const uint64_t first_block,
+                     const struct fio_block_t *const *const blocks, const size_t count) {
+    assert(torrent != NULL);
+    assert(torrent->downloaded_file_stream != NULL);
+    assert(blocks != NULL);
+    assert(count > 0 && count <= FIO_MAX_WRITE_BLOCKS);
+    assert(first_block + count <= torrent->block_count);
+
+    const uint64_t offset64 = first_block * FIO_MAX_BLOCK_SIZE;
+
+    const off_t offset = (off_t)offset64;
+
+    if (offset < 0 || (uint64_t)offset != offset64) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct iovec iov[FIO_MAX_WRITE_BLOCKS];
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        assert(i + 1 == count || blocks[i]->size == FIO_MAX_BLOCK_SIZE);
+        iov[i].iov_base = (void *)(uintptr_t)blocks[i]->data; // pwritev does not write to it
+        iov[i].iov_len = blocks[i]->size;
+        total += blocks[i]->size;
+    }
+
+    const int fd = fileno(torrent->downloaded_file_stream);
+    struct iovec *next = iov;
+    int left = (int)count;
+    size_t written = 0;
+
+    while (written < total) {
+        const ssize_t r = pwritev(fd, next, left, offset + (off_t)written);
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        written += (size_t)r;
+
+        // skip what was written
+        size_t n = (size_t)r;
+        while (left > 0 && n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (uint8_t *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+
+    // readers on other threads must not see the blocks before their data
+    for (size_t i = 0; i < count; i++) {
+        __atomic_store_n(&torrent->block_map[first_block + i], 1, __ATOMIC_RELEASE);
+        fio__log_stored(torrent, first_block + i);
+    }
+
+    return 0;
+}
+
+int fio_commit_block(struct fio_torrent_t *const torrent, const uint64_t block_number) {
+    assert(torrent != NULL);
+    assert(torrent->downloaded_file_stream != NULL);
+    assert(block_number < torrent->block_count);
+
+    const uint64_t offset64 = block_number * FIO_MAX_BLOCK_SIZE;
+
+    const off_t offset = (off_t)offset64;
+
+    if (offset < 0 || (uint64_t)offset != offset64) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    const size_t size = fio_get_block_size(torrent, block_number);
+
+    // blocks start at multiples of FIO_MAX_BLOCK_SIZE, which are page aligned
+    void *const data = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(torrent->downloaded_file_stream), offset);
+
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    unsigned char real_digest[SHA256_DIGEST_LENGTH];
+    SHA256(data, size, real_digest);
+
+    if (munmap(data, size)) {
+        return -1;
+    }
+
+    if (memcmp(real_digest, torrent->block_hashes[block_number], SHA256_DIGEST_LENGTH)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&torrent->block_map[block_number], 1, __ATOMIC_RELEASE);
+    fio__log_stored(torrent, block_number);
 
     return 0;
 }
@@ -468,6 +884,8 @@ int fio_destroy_torrent(struct fio_torrent_t *const torrent) {
 
     free(torrent->block_hashes);
     free(torrent->block_map);
+    free(torrent->block_unchecked);
+    free(torrent->stored_log);
     free(torrent->peers);
 
     return fclose(torrent->downloaded_file_stream);
@@ -60,12 +60,29 @@ enum { FIO_MAX_BLOCK_SIZE = 0x10000 }; //!< MAX_BLOCK_SIZE
  */
 typedef unsigned char fio_sha256_hash_t[SHA256_DIGEST_LENGTH];
 
+/**
+ * Maximum length of a locality label, including the '\0'.
+ */
+enum { FIO_MAX_LOCALITY = 64 };
+
+/**
+ * Maximum length of the path of a Unix socket, including the '\0' (the size of sun_path).
+ */
+enum { FIO_MAX_UNIX_PATH = 108 };
+
 /**
  * This structure represents a torrent peer as an address and port pair.
+ *
+ * A peer line of the metainfo file may be followed by a locality label, e.g. "host:8080 eu-west/r12/node7",
+ * naming the zone, the rack and the host of the peer from the widest to the narrowest (see peer_distance).
+ *
+ * A peer on the same host may be given as "unix:/path/of/socket" instead: address and port are then 0.
  */
 struct fio_peer_information_t {
-    uint8_t peer_address[4]; ///< Peer address in network byte order.
-    uint16_t peer_port;      ///< Peer port in network byte order.
+    uint8_t peer_address[4];          ///< Peer address in network byte order.
+    uint16_t peer_port;               ///< Peer port in network byte order.
+    char locality[FIO_MAX_LOCALITY];  ///< Locality label, empty if unknown.
+    char unix_path[FIO_MAX_UNIX_PATH]; ///< Path of the Unix socket of the peer, empty for a TCP peer.
 };
 
 /**
@@ -88,11 +105,33 @@ struct fio_torrent_t {
 
     uint_fast8_t *block_map; ///< An array of integers denoting whether a block is correctly downloaded.
 
+    uint8_t *block_unchecked; ///< FIO_BLOCK_UNCHECKED for blocks not verified yet, NULL if all were verified at load time.
+
     uint64_t peer_count; ///< Number of peers available in the "peers" field.
 
     struct fio_peer_information_t *peers; ///< An array of the peers available.
+
+    uint64_t *stored_log; ///< Blocks in the order they were stored after fio_log_stored, UINT64_MAX past the end. NULL if not enabled.
+
+    uint64_t stored_count; ///< Number of entries taken in stored_log, some may not be written yet.
 };
 
+/**
+ * Values of block_unchecked. A checked block is correct if block_map is set, and missing otherwise.
+ */
+enum { FIO_BLOCK_CHECKED = 0,
+       FIO_BLOCK_UNCHECKED = 1 };
+
+/**
+ * The maximum number of blocks written at once by fio_write_blocks.
+ */
+enum { FIO_MAX_WRITE_BLOCKS = 64 };
+
+/**
+ * The maximum number of blocks read at once by fio_read_blocks.
+ */
+enum { FIO_MAX_READ_BLOCKS = 64 };
+
 /**
  * A structure representing a block of data.
  */
@@ -111,6 +150,37 @@ struct fio_block_t {
 int fio_create_torrent_from_metainfo_file(char const *const metainfo_file_name, struct fio_torrent_t *const torrent,
                                           char const *const downloaded_file_name);
 
+/**
+ * Like fio_create_torrent_from_metainfo_file, but without reading the downloaded file. Blocks past the
+ * previous end of the file and blocks that are holes in it are known to be missing (unless their hash
+ * is the one of a block of zeros); the others are left FIO_BLOCK_UNCHECKED, for fio_check_block.
+ * @param metainfo_file_name is the ".ttorrent" file.
+ * @param torrent is the data structure to initialize.
+ * @param downloaded_file_name is the file name of the downloaded file.
+ * @return 0 on success, or -1 and errno is set.
+ */
+int fio_create_torrent_unchecked(char const *const metainfo_file_name, struct fio_torrent_t *const torrent,
+                                 char const *const downloaded_file_name);
+
+/**
+ * Verifies an unchecked block of the downloaded file, sets block_map if it is correct and then marks it
+ * FIO_BLOCK_CHECKED. It reads with pread, so it can be called from any thread, but only one thread may
+ * check a given block.
+ * @param torrent is a torrent_t data structure created with fio_create_torrent_unchecked.
+ * @param block_number is the index of the block to check.
+ * @return 0 on success (whether the block is correct or not), or -1 and errno is set. The block is then
+ * marked checked and missing, so that it is downloaded again.
+ */
+int fio_check_block(struct fio_torrent_t *const torrent, const uint64_t block_number);
+
+/**
+ * Starts recording the blocks that get stored, so that a server sharing the torrent with a client can tell
+ * its peers about them: each block whose block_map is set from now on is appended to stored_log.
+ * @param torrent is a torrent_t data structure, not used by other threads yet.
+ * @return 0 on success, or -1 and errno is set.
+ */
+int fio_log_stored(struct fio_torrent_t *const torrent);
+
 /**
  * Gets the size of a block in the downloaded file.
  * @param torrent is a torrent_t data structure.
@@ -128,6 +198,18 @@ uint64_t fio_get_block_size(const struct fio_torrent_t *const torrent, const uin
  */
 int fio_load_block(const struct fio_torrent_t *const torrent, const uint64_t block_number, struct fio_block_t *const block);
 
+/**
+ * Loads consecutive blocks from disk with a single preadv, each into its own buffer. It does not use the
+ * position of downloaded_file_stream, so it can be called from a thread other than the one using the stream.
+ * @param torrent is a torrent_t data structure.
+ * @param first_block is the index of the first block to load.
+ * @param data are the buffers of the blocks first_block, first_block + 1, ..., each of fio_get_block_size bytes.
+ * @param count is the number of blocks, at most FIO_MAX_READ_BLOCKS.
+ * @return 0 on success, or -1 and errno is set.
+ */
+int fio_read_blocks(const struct fio_torrent_t *const torrent, const uint64_t first_block, uint8_t *const *const data,
+                    const size_t count);
+
 /**
  * Stores a block in the downloaded file.
  * @param torrent is a torrent_t data structure.
@@ -137,6 +219,49 @@ int fio_load_block(const struct fio_torrent_t *const torrent, const uint64_t blo
  */
 int fio_store_block(struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block);
 
+/**
+ * Checks a block against its hash in the metainfo file. It does not modify the torrent, so it can be
+ * called from any thread.
+ * @param torrent is a torrent_t data structure.
+ * @param block_number is the index of the block.
+ * @param block contains the data to check.
+ * @return 0 if the block is correct, or -1 and errno is set to EINVAL.
+ */
+int fio_verify_block(const struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block);
+
+/**
+ * Writes a block that was already checked with fio_verify_block, and marks it in block_map.
+ * It writes with pwrite on the descriptor of downloaded_file_stream, so it can be called from a thread
+ * other than the one using the stream.
+ * @param torrent is a torrent_t data structure.
+ * @param block_number is the index of the block to write.
+ * @param block contains the verified data.
+ * @return 0 on success, or -1 and errno is set.
+ */
+int fio_write_block(struct fio_torrent_t *const torrent, const uint64_t block_number, const struct fio_block_t *const block);
+
+/**
+ * Writes consecutive blocks that were already checked with fio_verify_block with a single pwritev,
+ * and marks them in block_map. It can be called from a thread other than the one using the stream.
+ * @param torrent is a torrent_t data structure.
+ * @param first_block is the index of the first block to write.
+ * @param blocks are the blocks first_block, first_block + 1, ... All but the last one must be full.
+ * @param count is the number of blocks, at most FIO_MAX_WRITE_BLOCKS.
+ * @return 0 on success, or -1 and errno is set.
+ */
+int fio_write_blocks(struct fio_torrent_t *const torrent, const uint64_t first_block,
+                     const struct fio_block_t *const *const blocks, const size_t count);
+
+/**
+ * Verifies a block that was written to the downloaded file by other means (e.g. spliced from a socket),
+ * reading it through a memory mapping of the file, and marks it in block_map if it is correct.
+ * It can be called from any thread.
+ * @param torrent is a torrent_t data structure.
+ * @param block_number is the index of the block to verify.
+ * @return 0 if the block is correct, or -1 and errno is set (EINVAL if it is not correct).
+ */
+int fio_commit_block(struct fio_torrent_t *const torrent, const uint64_t block_number);
+
 /**
  * Deallocates all necessary fields in a torrent_t structure. It also closes the downloaded_file_stream stream.
  * @param torrent is a torrent_t data structure.
@@ -23,8 +23,10 @@ void log_message(const enum log_level_e log_level, const char *const message) {
         return;
     }
 
+    flockfile(stderr); // the client logs from several threads
     (void)fprintf(stderr, "%lu: %s\n", LOG_COUNT, message);
     LOG_COUNT++;
+    funlockfile(stderr);
 }
 
 void log_printf(const enum log_level_e log_level, const char *const format, ...) {
@@ -37,6 +39,7 @@ void log_printf(const enum log_level_e log_level, const char *const format, ...)
 
     va_list ap;
 
+    flockfile(stderr); // keep the lines of different threads apart
     va_start(ap, format);
     fprintf(stderr, "%lu: ", LOG_COUNT);
     (void)vfprintf(stderr, format, ap);
@@ -44,4 +47,5 @@ void log_printf(const enum log_level_e log_level, const char *const format, ...)
 
     (void)fputs("\n", stderr);
     LOG_COUNT++;
+    funlockfile(stderr);
 }
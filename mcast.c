@@ -0,0 +1,559 @@
+/**
+ * This file implements the multicast distribution specified in mcast.h.
+ */
+#define _GNU_SOURCE // sendmmsg
+#include "mcast.h"
+#include "enum.h"
+#include "logger.h"
+#include "ratelimit.h"
+#include "udp.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * State of the sender thread
+ */
+struct mcast__sender_t {
+    struct fio_torrent_t *torrent;
+    struct udp_t u;
+    struct sockaddr_in group;
+    struct ratelimit_t limit;
+    uint32_t session;
+    uint32_t pass;    // being sent
+    uint8_t *repair;  // blocks asked for by a NAK and not sent again yet
+    uint64_t repairs; // blocks set in repair
+    uint8_t *block;   // FIO_MAX_BLOCK_SIZE bytes being sent
+    uint32_t receivers[MCAST__RECEIVERS]; // that sent MSG_MCAST_DONE
+    size_t receiver_count;
+    uint64_t unicast; // blocks these receivers get from the peers instead
+    uint64_t bytes;   // of all the datagrams sent
+    uint64_t naks;    // received
+};
+
+int mcast_parse(const char *str, struct sockaddr_in *group, struct in_addr *interface) {
+    char address[64];
+    const char *colon = strchr(str, ':');
+
+    if (colon == NULL || (size_t)(colon - str) >= sizeof(address))
+        return -1;
+
+    memcpy(address, str, (size_t)(colon - str));
+    address[colon - str] = '\0';
+
+    char *end;
+    const long port = strtol(colon + 1, &end, 10);
+
+    memset(group, 0, sizeof(struct sockaddr_in));
+    group->sin_family = AF_INET;
+    group->sin_port = htons((uint16_t)port);
+    interface->s_addr = htonl(INADDR_ANY);
+
+    if (!inet_aton(address, &group->sin_addr) || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)) || port <= 0 ||
+        port > 65535)
+        return -1;
+
+    if (*end == ',')
+        return inet_aton(end + 1, interface) ? 0 : -1;
+
+    return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * Send every packet of a block to the group
+ * @return 0 on success or -1 if the block cannot be read
+ */
+static int mcast__send_block(struct mcast__sender_t *s, const uint64_t k) {
+    uint8_t *data[1] = {s->block};
+
+    if (fio_read_blocks(s->torrent, k, data, 1)) {
+        log_printf(LOG_INFO, "Cannot load block %lu: %s", k, strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    const uint64_t size = fio_get_block_size(s->torrent, k);
+    struct mcast_data_t headers[UDP_BLOCK_PACKETS];
+    struct iovec iov[UDP_BLOCK_PACKETS][2];
+    struct mmsghdr msgs[UDP_BLOCK_PACKETS];
+    unsigned int count = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (uint32_t offset = 0; offset < size; offset += UDP_PAYLOAD) {
+        struct mcast_data_t *h = &headers[count];
+        h->header.magic_number = MAGIC_NUMBER;
+        h->header.message_code = MSG_MCAST_DATA;
+        h->header.session = s->session;
+        h->block_number = k;
+        h->offset = offset;
+        h->pass = s->pass;
+
+        iov[count][0].iov_base = h;
+        iov[count][0].iov_len = sizeof(*h);
+        iov[count][1].iov_base = s->block + offset;
+        iov[count][1].iov_len = size - offset < UDP_PAYLOAD ? size - offset : UDP_PAYLOAD;
+        msgs[count].msg_hdr.msg_name = &s->group;
+        msgs[count].msg_hdr.msg_namelen = sizeof(s->group);
+        msgs[count].msg_hdr.msg_iov = iov[count];
+        msgs[count].msg_hdr.msg_iovlen = 2;
+        s->bytes += sizeof(*h) + iov[count][1].iov_len;
+        count++;
+    }
+
+    for (unsigned int sent = 0; sent < count;) {
+        const int n = sendmmsg(s->u.sock, msgs + sent, count - sent, 0);
+
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != ENOBUFS) {
+            log_printf(LOG_DEBUG, "sendmmsg failed: %s", strerror(errno));
+            errno = 0;
+            break; // the receivers ask for it again
+        }
+
+        errno = 0;
+        sent += n > 0 ? (unsigned int)n : 0;
+    }
+
+    s->u.sent += count;
+    return 0;
+}
+
+/**
+ * Tell the receivers which pass ended
+ */
+static void mcast__send_status(struct mcast__sender_t *s) {
+    struct mcast_status_t status;
+    status.header.magic_number = MAGIC_NUMBER;
+    status.header.message_code = MSG_MCAST_STATUS;
+    status.header.session = s->session;
+    status.block_count = s->torrent->block_count;
+    status.pass = s->pass;
+
+    if (sendto(s->u.sock, &status, sizeof(status), 0, (struct sockaddr *)&s->group, sizeof(s->group)) < 0) {
+        log_printf(LOG_DEBUG, "sendto failed: %s", strerror(errno));
+        errno = 0;
+    }
+
+    s->bytes += sizeof(status);
+}
+
+/**
+ * Count a receiver that is done, once, and log what multicast saved so far
+ */
+static void mcast__on_done(struct mcast__sender_t *s, const struct sockaddr_in *from, const struct mcast_done_t *done) {
+    for (size_t i = 0; i < s->receiver_count; i++) {
+        if (s->receivers[i] == done->receiver)
+            return;
+    }
+
+    if (s->receiver_count == MCAST__RECEIVERS)
+        return;
+
+    const uint64_t unicast = done->unicast;
+    s->receivers[s->receiver_count++] = done->receiver;
+    s->unicast += unicast;
+
+    const uint64_t file = s->torrent->downloaded_file_size;
+    const double sent = (double)s->bytes + (double)s->unicast * FIO_MAX_BLOCK_SIZE;
+    const double alone = (double)s->receiver_count * (double)file;
+
+    log_printf(LOG_INFO, "Receiver %08x at %s done, %lu blocks left to the peers", done->receiver,
+               inet_ntoa(from->sin_addr), unicast);
+    log_printf(LOG_INFO, "Multicast: %lu bytes in %u passes (%.2f times the file) and %lu blocks over TCP for %zu receivers, "
+                         "where unicast would send %.0f bytes (%.1f times more), %lu NAKs",
+               s->bytes, s->pass + 1, (double)s->bytes / (double)file, s->unicast, s->receiver_count, alone,
+               alone / sent, s->naks);
+}
+
+/**
+ * Take the NAKs and MSG_MCAST_DONE of the receivers
+ * @param wait seconds to wait for them, 0 to only take what is there
+ */
+static void mcast__listen(struct mcast__sender_t *s, const double wait) {
+    const double deadline = utils_now() + wait;
+
+    do {
+        const double left = deadline - utils_now();
+        const int n = udp_receive(&s->u, s->u.in, left > 0 ? left : 0);
+
+        for (int j = 0; j < n; j++) {
+            const struct udp_datagram_t *d = &s->u.in[j];
+            struct mcast_nak_t nak;
+
+            if (d->length < sizeof(struct mcast_header_t))
+                continue;
+
+            memcpy(&nak, d->data, d->length < sizeof(nak) ? d->length : sizeof(nak));
+
+            if (nak.header.magic_number != MAGIC_NUMBER || nak.header.session != s->session)
+                continue;
+
+            if (nak.header.message_code == MSG_MCAST_DONE && d->length >= sizeof(struct mcast_done_t)) {
+                struct mcast_done_t done;
+                memcpy(&done, d->data, sizeof(done));
+                mcast__on_done(s, &d->from, &done);
+                continue;
+            }
+
+            if (nak.header.message_code != MSG_MCAST_NAK || d->length < sizeof(nak) ||
+                d->length < sizeof(nak) + nak.count * sizeof(struct mcast_range_t))
+                continue;
+
+            s->naks++;
+
+            for (uint8_t i = 0; i < nak.count; i++) {
+                struct mcast_range_t range;
+                memcpy(&range, d->data + sizeof(nak) + i * sizeof(range), sizeof(range));
+
+                for (uint64_t k = range.first; k <= range.last && k < s->torrent->block_count; k++) {
+                    if (!s->repair[k] && __atomic_load_n(&s->torrent->block_map[k], __ATOMIC_ACQUIRE)) {
+                        s->repair[k] = 1;
+                        s->repairs++;
+                    }
+                }
+            }
+        }
+    } while (utils_now() < deadline);
+}
+
+static void *mcast__send(void *arg) {
+    struct mcast__sender_t *s = arg;
+    const struct fio_torrent_t *t = s->torrent;
+
+    while (1) {
+        const double start = utils_now();
+        const uint64_t bytes = s->bytes;
+        uint64_t sent = 0;
+
+        // the first pass sends what we have, the next ones what was asked for
+        for (uint64_t k = 0; k < t->block_count; k++) {
+            if (s->pass > 0 && !s->repair[k])
+                continue;
+
+            if (s->repair[k]) {
+                s->repair[k] = 0;
+                s->repairs--;
+            }
+
+            if (!__atomic_load_n(&t->block_map[k], __ATOMIC_ACQUIRE) || mcast__send_block(s, k))
+                continue;
+
+            sent++;
+            utils_sleep(ratelimit_acquire(&s->limit, (double)fio_get_block_size(t, k)));
+            mcast__listen(s, 0);
+        }
+
+        if (sent > 0)
+            log_printf(LOG_INFO, "Multicast pass %u: %lu blocks, %lu bytes in %.3f s", s->pass, sent, s->bytes - bytes,
+                       utils_now() - start);
+
+        mcast__send_status(s);
+        mcast__listen(s, MCAST__NAK_WAIT);
+
+        if (s->repairs == 0) {
+            while (s->repairs == 0) {
+                mcast__send_status(s);
+                mcast__listen(s, MCAST__STATUS_INTERVAL);
+            }
+
+            mcast__listen(s, MCAST__NAK_WAIT); // the other receivers answer the same status
+        }
+
+        s->pass++;
+    }
+
+    return NULL;
+}
+
+int mcast_start_sender(const struct sockaddr_in *group, const struct in_addr interface, double rate,
+                       struct fio_torrent_t *torrent) {
+    struct mcast__sender_t *s = calloc(1, sizeof(struct mcast__sender_t));
+
+    if (s == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    s->torrent = torrent;
+    s->group = *group;
+    s->repair = calloc(torrent->block_count, sizeof(uint8_t));
+    s->block = malloc(FIO_MAX_BLOCK_SIZE);
+
+    if (s->repair == NULL || s->block == NULL || udp_open(&s->u, 0)) {
+        log_printf(LOG_DEBUG, "Cannot set up the multicast sender: %s", strerror(errno));
+        free(s->repair);
+        free(s->block);
+        free(s);
+        return -1;
+    }
+
+    const unsigned char loop = 1; // receivers on this host too
+    if (setsockopt(s->u.sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) ||
+        (interface.s_addr != htonl(INADDR_ANY) &&
+         setsockopt(s->u.sock, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)))) {
+        log_printf(LOG_INFO, "Cannot send to the group on %s: %s", inet_ntoa(interface), strerror(errno));
+        udp_close(&s->u);
+        free(s->repair);
+        free(s->block);
+        free(s);
+        return -1;
+    }
+
+    s->session = (uint32_t)rand() ^ (uint32_t)getpid();
+    ratelimit_init(&s->limit, rate);
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, mcast__send, s)) {
+        log_message(LOG_DEBUG, "pthread_create failed");
+        udp_close(&s->u);
+        ratelimit_destroy(&s->limit);
+        free(s->repair);
+        free(s->block);
+        free(s);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    log_printf(LOG_INFO, "Sending to multicast group %s:%d at %.0f B/s", inet_ntoa(group->sin_addr),
+               ntohs(group->sin_port), rate);
+    return 0;
+}
+
+/**
+ * Tell the sender which blocks are still missing, in as many datagrams as needed
+ * @param handed blocks given to done: if still needed, they failed verification and are missing again
+ */
+static void mcast__send_naks(struct udp_t *u, const struct sockaddr_in *sender, const uint32_t session,
+                             const uint32_t pass, const struct fio_torrent_t *torrent, mcast_need_cb need, void *arg) {
+    uint8_t buffer[sizeof(struct mcast_nak_t) + MCAST_MAX_RANGES * sizeof(struct mcast_range_t)];
+    struct mcast_nak_t nak;
+    nak.header.magic_number = MAGIC_NUMBER;
+    nak.header.message_code = MSG_MCAST_NAK;
+    nak.header.session = session;
+    nak.pass = pass;
+    nak.count = 0;
+
+    for (uint64_t k = 0; k <= torrent->block_count; k++) {
+        if (k < torrent->block_count && need(arg, k)) {
+            struct mcast_range_t range = {k, k};
+
+            while (range.last + 1 < torrent->block_count && need(arg, range.last + 1)) {
+                range.last++;
+            }
+
+            memcpy(buffer + sizeof(nak) + nak.count * sizeof(range), &range, sizeof(range));
+            nak.count++;
+            k = range.last;
+        }
+
+        if (nak.count == MCAST_MAX_RANGES || (k >= torrent->block_count && nak.count > 0)) {
+            memcpy(buffer, &nak, sizeof(nak));
+
+            if (sendto(u->sock, buffer, sizeof(nak) + nak.count * sizeof(struct mcast_range_t), 0,
+                       (const struct sockaddr *)sender, sizeof(struct sockaddr_in)) < 0) {
+                log_printf(LOG_DEBUG, "sendto failed: %s", strerror(errno));
+                errno = 0;
+            }
+
+            nak.count = 0;
+        }
+    }
+}
+
+int mcast_receive(const struct sockaddr_in *group, const struct in_addr interface, struct fio_torrent_t *torrent,
+                  mcast_need_cb need, mcast_block_cb done, void *arg) {
+    struct udp_t u;
+
+    if (udp_open_group(&u, group, interface))
+        return -1;
+
+    uint64_t *pieces = calloc(torrent->block_count, sizeof(uint64_t)); // bitmap of the packets of each block written
+    uint8_t *handed = calloc(torrent->block_count, sizeof(uint8_t));    // given to done
+
+    if (pieces == NULL || handed == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        free(pieces);
+        free(handed);
+        udp_close(&u);
+        return -1;
+    }
+
+    log_printf(LOG_INFO, "Joined multicast group %s:%d", inet_ntoa(group->sin_addr), ntohs(group->sin_port));
+
+    const int fd = fileno(torrent->downloaded_file_stream);
+    uint64_t missing = 0;
+
+    for (uint64_t k = 0; k < torrent->block_count; k++) {
+        missing += need(arg, k) ? 1 : 0;
+    }
+
+    struct sockaddr_in sender = {0};
+    uint32_t session = 0;
+    char known = 0;       // sender and session are set
+    int received = 0;     // blocks given to done
+    double heard_at = utils_now();
+    double nak_at = HUGE_VAL; // when to send the next NAK
+    double naked_at = 0;      // when the last one was sent
+    uint32_t nak_pass = UINT32_MAX;
+    int naks = 0;
+    const char *why = "got every block";
+
+    while (missing > 0) {
+        double now = utils_now();
+
+        if (nak_at <= now) {
+            mcast__send_naks(&u, &sender, session, nak_pass, torrent, need, arg);
+            nak_at = HUGE_VAL;
+            naked_at = now;
+            naks++;
+        }
+
+        if (now - heard_at >= MCAST__IDLE) {
+            why = "the group is silent";
+            break;
+        }
+
+        const double wait = heard_at + MCAST__IDLE < nak_at ? heard_at + MCAST__IDLE - now : nak_at - now;
+        const int n = udp_receive(&u, u.in, wait > 0 ? wait : 0);
+
+        if (n < 0) {
+            why = "it cannot be received";
+            break;
+        }
+
+        now = utils_now();
+        char stop = 0;
+
+        for (int j = 0; j < n && !stop; j++) {
+            const struct udp_datagram_t *d = &u.in[j];
+            struct mcast_data_t msg;
+
+            if (d->length < sizeof(struct mcast_header_t))
+                continue;
+
+            memcpy(&msg, d->data, d->length < sizeof(msg) ? d->length : sizeof(msg));
+
+            if (msg.header.magic_number != MAGIC_NUMBER ||
+                (msg.header.message_code != MSG_MCAST_DATA && msg.header.message_code != MSG_MCAST_STATUS))
+                continue;
+
+            if (!known) { // follow the first sender heard of
+                sender = d->from;
+                session = msg.header.session;
+                known = 1;
+            }
+
+            if (msg.header.session != session || d->from.sin_addr.s_addr != sender.sin_addr.s_addr ||
+                d->from.sin_port != sender.sin_port)
+                continue;
+
+            heard_at = now;
+
+            if (msg.header.message_code == MSG_MCAST_STATUS && d->length >= sizeof(struct mcast_status_t)) {
+                struct mcast_status_t status;
+                memcpy(&status, d->data, sizeof(status));
+
+                if (status.block_count != torrent->block_count) {
+                    why = "the sender has another file";
+                    stop = 1;
+                    break;
+                }
+
+                // blocks that failed verification are missing again
+                missing = 0;
+
+                for (uint64_t k = 0; k < torrent->block_count; k++) {
+                    if (need(arg, k)) {
+                        pieces[k] = 0;
+                        handed[k] = 0;
+                        missing++;
+                    }
+                }
+
+                if (missing == 0)
+                    break;
+
+                if (naks >= MCAST__NAK_ROUNDS) {
+                    why = "repairs are not enough";
+                    stop = 1;
+                    break;
+                }
+
+                // once per pass, or again when the last NAK brought nothing
+                if (nak_at == HUGE_VAL && (status.pass != nak_pass || now - naked_at >= MCAST__NAK_RETRY)) {
+                    nak_at = now + MCAST__NAK_SPREAD * (double)rand() / (double)RAND_MAX;
+                    nak_pass = status.pass;
+                }
+                continue;
+            }
+
+            if (msg.header.message_code != MSG_MCAST_DATA || d->length < sizeof(msg) ||
+                msg.block_number >= torrent->block_count)
+                continue;
+
+            const uint64_t k = msg.block_number;
+            const uint64_t size = fio_get_block_size(torrent, k);
+            const size_t length = d->length - sizeof(msg);
+            const uint64_t piece = (uint64_t)1 << (msg.offset / UDP_PAYLOAD);
+
+            if (msg.offset % UDP_PAYLOAD || msg.offset >= size ||
+                length != (size - msg.offset < UDP_PAYLOAD ? size - msg.offset : UDP_PAYLOAD)) {
+                log_printf(LOG_DEBUG, "Bad packet for block %lu at %u", k, msg.offset);
+                continue;
+            }
+
+            if (handed[k] || pieces[k] & piece || !need(arg, k)) {
+                u.duplicates++;
+                continue;
+            }
+
+            if (pwrite(fd, d->data + sizeof(msg), length, (off_t)(k * FIO_MAX_BLOCK_SIZE + msg.offset)) != (ssize_t)length) {
+                log_printf(LOG_INFO, "Cannot write block %lu: %s", k, strerror(errno));
+                errno = 0;
+                continue;
+            }
+
+            pieces[k] |= piece;
+
+            if (pieces[k] == ((uint64_t)1 << ((size + UDP_PAYLOAD - 1) / UDP_PAYLOAD)) - 1) {
+                handed[k] = 1;
+                received++;
+                missing--;
+                done(arg, k);
+            }
+        }
+
+        if (stop)
+            break;
+    }
+
+    if (known) {
+        struct mcast_done_t msg;
+        msg.header.magic_number = MAGIC_NUMBER;
+        msg.header.message_code = MSG_MCAST_DONE;
+        msg.header.session = session;
+        msg.receiver = (uint32_t)rand() ^ (uint32_t)getpid();
+        msg.unicast = missing;
+
+        if (sendto(u.sock, &msg, sizeof(msg), 0, (struct sockaddr *)&sender, sizeof(sender)) < 0) {
+            log_printf(LOG_DEBUG, "sendto failed: %s", strerror(errno));
+            errno = 0;
+        }
+    }
+
+    log_printf(LOG_INFO, "Left multicast group, %s: %d blocks received, %lu left, %d NAKs, %lu duplicates", why,
+               received, missing, naks, u.duplicates);
+
+    free(pieces);
+    free(handed);
+    udp_close(&u);
+    return received;
+}
@@ -0,0 +1,175 @@
+/**
+ * Multicast distribution: a server given a group sends each block of the file once to the group, however many
+ * machines receive it, then repairs what they missed.
+ *
+ * The sender goes through the file in passes, at a fixed rate as multicast has no congestion control. Each block
+ * is cut into UDP_PAYLOAD byte MSG_MCAST_DATA packets tagged with the block number and the offset. At the end of a
+ * pass it sends MSG_MCAST_STATUS, and again every MCAST__STATUS_INTERVAL while it has nothing to send.
+ *
+ * A receiver joins the group and writes each packet straight to its place in the file; a block whose packets are
+ * all there is verified as any other. On MSG_MCAST_STATUS it tells the sender, unicast to the address the packets
+ * come from, which blocks it still misses with MSG_MCAST_NAK. It waits a random delay of up to MCAST__NAK_SPREAD
+ * first, so that the receivers do not all answer at once. The sender gathers the NAKs for MCAST__NAK_WAIT, then
+ * sends the blocks asked for in a repair pass: a block lost by many receivers costs one more copy, not one each.
+ *
+ * A receiver that joins late asks for what it missed in the same way. It leaves the rest to the peers, over TCP,
+ * after MCAST__NAK_ROUNDS NAKs or when the group is silent for MCAST__IDLE. It then sends MSG_MCAST_DONE with the
+ * number of blocks left, and the sender logs what it sent against what as many unicast transfers would have.
+ *
+ * Receivers go through the network simulated by udp_simulate. Integers are in host byte order.
+ *
+ * Usage:
+ *
+ *   struct sockaddr_in group;
+ *   struct in_addr interface;
+ *   mcast_parse("239.1.2.3:9000", &group, &interface);
+ *
+ *   mcast_start_sender(&group, interface, MCAST_DEFAULT_RATE, &torrent);   // on the server
+ *
+ *   int n = mcast_receive(&group, interface, &torrent, need, done, arg);  // on each client
+ */
+
+#ifndef MCAST_H_
+#define MCAST_H_
+
+#include "file_io.h"
+#include <netinet/in.h>
+#include <stdint.h>
+
+/**
+ * Bytes per second sent to the group unless told otherwise
+ */
+#define MCAST_DEFAULT_RATE (50.0 * 1024 * 1024)
+
+/**
+ * Most block ranges in a MSG_MCAST_NAK, more take several datagrams
+ */
+#define MCAST_MAX_RANGES 64
+
+/**
+ * Seconds between two MSG_MCAST_STATUS while the sender has nothing to send, and seconds it gathers NAKs before
+ * a repair pass
+ */
+#define MCAST__STATUS_INTERVAL 0.5
+#define MCAST__NAK_WAIT 0.2
+
+/**
+ * Most seconds a receiver waits before its NAK, and before it sends the same one again when nothing was repaired
+ */
+#define MCAST__NAK_SPREAD 0.1
+#define MCAST__NAK_RETRY 1.0
+
+/**
+ * NAKs a receiver sends before it leaves what is left to the peers, and seconds of silence after which it gives
+ * up on the group
+ */
+#define MCAST__NAK_ROUNDS 10
+#define MCAST__IDLE 3.0
+
+/**
+ * Receivers the sender remembers, to count each once
+ */
+#define MCAST__RECEIVERS 1024
+
+/**
+ * Header of every datagram
+ * Disable structure packing so we can use it as a buffer.
+ */
+struct mcast_header_t {
+    uint32_t magic_number; // MAGIC_NUMBER
+    uint8_t message_code;  // MSG_MCAST_*
+    uint32_t session;      // chosen by the sender when it starts
+} __attribute__((packed));
+
+/**
+ * MSG_MCAST_DATA, followed by the payload
+ */
+struct mcast_data_t {
+    struct mcast_header_t header;
+    uint64_t block_number;
+    uint32_t offset; // in the block
+    uint32_t pass;   // 0 for the first one, then the repair passes
+} __attribute__((packed));
+
+/**
+ * MSG_MCAST_STATUS
+ */
+struct mcast_status_t {
+    struct mcast_header_t header;
+    uint64_t block_count; // of the file, receivers of another one ignore the sender
+    uint32_t pass;        // the pass that ended
+} __attribute__((packed));
+
+/**
+ * A range of blocks in a MSG_MCAST_NAK, both ends included
+ */
+struct mcast_range_t {
+    uint64_t first;
+    uint64_t last;
+} __attribute__((packed));
+
+/**
+ * MSG_MCAST_NAK, followed by count mcast_range_t
+ */
+struct mcast_nak_t {
+    struct mcast_header_t header;
+    uint32_t pass; // of the MSG_MCAST_STATUS answered
+    uint8_t count;
+} __attribute__((packed));
+
+/**
+ * MSG_MCAST_DONE
+ */
+struct mcast_done_t {
+    struct mcast_header_t header;
+    uint32_t receiver; // chosen by the receiver, the ones on a host all send from the port of the group
+    uint64_t unicast;  // blocks the receiver gets from the peers instead
+} __attribute__((packed));
+
+/**
+ * Tells mcast_receive whether a block is still needed: not stored, not being verified, and wanted
+ * @param arg as given to mcast_receive
+ */
+typedef char (*mcast_need_cb)(void *arg, uint64_t k);
+
+/**
+ * Called by mcast_receive when all the packets of a block are in the file, to verify it there
+ * @param arg as given to mcast_receive
+ */
+typedef void (*mcast_block_cb)(void *arg, uint64_t k);
+
+/**
+ * Parse "group:port[,interface]", e.g. "239.1.2.3:9000,192.168.1.10"
+ * @param str the string
+ * @param group where the address and port of the group are stored
+ * @param interface where the address of the interface is stored, INADDR_ANY if not given
+ * @return 0 on success or -1 if the string is not valid
+ */
+int mcast_parse(const char *str, struct sockaddr_in *group, struct in_addr *interface);
+
+/**
+ * Send a torrent to a multicast group in a new thread, until the process exits
+ * @param group address and port of the group
+ * @param interface address of the interface to send on, INADDR_ANY to let the kernel choose
+ * @param rate bytes per second
+ * @param torrent the torrent, only the blocks in block_map are sent
+ * @return 0 on success or -1 on error
+ */
+int mcast_start_sender(const struct sockaddr_in *group, const struct in_addr interface, double rate,
+                       struct fio_torrent_t *torrent);
+
+/**
+ * Receive blocks from a multicast group into the downloaded file, until every needed block was received or the
+ * rest is better fetched from the peers
+ * @param group address and port of the group
+ * @param interface address of the interface to join on, INADDR_ANY to let the kernel choose
+ * @param torrent the torrent, whose file is written
+ * @param need tells which blocks to receive
+ * @param done called for each block received
+ * @param arg given to need and done
+ * @return number of blocks received, or -1 if the group cannot be joined
+ */
+int mcast_receive(const struct sockaddr_in *group, const struct in_addr interface, struct fio_torrent_t *torrent,
+                  mcast_need_cb need, mcast_block_cb done, void *arg);
+
+#endif
@@ -0,0 +1,419 @@
+/**
+ * This file implements the metainfo exchange specified in metainfo.h.
+ */
+#include "metainfo.h"
+#include "enum.h"
+#include "logger.h"
+#include "utils.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * State of a fetch, kept from one peer to the next
+ */
+struct metainfo__fetch_t {
+    fio_sha256_hash_t id;
+    struct metainfo_header_t header;
+    char have_header;     // header received and checked, the head of the file is written
+    uint64_t block_count;
+    uint64_t chunk_count;
+    uint64_t done;        // chunks written
+    FILE *out;
+    char *peers;          // the peers of the source, separated by ','
+    uint64_t peer_count;
+};
+
+/**
+ * Hash two nodes of the tree into their parent
+ */
+static void metainfo__parent(const fio_sha256_hash_t left, const fio_sha256_hash_t right, fio_sha256_hash_t parent) {
+    uint8_t both[2 * SHA256_DIGEST_LENGTH];
+
+    memcpy(both, left, SHA256_DIGEST_LENGTH);
+    memcpy(both + SHA256_DIGEST_LENGTH, right, SHA256_DIGEST_LENGTH);
+    SHA256(both, sizeof(both), parent);
+}
+
+int metainfo_tree_init(struct metainfo_tree_t *tree, const struct fio_torrent_t *torrent) {
+    memset(tree, 0, sizeof(*tree));
+    tree->header.size = torrent->downloaded_file_size;
+    memcpy(tree->header.file_hash, torrent->downloaded_file_hash, sizeof(fio_sha256_hash_t));
+    tree->chunk_count = (torrent->block_count + METAINFO_CHUNK_HASHES - 1) / METAINFO_CHUNK_HASHES;
+
+    if (tree->chunk_count > 0) {
+        uint64_t total = 0;
+
+        for (uint64_t n = tree->chunk_count; n > 1; n = (n + 1) / 2) {
+            total += n;
+        }
+
+        tree->nodes = malloc(sizeof(fio_sha256_hash_t) * (total + 1));
+
+        if (tree->nodes == NULL) {
+            log_printf(LOG_INFO, "Cannot allocate the hash tree: %s", strerror(errno));
+            errno = 0;
+            return -1;
+        }
+
+        for (uint64_t i = 0; i < tree->chunk_count; i++) {
+            SHA256((const uint8_t *)torrent->block_hashes[i * METAINFO_CHUNK_HASHES],
+                   sizeof(fio_sha256_hash_t) * metainfo_chunk_size(torrent->block_count, i), tree->nodes[i]);
+        }
+
+        uint64_t level = 0; // first node of the level
+        uint64_t n = tree->chunk_count;
+
+        for (; n > 1; level += n, n = (n + 1) / 2) {
+            for (uint64_t i = 0; i < n; i += 2) {
+                fio_sha256_hash_t *parent = &tree->nodes[level + n + i / 2];
+
+                if (i + 1 < n)
+                    metainfo__parent(tree->nodes[level + i], tree->nodes[level + i + 1], *parent);
+                else
+                    memcpy(*parent, tree->nodes[level + i], sizeof(fio_sha256_hash_t));
+            }
+        }
+
+        memcpy(tree->header.tree_root, tree->nodes[level], sizeof(fio_sha256_hash_t));
+    }
+
+    SHA256((const uint8_t *)&tree->header, sizeof(tree->header), tree->id);
+    return 0;
+}
+
+void metainfo_tree_destroy(struct metainfo_tree_t *tree) {
+    free(tree->nodes);
+    tree->nodes = NULL;
+}
+
+uint64_t metainfo_chunk_size(uint64_t block_count, uint64_t chunk) {
+    const uint64_t first = chunk * METAINFO_CHUNK_HASHES;
+
+    return block_count - first < METAINFO_CHUNK_HASHES ? block_count - first : METAINFO_CHUNK_HASHES;
+}
+
+size_t metainfo_proof(const struct metainfo_tree_t *tree, uint64_t chunk, fio_sha256_hash_t *proof) {
+    size_t count = 0;
+
+    for (uint64_t level = 0, n = tree->chunk_count; n > 1; level += n, n = (n + 1) / 2, chunk /= 2) {
+        if ((chunk ^ 1) < n)
+            memcpy(proof[count++], tree->nodes[level + (chunk ^ 1)], sizeof(fio_sha256_hash_t));
+    }
+
+    return count;
+}
+
+/**
+ * Number of hashes in the proof of a chunk, as metainfo_proof
+ */
+static size_t metainfo__proof_length(uint64_t chunk_count, uint64_t chunk) {
+    size_t count = 0;
+
+    for (uint64_t n = chunk_count; n > 1; n = (n + 1) / 2, chunk /= 2) {
+        count += (chunk ^ 1) < n;
+    }
+
+    return count;
+}
+
+/**
+ * Check a chunk against the root of the tree
+ * @return 0 if it belongs to the tree or -1 otherwise
+ */
+static int metainfo__verify_chunk(const struct metainfo__fetch_t *f, uint64_t chunk, fio_sha256_hash_t *hashes,
+                                  fio_sha256_hash_t *proof) {
+    fio_sha256_hash_t node;
+    size_t used = 0;
+
+    SHA256((const uint8_t *)hashes, sizeof(fio_sha256_hash_t) * metainfo_chunk_size(f->block_count, chunk), node);
+
+    for (uint64_t n = f->chunk_count, i = chunk; n > 1; n = (n + 1) / 2, i /= 2) {
+        if ((i ^ 1) >= n)
+            continue;
+
+        if (i % 2 == 0)
+            metainfo__parent(node, proof[used], node);
+        else
+            metainfo__parent(proof[used], node, node);
+        used++;
+    }
+
+    return memcmp(node, f->header.tree_root, sizeof(fio_sha256_hash_t)) ? -1 : 0;
+}
+
+void metainfo_format_id(const fio_sha256_hash_t id, char out[SHA256_STRING_LEN]) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        sprintf(out + 2 * i, "%02x", id[i]);
+    }
+}
+
+/**
+ * Read an identifier in hexadecimal, which must be followed by '@'
+ * @return 0 on success or -1 if it is not one
+ */
+static int metainfo__parse_id(const char *source, fio_sha256_hash_t id) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        unsigned int byte;
+
+        if (sscanf(source + 2 * i, "%2x", &byte) != 1 || strchr("0123456789abcdefABCDEF", source[2 * i]) == NULL ||
+            strchr("0123456789abcdefABCDEF", source[2 * i + 1]) == NULL)
+            return -1;
+
+        id[i] = (uint8_t)byte;
+    }
+
+    return source[2 * SHA256_DIGEST_LENGTH] == '@' ? 0 : -1;
+}
+
+/**
+ * Connect to a peer
+ * @param address "host:port"
+ * @param tls if not NULL, run the TLS handshake, see tls_connect
+ * @return the socket or -1 on error
+ */
+static int metainfo__connect(const char *address, const struct tls_t *tls) {
+    char host[1024];
+
+    if (strlen(address) >= sizeof(host) || strrchr(address, ':') == NULL) {
+        log_printf(LOG_INFO, "Peer address %s must be host:port", address);
+        return -1;
+    }
+
+    strcpy(host, address);
+    char *const colon = strrchr(host, ':');
+    *colon = '\0';
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result;
+    const int r = getaddrinfo(host, colon + 1, &hints, &result);
+
+    if (r != 0) {
+        log_printf(LOG_INFO, "Cannot resolve peer %s: %s", address, gai_strerror(r));
+        return -1;
+    }
+
+    const int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s < 0 || connect(s, result->ai_addr, result->ai_addrlen)) {
+        log_printf(LOG_INFO, "Cannot connect to peer %s: %s", address, strerror(errno));
+        errno = 0;
+
+        if (s >= 0)
+            close(s);
+        freeaddrinfo(result);
+        return -1;
+    }
+
+    freeaddrinfo(result);
+
+    // the certificate must name the peer as it was given, host name or address
+    if (tls != NULL && tls_connect(tls, s, host, utils_now() + TLS_HANDSHAKE_TIMEOUT)) {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/**
+ * Send a MSG_METAINFO
+ * @return 0 on success or -1 on error
+ */
+static int metainfo__request(int sock, const fio_sha256_hash_t id, uint64_t what) {
+    uint8_t buffer[RAW_MESSAGE_SIZE + sizeof(fio_sha256_hash_t)];
+    struct utils_message_t *msg = (struct utils_message_t *)buffer;
+
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_METAINFO;
+    msg->block_number = what;
+    memcpy(buffer + RAW_MESSAGE_SIZE, id, sizeof(fio_sha256_hash_t));
+
+    return utils_send_all(sock, buffer, sizeof(buffer)) == (ssize_t)sizeof(buffer) ? 0 : -1;
+}
+
+/**
+ * Receive the header of an answer to MSG_METAINFO
+ * @return 0 on success or -1 if it is not the expected one
+ */
+static int metainfo__answer(int sock, uint64_t what) {
+    struct utils_message_t msg;
+
+    const ssize_t r = utils_recv_all_deadline(sock, &msg, RAW_MESSAGE_SIZE, utils_now() + METAINFO__TIMEOUT, NULL);
+
+    if (r != RAW_MESSAGE_SIZE) {
+        log_printf(LOG_INFO, "No answer to MSG_METAINFO: %s", r < 0 ? strerror(errno) : "connection closed");
+        errno = 0;
+        return -1;
+    }
+
+    if (msg.magic_number == MAGIC_NUMBER && msg.message_code == MSG_RESPONSE_NA) {
+        log_message(LOG_INFO, "The peer does not serve this torrent");
+        return -1;
+    }
+
+    if (msg.magic_number != MAGIC_NUMBER || msg.message_code != MSG_METAINFO || msg.block_number != what) {
+        log_message(LOG_INFO, "Bad answer to MSG_METAINFO");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the header from a peer and write the head of the metainfo file
+ * @return 0 on success or -1 on error
+ */
+static int metainfo__fetch_header(int sock, struct metainfo__fetch_t *f) {
+    fio_sha256_hash_t id;
+    char hash[SHA256_STRING_LEN];
+
+    if (metainfo__request(sock, f->id, METAINFO_HEADER) || metainfo__answer(sock, METAINFO_HEADER) ||
+        utils_recv_all_deadline(sock, &f->header, sizeof(f->header), utils_now() + METAINFO__TIMEOUT, NULL) !=
+            (ssize_t)sizeof(f->header))
+        return -1;
+
+    SHA256((const uint8_t *)&f->header, sizeof(f->header), id);
+
+    if (memcmp(id, f->id, sizeof(id))) {
+        log_message(LOG_INFO, "The metainfo header does not match the identifier");
+        return -1;
+    }
+
+    f->block_count = (f->header.size + FIO_MAX_BLOCK_SIZE - 1) / FIO_MAX_BLOCK_SIZE;
+    f->chunk_count = (f->block_count + METAINFO_CHUNK_HASHES - 1) / METAINFO_CHUNK_HASHES;
+    f->have_header = 1;
+
+    metainfo_format_id(f->header.file_hash, hash);
+    fprintf(f->out, "#SHA-256 of the file is\n%s\n", hash);
+    fprintf(f->out, "#Size\n%" PRIu64 "\n", f->header.size);
+    fprintf(f->out, "#Peer count is\n%" PRIu64 "\n", f->peer_count);
+    fprintf(f->out, "#SHA-256, number of blocks is %" PRIu64 "\n", f->block_count);
+
+    log_printf(LOG_INFO, "Metainfo of %" PRIu64 " bytes, %" PRIu64 " blocks in %" PRIu64 " chunks",
+               f->header.size, f->block_count, f->chunk_count);
+    return 0;
+}
+
+/**
+ * Get the missing chunks from a peer, METAINFO__WINDOW requests ahead, and append them to the metainfo file
+ * @return 0 on success or -1 on error
+ */
+static int metainfo__fetch_chunks(int sock, struct metainfo__fetch_t *f) {
+    fio_sha256_hash_t hashes[METAINFO_CHUNK_HASHES];
+    fio_sha256_hash_t proof[METAINFO_MAX_PROOF];
+    uint64_t sent = f->done;
+
+    while (f->done < f->chunk_count) {
+        for (; sent < f->chunk_count && sent < f->done + METAINFO__WINDOW; sent++) {
+            if (metainfo__request(sock, f->id, sent))
+                return -1;
+        }
+
+        const uint64_t chunk = f->done;
+        const size_t n = (size_t)metainfo_chunk_size(f->block_count, chunk);
+        const size_t p = metainfo__proof_length(f->chunk_count, chunk);
+        const double deadline = utils_now() + METAINFO__TIMEOUT;
+
+        if (metainfo__answer(sock, chunk) ||
+            utils_recv_all_deadline(sock, hashes, sizeof(fio_sha256_hash_t) * n, deadline, NULL) !=
+                (ssize_t)(sizeof(fio_sha256_hash_t) * n) ||
+            utils_recv_all_deadline(sock, proof, sizeof(fio_sha256_hash_t) * p, deadline, NULL) !=
+                (ssize_t)(sizeof(fio_sha256_hash_t) * p))
+            return -1;
+
+        if (metainfo__verify_chunk(f, chunk, hashes, proof)) {
+            log_printf(LOG_INFO, "Chunk %" PRIu64 " of the metainfo does not match the root", chunk);
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            char hash[SHA256_STRING_LEN];
+            metainfo_format_id(hashes[i], hash);
+            fprintf(f->out, "%s\n", hash);
+        }
+
+        f->done++;
+    }
+
+    return 0;
+}
+
+int metainfo_fetch(const char *source, const char *metainfo_file_name, const struct tls_t *tls) {
+    struct metainfo__fetch_t f = {0};
+    char part[4096];
+
+    if (metainfo__parse_id(source, f.id)) {
+        log_printf(LOG_INFO, "%s is not identifier@host:port[,host:port...]", source);
+        return -1;
+    }
+
+    if (snprintf(part, sizeof(part), "%s.part", metainfo_file_name) >= (int)sizeof(part) ||
+        (f.peers = strdup(source + 2 * SHA256_DIGEST_LENGTH + 1)) == NULL) {
+        log_printf(LOG_INFO, "Cannot fetch metainfo into %s", metainfo_file_name);
+        errno = 0;
+        return -1;
+    }
+
+    for (char *c = f.peers; *c != '\0'; c++) {
+        f.peer_count += *c != ',' && (c == f.peers || c[-1] == ',');
+    }
+
+    if (f.peer_count == 0 || (f.out = fopen(part, "w")) == NULL) {
+        log_printf(LOG_INFO, "Cannot fetch metainfo into %s: %s", part, f.peer_count == 0 ? "no peer" : strerror(errno));
+        errno = 0;
+        free(f.peers);
+        return -1;
+    }
+
+    char *save = NULL;
+
+    for (char *peer = strtok_r(f.peers, ",", &save); peer != NULL && !(f.have_header && f.done == f.chunk_count);
+         peer = strtok_r(NULL, ",", &save)) {
+        const int sock = metainfo__connect(peer, tls);
+
+        if (sock < 0)
+            continue;
+
+        log_printf(LOG_INFO, "Fetching metainfo from %s", peer);
+
+        if ((f.have_header || metainfo__fetch_header(sock, &f) == 0) && metainfo__fetch_chunks(sock, &f) == 0)
+            log_printf(LOG_INFO, "Got the metainfo from %s", peer);
+
+        tls_close(sock);
+        close(sock);
+    }
+
+    char done = f.have_header && f.done == f.chunk_count;
+
+    if (done) { // the peers of the source, now that strtok_r is through
+        fprintf(f.out, "#Peers\n");
+        strcpy(f.peers, source + 2 * SHA256_DIGEST_LENGTH + 1);
+
+        for (char *peer = strtok_r(f.peers, ",", &save); peer != NULL; peer = strtok_r(NULL, ",", &save)) {
+            fprintf(f.out, "%s\n", peer);
+        }
+    }
+
+    if (fclose(f.out) || (done && rename(part, metainfo_file_name))) {
+        log_printf(LOG_INFO, "Cannot write %s: %s", metainfo_file_name, strerror(errno));
+        errno = 0;
+        done = 0;
+    }
+
+    if (!done) {
+        log_message(LOG_INFO, "No peer could provide the metainfo");
+        unlink(part);
+    }
+
+    free(f.peers);
+    return done ? 0 : -1;
+}
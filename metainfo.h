@@ -0,0 +1,115 @@
+/**
+ * Metainfo exchange: a client that only knows the identifier of a torrent and the address of a peer fetches
+ * the metainfo file from the peer, so that it does not have to be distributed ahead of time.
+ *
+ * The block hashes are split in chunks of METAINFO_CHUNK_HASHES. The leaves of a binary hash tree are the
+ * SHA-256 of each chunk (its hashes, concatenated), a parent is the SHA-256 of its two children, and the last
+ * node of a level without a sibling is carried up as is. The identifier is the SHA-256 of a metainfo_header_t,
+ * which holds the size of the file, its SHA-256 and the root of the tree. The header is checked against the
+ * identifier, then each chunk against the root with its proof: the siblings of the nodes on its path.
+ *
+ * A client sends MSG_METAINFO with block_number set to a chunk, or to METAINFO_HEADER, followed by the
+ * identifier. The server answers MSG_METAINFO with the same block_number, followed by the header, or by the
+ * hashes of the chunk and then its proof. Requests may be pipelined.
+ *
+ * Usage:
+ *
+ *   struct metainfo_tree_t tree;
+ *   metainfo_tree_init(&tree, &torrent);                           // on a server
+ *   metainfo_fetch("<identifier>@host:8080", "f.ttorrent", NULL);  // on a client
+ */
+
+#ifndef METAINFO_H_
+#define METAINFO_H_
+
+#include "file_io.h"
+#include "tls.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Block hashes in a chunk, the last one may have less
+ */
+enum { METAINFO_CHUNK_HASHES = 1024 };
+
+/**
+ * Most hashes in a proof, the depth of the tree
+ */
+enum { METAINFO_MAX_PROOF = 64 };
+
+/**
+ * block_number of a MSG_METAINFO for the header
+ */
+#define METAINFO_HEADER UINT64_MAX
+
+/**
+ * Chunks requested ahead of the answers
+ */
+#define METAINFO__WINDOW 8
+
+/**
+ * Seconds to wait for an answer
+ */
+#define METAINFO__TIMEOUT 5.0
+
+/**
+ * What the identifier of a torrent is the SHA-256 of, in host byte order like the other messages
+ */
+struct metainfo_header_t {
+    uint64_t size;                 // size of the file
+    fio_sha256_hash_t file_hash;   // SHA-256 of the whole file
+    fio_sha256_hash_t tree_root;   // root of the hash tree of the chunks, zeros for an empty file
+} __attribute__((packed));
+
+/**
+ * Hash tree of a torrent, kept by a server to answer MSG_METAINFO
+ */
+struct metainfo_tree_t {
+    struct metainfo_header_t header;
+    fio_sha256_hash_t id;      // identifier of the torrent
+    uint64_t chunk_count;      // leaves of the tree
+    fio_sha256_hash_t *nodes;  // every level of the tree, leaves first, NULL for an empty file
+};
+
+/**
+ * Build the hash tree of a torrent
+ * @param tree where it is stored, to be freed with metainfo_tree_destroy
+ * @param torrent a torrent with its block hashes
+ * @return 0 on success or -1 on error
+ */
+int metainfo_tree_init(struct metainfo_tree_t *tree, const struct fio_torrent_t *torrent);
+
+/**
+ * Free a hash tree
+ */
+void metainfo_tree_destroy(struct metainfo_tree_t *tree);
+
+/**
+ * Number of block hashes in a chunk
+ * @param block_count blocks of the torrent
+ * @param chunk a chunk of the torrent
+ */
+uint64_t metainfo_chunk_size(uint64_t block_count, uint64_t chunk);
+
+/**
+ * Get the proof of a chunk
+ * @param proof where the siblings on its path are stored, from the leaves up, METAINFO_MAX_PROOF at most
+ * @return number of hashes in the proof
+ */
+size_t metainfo_proof(const struct metainfo_tree_t *tree, uint64_t chunk, fio_sha256_hash_t *proof);
+
+/**
+ * Write an identifier in hexadecimal
+ */
+void metainfo_format_id(const fio_sha256_hash_t id, char out[SHA256_STRING_LEN]);
+
+/**
+ * Fetch a metainfo file from the peers that serve its torrent, trying each in turn if one fails
+ * @param source "identifier@host:port[,host:port...]", these peers are the ones of the metainfo file
+ * @param metainfo_file_name where the metainfo file is written, it is only there once it is complete
+ * @param tls if not NULL, settings from tls_init_client: the peers speak TLS
+ * @return 0 on success or -1 if no peer could provide it
+ */
+int metainfo_fetch(const char *source, const char *metainfo_file_name, const struct tls_t *tls);
+
+#endif // METAINFO_H_
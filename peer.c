@@ -0,0 +1,146 @@
+/**
+ * This file implements the peer statistics API specified in peer.h.
+ */
+#include "peer.h"
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+void peer_stats_init(struct peer_stats_t *stats) {
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(struct peer_stats_t));
+}
+
+void peer_stats_record_block(struct peer_stats_t *stats, double rtt, double elapsed, uint64_t bytes) {
+    assert(stats != NULL);
+
+    if (elapsed <= 0) // clock granularity, count it as 1us
+        elapsed = 1e-6;
+
+    const double sample = (double)bytes / elapsed;
+
+    if (stats->responses_ok == 0) { // first sample, nothing to average with
+        stats->rtt = rtt;
+        stats->throughput = sample;
+        stats->latency = elapsed;
+        stats->latency_var = elapsed / 2;
+    } else {
+        stats->rtt += PEER_EWMA_ALPHA * (rtt - stats->rtt);
+        stats->throughput += PEER_EWMA_ALPHA * (sample - stats->throughput);
+        stats->latency_var += PEER_EWMA_ALPHA * (fabs(elapsed - stats->latency) - stats->latency_var);
+        stats->latency += PEER_EWMA_ALPHA * (elapsed - stats->latency);
+    }
+
+    stats->requests++;
+    stats->responses_ok++;
+    stats->bytes += bytes;
+}
+
+void peer_stats_record_stall(struct peer_stats_t *stats, double elapsed, uint64_t bytes) {
+    assert(stats != NULL);
+    assert(elapsed > 0);
+
+    const double sample = (double)bytes / elapsed;
+
+    stats->throughput += PEER_EWMA_ALPHA * (sample - stats->throughput);
+    stats->requests++;
+    stats->stalls++;
+}
+
+void peer_stats_record_na(struct peer_stats_t *stats) {
+    assert(stats != NULL);
+    stats->requests++;
+    stats->responses_na++;
+}
+
+void peer_stats_record_failure(struct peer_stats_t *stats) {
+    assert(stats != NULL);
+    stats->failures++;
+}
+
+double peer_score(const struct peer_stats_t *stats) {
+    assert(stats != NULL);
+
+    if (stats->responses_ok == 0 && stats->responses_na == 0 && stats->failures == 0)
+        return HUGE_VAL; // never tried, explore it
+
+    const uint64_t answered = stats->responses_ok + stats->responses_na;
+    const double ok_rate = answered ? (double)stats->responses_ok / (double)answered : 0;
+
+    return stats->throughput * ok_rate / (double)(1 + stats->failures);
+}
+
+double peer_timeout(const struct peer_stats_t *stats) {
+    assert(stats != NULL);
+
+    if (stats->responses_ok == 0)
+        return PEER_INITIAL_TIMEOUT;
+
+    const double timeout = stats->latency + 4 * stats->latency_var;
+
+    if (timeout < PEER_MIN_TIMEOUT)
+        return PEER_MIN_TIMEOUT;
+    if (timeout > PEER_MAX_TIMEOUT)
+        return PEER_MAX_TIMEOUT;
+    return timeout;
+}
+
+/**
+ * Get the index of the n-th usable peer.
+ */
+static size_t peer__nth_usable(const uint8_t *usable, size_t count, size_t n) {
+    for (size_t i = 0; i < count; i++) {
+        if (usable[i] && n-- == 0)
+            return i;
+    }
+    return count;
+}
+
+size_t peer_select(const double *scores, const uint8_t *usable, size_t count) {
+    assert(scores != NULL);
+    assert(usable != NULL);
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (usable[i])
+            n++;
+    }
+
+    if (n == 0)
+        return count;
+
+    if (n == 1)
+        return peer__nth_usable(usable, count, 0);
+
+    const size_t first = (size_t)rand() % n;
+    size_t second = (size_t)rand() % (n - 1);
+    if (second >= first) // draw without replacement
+        second++;
+
+    const size_t a = peer__nth_usable(usable, count, first);
+    const size_t b = peer__nth_usable(usable, count, second);
+
+    return scores[b] > scores[a] ? b : a;
+}
+
+int peer_distance(const char *a, const char *b) {
+    assert(a != NULL);
+    assert(b != NULL);
+
+    int same = 0;
+
+    while (same < PEER_LOCALITY_LEVELS && *a != '\0' && *b != '\0') {
+        const size_t la = strcspn(a, "/");
+        const size_t lb = strcspn(b, "/");
+
+        if (la != lb || strncmp(a, b, la))
+            break;
+
+        same++;
+        a += la + (a[la] == '/');
+        b += lb + (b[lb] == '/');
+    }
+
+    return PEER_LOCALITY_LEVELS - same;
+}
@@ -0,0 +1,140 @@
+/**
+ * Per-peer statistics and peer selection for the client.
+ *
+ * Usage:
+ *
+ *   struct peer_stats_t stats[N];
+ *   for (i = 0; i < N; i++) peer_stats_init(&stats[i]);
+ *
+ *   for (i = 0; i < N; i++) scores[i] = peer_score(&stats[i]);
+ *   size_t chosen = peer_select(scores, usable, N);  // power-of-two choices
+ *
+ *   ... request a block from the chosen peer ...
+ *
+ *   double deadline = now + peer_timeout(&stats[chosen]);
+ *
+ *   peer_stats_record_block(&stats[chosen], rtt, elapsed, bytes);
+ *   peer_stats_record_stall(&stats[chosen], elapsed, bytes_so_far);
+ *   peer_stats_record_na(&stats[chosen]);
+ *   peer_stats_record_failure(&stats[chosen]);
+ *
+ *   int d = peer_distance("eu/r1/h1", "eu/r2/h5");  // 2, same zone but another rack
+ */
+
+#ifndef PEER_H_
+#define PEER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Weight of the newest sample in the moving averages (0 < PEER_EWMA_ALPHA <= 1).
+ */
+#define PEER_EWMA_ALPHA 0.25
+
+/**
+ * Seconds we wait for a block from a peer we have no samples of.
+ */
+#define PEER_INITIAL_TIMEOUT 5.0
+
+/**
+ * Bounds of the per-request deadline, in seconds.
+ */
+#define PEER_MIN_TIMEOUT 1.0
+#define PEER_MAX_TIMEOUT 30.0
+
+/**
+ * Number of levels of a locality label: zone, rack and host.
+ */
+#define PEER_LOCALITY_LEVELS 3
+
+/**
+ * Statistics gathered for a single peer.
+ */
+struct peer_stats_t {
+    double rtt;            ///< Moving average of the time until the response header arrives, in seconds.
+    double throughput;     ///< Moving average of the block throughput, in bytes per second.
+    double latency;        ///< Moving average of the time needed to get a whole block, in seconds.
+    double latency_var;    ///< Moving average of the deviation of latency, in seconds.
+    uint64_t requests;     ///< Number of requests sent to this peer.
+    uint64_t responses_ok; ///< Number of MSG_RESPONSE_OK received.
+    uint64_t responses_na; ///< Number of MSG_RESPONSE_NA received.
+    uint64_t failures;     ///< Connection failures, protocol errors and corrupted blocks.
+    uint64_t stalls;       ///< Requests that missed their deadline.
+    uint64_t bytes;        ///< Payload bytes received from this peer.
+};
+
+/**
+ * Reset the statistics of a peer. A peer without samples is scored optimistically so it gets tried.
+ * @param stats pointer to the statistics
+ */
+void peer_stats_init(struct peer_stats_t *stats);
+
+/**
+ * Account a block received from the peer.
+ * @param stats pointer to the statistics
+ * @param rtt seconds between sending the request and receiving the response header
+ * @param elapsed seconds between sending the request and receiving the whole block
+ * @param bytes size of the block
+ */
+void peer_stats_record_block(struct peer_stats_t *stats, double rtt, double elapsed, uint64_t bytes);
+
+/**
+ * Account a request that missed its deadline. The bytes received so far are folded into the
+ * throughput average, so a hung peer quickly loses its requests to the others.
+ * @param stats pointer to the statistics
+ * @param elapsed seconds between sending the request and giving up
+ * @param bytes bytes of the block received before giving up
+ */
+void peer_stats_record_stall(struct peer_stats_t *stats, double elapsed, uint64_t bytes);
+
+/**
+ * Account a MSG_RESPONSE_NA received from the peer.
+ * @param stats pointer to the statistics
+ */
+void peer_stats_record_na(struct peer_stats_t *stats);
+
+/**
+ * Account a failure (connection refused or lost, bad message, corrupted block).
+ * @param stats pointer to the statistics
+ */
+void peer_stats_record_failure(struct peer_stats_t *stats);
+
+/**
+ * Expected useful bytes per second we get from the peer: throughput discounted by the NA rate
+ * and by the failures. Peers without samples get +infinity so they are explored first.
+ * @param stats pointer to the statistics
+ * @return the score, higher is better
+ */
+double peer_score(const struct peer_stats_t *stats);
+
+/**
+ * Time we give the peer to answer a request, like TCP's retransmission timeout: the average
+ * latency plus four deviations, within [PEER_MIN_TIMEOUT, PEER_MAX_TIMEOUT].
+ * @param stats pointer to the statistics
+ * @return seconds from sending the request until the whole block must have been received
+ */
+double peer_timeout(const struct peer_stats_t *stats);
+
+/**
+ * Choose a peer using power-of-two choices: draw two distinct usable peers at random and keep
+ * the one with the better score. Fast peers get most of the requests while slow ones are still
+ * sampled now and then, so their statistics do not go stale.
+ * @param scores array of count scores obtained with peer_score
+ * @param usable array of count flags, peers with a 0 flag are never chosen
+ * @param count number of peers
+ * @return index of the chosen peer or count if no peer is usable
+ */
+size_t peer_select(const double *scores, const uint8_t *usable, size_t count);
+
+/**
+ * Distance between two locality labels "zone/rack/host", from the widest level to the narrowest.
+ * Levels may be left out at the end, e.g. "eu/r1" when the host is not known.
+ * @param a first label
+ * @param b second label
+ * @return the number of levels from the first one that differs to the end: 0 for the same host,
+ * 1 for the same rack, 2 for the same zone and PEER_LOCALITY_LEVELS for another zone or if a label is empty
+ */
+int peer_distance(const char *a, const char *b);
+
+#endif // PEER_H_
@@ -0,0 +1,282 @@
+/**
+ * This file implements the pipeline specified in pipeline.h.
+ *
+ * Threads are stopped by pushing NULL into their queue. Since queues are FIFO, every job submitted
+ * before pipeline_destroy is processed first.
+ */
+#include "pipeline.h"
+#include "logger.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *pipeline__verifier(void *arg) {
+    struct pipeline_t *p = arg;
+
+    while (1) {
+        struct pipeline_job_t *job = queue_pop(&p->verify);
+
+        if (job == NULL)
+            return NULL;
+
+        if (job->stored) { // zero-copy receive, check what landed in the file
+            const int r = fio_commit_block(job->torrent, job->block_number);
+
+            if (r)
+                log_printf(LOG_INFO, "Block %lu is corrupted", job->block_number);
+
+            p->done(p->arg, job, r == 0 ? PIPELINE_STORED : errno == EINVAL ? PIPELINE_CORRUPTED : PIPELINE_WRITE_FAILED);
+            errno = 0;
+            queue_push(&p->free, job);
+            continue;
+        }
+
+        if (fio_verify_block(job->torrent, job->block_number, &job->block)) {
+            log_printf(LOG_INFO, "Block %lu is corrupted", job->block_number);
+            p->done(p->arg, job, PIPELINE_CORRUPTED);
+            queue_push(&p->free, job);
+            continue;
+        }
+
+        queue_push(&p->write, job);
+    }
+}
+
+/**
+ * Write consecutive blocks of the same torrent and report them
+ */
+static void pipeline__write_run(struct pipeline_t *p, struct pipeline_job_t **jobs, size_t count) {
+    const struct fio_block_t *blocks[FIO_MAX_WRITE_BLOCKS];
+
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = &jobs[i]->block;
+    }
+
+    const int r = fio_write_blocks(jobs[0]->torrent, jobs[0]->block_number, blocks, count);
+
+    if (r) {
+        log_printf(LOG_INFO, "Failed to write blocks %lu to %lu: %s", jobs[0]->block_number,
+                   jobs[0]->block_number + count - 1, strerror(errno));
+        errno = 0;
+    } else {
+        log_printf(LOG_DEBUG, "Blocks %lu to %lu saved", jobs[0]->block_number, jobs[0]->block_number + count - 1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        p->done(p->arg, jobs[i], r ? PIPELINE_WRITE_FAILED : PIPELINE_STORED);
+        queue_push(&p->free, jobs[i]);
+    }
+}
+
+/**
+ * Write everything in the reorder buffer, one pwritev per run of consecutive blocks
+ */
+static void pipeline__flush(struct pipeline_t *p) {
+    size_t i = 0;
+
+    while (i < p->held_count) {
+        size_t j = i + 1;
+
+        while (j < p->held_count && j - i < FIO_MAX_WRITE_BLOCKS &&
+               p->held[j]->torrent == p->held[i]->torrent &&
+               p->held[j]->block_number == p->held[j - 1]->block_number + 1) {
+            j++;
+        }
+
+        pipeline__write_run(p, &p->held[i], j - i);
+        i = j;
+    }
+
+    p->held_count = 0;
+}
+
+/**
+ * Insert a verified block in the reorder buffer, keeping it sorted
+ */
+static void pipeline__hold(struct pipeline_t *p, struct pipeline_job_t *job) {
+    assert(p->held_count < p->reorder_blocks);
+
+    if (p->held_count == 0)
+        p->held_since = utils_now();
+
+    size_t i = p->held_count;
+
+    while (i > 0 && (p->held[i - 1]->torrent > job->torrent ||
+                     (p->held[i - 1]->torrent == job->torrent && p->held[i - 1]->block_number > job->block_number))) {
+        p->held[i] = p->held[i - 1];
+        i--;
+    }
+
+    p->held[i] = job;
+    p->held_count++;
+}
+
+static void *pipeline__writer(void *arg) {
+    struct pipeline_t *p = arg;
+
+    while (1) {
+        struct pipeline_job_t *job;
+
+        if (p->held_count == 0) {
+            job = queue_pop(&p->write);
+        } else if (queue_pop_timed(&p->write, p->held_since + p->flush_delay - utils_now(), (void **)&job)) {
+            pipeline__flush(p); // the oldest block waited long enough
+            continue;
+        }
+
+        if (job == NULL) {
+            pipeline__flush(p);
+            return NULL;
+        }
+
+        if (p->reorder_blocks == 0) {
+            pipeline__write_run(p, &job, 1);
+            continue;
+        }
+
+        pipeline__hold(p, job);
+
+        if (p->held_count == p->reorder_blocks)
+            pipeline__flush(p);
+    }
+}
+
+/**
+ * Undo what pipeline_init did before it failed: stop the verifiers already running, then free the rest
+ * @param queues number of queues initialized, in the order free, verify, write
+ * @param started number of verifiers running
+ */
+static void pipeline__unwind(struct pipeline_t *p, size_t queues, size_t started) {
+    for (size_t i = 0; i < started; i++) {
+        queue_push(&p->verify, NULL);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(p->verifiers[i], NULL);
+    }
+
+    if (queues > 2)
+        queue_destroy(&p->write);
+    if (queues > 1)
+        queue_destroy(&p->verify);
+    if (queues > 0)
+        queue_destroy(&p->free);
+
+    free(p->jobs);
+    free(p->verifiers);
+    free(p->held);
+}
+
+int pipeline_init(struct pipeline_t *p, size_t buffers, size_t verifiers, size_t reorder_blocks, double flush_delay,
+                  pipeline_done_t done, void *arg) {
+    assert(p != NULL);
+    assert(buffers > 0);
+    assert(verifiers > 0);
+    assert(reorder_blocks < buffers);
+    assert(done != NULL);
+
+    memset(p, 0, sizeof(struct pipeline_t));
+    p->done = done;
+    p->arg = arg;
+    p->job_count = buffers;
+    p->verifier_count = verifiers;
+    p->reorder_blocks = reorder_blocks;
+    p->flush_delay = flush_delay;
+
+    p->jobs = malloc(sizeof(struct pipeline_job_t) * buffers);
+    p->verifiers = malloc(sizeof(pthread_t) * verifiers);
+    p->held = malloc(sizeof(struct pipeline_job_t *) * (reorder_blocks + 1));
+
+    if (p->jobs == NULL || p->verifiers == NULL || p->held == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        pipeline__unwind(p, 0, 0);
+        return -1;
+    }
+
+    // every queue can hold all the buffers plus the NULLs used to stop the threads
+    if (queue_init(&p->free, buffers)) {
+        pipeline__unwind(p, 0, 0);
+        return -1;
+    }
+
+    if (queue_init(&p->verify, buffers + verifiers)) {
+        pipeline__unwind(p, 1, 0);
+        return -1;
+    }
+
+    if (queue_init(&p->write, buffers + 1)) {
+        pipeline__unwind(p, 2, 0);
+        return -1;
+    }
+
+    for (size_t i = 0; i < buffers; i++) {
+        queue_push(&p->free, &p->jobs[i]);
+    }
+
+    for (size_t i = 0; i < verifiers; i++) {
+        const int r = pthread_create(&p->verifiers[i], NULL, pipeline__verifier, p);
+
+        if (r) {
+            log_printf(LOG_DEBUG, "pthread_create failed: %s", strerror(r));
+            pipeline__unwind(p, 3, i);
+            return -1;
+        }
+    }
+
+    const int r = pthread_create(&p->writer, NULL, pipeline__writer, p);
+
+    if (r) {
+        log_printf(LOG_DEBUG, "pthread_create failed: %s", strerror(r));
+        pipeline__unwind(p, 3, verifiers);
+        return -1;
+    }
+
+    log_printf(LOG_DEBUG, "Pipeline started with %lu buffers, %lu verifiers and a reorder buffer of %lu blocks",
+               buffers, verifiers, reorder_blocks);
+    return 0;
+}
+
+struct pipeline_job_t *pipeline_get(struct pipeline_t *p) {
+    return queue_pop(&p->free);
+}
+
+void pipeline_submit(struct pipeline_t *p, struct pipeline_job_t *job) {
+    assert(job != NULL);
+    queue_push(&p->verify, job);
+}
+
+void pipeline_release(struct pipeline_t *p, struct pipeline_job_t *job) {
+    assert(job != NULL);
+    queue_push(&p->free, job);
+}
+
+int pipeline_destroy(struct pipeline_t *p) {
+    int ret = 0;
+
+    for (size_t i = 0; i < p->verifier_count; i++) {
+        queue_push(&p->verify, NULL);
+    }
+
+    for (size_t i = 0; i < p->verifier_count; i++) {
+        if (pthread_join(p->verifiers[i], NULL))
+            ret = -1;
+    }
+
+    // the verifiers are done, so nothing else can be pushed after this
+    queue_push(&p->write, NULL);
+
+    if (pthread_join(p->writer, NULL))
+        ret = -1;
+
+    queue_destroy(&p->free);
+    queue_destroy(&p->verify);
+    queue_destroy(&p->write);
+    free(p->jobs);
+    free(p->verifiers);
+    free(p->held);
+
+    return ret;
+}
@@ -0,0 +1,125 @@
+/**
+ * Staged processing of received blocks: the network thread fills buffers, a pool of workers checks
+ * their SHA-256 and a writer thread stores them, so that receiving, hashing and writing overlap.
+ *
+ *   network --verify queue--> verifiers --write queue--> writer
+ *      ^                          |                        |
+ *      +-------- free queue ------+------------------------+
+ *
+ * The number of buffers is fixed: when the verifiers or the writer fall behind, pipeline_get blocks
+ * and the network thread stops requesting blocks until a buffer comes back.
+ *
+ * The writer keeps verified blocks in a reorder buffer, sorted by block number, for up to flush_delay
+ * seconds or until it holds reorder_blocks blocks. Then each run of consecutive blocks is written with
+ * a single pwritev, so blocks arriving out of order from several peers still make large sequential writes.
+ *
+ * Usage:
+ *
+ *   struct pipeline_t p;
+ *   pipeline_init(&p, 64, 3, 16, 0.2, on_done, arg);
+ *
+ *   struct pipeline_job_t *job = pipeline_get(&p);
+ *   job->torrent = t;
+ *   job->block_number = k;
+ *   ... receive job->block ...
+ *   pipeline_submit(&p, job);   // on_done(arg, job, PIPELINE_STORED) once it is on disk
+ *
+ *   pipeline_destroy(&p);       // waits for the submitted jobs
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "file_io.h"
+#include "queue.h"
+#include <pthread.h>
+
+/**
+ * A block travelling through the pipeline
+ */
+struct pipeline_job_t {
+    struct fio_torrent_t *torrent; // where the block belongs
+    uint64_t block_number;
+    void *context; // for the completion callback, e.g. the peer that sent the block
+    char stored;   // the data is already in the file (block.data is unused), only verify it there
+    struct fio_block_t block;
+};
+
+/**
+ * Results given to the completion callback
+ */
+enum { PIPELINE_STORED = 0,
+       PIPELINE_CORRUPTED = -1,
+       PIPELINE_WRITE_FAILED = -2 };
+
+/**
+ * Called once per submitted job, from a verifier or from the writer thread, before the buffer is reused.
+ * @param arg the argument given to pipeline_init
+ * @param job the job
+ * @param result PIPELINE_STORED if the block was verified and written (block_map is set),
+ * PIPELINE_CORRUPTED or PIPELINE_WRITE_FAILED otherwise
+ */
+typedef void (*pipeline_done_t)(void *arg, struct pipeline_job_t *job, int result);
+
+struct pipeline_t {
+    struct pipeline_job_t *jobs; // the buffers
+    size_t job_count;
+    struct queue_t free;   // buffers ready for pipeline_get
+    struct queue_t verify; // received blocks
+    struct queue_t write;  // verified blocks
+    pthread_t *verifiers;
+    size_t verifier_count;
+    pthread_t writer;
+    pipeline_done_t done;
+    void *arg;
+    struct pipeline_job_t **held; // reorder buffer of the writer, sorted by torrent and block number
+    size_t held_count;
+    size_t reorder_blocks; // capacity of held, 0 to write every block as soon as it is verified
+    double flush_delay;    // seconds a block may wait in held
+    double held_since;     // when the oldest block in held arrived (utils_now)
+};
+
+/**
+ * Allocate the buffers and start the threads
+ * @param p the pipeline
+ * @param buffers number of blocks that can be in flight
+ * @param verifiers number of hashing threads
+ * @param reorder_blocks number of verified blocks the writer may hold to coalesce writes, 0 for none.
+ * It must be smaller than buffers, otherwise nothing is left for the network thread.
+ * @param flush_delay seconds a verified block may be held before it is written
+ * @param done completion callback
+ * @param arg first argument of the callback
+ * @return 0 on success or -1 on error
+ */
+int pipeline_init(struct pipeline_t *p, size_t buffers, size_t verifiers, size_t reorder_blocks, double flush_delay,
+                  pipeline_done_t done, void *arg);
+
+/**
+ * Get an empty buffer, waiting until one is free
+ * @param p the pipeline
+ * @return the job, to be given back with pipeline_submit or pipeline_release
+ */
+struct pipeline_job_t *pipeline_get(struct pipeline_t *p);
+
+/**
+ * Queue a received block for verification and writing
+ * @param p the pipeline
+ * @param job a job obtained with pipeline_get, with all its fields set
+ */
+void pipeline_submit(struct pipeline_t *p, struct pipeline_job_t *job);
+
+/**
+ * Give back a buffer that was not used
+ * @param p the pipeline
+ * @param job a job obtained with pipeline_get
+ */
+void pipeline_release(struct pipeline_t *p, struct pipeline_job_t *job);
+
+/**
+ * Wait for the submitted jobs, stop the threads and free the buffers
+ * @param p the pipeline
+ * @return 0 on success or -1 on error
+ */
+int pipeline_destroy(struct pipeline_t *p);
+
+#endif // PIPELINE_H_
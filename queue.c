@@ -0,0 +1,149 @@
+/**
+ * This file implements the queue specified in queue.h.
+ */
+#include "queue.h"
+#include "logger.h"
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int queue_init(struct queue_t *q, size_t capacity) {
+    assert(q != NULL);
+    assert(capacity > 0);
+
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    q->cells = malloc(sizeof(struct queue__cell_t) * size);
+    if (q->cells == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        q->cells[i].sequence = i;
+        q->cells[i].item = NULL;
+    }
+
+    q->mask = size - 1;
+    q->enqueue = 0;
+    q->dequeue = 0;
+
+    if (size > UINT32_MAX || sem_init(&q->slots, 0, (unsigned int)size) || sem_init(&q->items, 0, 0)) {
+        log_printf(LOG_DEBUG, "sem_init failed: %s", strerror(errno));
+        free(q->cells);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * sem_wait that resumes after signals
+ */
+static void queue__wait(sem_t *sem) {
+    while (sem_wait(sem) && errno == EINTR)
+        errno = 0;
+}
+
+void queue_push(struct queue_t *q, void *item) {
+    queue__wait(&q->slots);
+
+    // a slot is ours, but the consumer that freed it may still be writing its sequence
+    size_t pos = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+    while (1) {
+        struct queue__cell_t *cell = &q->cells[pos & q->mask];
+        const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->enqueue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (seq < pos) {
+            sched_yield();
+            pos = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+
+    sem_post(&q->items);
+}
+
+/**
+ * Take the item at the head of the ring; the caller already owns one item of the semaphore
+ */
+static void *queue__take(struct queue_t *q) {
+    void *item;
+    size_t pos = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+    while (1) {
+        struct queue__cell_t *cell = &q->cells[pos & q->mask];
+        const size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&q->dequeue, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                item = cell->item;
+                __atomic_store_n(&cell->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+                break;
+            }
+        } else if (seq < pos + 1) {
+            sched_yield(); // the producer holding this cell has not published it yet
+            pos = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->dequeue, __ATOMIC_RELAXED);
+        }
+    }
+
+    sem_post(&q->slots);
+    return item;
+}
+
+void *queue_pop(struct queue_t *q) {
+    queue__wait(&q->items);
+    return queue__take(q);
+}
+
+int queue_try_pop(struct queue_t *q, void **item) {
+    if (sem_trywait(&q->items)) {
+        errno = 0;
+        return -1;
+    }
+
+    *item = queue__take(q);
+    return 0;
+}
+
+int queue_pop_timed(struct queue_t *q, double seconds, void **item) {
+    struct timespec ts; // sem_timedwait wants an absolute CLOCK_REALTIME time
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    const double end = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9 + (seconds > 0 ? seconds : 0);
+    ts.tv_sec = (time_t)end;
+    ts.tv_nsec = (long)((end - (double)ts.tv_sec) * 1e9);
+
+    while (sem_timedwait(&q->items, &ts)) {
+        if (errno != EINTR) {
+            errno = 0;
+            return -1;
+        }
+        errno = 0;
+    }
+
+    *item = queue__take(q);
+    return 0;
+}
+
+void queue_destroy(struct queue_t *q) {
+    assert(q->cells != NULL);
+    sem_destroy(&q->slots);
+    sem_destroy(&q->items);
+    free(q->cells);
+    q->cells = NULL;
+}
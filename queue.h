@@ -0,0 +1,85 @@
+/**
+ * Bounded multi-producer multi-consumer queue of pointers.
+ *
+ * The ring itself is lock-free (one atomic sequence number per cell, as in D. Vyukov's bounded
+ * MPMC queue). Two counting semaphores track the free slots and the queued items, so a producer
+ * sleeps while the queue is full and a consumer sleeps while it is empty: this is what gives
+ * backpressure between the stages of a pipeline without spinning.
+ *
+ * Usage:
+ *
+ *   struct queue_t q;
+ *   queue_init(&q, 64);
+ *
+ *   queue_push(&q, item);       // producer, blocks while full
+ *   void *item = queue_pop(&q); // consumer, blocks while empty
+ *
+ *   queue_destroy(&q);
+ */
+
+#ifndef QUEUE_H_
+#define QUEUE_H_
+
+#include <semaphore.h>
+#include <stddef.h>
+
+struct queue__cell_t {
+    size_t sequence;
+    void *item;
+};
+
+struct queue_t {
+    struct queue__cell_t *cells;
+    size_t mask;    // capacity - 1
+    size_t enqueue; // next position to write, only modified atomically
+    size_t dequeue; // next position to read, only modified atomically
+    sem_t slots;    // free cells
+    sem_t items;    // queued items
+};
+
+/**
+ * Initialize an empty queue
+ * @param q the queue
+ * @param capacity number of items it can hold, rounded up to a power of two
+ * @return 0 on success or -1 on error
+ */
+int queue_init(struct queue_t *q, size_t capacity);
+
+/**
+ * Add an item, waiting for a free slot
+ * @param q the queue
+ * @param item the item, may be NULL
+ */
+void queue_push(struct queue_t *q, void *item);
+
+/**
+ * Remove the oldest item, waiting until there is one
+ * @param q the queue
+ * @return the item
+ */
+void *queue_pop(struct queue_t *q);
+
+/**
+ * Remove the oldest item if there is one
+ * @param q the queue
+ * @param item where the item is stored
+ * @return 0 if an item was removed or -1 if the queue is empty
+ */
+int queue_try_pop(struct queue_t *q, void **item);
+
+/**
+ * Remove the oldest item, waiting at most the given time for one
+ * @param q the queue
+ * @param seconds maximum time to wait
+ * @param item where the item is stored
+ * @return 0 if an item was removed or -1 if the time passed
+ */
+int queue_pop_timed(struct queue_t *q, double seconds, void **item);
+
+/**
+ * Free the queue, which must not be used by any thread anymore
+ * @param q the queue
+ */
+void queue_destroy(struct queue_t *q);
+
+#endif // QUEUE_H_
@@ -0,0 +1,96 @@
+/**
+ * This file implements the token bucket specified in ratelimit.h.
+ */
+#include "ratelimit.h"
+#include "file_io.h"
+#include "utils.h"
+#include <assert.h>
+#include <stddef.h>
+
+/**
+ * The bucket holds a block worth of tokens, so a long idle time is not followed by a burst.
+ */
+#define RATELIMIT__BURST FIO_MAX_BLOCK_SIZE
+
+/**
+ * Add the tokens earned since the last refill
+ */
+static void ratelimit__refill(struct ratelimit_t *rl) {
+    const double now = utils_now();
+
+    rl->tokens += (now - rl->last) * rl->rate;
+    if (rl->tokens > rl->burst)
+        rl->tokens = rl->burst;
+    rl->last = now;
+}
+
+void ratelimit_init(struct ratelimit_t *rl, double rate) {
+    assert(rl != NULL);
+    assert(rate >= 0);
+
+    rl->rate = rate;
+    rl->burst = RATELIMIT__BURST;
+    rl->tokens = rl->burst;
+    rl->last = utils_now();
+    pthread_mutex_init(&rl->lock, NULL);
+}
+
+void ratelimit_set_rate(struct ratelimit_t *rl, double rate) {
+    assert(rl != NULL);
+    assert(rate >= 0);
+
+    pthread_mutex_lock(&rl->lock);
+
+    if (rl->rate > 0)
+        ratelimit__refill(rl); // earned at the old rate
+
+    rl->rate = rate;
+    rl->last = utils_now();
+
+    if (rate == 0) // forgive the debt
+        rl->tokens = rl->burst;
+
+    pthread_mutex_unlock(&rl->lock);
+}
+
+double ratelimit_acquire(struct ratelimit_t *rl, double bytes) {
+    assert(rl != NULL);
+
+    double wait = 0;
+
+    pthread_mutex_lock(&rl->lock);
+
+    if (rl->rate > 0) {
+        ratelimit__refill(rl);
+        rl->tokens -= bytes;
+
+        if (rl->tokens < 0)
+            wait = -rl->tokens / rl->rate;
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+    return wait;
+}
+
+double ratelimit_delay(struct ratelimit_t *rl) {
+    assert(rl != NULL);
+
+    double wait = 0;
+
+    pthread_mutex_lock(&rl->lock);
+
+    if (rl->rate > 0) {
+        ratelimit__refill(rl);
+
+        if (rl->tokens < 0)
+            wait = -rl->tokens / rl->rate;
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+    return wait;
+}
+
+void ratelimit_destroy(struct ratelimit_t *rl) {
+    assert(rl != NULL);
+    pthread_mutex_destroy(&rl->lock);
+}
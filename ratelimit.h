@@ -0,0 +1,72 @@
+/**
+ * Token bucket rate limiter.
+ *
+ * Usage:
+ *
+ *   struct ratelimit_t rl;
+ *   ratelimit_init(&rl, 1 << 20); // 1 MiB/s
+ *
+ *   while (...) {
+ *       utils_sleep(ratelimit_acquire(&rl, chunk));
+ *       recv(s, buffer, chunk, 0);
+ *   }
+ *
+ * The bucket may go into debt: ratelimit_acquire always takes the tokens and returns how long
+ * the caller has to wait for the bucket to be back at zero. That way the caller sleeps exactly
+ * once per chunk instead of polling.
+ *
+ * A bucket can be shared by several threads, e.g. one global limit for several downloads.
+ */
+
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include <pthread.h>
+
+/**
+ * A token bucket. A rate of 0 means unlimited.
+ */
+struct ratelimit_t {
+    double rate;   ///< Tokens (bytes) added per second.
+    double burst;  ///< Maximum number of tokens in the bucket.
+    double tokens; ///< Tokens available, negative when in debt.
+    double last;   ///< Last time the bucket was refilled (utils_now).
+    pthread_mutex_t lock;
+};
+
+/**
+ * Initialize a bucket, full.
+ * @param rl the bucket
+ * @param rate bytes per second, 0 for unlimited
+ */
+void ratelimit_init(struct ratelimit_t *rl, double rate);
+
+/**
+ * Change the rate of a bucket, keeping the tokens it has.
+ * @param rl the bucket
+ * @param rate bytes per second, 0 for unlimited
+ */
+void ratelimit_set_rate(struct ratelimit_t *rl, double rate);
+
+/**
+ * Take tokens from the bucket.
+ * @param rl the bucket
+ * @param bytes tokens to take
+ * @return seconds to wait before using them, 0 if they can be used right away
+ */
+double ratelimit_acquire(struct ratelimit_t *rl, double bytes);
+
+/**
+ * Time until the bucket is out of debt, without taking anything.
+ * @param rl the bucket
+ * @return seconds to wait, 0 if the bucket is not in debt
+ */
+double ratelimit_delay(struct ratelimit_t *rl);
+
+/**
+ * Free the resources of a bucket that is not used anymore.
+ * @param rl the bucket
+ */
+void ratelimit_destroy(struct ratelimit_t *rl);
+
+#endif // RATELIMIT_H_
@@ -2,6 +2,9 @@
 #include "enum.h"
 #include "file_io.h"
 #include "logger.h"
+#include "metainfo.h"
+#include "tls.h"
+#include "tracker.h"
 #include "utils.h"
 #include <arpa/inet.h>
 #include <assert.h>
@@ -13,7 +16,10 @@
 #include <string.h>
 #include <sys/fcntl.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/unistd.h>
+#include <zlib.h>
 
 #define TIME_TO_POLL -1 //  wait forever
 
@@ -22,13 +28,116 @@
   a. Check for the existence of the associated downloaded file.
   b. Check which blocks are correct using the SHA256 hashes in the metainfo file.
 2. Forever listen to incoming connections, and for each connection:
-  a. Wait for a message.
+  a. Wait for a message. It is received as it comes, the header then the body its code announces, kept with
+  the connection in between so that a slow client does not hold up the others.
   b. If a message requests a block that can be served (correct hash), respond with the appropriate message,
   followed by the raw block data.
   c. Otherwise, respond with a message signaling the unavailability of the block.
+  A MSG_REQUEST_RANGE or MSG_REQUEST_LIST asks for several blocks: they are answered in order, reading
+  each run of consecutive blocks with one preadv into a buffer where the responses are laid out, which
+  is sent as the socket accepts it.
+  A client may first send MSG_HELLO: answer with the version and the capabilities we both support, and
+  only use those. With CAP_AVAILABILITY, follow with MSG_BITFIELD built from block_map, so that the client
+  does not request blocks we do not have, and in a relay send MSG_HAVE for the blocks stored since then
+  before each response. With CAP_DEFLATE, send the blocks that compress well as MSG_RESPONSE_DEFLATE,
+  keeping their compressed form for the next clients. A client that does not send MSG_HELLO gets none
+  of that.
+  d. A MSG_PEX carries peers the client got blocks from: remember them, and answer right away with
+  a random sample of the peers other clients told us about.
+  e. With super-seeding (for the initial seeder), a client that serves the torrent too (CAP_CLIENT_HAVE)
+  is only offered, and only served, SERVER__SUPER_OFFERS blocks at a time: among those no client announced
+  with MSG_HAVE yet, those offered to the fewest clients. When it requests them it is offered the next ones,
+  ahead of the responses, and it has to get the rest from the other clients. When every block was announced
+  a full copy is out: everybody gets the real MSG_BITFIELD and is served everything.
+  f. A MSG_METAINFO asks for a part of the metainfo file, checked by the client against the identifier of
+  the torrent (see metainfo.h): it is laid out in the buffer and sent like the blocks.
+  g. Clients on this host may connect to a Unix socket instead, and agree on CAP_FILE: a MSG_FILE is answered
+  right away with a read-only descriptor of the downloaded file, then the blocks are answered with
+  MSG_RESPONSE_FILE alone and the client copies them from the file itself (copy_file_range).
+  h. With TLS, the handshake of each connection on the port runs as its socket gets ready, before any message
+  (see tls.h). When the kernel encrypts for the connection, each block is sent from the file with sendfile
+  after its header instead of being read into the buffer.
 */
 
-int server_init(uint16_t const port, struct fio_torrent_t *torrent) {
+/**
+ * Peers heard of by peer exchange
+ */
+struct server__pex_t {
+    struct tracker_peer_t peers[SERVER__PEX_PEERS];
+    double heard[SERVER__PEX_PEERS]; // last time a client mentioned the peer (utils_now)
+    size_t count;
+};
+
+/**
+ * Blocks compressed for the clients with CAP_DEFLATE, allocated with the first of them
+ */
+struct server__deflate_t {
+    uint8_t **data;     // compressed form of each block, NULL if not kept
+    uint32_t *size;     // bytes in data
+    uint8_t *raw;       // compressing the block does not pay, it is sent as MSG_RESPONSE_OK
+    size_t cached;      // bytes in all of data, at most SERVER__DEFLATE_CACHE
+    uint8_t *scratch;   // compressBound(FIO_MAX_BLOCK_SIZE) bytes
+    uint64_t plain;     // bytes the responses sent to these clients would take uncompressed
+    uint64_t sent;      // bytes they took
+    uint64_t raw_count; // blocks sent uncompressed to them
+    double time;        // seconds spent compressing
+};
+
+/**
+ * Super-seeding state of a server, see server__non_blocking
+ */
+struct server__super_t {
+    char on;             // still super-seeding
+    uint32_t *offered;   // number of clients each block was offered to
+    uint8_t *seen;       // number of clients that announced each block with MSG_HAVE, at most UINT8_MAX
+    uint64_t seen_count; // blocks announced at least once, a full copy is out at torrent->block_count
+    uint64_t next;       // where the search for the next block to offer starts
+    uint64_t uploaded;   // blocks served while super-seeding
+    double started;      // utils_now when super-seeding started
+};
+
+/**
+ * Size of server__conn_t.buffer: the MSG_HAVE, then SERVER__SEND_BLOCKS responses
+ */
+#define SERVER__BUFFER_SIZE \
+    (SERVER__HAVE_BATCH * RAW_MESSAGE_SIZE + SERVER__SEND_BLOCKS * (RAW_MESSAGE_SIZE + FIO_MAX_BLOCK_SIZE))
+
+/**
+ * Size of server__conn_t.in: a header and the longest body, the block numbers of a MSG_REQUEST_LIST
+ */
+#define SERVER__MESSAGE_SIZE (RAW_MESSAGE_SIZE + REQUEST_MAX_BLOCKS * sizeof(uint64_t))
+
+/**
+ * State of a connection, indexed by socket
+ */
+struct server__conn_t {
+    uint32_t capabilities;               // CAP_* agreed in the handshake, 0 for a legacy client
+    uint64_t have_next;                  // next entry of torrent->stored_log to announce
+    uint64_t blocks[REQUEST_MAX_BLOCKS]; // blocks of the last request
+    size_t count;                        // number of blocks in blocks
+    size_t next;                         // first block not answered yet
+    double since;                        // when blocks[next] became the next to answer (utils_now)
+    uint8_t *buffer;                     // what is being sent, NULL until the first message to answer
+    size_t size;                         // bytes allocated for buffer, at least SERVER__BUFFER_SIZE
+    size_t length;                       // bytes of buffer to send
+    size_t sent;                         // bytes of buffer already sent
+    char super;                          // only the offered blocks are announced and served
+    char local;                          // connected over the Unix socket
+    char file;                           // the client was given the file, blocks are answered with MSG_RESPONSE_FILE
+    char handshake;                      // the TLS handshake is not complete yet
+    char sendfile;                       // the kernel encrypts for this TLS connection, blocks are sent from the file
+    uint64_t file_offset;                // with sendfile, where the block to send after buffer starts in the file
+    size_t file_left;                    // bytes of it not sent yet
+    uint64_t offers[SERVER__SUPER_OFFERS];   // blocks offered while super-seeding, UINT64_MAX for none
+    double offered_at[SERVER__SUPER_OFFERS]; // when they were offered (utils_now)
+    uint64_t granted[SERVER__SUPER_OFFERS];  // offered blocks of the last request, UINT64_MAX for none
+    uint8_t in[SERVER__MESSAGE_SIZE];        // message being received: its header, then its body
+    size_t in_length;                        // bytes of it received
+    size_t in_needed;                        // bytes it takes, RAW_MESSAGE_SIZE until the header is in
+};
+
+int server_init(uint16_t const port, const char *unix_path, const struct tls_t *tls, struct fio_torrent_t *torrent,
+                const char super_seed) {
 
     if (torrent->downloaded_file_size == 0) {
         log_message(LOG_INFO, "Nothing to download! File size is 0");
@@ -42,14 +151,925 @@ int server_init(uint16_t const port, struct fio_torrent_t *torrent) {
         return -1;
     }
 
-    if (server__non_blocking(s, torrent)) {
+    int local = unix_path != NULL ? server__init_unix_socket(unix_path) : -1;
+
+    if (unix_path != NULL && local < 0) {
+        log_printf(LOG_DEBUG, "Failed to init Unix socket %s", unix_path);
+        close(s);
+        return -1;
+    }
+
+    if (server__non_blocking(s, local, tls, torrent, 0, super_seed)) {
+        log_message(LOG_DEBUG, "Error while calling server__non_blocking");
+        return -1;
+    }
+
+    return 0;
+}
+
+struct server__relay_t {
+    int sock;
+    int local_sock; // -1 without a Unix socket
+    const struct tls_t *tls;
+    struct fio_torrent_t *torrent;
+};
+
+static void *server__relay(void *arg) {
+    struct server__relay_t relay = *(struct server__relay_t *)arg;
+    free(arg);
+
+    if (server__non_blocking(relay.sock, relay.local_sock, relay.tls, relay.torrent, SERVER_RELAY_HOLD, 0)) {
         log_message(LOG_DEBUG, "Error while calling server__non_blocking");
+    }
+
+    return NULL;
+}
+
+int server_start_relay(uint16_t const port, const char *unix_path, const struct tls_t *tls, struct fio_torrent_t *torrent,
+                       pthread_t *thread) {
+    struct server__relay_t *relay = malloc(sizeof(struct server__relay_t));
+
+    if (relay == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    relay->tls = tls;
+    relay->torrent = torrent;
+
+    if (fio_log_stored(torrent)) {
+        log_printf(LOG_DEBUG, "Cannot log the stored blocks: %s", strerror(errno));
+        free(relay);
+        return -1;
+    }
+
+    relay->sock = server__init_socket(port);
+
+    if (relay->sock < 0) {
+        log_printf(LOG_DEBUG, "Failed to init socket with port %i", port);
+        free(relay);
+        return -1;
+    }
+
+    relay->local_sock = unix_path != NULL ? server__init_unix_socket(unix_path) : -1;
+
+    if (unix_path != NULL && relay->local_sock < 0) {
+        log_printf(LOG_DEBUG, "Failed to init Unix socket %s", unix_path);
+        close(relay->sock);
+        free(relay);
+        return -1;
+    }
+
+    if (pthread_create(thread, NULL, server__relay, relay)) {
+        log_message(LOG_DEBUG, "pthread_create failed");
+        close(relay->sock);
+        if (relay->local_sock >= 0)
+            close(relay->local_sock);
+        free(relay);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Remember the peers in the list of a MSG_PEX and answer with up to PEX_MAX_PEERS others
+ * @param body the list, count peers received after the header
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__exchange_peers(int sock, struct server__pex_t *known, uint64_t count, const uint8_t *body) {
+    struct tracker_peer_t list[PEX_MAX_PEERS];
+
+    if (count > PEX_MAX_PEERS) {
+        log_printf(LOG_INFO, "Bad MSG_PEX from socket %i", sock);
+        errno = 0;
+        return -1;
+    }
+
+    memcpy(list, body, count * sizeof(struct tracker_peer_t));
+
+    struct sockaddr_in from;
+    socklen_t length = sizeof(from);
+
+    if (getpeername(sock, (struct sockaddr *)&from, &length)) {
+        log_printf(LOG_DEBUG, "getpeername failed: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    const double now = utils_now();
+    struct tracker_peer_t self = {{0}, 0}; // the client itself, if it serves the torrent too
+
+    for (uint64_t j = 0; j < count; j++) {
+        struct tracker_peer_t peer = list[j];
+        static const uint8_t any[4] = {0};
+
+        if (!memcmp(peer.address, any, sizeof(any))) { // the client, reachable at the address of the connection
+            if (from.sin_family != AF_INET) // over the Unix socket, it has none
+                continue;
+
+            memcpy(peer.address, &from.sin_addr.s_addr, sizeof(peer.address));
+            self = peer;
+        }
+
+        // refresh it, or take the slot of an expired or of the oldest peer
+        size_t slot = known->count;
+        size_t oldest = 0;
+
+        for (size_t i = 0; i < known->count; i++) {
+            if (!memcmp(&known->peers[i], &peer, sizeof(peer))) {
+                slot = i;
+                break;
+            }
+
+            if (known->heard[i] < known->heard[oldest])
+                oldest = i;
+        }
+
+        if (slot == known->count) {
+            if (known->count < SERVER__PEX_PEERS)
+                known->count++;
+            else
+                slot = oldest;
+        }
+
+        known->peers[slot] = peer;
+        known->heard[slot] = now;
+    }
+
+    // reservoir sampling of the live peers, except the client itself
+    struct utils_message_t answer;
+    size_t seen = 0;
+
+    for (size_t i = 0; i < known->count; i++) {
+        if (now - known->heard[i] > SERVER__PEX_TTL || !memcmp(&known->peers[i], &self, sizeof(self)))
+            continue;
+
+        if (seen < PEX_MAX_PEERS) {
+            list[seen] = known->peers[i];
+        } else {
+            const size_t j = (size_t)rand() % (seen + 1);
+            if (j < PEX_MAX_PEERS)
+                list[j] = known->peers[i];
+        }
+        seen++;
+    }
+
+    answer.magic_number = MAGIC_NUMBER;
+    answer.message_code = MSG_PEX;
+    answer.block_number = seen < PEX_MAX_PEERS ? seen : PEX_MAX_PEERS;
+
+    if (utils_send_all(sock, &answer, RAW_MESSAGE_SIZE) <= 0 ||
+        (answer.block_number > 0 &&
+         utils_send_all(sock, list, answer.block_number * sizeof(struct tracker_peer_t)) <= 0)) {
+        log_printf(LOG_INFO, "Could not answer MSG_PEX: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    log_printf(LOG_INFO, "Exchanged peers with socket %i: got %lu, sent %lu of %lu", sock, count, answer.block_number, seen);
+    return 0;
+}
+
+/**
+ * Set up the state of a new client
+ * @param conns array indexed by socket, grown as needed
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__greet(int sock, struct server__conn_t **conns, size_t *conn_size) {
+    if ((size_t)sock >= *conn_size) {
+        const size_t size = (size_t)sock * 2 + 1;
+        struct server__conn_t *grown = realloc(*conns, sizeof(struct server__conn_t) * size);
+
+        if (grown == NULL) {
+            log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+            errno = 0;
+            return -1;
+        }
+
+        memset(grown + *conn_size, 0, sizeof(struct server__conn_t) * (size - *conn_size));
+        *conns = grown;
+        *conn_size = size;
+    }
+
+    // the buffer of a previous connection on the same socket is kept for this one
+    struct server__conn_t *conn = &(*conns)[sock];
+    conn->capabilities = 0;
+    conn->count = conn->next = 0;
+    conn->length = conn->sent = 0;
+    conn->super = 0;
+    conn->local = 0;
+    conn->file = 0;
+    conn->handshake = 0;
+    conn->sendfile = 0;
+    conn->file_left = 0;
+    conn->in_length = 0;
+    conn->in_needed = RAW_MESSAGE_SIZE;
+    return 0;
+}
+
+/**
+ * Make room in the buffer of a connection
+ * @param size bytes needed, SERVER__BUFFER_SIZE are allocated at least
+ * @return 0 on success or -1 on error
+ */
+static int server__reserve(struct server__conn_t *conn, size_t size) {
+    if (size < SERVER__BUFFER_SIZE)
+        size = SERVER__BUFFER_SIZE;
+
+    if (conn->size >= size)
+        return 0;
+
+    uint8_t *buffer = realloc(conn->buffer, size);
+
+    if (buffer == NULL) {
+        log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    conn->buffer = buffer;
+    conn->size = size;
+    return 0;
+}
+
+/**
+ * Choose the next block to offer while super-seeding: one no client announced yet, offered to the fewest
+ * clients so far
+ * @param conn the client, which is not offered the blocks it was already
+ * @return the block or UINT64_MAX if there is none
+ */
+static uint64_t server__super_pick(const struct fio_torrent_t *torrent, struct server__super_t *super,
+                                   const struct server__conn_t *conn) {
+    uint64_t best = UINT64_MAX;
+
+    for (uint64_t n = 0; n < torrent->block_count; n++) {
+        const uint64_t k = (super->next + n) % torrent->block_count;
+        char taken = 0;
+
+        for (size_t i = 0; i < SERVER__SUPER_OFFERS; i++) {
+            taken |= conn->offers[i] == k || conn->granted[i] == k;
+        }
+
+        if (taken || super->seen[k] > 0 || !__atomic_load_n(&torrent->block_map[k], __ATOMIC_ACQUIRE) ||
+            (best != UINT64_MAX && super->offered[k] >= super->offered[best]))
+            continue;
+
+        best = k;
+
+        if (super->offered[k] == 0)
+            break;
+    }
+
+    if (best != UINT64_MAX)
+        super->next = best + 1;
+
+    return best;
+}
+
+/**
+ * Offer new blocks to a super-seeded client in place of those it requested, those another client announced
+ * and those it did not request within SERVER__SUPER_WAIT
+ * @param haves where MSG_HAVE are written for the new ones, NULL to write none
+ * @return number of blocks offered
+ */
+static size_t server__super_offer(const struct fio_torrent_t *torrent, struct server__super_t *super,
+                                  struct server__conn_t *conn, struct utils_message_t *haves) {
+    const double now = utils_now();
+    size_t count = 0;
+
+    for (size_t i = 0; i < SERVER__SUPER_OFFERS; i++) {
+        const uint64_t old = conn->offers[i];
+
+        if (old != UINT64_MAX && super->seen[old] == 0 && now - conn->offered_at[i] < SERVER__SUPER_WAIT)
+            continue;
+
+        conn->offers[i] = UINT64_MAX;
+        const uint64_t k = server__super_pick(torrent, super, conn);
+
+        if (k == UINT64_MAX)
+            continue;
+
+        conn->offers[i] = k;
+        conn->offered_at[i] = now;
+        super->offered[k]++;
+
+        if (haves != NULL) {
+            haves[count].magic_number = MAGIC_NUMBER;
+            haves[count].message_code = MSG_HAVE;
+            haves[count].block_number = k;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Grant a super-seeded client the offered blocks of the request it just sent, so that they are served even
+ * though new ones are offered in their place right away
+ */
+static void server__super_grant(struct server__conn_t *conn) {
+    for (size_t i = 0; i < SERVER__SUPER_OFFERS; i++) {
+        conn->granted[i] = UINT64_MAX;
+
+        for (size_t j = 0; j < conn->count && conn->offers[i] != UINT64_MAX; j++) {
+            if (conn->blocks[j] == conn->offers[i]) {
+                conn->granted[i] = conn->offers[i];
+                conn->offers[i] = UINT64_MAX;
+            }
+        }
+    }
+}
+
+/**
+ * Whether a block may be announced and served to a client
+ */
+static char server__super_serves(const struct server__conn_t *conn, uint64_t k) {
+    if (!conn->super)
+        return 1;
+
+    for (size_t i = 0; i < SERVER__SUPER_OFFERS; i++) {
+        if (conn->offers[i] == k || conn->granted[i] == k)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Count a MSG_HAVE of a client, and stop super-seeding once every block was announced
+ */
+static void server__super_seen(const struct fio_torrent_t *torrent, struct server__super_t *super, uint64_t k) {
+    if (super->seen == NULL || k >= torrent->block_count || super->seen[k] == UINT8_MAX)
+        return;
+
+    if (super->seen[k]++ == 0)
+        super->seen_count++;
+
+    if (super->on && super->seen_count == torrent->block_count) {
+        super->on = 0;
+        log_printf(LOG_INFO, "Super-seeding done in %.3f s: %lu blocks served for %lu (%.2f copies)",
+                   utils_now() - super->started, super->uploaded, torrent->block_count,
+                   (double)super->uploaded / (double)torrent->block_count);
+    }
+}
+
+/**
+ * Lay out at the end of the buffer of a connection a MSG_BITFIELD with the blocks that may be served to it
+ */
+static void server__put_bitfield(const struct fio_torrent_t *torrent, struct server__conn_t *conn) {
+    struct utils_message_t *msg = (struct utils_message_t *)(conn->buffer + conn->length);
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_BITFIELD;
+    msg->block_number = torrent->block_count;
+
+    const size_t bytes = (torrent->block_count + 7) / 8;
+    uint8_t *bits = conn->buffer + conn->length + RAW_MESSAGE_SIZE;
+    uint64_t available = 0;
+    memset(bits, 0, bytes);
+
+    for (uint64_t k = 0; k < torrent->block_count; k++) {
+        if (__atomic_load_n(&torrent->block_map[k], __ATOMIC_ACQUIRE) && server__super_serves(conn, k)) {
+            bits[k / 8] |= (uint8_t)(1 << (k % 8));
+            available++;
+        }
+    }
+
+    conn->length += RAW_MESSAGE_SIZE + bytes;
+
+    log_printf(LOG_DEBUG, "Sending MSG_BITFIELD with %lu of %lu blocks", available, torrent->block_count);
+}
+
+/**
+ * Answer the MSG_HELLO of a client, received with its body: lay out in its buffer a MSG_HELLO with what
+ * both support, then MSG_BITFIELD if that includes CAP_AVAILABILITY, and remember from where in the
+ * stored_log of the torrent it has to be sent MSG_HAVE. While super-seeding, a client with CAP_CLIENT_HAVE
+ * is only offered a few blocks.
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__hello(int sock, const struct fio_torrent_t *torrent, struct server__super_t *super,
+                         struct server__conn_t *conn, const uint8_t *body) {
+    struct utils_hello_t hello;
+    memcpy(&hello, body, sizeof(hello));
+
+    if (hello.version == 0 || hello.block_size != FIO_MAX_BLOCK_SIZE) {
+        log_printf(LOG_INFO, "Bad MSG_HELLO from socket %i", sock);
+        errno = 0;
         return -1;
     }
 
+    const size_t bytes = (torrent->block_count + 7) / 8;
+
+    if (server__reserve(conn, RAW_MESSAGE_SIZE + sizeof(hello) + RAW_MESSAGE_SIZE + bytes))
+        return -1;
+
+    conn->capabilities = hello.capabilities & SERVER__CAPABILITIES & (conn->local ? UINT32_MAX : ~CAP_FILE);
+    conn->count = conn->next = 0;
+    conn->sent = 0;
+
+    struct utils_message_t *msg = (struct utils_message_t *)conn->buffer;
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_HELLO;
+    msg->block_number = 0;
+
+    hello.version = hello.version < PROTOCOL_VERSION ? hello.version : PROTOCOL_VERSION;
+    hello.capabilities = conn->capabilities;
+    hello.depth = hello.depth < REQUEST_MAX_BLOCKS ? hello.depth : REQUEST_MAX_BLOCKS;
+    memcpy(conn->buffer + RAW_MESSAGE_SIZE, &hello, sizeof(hello));
+    conn->length = RAW_MESSAGE_SIZE + sizeof(hello);
+
+    log_printf(LOG_DEBUG, "Socket %i speaks version %u with capabilities %x", sock, hello.version, hello.capabilities);
+
+    if (!(conn->capabilities & CAP_AVAILABILITY))
+        return 0;
+
+    // take the position in the log first: whatever is stored later is announced with MSG_HAVE
+    const uint64_t logged = __atomic_load_n(&torrent->stored_count, __ATOMIC_ACQUIRE);
+    conn->have_next = logged < torrent->block_count ? logged : torrent->block_count;
+
+    conn->super = super->on && conn->capabilities & CAP_CLIENT_HAVE;
+
+    for (size_t i = 0; i < SERVER__SUPER_OFFERS; i++) {
+        conn->offers[i] = conn->granted[i] = UINT64_MAX;
+    }
+
+    // the client reads what we send only when it requests blocks to us, so the first offers go in the bitfield
+    if (conn->super)
+        server__super_offer(torrent, super, conn, NULL);
+
+    server__put_bitfield(torrent, conn);
+    return 0;
+}
+
+/**
+ * Answer a MSG_METAINFO, received with the identifier that follows it: lay out in the buffer of the client
+ * the header of the metainfo or a chunk of block hashes and its proof
+ * @param tree hash tree of the torrent, NULL if it could not be built
+ * @param body the identifier
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__metainfo(int sock, const struct fio_torrent_t *torrent, const struct metainfo_tree_t *tree,
+                            struct server__conn_t *conn, const struct utils_message_t *msg, const uint8_t *body) {
+    fio_sha256_hash_t id;
+    const uint64_t what = msg->block_number;
+    memcpy(id, body, sizeof(id));
+
+    if (tree != NULL && what != METAINFO_HEADER && what >= tree->chunk_count) {
+        log_printf(LOG_INFO, "Bad MSG_METAINFO from socket %i", sock);
+        errno = 0;
+        return -1;
+    }
+
+    const size_t room = RAW_MESSAGE_SIZE + sizeof(fio_sha256_hash_t) * (METAINFO_CHUNK_HASHES + METAINFO_MAX_PROOF);
+
+    if (server__reserve(conn, room))
+        return -1;
+
+    conn->count = conn->next = 0;
+    conn->sent = 0;
+    conn->length = RAW_MESSAGE_SIZE;
+
+    struct utils_message_t *answer = (struct utils_message_t *)conn->buffer;
+    answer->magic_number = MAGIC_NUMBER;
+    answer->message_code = MSG_METAINFO;
+    answer->block_number = what;
+
+    if (tree == NULL || memcmp(id, tree->id, sizeof(id))) { // another torrent
+        answer->message_code = MSG_RESPONSE_NA;
+    } else if (what == METAINFO_HEADER) {
+        memcpy(conn->buffer + conn->length, &tree->header, sizeof(tree->header));
+        conn->length += sizeof(tree->header);
+    } else {
+        const size_t hashes = sizeof(fio_sha256_hash_t) * metainfo_chunk_size(torrent->block_count, what);
+        memcpy(conn->buffer + conn->length, torrent->block_hashes[what * METAINFO_CHUNK_HASHES], hashes);
+        conn->length += hashes;
+        conn->length += sizeof(fio_sha256_hash_t) *
+                        metainfo_proof(tree, what, (fio_sha256_hash_t *)(conn->buffer + conn->length));
+    }
+
+    log_printf(LOG_DEBUG, "Sending %lu bytes of metainfo to socket %i", conn->length, sock);
     return 0;
 }
 
+/**
+ * Write MSG_HAVE for the blocks stored since the last ones announced to a client, if the torrent logs them
+ * and the client asked for them
+ * @param conn the client, whose have_next is updated
+ * @param haves where the messages are written
+ * @param max room in haves
+ * @return number of messages written
+ */
+static size_t server__put_haves(const struct fio_torrent_t *torrent, struct server__conn_t *conn,
+                                struct utils_message_t *haves, size_t max) {
+    size_t count = 0;
+
+    if (torrent->stored_log == NULL || !(conn->capabilities & CAP_AVAILABILITY))
+        return 0;
+
+    while (count < max && conn->have_next < torrent->block_count) {
+        const uint64_t k = __atomic_load_n(&torrent->stored_log[conn->have_next], __ATOMIC_ACQUIRE);
+
+        if (k == UINT64_MAX) // not stored yet, or not written to the log yet
+            break;
+
+        haves[count].magic_number = MAGIC_NUMBER;
+        haves[count].message_code = MSG_HAVE;
+        haves[count].block_number = k;
+        count++;
+        conn->have_next++;
+    }
+
+    return count;
+}
+
+/**
+ * Send MSG_HAVE for the blocks stored since the last ones sent to this client, as server__put_haves
+ * @return 0 on success or -1 on error
+ */
+static int server__send_haves(int sock, const struct fio_torrent_t *torrent, struct server__conn_t *conn) {
+    struct utils_message_t haves[SERVER__HAVE_BATCH];
+    size_t count;
+
+    while ((count = server__put_haves(torrent, conn, haves, SERVER__HAVE_BATCH)) > 0) {
+        if (utils_send_all(sock, haves, count * RAW_MESSAGE_SIZE) <= 0)
+            return -1;
+
+        log_printf(LOG_DEBUG, "Sent %lu MSG_HAVE to socket %i", count, sock);
+    }
+
+    return 0;
+}
+
+/**
+ * Answer a MSG_FILE: pass the client a read-only descriptor of the downloaded file, opened on the first request
+ * through /proc so that the client cannot write to it, or answer MSG_RESPONSE_NA if it cannot be opened
+ * @param file the descriptor given to every client, -1 until it is opened
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__send_file(int sock, const struct fio_torrent_t *torrent, int *file, struct server__conn_t *conn) {
+    if (!(conn->capabilities & CAP_FILE)) {
+        log_printf(LOG_INFO, "MSG_FILE without CAP_FILE from socket %i", sock);
+        return -1;
+    }
+
+    if (*file < 0) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(torrent->downloaded_file_stream));
+        *file = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (*file < 0) {
+            log_printf(LOG_INFO, "Cannot open the file read-only: %s", strerror(errno));
+            errno = 0;
+        }
+    }
+
+    struct utils_message_t answer;
+    answer.magic_number = MAGIC_NUMBER;
+    answer.message_code = *file < 0 ? MSG_RESPONSE_NA : MSG_FILE;
+    answer.block_number = 0;
+
+    if ((*file < 0 ? utils_send_all(sock, &answer, RAW_MESSAGE_SIZE) : utils_send_fd(sock, &answer, RAW_MESSAGE_SIZE, *file)) <= 0) {
+        log_printf(LOG_INFO, "Could not answer MSG_FILE: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    conn->file = *file >= 0;
+
+    if (conn->file)
+        log_printf(LOG_INFO, "Gave the file to socket %i, its blocks are copied from there", sock);
+    return 0;
+}
+
+/**
+ * Bytes that follow the header of a message from a client. A message that is not valid has none, for its handler
+ * to reject it.
+ * @return the size of the body, at most SERVER__MESSAGE_SIZE - RAW_MESSAGE_SIZE
+ */
+static size_t server__body_size(const struct utils_message_t *msg) {
+    if (msg->magic_number != MAGIC_NUMBER)
+        return 0;
+
+    if (msg->message_code == MSG_REQUEST_RANGE)
+        return sizeof(uint64_t);
+    if (msg->message_code == MSG_REQUEST_LIST)
+        return msg->block_number <= REQUEST_MAX_BLOCKS ? msg->block_number * sizeof(uint64_t) : 0;
+    if (msg->message_code == MSG_PEX)
+        return msg->block_number <= PEX_MAX_PEERS ? msg->block_number * sizeof(struct tracker_peer_t) : 0;
+    if (msg->message_code == MSG_HELLO)
+        return sizeof(struct utils_hello_t);
+    if (msg->message_code == MSG_METAINFO)
+        return sizeof(fio_sha256_hash_t);
+    return 0;
+}
+
+/**
+ * Receive what the socket has of the message of a client into conn->in, without waiting for the rest: the header,
+ * then the body it announces
+ * @return 1 once the message is complete, 0 if the rest has not come yet, -1 if the client must be dropped
+ */
+static int server__receive(int sock, struct server__conn_t *conn) {
+    while (conn->in_length < conn->in_needed) {
+        const ssize_t n = tls_recv(sock, conn->in + conn->in_length, conn->in_needed - conn->in_length);
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            errno = 0;
+            return 0;
+        }
+
+        if (n < 0) {
+            log_printf(LOG_DEBUG, "Error while reading from socket %i: %s", sock, strerror(errno));
+            errno = 0;
+            return -1;
+        }
+
+        if (n == 0) {
+            log_printf(LOG_INFO, "Connection closed on socket %i", sock);
+            return -1;
+        }
+
+        conn->in_length += (size_t)n;
+
+        if (conn->in_length == RAW_MESSAGE_SIZE)
+            conn->in_needed += server__body_size((const struct utils_message_t *)conn->in);
+    }
+
+    return 1;
+}
+
+/**
+ * Take a request, with the block numbers that follow a MSG_REQUEST_RANGE or a MSG_REQUEST_LIST, as the blocks
+ * to answer next
+ * @param body what was received after the header, see server__body_size
+ * @return 0 on success or -1 if the client must be dropped
+ */
+static int server__read_request(const struct fio_torrent_t *torrent, struct server__conn_t *conn,
+                                const struct utils_message_t *msg, const uint8_t *body) {
+    const uint64_t first = msg->block_number;
+    uint64_t count = 0;
+
+    if (msg->magic_number != MAGIC_NUMBER) {
+        count = 0;
+    } else if (msg->message_code == MSG_REQUEST && first < torrent->block_count) {
+        conn->blocks[0] = first;
+        count = 1;
+    } else if (msg->message_code == MSG_REQUEST_RANGE) {
+        uint64_t n;
+        memcpy(&n, body, sizeof(n));
+
+        if (n > 0 && n <= REQUEST_MAX_BLOCKS && first < torrent->block_count && n <= torrent->block_count - first) {
+            for (uint64_t i = 0; i < n; i++) {
+                conn->blocks[i] = first + i;
+            }
+            count = n;
+        }
+    } else if (msg->message_code == MSG_REQUEST_LIST && first > 0 && first <= REQUEST_MAX_BLOCKS) {
+        memcpy(conn->blocks, body, sizeof(uint64_t) * first);
+        count = first;
+
+        for (uint64_t i = 0; i < count; i++) {
+            if (conn->blocks[i] >= torrent->block_count)
+                count = 0;
+        }
+    }
+
+    if (count == 0) {
+        log_printf(LOG_INFO, "Magic number, messagecode or block number wrong, dropping client!");
+        errno = 0;
+        return -1;
+    }
+
+    conn->count = count;
+    conn->next = 0;
+    conn->since = utils_now();
+
+    if (conn->super)
+        server__super_grant(conn);
+    return 0;
+}
+
+/**
+ * Allocate the compressed blocks, if not done yet
+ * @return 0 on success or -1 on error
+ */
+static int server__deflate_init(const struct fio_torrent_t *torrent, struct server__deflate_t *z) {
+    if (z->data != NULL)
+        return 0;
+
+    z->data = calloc(torrent->block_count, sizeof(uint8_t *));
+    z->size = calloc(torrent->block_count, sizeof(uint32_t));
+    z->raw = calloc(torrent->block_count, sizeof(uint8_t));
+    z->scratch = malloc(compressBound(FIO_MAX_BLOCK_SIZE));
+
+    if (z->data == NULL || z->size == NULL || z->raw == NULL || z->scratch == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        free(z->data);
+        free(z->size);
+        free(z->raw);
+        free(z->scratch);
+        memset(z, 0, sizeof(struct server__deflate_t));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write a MSG_RESPONSE_DEFLATE
+ * @param at where in the buffer of the connection
+ * @return bytes written
+ */
+static size_t server__put_deflated(struct server__conn_t *conn, size_t at, uint64_t k, const uint8_t *data, uint32_t size) {
+    struct utils_message_t *msg = (struct utils_message_t *)(conn->buffer + at);
+    msg->magic_number = MAGIC_NUMBER;
+    msg->message_code = MSG_RESPONSE_DEFLATE;
+    msg->block_number = k;
+    memcpy(conn->buffer + at + RAW_MESSAGE_SIZE, &size, sizeof(size));
+    memcpy(conn->buffer + at + RAW_MESSAGE_SIZE + sizeof(size), data, size);
+    return RAW_MESSAGE_SIZE + sizeof(size) + size;
+}
+
+/**
+ * Compress the responses of consecutive blocks just laid out in the buffer of a connection, keeping the blocks
+ * that do not compress well enough as they are, and moving everything back so that the buffer stays contiguous
+ * @param offset where the response of the first block starts
+ */
+static void server__deflate_run(const struct fio_torrent_t *torrent, struct server__deflate_t *z, struct server__conn_t *conn,
+                                size_t offset, uint64_t first, size_t count) {
+    size_t from = offset; // next response to compress
+    size_t to = offset;   // where it goes
+
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t k = first + i;
+        const uint64_t size = fio_get_block_size(torrent, k);
+        uLongf length = compressBound(FIO_MAX_BLOCK_SIZE);
+
+        if (!z->raw[k]) {
+            const double start = utils_now();
+            const int r = compress2(z->scratch, &length, conn->buffer + from + RAW_MESSAGE_SIZE, size, Z_BEST_SPEED);
+            z->time += utils_now() - start;
+
+            if (r != Z_OK || (double)(sizeof(uint32_t) + length) > (double)size * SERVER__DEFLATE_RATIO)
+                z->raw[k] = 1;
+        }
+
+        if (z->raw[k]) {
+            memmove(conn->buffer + to, conn->buffer + from, RAW_MESSAGE_SIZE + size);
+            to += RAW_MESSAGE_SIZE + size;
+            z->sent += RAW_MESSAGE_SIZE + size;
+            z->raw_count++;
+        } else {
+            // the compressed response is shorter, so it does not reach the next block
+            const size_t written = server__put_deflated(conn, to, k, z->scratch, (uint32_t)length);
+            to += written;
+            z->sent += written;
+
+            if (z->cached + length <= SERVER__DEFLATE_CACHE && (z->data[k] = malloc(length)) != NULL) {
+                memcpy(z->data[k], z->scratch, length);
+                z->size[k] = (uint32_t)length;
+                z->cached += length;
+            }
+        }
+
+        z->plain += RAW_MESSAGE_SIZE + size;
+        from += RAW_MESSAGE_SIZE + size;
+    }
+
+    conn->length = to;
+}
+
+/**
+ * Lay out in the buffer of a connection the MSG_HAVE due and the responses to the next blocks it requested,
+ * reading each run of consecutive available blocks with a single fio_read_blocks. With sendfile, the data
+ * of a block is left in the file to be sent after the buffer instead, so the buffer ends with its header.
+ * @param z compressed blocks, used if the client has CAP_DEFLATE
+ * @param super super-seeding state: the client may get new offers, or the whole bitfield once it is over
+ * @param hold seconds a missing block may wait to be stored before it is answered MSG_RESPONSE_NA
+ * @return 0 if there is something to send, 1 if the next block must be waited for or -1 on error
+ */
+static int server__prepare(const struct fio_torrent_t *torrent, struct server__deflate_t *z, struct server__super_t *super,
+                           struct server__conn_t *conn, const double hold) {
+    // with room for the bitfield when super-seeding is over
+    if (server__reserve(conn, SERVER__BUFFER_SIZE + (conn->super ? RAW_MESSAGE_SIZE + (torrent->block_count + 7) / 8 : 0)))
+        return -1;
+
+    const char deflate = conn->capabilities & CAP_DEFLATE && server__deflate_init(torrent, z) == 0;
+
+    const double now = utils_now();
+    size_t slots = SERVER__SEND_BLOCKS;
+
+    // announce new blocks first, so that the client may request them next
+    conn->sent = 0;
+    conn->length = RAW_MESSAGE_SIZE *
+                   server__put_haves(torrent, conn, (struct utils_message_t *)conn->buffer, SERVER__HAVE_BATCH - SERVER__SUPER_OFFERS);
+
+    if (conn->super && !super->on) { // a full copy is out
+        conn->super = 0;
+        server__put_bitfield(torrent, conn);
+    } else if (conn->super) {
+        conn->length += RAW_MESSAGE_SIZE *
+                        server__super_offer(torrent, super, conn, (struct utils_message_t *)(conn->buffer + conn->length));
+    }
+
+    while (conn->next < conn->count && slots > 0) {
+        const uint64_t k = conn->blocks[conn->next];
+
+        // the block may be being stored by the client of a relay, or not be offered while super-seeding. A
+        // client told what we have only requests a missing block after forgetting our MSG_RESPONSE_NA, do
+        // not make it wait.
+        if (!__atomic_load_n(&torrent->block_map[k], __ATOMIC_ACQUIRE) || !server__super_serves(conn, k)) {
+            if (now - conn->since < hold && !(conn->capabilities & CAP_AVAILABILITY))
+                break;
+
+            struct utils_message_t *na = (struct utils_message_t *)(conn->buffer + conn->length);
+            na->magic_number = MAGIC_NUMBER;
+            na->message_code = MSG_RESPONSE_NA;
+            na->block_number = k;
+            conn->length += RAW_MESSAGE_SIZE;
+            conn->next++;
+            conn->since = now;
+            slots--;
+            continue;
+        }
+
+        if (super->on)
+            super->uploaded++;
+
+        if (conn->file) { // the client copies the block from the file
+            struct utils_message_t *copy = (struct utils_message_t *)(conn->buffer + conn->length);
+            copy->magic_number = MAGIC_NUMBER;
+            copy->message_code = MSG_RESPONSE_FILE;
+            copy->block_number = k;
+            conn->length += RAW_MESSAGE_SIZE;
+            conn->next++;
+            conn->since = now;
+            slots--;
+            continue;
+        }
+
+        if (deflate && z->data[k] != NULL) { // compressed for another client
+            conn->length += server__put_deflated(conn, conn->length, k, z->data[k], z->size[k]);
+            z->plain += RAW_MESSAGE_SIZE + fio_get_block_size(torrent, k);
+            z->sent += RAW_MESSAGE_SIZE + sizeof(uint32_t) + z->size[k];
+            conn->next++;
+            conn->since = now;
+            slots--;
+            continue;
+        }
+
+        if (conn->sendfile && !deflate) { // the block follows from the file, so nothing can come after it
+            struct utils_message_t *ok = (struct utils_message_t *)(conn->buffer + conn->length);
+            ok->magic_number = MAGIC_NUMBER;
+            ok->message_code = MSG_RESPONSE_OK;
+            ok->block_number = k;
+            conn->length += RAW_MESSAGE_SIZE;
+            conn->file_offset = k * FIO_MAX_BLOCK_SIZE;
+            conn->file_left = fio_get_block_size(torrent, k);
+            conn->next++;
+            conn->since = now;
+            break;
+        }
+
+        uint8_t *data[SERVER__SEND_BLOCKS];
+        const size_t offset = conn->length;
+        size_t run = 0;
+
+        while (run < slots && conn->next + run < conn->count && conn->blocks[conn->next + run] == k + run &&
+               __atomic_load_n(&torrent->block_map[k + run], __ATOMIC_ACQUIRE) && !(deflate && z->data[k + run] != NULL) &&
+               server__super_serves(conn, k + run)) {
+            struct utils_message_t *ok = (struct utils_message_t *)(conn->buffer + conn->length);
+            ok->magic_number = MAGIC_NUMBER;
+            ok->message_code = MSG_RESPONSE_OK;
+            ok->block_number = k + run;
+            data[run] = conn->buffer + conn->length + RAW_MESSAGE_SIZE;
+            conn->length += RAW_MESSAGE_SIZE + fio_get_block_size(torrent, k + run);
+            run++;
+        }
+
+        if (fio_read_blocks(torrent, k, data, run)) {
+            log_printf(LOG_INFO, "Cannot load blocks %lu to %lu: %s", k, k + run - 1, strerror(errno));
+            errno = 0;
+            return -1;
+        }
+
+        log_printf(LOG_DEBUG, "Loaded blocks %lu to %lu", k, k + run - 1);
+
+        if (super->on) // the first one was counted above
+            super->uploaded += run - 1;
+
+        if (deflate)
+            server__deflate_run(torrent, z, conn, offset, k, run);
+
+        conn->next += run;
+        conn->since = now;
+        slots -= run;
+    }
+
+    return conn->length > 0 ? 0 : 1;
+}
+
 #define SERVER__BACKLOG 10
 int server__init_socket(const uint16_t port) {
 
@@ -87,6 +1107,40 @@ int server__init_socket(const uint16_t port) {
     return s;
 }
 
+int server__init_unix_socket(const char *path) {
+    struct sockaddr_un hint;
+    memset(&hint, 0, sizeof(struct sockaddr_un));
+    hint.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(hint.sun_path)) {
+        log_printf(LOG_DEBUG, "Socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(hint.sun_path, path);
+
+    // a socket left by a previous server, never anything else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path)) {
+        log_printf(LOG_DEBUG, "Cannot remove %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) {
+        log_printf(LOG_DEBUG, "Socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (fcntl(s, F_SETFL, O_NONBLOCK) || bind(s, (struct sockaddr *)&hint, sizeof(hint)) || listen(s, SERVER__BACKLOG)) {
+        log_printf(LOG_DEBUG, "Cannot listen on %s: %s", path, strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    log_printf(LOG_INFO, "Listening on Unix socket %s", path);
+    return s;
+}
+
 void server__die(char *file_name, int file_line, struct utils_array_rcv_data_t *ptrData, struct utils_array_pollfd_t *ptrPoll) {
 
     log_printf(LOG_DEBUG, "Program exitted at %s:%d", file_name, file_line);
@@ -100,6 +1154,7 @@ void server__die(char *file_name, int file_line, struct utils_array_rcv_data_t *
 }
 
 void server__remove_client(struct utils_array_rcv_data_t *ptrData, struct utils_array_pollfd_t *ptrPoll, int sock) {
+    tls_close(sock);
 
     if (utils_array_rcv_remove(ptrData, sock)) {
         log_printf(LOG_DEBUG, "No message from %i in the array", sock);
@@ -117,35 +1172,120 @@ void server__remove_client(struct utils_array_rcv_data_t *ptrData, struct utils_
     }
 }
 
-int server__non_blocking(const int sockd, struct fio_torrent_t *const torrent) {
+int server__non_blocking(const int sockd, const int local_sockd, const struct tls_t *tls, struct fio_torrent_t *const torrent,
+                         const double hold, const char super_seed) {
     struct utils_array_pollfd_t p;   // array to poll
     struct utils_array_rcv_data_t d; // array to store the rcv messages
+    size_t held = 0;                 // sockets not polled because they wait for a block (events == 0)
+    double retry_at = 0;             // when to look at the held requests again
+    struct server__pex_t known;      // peers heard of by peer exchange
+    struct server__deflate_t z = {0}; // blocks compressed for the clients with CAP_DEFLATE
+    struct server__super_t super = {0};
+    struct metainfo_tree_t tree;      // to answer MSG_METAINFO
+    struct server__conn_t *conns = NULL; // indexed by socket
+    size_t conn_size = 0;                // entries in conns
+    int file = -1;                       // read-only descriptor of the file, given with MSG_FILE
+    const int file_fd = fileno(torrent->downloaded_file_stream); // sent from with sendfile
+    known.count = 0;
+
+    const char metainfo = metainfo_tree_init(&tree, torrent) == 0;
+
+    if (metainfo) {
+        char id[SHA256_STRING_LEN];
+        metainfo_format_id(tree.id, id);
+        log_printf(LOG_INFO, "Metainfo identifier is %s", id);
+    }
+
+    if (super_seed && torrent->block_count > 0) {
+        super.offered = calloc(torrent->block_count, sizeof(uint32_t));
+        super.seen = calloc(torrent->block_count, sizeof(uint8_t));
+
+        if (super.offered == NULL || super.seen == NULL) {
+            log_printf(LOG_INFO, "Cannot allocate the super-seeding state, serving everything: %s", strerror(errno));
+            errno = 0;
+            free(super.offered);
+            free(super.seen);
+            super.offered = NULL;
+            super.seen = NULL;
+        } else {
+            super.on = 1;
+            super.started = utils_now();
+            log_message(LOG_INFO, "Super-seeding until a full copy is out");
+        }
+    }
 
     utils_array_pollfd_init(&p);
     utils_array_rcv_init(&d);
 
     utils_array_pollfd_add(&p, sockd, POLLIN);
 
+    if (local_sockd >= 0)
+        utils_array_pollfd_add(&p, local_sockd, POLLIN);
+
     while (1) {
         int revent_c;
 
-        if ((revent_c = poll(p.content, p.size, TIME_TO_POLL)) == -1) {
+        // what TLS already decrypted does not make a socket readable
+        char pending = 0;
+        for (size_t i = 0; tls != NULL && i < p.size; i++) {
+            pending |= p.content[i].events & POLLIN && tls_pending(p.content[i].fd);
+        }
+
+        if ((revent_c = poll(p.content, p.size, pending ? 0 : held > 0 ? SERVER__HOLD_POLL : TIME_TO_POLL)) == -1) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
             log_message(LOG_DEBUG, "Polling failed");
             return -1;
         }
 
+        for (size_t i = 0; pending && i < p.size; i++) {
+            if (p.content[i].events & POLLIN && tls_pending(p.content[i].fd))
+                p.content[i].revents |= POLLIN;
+        }
+
+        if (held > 0 && utils_now() >= retry_at) { // look at the held requests again
+            for (size_t i = 0; i < p.size; i++) {
+                if (p.content[i].events == 0)
+                    p.content[i].events = POLLOUT;
+            }
+            held = 0;
+        }
+
         log_printf(LOG_DEBUG, "Polling returned with %i", revent_c);
         uint32_t c = p.size;
         for (size_t i = 0; i < c; i++) {
 
             struct pollfd *t = &p.content[i]; // easier to write
 
+            if (t->events == 0 && t->revents & (POLLHUP | POLLERR)) { // a held requester went away
+                log_printf(LOG_INFO, "Connection closed on socket %i", t->fd);
+                server__remove_client(&d, &p, t->fd);
+                held--;
+                continue;
+            }
+
+            if (t->fd != sockd && t->fd != local_sockd && conns[t->fd].handshake && t->revents) {
+                const int r = tls_handshake(t->fd);
+
+                if (r < 0) {
+                    server__remove_client(&d, &p, t->fd);
+                    continue;
+                }
+
+                t->events = r > 0 ? (short)r : POLLIN; // then the messages
+                conns[t->fd].handshake = r > 0;
+                conns[t->fd].sendfile = r == 0 && tls_kernel_send(t->fd);
+                continue;
+            }
+
             if (t->revents & POLLIN) {
 
-                if (t->fd == sockd) { // accept incoming connections
+                if (t->fd == sockd || t->fd == local_sockd) { // accept incoming connections
                     struct sockaddr_in client;
                     unsigned int size = sizeof(struct sockaddr_in);
-                    int rcv = accept(sockd, (struct sockaddr *)&client, &size);
+                    int rcv = accept(t->fd, (struct sockaddr *)&client, &size);
 
                     if (rcv < 0) {
                         log_printf(LOG_DEBUG, "Error while accepting the connection: %s, ignoring connection", strerror(errno));
@@ -153,6 +1293,11 @@ int server__non_blocking(const int sockd, struct fio_torrent_t *const torrent) {
                         // return -1;
                     }
 
+                    if (rcv >= 0 && server__greet(rcv, &conns, &conn_size)) {
+                        close(rcv);
+                        continue;
+                    }
+
                     // set socket to non-blocking
                     if (fcntl(rcv, F_SETFL, O_NONBLOCK)) {
                         log_printf(LOG_DEBUG, "cannot set the socket to non-blocking, dropping socket: %s", strerror(errno));
@@ -160,105 +1305,139 @@ int server__non_blocking(const int sockd, struct fio_torrent_t *const torrent) {
                         continue;
                     }
 
-                    log_printf(LOG_INFO, "Got a connection from %s in socket %i", inet_ntoa(client.sin_addr), rcv);
+                    conns[rcv].local = t->fd == local_sockd;
+                    log_printf(LOG_INFO, "Got a connection from %s in socket %i",
+                               conns[rcv].local ? "the Unix socket" : inet_ntoa(client.sin_addr), rcv);
+
+                    // the handshake runs as the socket gets ready, before any message
+                    if (tls != NULL && !conns[rcv].local) {
+                        if (tls_accept(tls, rcv)) {
+                            close(rcv);
+                            continue;
+                        }
+
+                        conns[rcv].handshake = 1;
+                    }
 
                     if (utils_array_pollfd_add(&p, rcv, POLLIN)) {
                         log_printf(LOG_INFO, "Could save not message from socket %i to the array", t->fd);
                     }
 
                 } else { // if not server, read data
-                         // mark to handle message
-                    t->events = POLLOUT;
-                    struct utils_message_t buffer;
-                    ssize_t read = utils_recv_all(t->fd, &buffer, RAW_MESSAGE_SIZE);
+                    struct server__conn_t *conn = &conns[t->fd];
+                    const int r = server__receive(t->fd, conn);
 
-                    if (read < 0) {
-                        log_printf(LOG_DEBUG, "Error while reading: %s", strerror(errno));
-                        errno = 0;
+                    if (r < 0) {
+                        server__remove_client(&d, &p, t->fd);
                         continue;
                     }
 
-                    if (read > 0) {
-                        log_printf(LOG_INFO, "Got %i bytes from socket %i", read, t->fd);
+                    if (r == 0) // the rest comes with the next POLLIN
+                        continue;
 
-                        // store the data to use later
+                    // mark to handle message
+                    t->events = POLLOUT;
+                    struct utils_message_t buffer;
+                    memcpy(&buffer, conn->in, RAW_MESSAGE_SIZE);
+                    const uint8_t *body = conn->in + RAW_MESSAGE_SIZE;
+                    conn->in_length = 0;
+                    conn->in_needed = RAW_MESSAGE_SIZE;
 
-                        if (utils_array_rcv_add(&d, t->fd, &buffer)) {
-                            log_printf(LOG_INFO, "Could save not message from socket %i to the array", t->fd);
-                        }
+                    if (buffer.magic_number == MAGIC_NUMBER && buffer.message_code == MSG_PEX) {
+                        t->events = POLLIN; // answered right away, nothing left to send
 
-                    } else if (read == 0) { // connection closed
+                        if (server__send_haves(t->fd, torrent, conn) ||
+                            server__exchange_peers(t->fd, &known, buffer.block_number, body))
+                            server__remove_client(&d, &p, t->fd);
 
-                        log_printf(LOG_INFO, "Connection closed on socket %i", t->fd);
+                    } else if (buffer.magic_number == MAGIC_NUMBER && buffer.message_code == MSG_FILE) {
+                        t->events = POLLIN; // answered right away, nothing left to send
 
-                        // remove dead client
-                        server__remove_client(&d, &p, t->fd);
-                    }
-                }
+                        if (server__send_file(t->fd, torrent, &file, conn))
+                            server__remove_client(&d, &p, t->fd);
 
-            } else if (t->revents & POLLOUT) { // if we can send without blocking
+                    } else if (buffer.magic_number == MAGIC_NUMBER && buffer.message_code == MSG_HAVE) {
+                        t->events = POLLIN; // the request follows
+                        server__super_seen(torrent, &super, buffer.block_number);
 
-                // mark for recieving
-                t->events = POLLIN;
+                    } else if (buffer.magic_number == MAGIC_NUMBER && buffer.message_code == MSG_METAINFO) {
+                        // the answer is sent like the blocks
+                        if (server__metainfo(t->fd, torrent, metainfo ? &tree : NULL, conn, &buffer, body))
+                            server__remove_client(&d, &p, t->fd);
 
-                struct utils_message_t *msg_rcv = utils_array_rcv_find(&d, t->fd); // find message recieved
+                    } else if (buffer.magic_number == MAGIC_NUMBER && buffer.message_code == MSG_HELLO) {
+                        // the answer is sent like the blocks
+                        if (server__hello(t->fd, torrent, &super, conn, body))
+                            server__remove_client(&d, &p, t->fd);
 
-                if (msg_rcv == NULL) {
-                    log_printf(LOG_DEBUG, "No messages recieved from %i, socket marked for POLLIN", t->fd);
-                    log_printf(LOG_DEBUG, "This shouldn't have happened");
-                    continue;
-                }
+                    } else {
+                        log_printf(LOG_INFO, "Got a request from socket %i", t->fd);
 
-                log_printf(LOG_INFO, "Recieved magic_number = %x, message_code = %u, block_number = %lu ",
-                           msg_rcv->magic_number, msg_rcv->message_code, msg_rcv->block_number);
+                        if (server__read_request(torrent, conn, &buffer, body)) {
+                            server__remove_client(&d, &p, t->fd);
+                            continue;
+                        }
 
-                if (msg_rcv->magic_number != MAGIC_NUMBER ||
-                    msg_rcv->message_code != MSG_REQUEST ||
-                    msg_rcv->block_number >= torrent->block_count) {
-                    log_printf(LOG_INFO, "Magic number, messagecode or block number wrong, dropping client!");
-                    server__remove_client(&d, &p, t->fd);
-                    continue;
+                        // store the data to use later
+
+                        if (utils_array_rcv_add(&d, t->fd, &buffer)) {
+                            log_printf(LOG_INFO, "Could save not message from socket %i to the array", t->fd);
+                        }
+                    }
                 }
 
-                if (!torrent->block_map[msg_rcv->block_number]) { // check if we have the block
-                    log_message(LOG_INFO, "Block hash incorrect hash, sending MSG_RESPONSE_NA");
-                    struct utils_message_payload_t payload;
-                    payload.message_code = MSG_RESPONSE_NA;
+            } else if (t->revents & POLLOUT) { // if we can send without blocking
+                struct server__conn_t *conn = &conns[t->fd];
+
+                if (conn->sent == conn->length && conn->file_left == 0) { // lay out what comes next
+                    const int r = server__prepare(torrent, &z, &super, conn, hold);
 
-                    if (utils_send_all(t->fd, &payload, RAW_MESSAGE_SIZE) <= 0) {
-                        log_printf(LOG_INFO, "Could not send MSG_RESPONSE_NA: %s", strerror(errno));
-                        errno = 0;
+                    if (r < 0) {
+                        server__remove_client(&d, &p, t->fd);
                         continue;
                     }
 
-                    log_printf(LOG_INFO, "Send sucess");
-                    continue;
+                    if (r > 0) {
+                        t->events = 0;
+                        retry_at = utils_now() + SERVER__HOLD_POLL / 1000.0;
+                        held++;
+                        continue;
+                    }
                 }
 
-                // contruct the payload and send it
-
-                struct fio_block_t block;
-                struct utils_message_payload_t payload;
-
-                payload.magic_number = MAGIC_NUMBER;
-                payload.message_code = MSG_RESPONSE_OK;
-                payload.block_number = msg_rcv->block_number;
-                log_printf(LOG_INFO, "Sending payload for block %lu from socked %i", payload.block_number, t->fd);
+                // with sendfile, the block after the buffer goes from the file
+                const char from_file = conn->sent == conn->length;
+                const ssize_t sent = from_file ? tls_sendfile(t->fd, file_fd, (off_t)conn->file_offset, conn->file_left)
+                                               : tls_send(t->fd, conn->buffer + conn->sent, conn->length - conn->sent);
 
-                if (fio_load_block(torrent, payload.block_number, &block)) {
-                    log_printf(LOG_INFO, "Cannot load block %i", payload.block_number);
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    errno = 0;
                     continue;
                 }
 
-                memcpy(payload.data, block.data, block.size);
-
-                if (utils_send_all(t->fd, &payload, RAW_MESSAGE_SIZE + block.size) <= 0) {
+                if (sent < 0) {
                     log_printf(LOG_INFO, "Could not send the payload: %s", strerror(errno));
                     errno = 0;
+                    server__remove_client(&d, &p, t->fd);
                     continue;
                 }
 
-                log_printf(LOG_INFO, "Send sucess");
+                if (from_file) {
+                    conn->file_offset += (uint64_t)sent;
+                    conn->file_left -= (size_t)sent;
+                } else {
+                    conn->sent += (size_t)sent;
+                }
+
+                // mark for recieving once every block requested was answered
+                if (conn->sent == conn->length && conn->file_left == 0 && conn->next == conn->count) {
+                    log_printf(LOG_INFO, "Answered socket %i", t->fd);
+
+                    if (conn->capabilities & CAP_DEFLATE && z.plain > 0)
+                        log_printf(LOG_INFO, "Compression: %lu bytes sent as %lu (ratio %.2f), %lu blocks raw, %.3f s compressing, %lu bytes kept",
+                                   z.plain, z.sent, (double)z.plain / (double)z.sent, z.raw_count, z.time, z.cached);
+                    t->events = POLLIN;
+                }
                 continue;
 
             } // POLLOUT
@@ -271,6 +1450,26 @@ int server__non_blocking(const int sockd, struct fio_torrent_t *const torrent) {
 
     utils_array_pollfd_destroy(&p);
     utils_array_rcv_destroy(&d);
+    for (size_t i = 0; i < conn_size; i++) {
+        free(conns[i].buffer);
+    }
+    free(conns);
+
+    for (uint64_t k = 0; z.data != NULL && k < torrent->block_count; k++) {
+        free(z.data[k]);
+    }
+    free(z.data);
+    free(z.size);
+    free(z.raw);
+    free(z.scratch);
+    free(super.offered);
+    free(super.seen);
+
+    if (file >= 0)
+        close(file);
+
+    if (metainfo)
+        metainfo_tree_destroy(&tree);
 
     return 0;
 }
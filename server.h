@@ -1,9 +1,58 @@
 #ifndef SERVER_H
 #define SERVER_H
 #include "file_io.h"
+#include "tls.h"
 #include "utils.h"
+#include <pthread.h>
 #include <stdint.h>
 
+/**
+ * In a relay, how long a request for a block that is still being downloaded is kept before answering
+ * MSG_RESPONSE_NA, in seconds. It must stay below PEER_MIN_TIMEOUT, or the requester gives up first.
+ */
+#define SERVER_RELAY_HOLD 0.5
+
+/**
+ * How often held requests are looked at again, in milliseconds
+ */
+#define SERVER__HOLD_POLL 2
+
+/**
+ * Peer exchange: number of peers the server remembers, and how long it tells others about a peer after a client
+ * mentioned it, in seconds
+ */
+#define SERVER__PEX_PEERS 256
+#define SERVER__PEX_TTL 60.0
+
+/**
+ * Most MSG_HAVE sent in one go
+ */
+#define SERVER__HAVE_BATCH 64
+
+/**
+ * CAP_* offered to the clients in the handshake, CAP_FILE only to those connected over the Unix socket
+ */
+#define SERVER__CAPABILITIES (CAP_RANGE | CAP_AVAILABILITY | CAP_PEX | CAP_DEFLATE | CAP_CLIENT_HAVE | CAP_FILE)
+
+/**
+ * Super-seeding: number of blocks offered to each client at a time, and seconds after which an offer the
+ * client did not request is replaced
+ */
+#define SERVER__SUPER_OFFERS 4
+#define SERVER__SUPER_WAIT 2.0
+
+/**
+ * With CAP_DEFLATE, a block is only sent compressed if that takes at most this fraction of its size, and at
+ * most SERVER__DEFLATE_CACHE bytes of compressed blocks are kept to be sent again
+ */
+#define SERVER__DEFLATE_RATIO 0.9
+#define SERVER__DEFLATE_CACHE (256 * 1024 * 1024)
+
+/**
+ * Most blocks read from the file in one go for a client
+ */
+#define SERVER__SEND_BLOCKS 16
+
 /**
  * Create a socket and bind it to INADDR_ANY:port 
  * @param port A number between 2^16 and 1
@@ -11,13 +60,27 @@
  */
 int server__init_socket(const uint16_t port);
 
+/**
+ * Create a Unix socket bound to a path, replacing a socket left there by a previous server
+ * @param path where the socket is created
+ * @return socket descriptor or -1 on error
+ */
+int server__init_unix_socket(const char *path);
+
 /**
  * Manage a non-blocking socket, must be used after calling server__init_socket
  * @param sockd A descriptor to a non blocking socket 
+ * @param local_sockd socket from server__init_unix_socket, whose clients may be given the file (CAP_FILE), or -1
+ * @param tls if not NULL, settings from tls_init_server: the clients of sockd speak TLS
  * @param t pointer to struct created with utils_create_torrent_struct
+ * @param hold seconds a request for a missing block may wait for the block to be stored by a client
+ * running on the same torrent, 0 to answer MSG_RESPONSE_NA right away
+ * @param super_seed offer each block to a few of the clients that serve the torrent (CAP_CLIENT_HAVE) until
+ * they spread it, instead of everything to everybody, for as long as no full copy was announced
  * @return 0 if no error or -1 if error 
  */
-int server__non_blocking(const int sockd, struct fio_torrent_t *const t);
+int server__non_blocking(const int sockd, const int local_sockd, const struct tls_t *tls, struct fio_torrent_t *const t,
+                         const double hold, const char super_seed);
 
 /**
  * Manage a blocking socket, must be used after calling server__init_socket
@@ -49,9 +112,26 @@ void server__remove_client(struct utils_array_rcv_data_t *d, struct utils_array_
 /**
  * Main function
  * @param port the port to listen to 
+ * @param unix_path if not NULL, also listen on a Unix socket there, for the clients on this host
+ * @param tls if not NULL, settings from tls_init_server: encrypt the connections to port
  * @return 0 if everything went correctly or -1 if error
  * @param ttorrent Pointer to the struct created with utils_create_torrent_struct
+ * @param super_seed initial seeder of the torrent, see server__non_blocking
+ */
+int server_init(uint16_t const port, const char *unix_path, const struct tls_t *tls, struct fio_torrent_t *torrent,
+                const char super_seed);
+
+/**
+ * Serve a torrent from a new thread while a client downloads it (relay mode): every block is served
+ * as soon as the client has verified and stored it.
+ * @param port the port to listen to
+ * @param unix_path if not NULL, also listen on a Unix socket there, for the clients on this host
+ * @param tls if not NULL, settings from tls_init_server: encrypt the connections to port
+ * @param torrent Pointer to the struct created with utils_create_torrent_struct, shared with the client
+ * @param thread where the id of the thread is stored
+ * @return 0 if the server is listening or -1 if error
  */
-int server_init(uint16_t const port, struct fio_torrent_t *torrent);
+int server_start_relay(uint16_t const port, const char *unix_path, const struct tls_t *tls, struct fio_torrent_t *torrent,
+                       pthread_t *thread);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,214 @@
+/**
+ * This file implements the session specified in session.h.
+ */
+#include "session.h"
+#include "logger.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int session_init(struct session_t *s) {
+    assert(s != NULL);
+
+    memset(s, 0, sizeof(struct session_t));
+
+    if (pthread_mutex_init(&s->lock, NULL)) {
+        log_message(LOG_DEBUG, "pthread_mutex_init failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int session_add(struct session_t *s, const char *metainfo, int priority) {
+    assert(s != NULL);
+    assert(metainfo != NULL);
+
+    if (s->count == s->allocated) {
+        const size_t allocated = s->allocated ? s->allocated * 2 : 8;
+        struct session__entry_t *entries = realloc(s->entries, sizeof(struct session__entry_t) * allocated);
+
+        if (entries == NULL) {
+            log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+            return -1;
+        }
+
+        s->entries = entries;
+        s->allocated = allocated;
+    }
+
+    struct session__entry_t *e = &s->entries[s->count];
+    e->metainfo = strdup(metainfo);
+
+    if (e->metainfo == NULL) {
+        log_printf(LOG_DEBUG, "Strdup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    e->priority = priority;
+    e->order = s->count;
+    e->done = 0;
+    s->count++;
+
+    return 0;
+}
+
+int session_read_list(struct session_t *s, const char *path) {
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        log_printf(LOG_INFO, "Cannot open list %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char line[1024];
+    char metainfo[1024];
+    int ret = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        int priority = 0;
+        const int fields = sscanf(line, "%1023s %d", metainfo, &priority);
+
+        if (fields < 1 || metainfo[0] == '#')
+            continue;
+
+        if (session_add(s, metainfo, priority)) {
+            ret = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Highest priority first, then in the order of session_add
+ */
+static int session__compare(const void *a, const void *b) {
+    const struct session__entry_t *x = a;
+    const struct session__entry_t *y = b;
+
+    if (x->priority != y->priority)
+        return x->priority > y->priority ? -1 : 1;
+
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Worker thread: download the torrents one after the other, in priority order
+ */
+static void *session__worker(void *arg) {
+    struct session_t *s = arg;
+
+    while (1) {
+        pthread_mutex_lock(&s->lock);
+        struct session__entry_t *e = s->next < s->count ? &s->entries[s->next++] : NULL;
+        pthread_mutex_unlock(&s->lock);
+
+        if (e == NULL)
+            return NULL;
+
+        log_printf(LOG_INFO, "Starting download of %s (priority %d)", e->metainfo, e->priority);
+
+        struct fio_torrent_t t = {0};
+
+        if (utils_create_torrent_struct(e->metainfo, &t, s->config.background_check)) {
+            log_printf(LOG_INFO, "Skipping %s", e->metainfo);
+            continue;
+        }
+
+        if (client_init(&t, &s->config)) {
+            log_printf(LOG_INFO, "Something went wrong with the download of %s", e->metainfo);
+        }
+
+        e->done = client__is_completed(&t);
+
+        log_printf(LOG_INFO, "Download of %s %s", e->metainfo, e->done ? "complete" : "incomplete");
+
+        if (fio_destroy_torrent(&t)) {
+            log_printf(LOG_DEBUG, "Error while destroying the torrent struct: %s", strerror(errno));
+            errno = 0;
+        }
+    }
+}
+
+int session_run(struct session_t *s, const struct client_config_t *config, size_t active, size_t connections) {
+    assert(s != NULL);
+    assert(config != NULL);
+    assert(active > 0);
+    assert(connections > 0);
+
+    if (connections > SEM_VALUE_MAX)
+        connections = SEM_VALUE_MAX;
+
+    if (active > s->count)
+        active = s->count;
+
+    if (sem_init(&s->connections, 0, (unsigned int)connections)) {
+        log_printf(LOG_DEBUG, "sem_init failed: %s", strerror(errno));
+        return -1;
+    }
+
+    qsort(s->entries, s->count, sizeof(struct session__entry_t), session__compare);
+
+    ratelimit_init(&s->limit, config->rate);
+    s->config = *config;
+    s->config.shared_limit = &s->limit;
+    s->config.connections = &s->connections;
+    s->next = 0;
+
+    log_printf(LOG_INFO, "Downloading %lu files, %lu at a time, with at most %lu connections",
+               s->count, active, connections);
+
+    const double start = utils_now();
+    pthread_t *workers = malloc(sizeof(pthread_t) * active);
+    size_t started = 0;
+
+    if (workers == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+    } else {
+        for (; started < active; started++) {
+            if (pthread_create(&workers[started], NULL, session__worker, s)) {
+                log_message(LOG_DEBUG, "pthread_create failed");
+                break;
+            }
+        }
+    }
+
+    // with no worker at all, download here
+    if (started == 0)
+        session__worker(s);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+    sem_destroy(&s->connections);
+    ratelimit_destroy(&s->limit);
+
+    size_t done = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        done += (size_t)s->entries[i].done;
+    }
+
+    log_printf(LOG_INFO, "%lu of %lu files complete in %.3f s", done, s->count, utils_now() - start);
+
+    return done == s->count ? 0 : -1;
+}
+
+void session_destroy(struct session_t *s) {
+    for (size_t i = 0; i < s->count; i++) {
+        free(s->entries[i].metainfo);
+    }
+
+    free(s->entries);
+    pthread_mutex_destroy(&s->lock);
+    s->entries = NULL;
+    s->count = 0;
+}
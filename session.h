@@ -0,0 +1,96 @@
+/**
+ * Several downloads in one process.
+ *
+ * The torrents are taken by priority (highest first, then in the order they were added) by a fixed
+ * number of worker threads, each running client_init on one torrent at a time. The number of workers
+ * bounds how many files are hashed and written at once. All the downloads share one global rate limit
+ * and one budget of open connections.
+ *
+ * Connections cannot be shared between torrents: a request only carries a block number, so a server
+ * port serves a single file, and two torrents never have a peer in common.
+ *
+ * Usage:
+ *
+ *   struct session_t s;
+ *   session_init(&s);
+ *   session_add(&s, "a.ttorrent", 0);
+ *   session_read_list(&s, "list.txt");
+ *   session_run(&s, &config, 4, 64);
+ *   session_destroy(&s);
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include "client.h"
+#include "ratelimit.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+
+/**
+ * Default number of downloads running at the same time, and of open connections for all of them
+ */
+#define SESSION_DEFAULT_ACTIVE 4
+#define SESSION_DEFAULT_CONNECTIONS 64
+
+struct session__entry_t {
+    char *metainfo; // path of the .ttorrent file, owned by the session
+    int priority;   // higher first
+    size_t order;   // position in which it was added, to keep the sort stable
+    char done;      // the file was complete when its download finished
+};
+
+struct session_t {
+    struct session__entry_t *entries;
+    size_t count;
+    size_t allocated;
+    size_t next; // next entry for a worker, under lock
+    pthread_mutex_t lock;
+    struct client_config_t config; // settings of every download, with the shared limits
+    struct ratelimit_t limit;      // global download limit
+    sem_t connections;             // open connections left
+};
+
+/**
+ * Initialize an empty session
+ * @param s the session
+ * @return 0 on success or -1 on error
+ */
+int session_init(struct session_t *s);
+
+/**
+ * Add a torrent
+ * @param s the session
+ * @param metainfo path of the .ttorrent file
+ * @param priority torrents with a higher priority are downloaded first
+ * @return 0 on success or -1 on error
+ */
+int session_add(struct session_t *s, const char *metainfo, int priority);
+
+/**
+ * Add the torrents listed in a file, one per line: the path of the .ttorrent file, optionally followed
+ * by a priority (0 by default). Empty lines and lines starting with '#' are ignored.
+ * @param s the session
+ * @param path the list
+ * @return 0 on success or -1 on error
+ */
+int session_read_list(struct session_t *s, const char *path);
+
+/**
+ * Download every torrent and wait for them
+ * @param s the session
+ * @param config settings of each download; config->rate becomes the limit for all of them together
+ * @param active number of downloads running at the same time
+ * @param connections number of connections open at the same time, for all the downloads
+ * @return 0 if every file is complete or -1 otherwise
+ */
+int session_run(struct session_t *s, const struct client_config_t *config, size_t active, size_t connections);
+
+/**
+ * Free the session
+ * @param s the session
+ */
+void session_destroy(struct session_t *s);
+
+#endif // SESSION_H_
@@ -0,0 +1,55 @@
+#!/bin/sh
+# The client must agree on MSG_HELLO with a server that knows it, and still download from a legacy server that
+# resets the connection on MSG_HELLO: it takes it for one after CLIENT__LEGACY_CLOSES (2) closes in a row and
+# speaks version 0 with it. Runs on loopback, from the root of the repository, after make.
+set -e
+
+BIN=$(pwd)/bin/ttorrent
+PORT=${PORT:-9351}
+DIR=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+fail() {
+    echo "FAIL: $1" >&2
+    tail -n 20 "$2" >&2
+    exit 1
+}
+
+# download f from the peer on the port given, into $DIR/$1
+download() {
+    name=$1
+    mkdir "$DIR/$name"
+    sed -e '/^#Peers/q' -e '/^#Peer count/{n;s/.*/1/}' "$DIR/srv/f.ttorrent" > "$DIR/$name/f.ttorrent"
+    echo "127.0.0.1:$2" >> "$DIR/$name/f.ttorrent"
+    (cd "$DIR/$name" && "$BIN" -t 30 f.ttorrent > "$DIR/$name.log" 2>&1) || fail "the client of the $name server failed" "$DIR/$name.log"
+    cmp -s "$DIR/srv/f" "$DIR/$name/f" || fail "the file from the $name server differs" "$DIR/$name.log"
+}
+
+mkdir "$DIR/srv"
+head -c 1500000 /dev/urandom > "$DIR/srv/f"
+(cd "$DIR/srv" && "$BIN" -c f > /dev/null 2>&1)
+
+(cd "$DIR/srv" && exec "$BIN" -l "$PORT" f.ttorrent > "$DIR/server.log" 2>&1) &
+PIDS="$PIDS $!"
+python3 test/stall_server.py legacy $((PORT + 1)) "$DIR/srv/f" > "$DIR/stub.log" 2>&1 &
+PIDS="$PIDS $!"
+sleep 1
+
+download new "$PORT"
+grep -q "Peer speaks version" "$DIR/new.log" || fail "no handshake with the new server" "$DIR/new.log"
+! grep -q "closed the connection on MSG_HELLO" "$DIR/new.log" || fail "the new server was taken for a legacy one" "$DIR/new.log"
+
+download legacy $((PORT + 1))
+grep -q "connecting again with it" "$DIR/legacy.log" || fail "the first close was taken as definitive" "$DIR/legacy.log"
+grep -q "connecting again without a handshake" "$DIR/legacy.log" || fail "the legacy server was not recognized" "$DIR/legacy.log"
+[ "$(grep -c "dropping the client on message 11" "$DIR/stub.log")" -eq 2 ] || fail "MSG_HELLO was not sent twice" "$DIR/stub.log"
+! grep -q "Peer speaks version" "$DIR/legacy.log" || fail "a handshake with the legacy server" "$DIR/legacy.log"
+
+echo "PASS: downloaded with and without the handshake"
@@ -0,0 +1,58 @@
+#!/bin/sh
+# A server sends the file to a multicast group on loopback, to two receivers, one of them behind a lossy network
+# (-D): both must end with the file, what they missed being repaired by the sender or fetched over TCP, and the
+# sender must report what it sent against the size of the file. Runs from the root of the repository, after make.
+set -e
+
+BIN=$(pwd)/bin/ttorrent
+PORT=${PORT:-9361}
+GROUP=${GROUP:-239.255.42.1:$((PORT + 1)),127.0.0.1}
+DIR=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+fail() {
+    echo "FAIL: $1" >&2
+    tail -n 20 "$2" >&2
+    exit 1
+}
+
+mkdir "$DIR/srv" "$DIR/clean" "$DIR/lossy"
+head -c 3000000 /dev/urandom > "$DIR/srv/f"
+(cd "$DIR/srv" && "$BIN" -c f > /dev/null 2>&1)
+
+sed -i -e '/^#Peers/q' -e '/^#Peer count/{n;s/.*/1/}' "$DIR/srv/f.ttorrent"
+echo "127.0.0.1:$PORT" >> "$DIR/srv/f.ttorrent"
+cp "$DIR/srv/f.ttorrent" "$DIR/clean/"
+cp "$DIR/srv/f.ttorrent" "$DIR/lossy/"
+
+(cd "$DIR/srv" && exec "$BIN" -l "$PORT" -G "$GROUP" -r 20M f.ttorrent > "$DIR/server.log" 2>&1) &
+PIDS="$PIDS $!"
+sleep 1
+
+(cd "$DIR/clean" && exec "$BIN" -t 60 -G "$GROUP" f.ttorrent > "$DIR/clean.log" 2>&1) &
+CLEAN=$!
+(cd "$DIR/lossy" && exec "$BIN" -t 60 -G "$GROUP" -D 0.01,0.001 f.ttorrent > "$DIR/lossy.log" 2>&1) &
+LOSSY=$!
+PIDS="$PIDS $CLEAN $LOSSY"
+
+wait $CLEAN || fail "the receiver without loss failed" "$DIR/clean.log"
+wait $LOSSY || fail "the receiver with loss failed" "$DIR/lossy.log"
+
+for name in clean lossy; do
+    cmp -s "$DIR/srv/f" "$DIR/$name/f" || fail "the file of the $name receiver differs" "$DIR/$name.log"
+    grep -q "Joined multicast group" "$DIR/$name.log" || fail "the $name receiver did not join the group" "$DIR/$name.log"
+    grep -q "Left multicast group, .*: [1-9][0-9]* blocks received" "$DIR/$name.log" ||
+        fail "the $name receiver got nothing from the group" "$DIR/$name.log"
+done
+
+sleep 1 # the summary follows the MSG_MCAST_DONE of the last receiver
+grep -q "times the file" "$DIR/server.log" || fail "no summary from the sender" "$DIR/server.log"
+
+echo "PASS: multicast to two receivers, $(grep "times the file" "$DIR/server.log" | tail -n 1 | sed 's/.*Multicast: //')"
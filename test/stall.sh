@@ -0,0 +1,54 @@
+#!/bin/sh
+# A seeder that stalls in the middle of a block, and one that drops the SYNs, must not hold the download:
+# the block is requested again from the peer that works, and the download completes long before the
+# kernel would give up on the SYNs. Runs on loopback, from the root of the repository, after make.
+set -e
+
+BIN=$(pwd)/bin/ttorrent
+PORT=${PORT:-9301}
+DIR=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+fail() {
+    echo "FAIL: $1"
+    tail -n 20 "$DIR/client.log"
+    exit 1
+}
+
+mkdir "$DIR/srv" "$DIR/cli"
+head -c 1500000 /dev/urandom > "$DIR/srv/f"
+(cd "$DIR/srv" && "$BIN" -c f > /dev/null 2>&1)
+
+# the peers are the stalling one, the blackholed one and a working seeder, in that order
+sed -i -e '/^#Peers/q' -e '/^#Peer count/{n;s/.*/3/}' "$DIR/srv/f.ttorrent"
+printf '127.0.0.1:%d\n127.0.0.1:%d\n127.0.0.1:%d\n' "$PORT" $((PORT + 1)) $((PORT + 2)) >> "$DIR/srv/f.ttorrent"
+cp "$DIR/srv/f.ttorrent" "$DIR/cli/"
+
+python3 test/stall_server.py stall "$PORT" > "$DIR/stall.log" 2>&1 &
+PIDS="$PIDS $!"
+python3 test/stall_server.py blackhole $((PORT + 1)) > "$DIR/blackhole.log" 2>&1 &
+PIDS="$PIDS $!"
+(cd "$DIR/srv" && exec "$BIN" -l $((PORT + 2)) f.ttorrent > "$DIR/server.log" 2>&1) &
+PIDS="$PIDS $!"
+sleep 1
+
+START=$(date +%s)
+(cd "$DIR/cli" && "$BIN" -t 60 f.ttorrent > "$DIR/client.log" 2>&1) || fail "the client failed"
+ELAPSED=$(($(date +%s) - START))
+
+cmp -s "$DIR/srv/f" "$DIR/cli/f" || fail "the downloaded file differs"
+grep -q "stall: block .* requested" "$DIR/stall.log" || fail "the stalling peer was not asked for a block"
+grep -q "Peer stalled after 32768 of" "$DIR/client.log" || fail "the stall was not detected"
+grep -q "Connection failed for peer 127.0.0.1 $((PORT + 1)): Connection timed out" "$DIR/client.log" ||
+    fail "the connection to the blackholed peer did not time out"
+grep -q "Peer 2: .* 1500000 bytes" "$DIR/client.log" || fail "the working peer did not send the whole file"
+[ "$ELAPSED" -lt 30 ] || fail "the download took $ELAPSED s"
+
+echo "PASS: stalled and blackholed peers, downloaded in $ELAPSED s"
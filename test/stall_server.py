@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Stub peers for test/stall.sh and test/handshake.sh, on loopback:
+  stall_server.py stall PORT          answers MSG_REQUEST with MSG_RESPONSE_OK and half the block, then nothing
+  stall_server.py blackhole PORT      never accepts, and its full backlog makes the kernel drop the SYNs
+  stall_server.py legacy PORT FILE    serves the blocks of FILE, and drops the client on any other message
+They speak version 0: they close the connection on MSG_HELLO, as a legacy server does, with a reset since
+the rest of MSG_HELLO is left unread.
+"""
+import socket
+import struct
+import sys
+import threading
+import time
+
+MAGIC_NUMBER = 0xde1c3230
+MSG_REQUEST, MSG_RESPONSE_OK, MSG_RESPONSE_NA, MSG_PEX, MSG_HELLO = 0, 1, 2, 6, 11
+HEADER = struct.Struct("<IBQ")  # utils_message_t, packed, host byte order
+HELLO_SIZE = 12                 # utils_hello_t
+PEER_SIZE = 6                   # tracker_peer_t
+BLOCK_SIZE = 65536              # FIO_MAX_BLOCK_SIZE
+
+
+def recv_exactly(conn, length):
+    data = b""
+    while len(data) < length:
+        chunk = conn.recv(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def serve(conn):
+    with conn:
+        while True:
+            raw = recv_exactly(conn, HEADER.size)
+            if raw is None:
+                return
+            magic, code, number = HEADER.unpack(raw)
+            if magic != MAGIC_NUMBER or code == MSG_HELLO:
+                return
+            if code == MSG_PEX:
+                recv_exactly(conn, number * PEER_SIZE)
+                conn.sendall(HEADER.pack(MAGIC_NUMBER, MSG_PEX, 0))
+            elif code == MSG_REQUEST:
+                print("stall: block %d requested, sending half of it" % number, flush=True)
+                conn.sendall(HEADER.pack(MAGIC_NUMBER, MSG_RESPONSE_OK, number) + bytes(BLOCK_SIZE // 2))
+                while conn.recv(4096):  # hold the connection until the client drops it
+                    pass
+                return
+
+
+def serve_legacy(conn, path):
+    with conn, open(path, "rb") as f:
+        while True:
+            raw = recv_exactly(conn, HEADER.size)
+            if raw is None:
+                return
+            magic, code, number = HEADER.unpack(raw)
+            if magic != MAGIC_NUMBER or code != MSG_REQUEST:
+                print("legacy: dropping the client on message %d" % code, flush=True)
+                return
+            f.seek(number * BLOCK_SIZE)
+            block = f.read(BLOCK_SIZE)
+            if block:
+                conn.sendall(HEADER.pack(MAGIC_NUMBER, MSG_RESPONSE_OK, number) + block)
+            else:
+                conn.sendall(HEADER.pack(MAGIC_NUMBER, MSG_RESPONSE_NA, number))
+
+
+def main():
+    mode, port = sys.argv[1], int(sys.argv[2])
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("127.0.0.1", port))
+
+    if mode == "blackhole":
+        listener.listen(0)
+        fillers = []
+        for _ in range(2):  # the accept queue holds backlog + 1 connections
+            f = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            f.settimeout(1)
+            try:
+                f.connect(("127.0.0.1", port))
+            except OSError:
+                pass
+            fillers.append(f)
+        print("blackhole: listening on %d without accepting" % port, flush=True)
+        while True:
+            time.sleep(3600)
+
+    listener.listen(16)
+    print("%s: listening on %d" % (mode, port), flush=True)
+    while True:
+        conn, _ = listener.accept()
+        if mode == "legacy":
+            threading.Thread(target=serve_legacy, args=(conn, sys.argv[3]), daemon=True).start()
+        else:
+            threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+#!/bin/sh
+# With -U, peers that are down must cost no more than over TCP: the metainfo file lists 19 dead peers and
+# one live seeder, and the download over UDP, through a simulated network (-D), must not be slower than
+# the one over TCP. Runs on loopback, from the root of the repository, after make.
+set -e
+
+BIN=$(pwd)/bin/ttorrent
+PORT=${PORT:-9321}
+LIVE=$((PORT + 19))
+DIR=$(mktemp -d)
+PIDS=
+
+cleanup() {
+    for pid in $PIDS; do kill "$pid" 2>/dev/null || true; done
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+fail() {
+    echo "FAIL: $1" >&2
+    tail -n 20 "$2" >&2
+    exit 1
+}
+
+# milliseconds since the epoch
+now() {
+    python3 -c 'import time; print(int(time.time() * 1000))'
+}
+
+mkdir "$DIR/srv"
+head -c 3000000 /dev/urandom > "$DIR/srv/f"
+(cd "$DIR/srv" && "$BIN" -c f > /dev/null 2>&1)
+
+sed -i -e '/^#Peers/q' -e '/^#Peer count/{n;s/.*/20/}' "$DIR/srv/f.ttorrent"
+i=0
+while [ $i -lt 20 ]; do
+    echo "127.0.0.1:$((PORT + i))" >> "$DIR/srv/f.ttorrent"
+    i=$((i + 1))
+done
+
+(cd "$DIR/srv" && exec "$BIN" -l $LIVE -U f.ttorrent > "$DIR/server.log" 2>&1) &
+PIDS="$PIDS $!"
+sleep 1
+
+# download: name, then the options
+download() {
+    name=$1
+    shift
+    mkdir "$DIR/$name"
+    cp "$DIR/srv/f.ttorrent" "$DIR/$name/"
+    start=$(now)
+    (cd "$DIR/$name" && "$BIN" -t 60 "$@" f.ttorrent > "$DIR/$name.log" 2>&1) ||
+        fail "the $name client failed" "$DIR/$name.log"
+    cmp -s "$DIR/srv/f" "$DIR/$name/f" || fail "the $name download differs" "$DIR/$name.log"
+    echo $(($(now) - start))
+}
+
+TCP=$(download tcp)
+UDP=$(download udp -U -D 0.01,0.001)
+
+grep -q "UDP: .* received" "$DIR/udp.log" || fail "nothing was received over UDP" "$DIR/udp.log"
+# a little slack for the scheduling noise of loopback
+[ "$UDP" -le $((TCP + 500)) ] || fail "over UDP in $UDP ms, over TCP in $TCP ms" "$DIR/udp.log"
+
+echo "PASS: 19 dead peers, over TCP in $TCP ms, over UDP in $UDP ms"
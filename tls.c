@@ -0,0 +1,358 @@
+/**
+ * This file implements the encrypted connections specified in tls.h.
+ */
+#include "tls.h"
+#include "logger.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/**
+ * Registered connections, indexed by socket. The count is read without the lock, so that plain sockets do
+ * not take it while nothing is registered.
+ */
+static pthread_mutex_t tls__lock = PTHREAD_MUTEX_INITIALIZER;
+static SSL **tls__ssl = NULL;
+static size_t tls__size = 0;
+static size_t tls__count = 0;
+
+/**
+ * Log what OpenSSL failed at, and clear its error queue
+ */
+static void tls__log(const char *what) {
+    const unsigned long e = ERR_get_error();
+    char reason[256];
+
+    ERR_error_string_n(e, reason, sizeof(reason));
+    log_printf(LOG_INFO, "%s: %s", what, e != 0 ? reason : errno != 0 ? strerror(errno) : "connection closed");
+    ERR_clear_error();
+    errno = 0;
+}
+
+/**
+ * Settings common to both sides
+ */
+static int tls__init(struct tls_t *tls, const SSL_METHOD *method) {
+    tls->ctx = SSL_CTX_new(method);
+
+    if (tls->ctx == NULL) {
+        tls__log("Cannot create the TLS context");
+        return -1;
+    }
+
+    // the kernel takes over the record layer after the handshake when it can
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS);
+
+    // peers close the connections without close_notify when they are done, as they did in the clear
+    SSL_CTX_set_options(tls->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+
+    // non-blocking sockets send what they can, from a buffer that moves as it is sent
+    SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // OpenSSL and sendfile write to the sockets without MSG_NOSIGNAL: a peer that went away is reported by them
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+int tls_init_server(struct tls_t *tls, const char *cert, const char *key) {
+    if (tls__init(tls, TLS_server_method()))
+        return -1;
+
+    if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls->ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls->ctx) != 1) {
+        tls__log("Cannot load the certificate");
+        tls_destroy(tls);
+        return -1;
+    }
+
+    SSL_CTX_set_num_tickets(tls->ctx, 0);
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+    return 0;
+}
+
+int tls_init_client(struct tls_t *tls, const char *ca) {
+    if (tls__init(tls, TLS_client_method()))
+        return -1;
+
+    if (SSL_CTX_load_verify_locations(tls->ctx, ca, NULL) != 1) {
+        tls__log("Cannot load the certificate authorities");
+        tls_destroy(tls);
+        return -1;
+    }
+
+    SSL_CTX_set_verify(tls->ctx, SSL_VERIFY_PEER, NULL);
+    return 0;
+}
+
+void tls_destroy(struct tls_t *tls) {
+    SSL_CTX_free(tls->ctx);
+    tls->ctx = NULL;
+}
+
+/**
+ * The connection registered for a socket, NULL if none
+ */
+static SSL *tls__get(int sock) {
+    if (__atomic_load_n(&tls__count, __ATOMIC_ACQUIRE) == 0 || sock < 0)
+        return NULL;
+
+    pthread_mutex_lock(&tls__lock);
+    SSL *ssl = (size_t)sock < tls__size ? tls__ssl[sock] : NULL;
+    pthread_mutex_unlock(&tls__lock);
+    return ssl;
+}
+
+/**
+ * Create and register the connection of a socket
+ * @return the connection or NULL on error
+ */
+static SSL *tls__register(const struct tls_t *tls, int sock) {
+    SSL *ssl = SSL_new(tls->ctx);
+
+    if (ssl == NULL || SSL_set_fd(ssl, sock) != 1) {
+        tls__log("Cannot create the TLS connection");
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tls__lock);
+
+    if ((size_t)sock >= tls__size) {
+        const size_t size = (size_t)sock * 2 + 1;
+        SSL **grown = realloc(tls__ssl, sizeof(SSL *) * size);
+
+        if (grown == NULL) {
+            pthread_mutex_unlock(&tls__lock);
+            log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+            errno = 0;
+            SSL_free(ssl);
+            return NULL;
+        }
+
+        memset(grown + tls__size, 0, sizeof(SSL *) * (size - tls__size));
+        tls__ssl = grown;
+        tls__size = size;
+    }
+
+    if (tls__ssl[sock] == NULL)
+        __atomic_add_fetch(&tls__count, 1, __ATOMIC_RELEASE);
+
+    SSL_free(tls__ssl[sock]); // left by a socket closed without tls_close
+    tls__ssl[sock] = ssl;
+    pthread_mutex_unlock(&tls__lock);
+    return ssl;
+}
+
+void tls_close(int sock) {
+    if (__atomic_load_n(&tls__count, __ATOMIC_ACQUIRE) == 0 || sock < 0)
+        return;
+
+    pthread_mutex_lock(&tls__lock);
+    SSL *ssl = (size_t)sock < tls__size ? tls__ssl[sock] : NULL;
+
+    if (ssl != NULL) {
+        tls__ssl[sock] = NULL;
+        __atomic_sub_fetch(&tls__count, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&tls__lock);
+    SSL_free(ssl);
+}
+
+int tls_accept(const struct tls_t *tls, int sock) {
+    SSL *ssl = tls__register(tls, sock);
+
+    if (ssl == NULL)
+        return -1;
+
+    SSL_set_accept_state(ssl);
+    return 0;
+}
+
+int tls_handshake(int sock) {
+    SSL *ssl = tls__get(sock);
+
+    if (ssl == NULL)
+        return -1;
+
+    const int r = SSL_do_handshake(ssl);
+
+    if (r != 1) {
+        switch (SSL_get_error(ssl, r)) {
+        case SSL_ERROR_WANT_READ:
+            return POLLIN;
+        case SSL_ERROR_WANT_WRITE:
+            return POLLOUT;
+        default:
+            if (SSL_get_verify_result(ssl) != X509_V_OK) // tell a wrong peer from a broken connection
+                log_printf(LOG_INFO, "Certificate of the peer on socket %i rejected: %s", sock,
+                           X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+            tls__log("TLS handshake failed");
+            return -1;
+        }
+    }
+
+    log_printf(LOG_INFO, "%s with %s on socket %i, kTLS send %s, receive %s", SSL_get_version(ssl),
+               SSL_get_cipher_name(ssl), sock, BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off",
+               BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+    return 0;
+}
+
+/**
+ * Make the handshake fail unless the certificate of the server names the peer: an address literal must be
+ * in an iPAddress subjectAltName, a name in a dNSName one (or the common name, without subjectAltName)
+ * @return 0 on success or -1 on error
+ */
+static int tls__expect(SSL *ssl, const char *host) {
+    unsigned char address[sizeof(struct in6_addr)];
+    const char literal = inet_pton(AF_INET, host, address) == 1 || inet_pton(AF_INET6, host, address) == 1;
+
+    if (literal ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) != 1 : SSL_set1_host(ssl, host) != 1) {
+        tls__log("Cannot set the name expected from the peer");
+        return -1;
+    }
+
+    return 0;
+}
+
+int tls_connect(const struct tls_t *tls, int sock, const char *host, double deadline) {
+    const int flags = fcntl(sock, F_GETFL);
+
+    // non-blocking while the handshake runs, so that the deadline holds
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+        log_printf(LOG_DEBUG, "fcntl failed: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    SSL *ssl = tls__register(tls, sock);
+    int r = ssl == NULL || tls__expect(ssl, host) ? -1 : POLLOUT;
+
+    if (r > 0)
+        SSL_set_connect_state(ssl);
+
+    while (r > 0) {
+        r = tls_handshake(sock);
+
+        if (r > 0 && utils_poll_deadline(sock, (short)r, deadline)) {
+            log_message(LOG_INFO, "TLS handshake timed out");
+            errno = 0;
+            r = -1;
+        }
+    }
+
+    // a blocking read stuck in the middle of a record gives control back, see TLS__RECV_SLICE
+    const struct timeval slice = {0, (suseconds_t)(TLS__RECV_SLICE * 1e6)};
+
+    if (fcntl(sock, F_SETFL, flags) ||
+        (!(flags & O_NONBLOCK) && setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &slice, sizeof(slice)))) {
+        log_printf(LOG_DEBUG, "Cannot restore the socket: %s", strerror(errno));
+        errno = 0;
+        r = -1;
+    }
+
+    if (r)
+        tls_close(sock);
+
+    return r;
+}
+
+/**
+ * Map the result of SSL_read_ex, SSL_write_ex or SSL_sendfile to the one of recv or send
+ */
+static ssize_t tls__result(SSL *ssl, int r, size_t done) {
+    if (r > 0)
+        return (ssize_t)done;
+
+    switch (SSL_get_error(ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        ERR_clear_error();
+        if (errno == 0) // closed without close_notify
+            return 0;
+        return -1;
+    default:
+        tls__log("TLS failed");
+        errno = EIO;
+        return -1;
+    }
+}
+
+ssize_t tls_send(int sock, const void *buffer, size_t length) {
+    SSL *ssl = tls__get(sock);
+
+    if (ssl == NULL)
+        return send(sock, buffer, length, MSG_NOSIGNAL);
+
+    size_t written = 0;
+    errno = 0;
+    const int r = SSL_write_ex(ssl, buffer, length, &written);
+    return tls__result(ssl, r, written);
+}
+
+ssize_t tls_recv(int sock, void *buffer, size_t length) {
+    SSL *ssl = tls__get(sock);
+
+    if (ssl == NULL)
+        return recv(sock, buffer, length, 0);
+
+    size_t read = 0;
+    errno = 0;
+    const int r = SSL_read_ex(ssl, buffer, length, &read);
+    return tls__result(ssl, r, read);
+}
+
+char tls_pending(int sock) {
+    SSL *ssl = tls__get(sock);
+    return ssl != NULL && SSL_pending(ssl) > 0;
+}
+
+char tls_kernel_send(int sock) {
+    SSL *ssl = tls__get(sock);
+    return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+char tls_kernel_recv(int sock) {
+    SSL *ssl = tls__get(sock);
+    return ssl == NULL || (BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl));
+}
+
+ssize_t tls_sendfile(int sock, int fd, off_t offset, size_t length) {
+    SSL *ssl = tls__get(sock);
+
+    if (ssl == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    errno = 0;
+    const ossl_ssize_t n = SSL_sendfile(ssl, fd, offset, length, 0);
+
+    if (n >= 0)
+        return (ssize_t)n;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        ERR_clear_error();
+        errno = EAGAIN;
+        return -1;
+    }
+
+    tls__log("SSL_sendfile failed");
+    errno = EIO;
+    return -1;
+}
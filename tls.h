@@ -0,0 +1,147 @@
+/**
+ * Encrypted connections: TLS with OpenSSL, whose record layer is handed to the kernel (kTLS) once the
+ * handshake is over, where the kernel and OpenSSL support it.
+ *
+ * With kTLS the kernel encrypts what is written to the socket, so the server sends the blocks straight from
+ * the page cache with SSL_sendfile, sendfile underneath, as it does not read them into user space. When the
+ * kernel also decrypts, a client may still splice the blocks from the socket into the file. Without kTLS,
+ * OpenSSL encrypts in user space: the server reads the blocks into its buffer and sends them with SSL_write.
+ *
+ * The connections are registered by socket, and utils_send_all, utils_recv_all and utils_recv_all_deadline go
+ * through SSL_write and SSL_read on them, so the code that speaks the protocol does not change. Servers send
+ * no session tickets, which a kTLS socket could only take for data.
+ *
+ * Only servers have a certificate, that clients check against a CA file. A certificate is only accepted from
+ * the peer it names, so that a server of the CA cannot pose as another: the peers of the metainfo file (whose
+ * names are resolved when it is loaded), of the tracker and of peer exchange are known by their address, which
+ * their certificate must hold as an iPAddress subjectAltName; the peers given to -M are checked against what
+ * was given, a DNS name (dNSName subjectAltName) or an address. Servers do not check the clients. Unix sockets,
+ * UDP and multicast stay in the clear.
+ *
+ * Usage:
+ *
+ *   struct tls_t tls;
+ *   tls_init_server(&tls, "cert.pem", "key.pem");
+ *   tls_accept(&tls, sock);                     // then tls_handshake(sock) when the socket is ready, until 0
+ *
+ *   tls_init_client(&tls, "ca.pem");
+ *   tls_connect(&tls, sock, "10.0.0.7", utils_now() + 5);
+ *
+ *   utils_send_all(sock, buffer, length);
+ *   tls_close(sock);
+ *   close(sock);
+ */
+
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Seconds a client waits for the handshake to complete
+ */
+#define TLS_HANDSHAKE_TIMEOUT 5.0
+
+/**
+ * Receive timeout given to blocking sockets, in seconds: SSL_read waits for a whole record, which would
+ * otherwise hang past the deadline of utils_recv_all_deadline if the peer stalls in the middle of one
+ */
+#define TLS__RECV_SLICE 0.1
+
+/**
+ * Settings shared by the connections of a server or of a client
+ */
+struct tls_t {
+    SSL_CTX *ctx;
+};
+
+/**
+ * Set up the server side
+ * @param tls where the settings are stored
+ * @param cert PEM file with the certificate, followed by the chain if any
+ * @param key PEM file with the private key, may be cert
+ * @return 0 on success or -1 on error
+ */
+int tls_init_server(struct tls_t *tls, const char *cert, const char *key);
+
+/**
+ * Set up the client side
+ * @param tls where the settings are stored
+ * @param ca PEM file with the certificates of the authorities the servers must be signed by
+ * @return 0 on success or -1 on error
+ */
+int tls_init_client(struct tls_t *tls, const char *ca);
+
+/**
+ * Free what tls_init_server or tls_init_client allocated, once no connection uses it
+ */
+void tls_destroy(struct tls_t *tls);
+
+/**
+ * Register a connection accepted by a server, whose handshake is then run by tls_handshake
+ * @param tls settings from tls_init_server
+ * @param sock the non-blocking socket
+ * @return 0 on success or -1 on error
+ */
+int tls_accept(const struct tls_t *tls, int sock);
+
+/**
+ * Go on with the handshake of a registered connection, as far as the socket allows
+ * @param sock the socket
+ * @return 0 once it is complete, POLLIN or POLLOUT for what the socket must be ready for to go on, or -1 if
+ * it failed
+ */
+int tls_handshake(int sock);
+
+/**
+ * Register a connection to a server and run the handshake
+ * @param tls settings from tls_init_client
+ * @param sock the connected socket, blocking or not, left as it was but for TLS__RECV_SLICE
+ * @param host the peer as its certificate must name it: an IPv4 or IPv6 address, or a DNS name
+ * @param deadline absolute time, as returned by utils_now, when we stop waiting
+ * @return 0 on success or -1 on error, the connection is then unregistered
+ */
+int tls_connect(const struct tls_t *tls, int sock, const char *host, double deadline);
+
+/**
+ * Unregister a connection, before its socket is closed. Nothing happens if it is not registered.
+ */
+void tls_close(int sock);
+
+/**
+ * Send on a socket, through TLS if it is registered
+ * @return as send, -1 with errno EAGAIN if the socket is not ready
+ */
+ssize_t tls_send(int sock, const void *buffer, size_t length);
+
+/**
+ * Receive from a socket, through TLS if it is registered
+ * @return as recv, -1 with errno EAGAIN if nothing is ready
+ */
+ssize_t tls_recv(int sock, void *buffer, size_t length);
+
+/**
+ * Tells whether a registered connection holds received data that the socket is not readable for anymore
+ */
+char tls_pending(int sock);
+
+/**
+ * Tells whether a socket is registered and the kernel encrypts what is sent on it, so that tls_sendfile works
+ */
+char tls_kernel_send(int sock);
+
+/**
+ * Tells whether the kernel decrypts what is received on a socket: it is not registered, or it is with kTLS
+ * and nothing is pending, so that the socket can be read directly, e.g. with splice
+ */
+char tls_kernel_recv(int sock);
+
+/**
+ * Send part of a file on a connection, see tls_kernel_send
+ * @return bytes sent, or -1 with errno EAGAIN if the socket is not ready
+ */
+ssize_t tls_sendfile(int sock, int fd, off_t offset, size_t length);
+
+#endif
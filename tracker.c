@@ -0,0 +1,381 @@
+/**
+ * This file implements the tracker specified in tracker.h.
+ */
+#include "tracker.h"
+#include "enum.h"
+#include "logger.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * A live server of a torrent
+ */
+struct tracker__entry_t {
+    fio_sha256_hash_t torrent;
+    struct tracker_peer_t peer;
+    double last_seen; // utils_now of the last announce
+};
+
+struct tracker__table_t {
+    struct tracker__entry_t *entries;
+    size_t count;
+    size_t allocated;
+};
+
+/**
+ * Forget the servers that did not announce themselves for ttl seconds
+ */
+static void tracker__expire(struct tracker__table_t *table, double ttl) {
+    const double now = utils_now();
+    size_t i = 0;
+
+    while (i < table->count) {
+        struct tracker__entry_t *e = &table->entries[i];
+
+        if (now - e->last_seen <= ttl) {
+            i++;
+            continue;
+        }
+
+        log_printf(LOG_INFO, "Server %d.%d.%d.%d:%d expired", e->peer.address[0], e->peer.address[1],
+                   e->peer.address[2], e->peer.address[3], ntohs(e->peer.port));
+
+        table->entries[i] = table->entries[--table->count];
+    }
+}
+
+/**
+ * Add a server or refresh it
+ */
+static void tracker__announce(struct tracker__table_t *table, const struct tracker_message_t *msg,
+                              const struct sockaddr_in *from) {
+    struct tracker_peer_t peer;
+    memcpy(peer.address, &from->sin_addr.s_addr, sizeof(peer.address));
+    peer.port = msg->port;
+
+    for (size_t i = 0; i < table->count; i++) {
+        struct tracker__entry_t *e = &table->entries[i];
+
+        if (!memcmp(e->torrent, msg->torrent, sizeof(fio_sha256_hash_t)) &&
+            !memcmp(&e->peer, &peer, sizeof(struct tracker_peer_t))) {
+            e->last_seen = utils_now();
+            return;
+        }
+    }
+
+    if (table->count == table->allocated) {
+        const size_t allocated = table->allocated ? table->allocated * 2 : 64;
+        struct tracker__entry_t *entries = realloc(table->entries, sizeof(struct tracker__entry_t) * allocated);
+
+        if (entries == NULL) {
+            log_printf(LOG_DEBUG, "Realloc failed: %s", strerror(errno));
+            errno = 0;
+            return;
+        }
+
+        table->entries = entries;
+        table->allocated = allocated;
+    }
+
+    struct tracker__entry_t *e = &table->entries[table->count++];
+    memcpy(e->torrent, msg->torrent, sizeof(fio_sha256_hash_t));
+    e->peer = peer;
+    e->last_seen = utils_now();
+
+    log_printf(LOG_INFO, "Server %d.%d.%d.%d:%d registered", peer.address[0], peer.address[1], peer.address[2],
+               peer.address[3], ntohs(peer.port));
+}
+
+/**
+ * Answer a query with a random subset of the live servers of the torrent
+ */
+static void tracker__answer(int sock, const struct tracker__table_t *table, const struct tracker_message_t *msg,
+                            const struct sockaddr_in *from) {
+    size_t matches[TRACKER_MAX_PEERS];
+    size_t seen = 0;
+
+    // reservoir sampling, so every live server has the same chance to be in the answer
+    size_t wanted = ntohs(msg->count);
+    if (wanted > TRACKER_MAX_PEERS || wanted == 0)
+        wanted = TRACKER_MAX_PEERS;
+
+    for (size_t i = 0; i < table->count; i++) {
+        if (memcmp(table->entries[i].torrent, msg->torrent, sizeof(fio_sha256_hash_t)))
+            continue;
+
+        if (seen < wanted) {
+            matches[seen] = i;
+        } else {
+            const size_t j = (size_t)rand() % (seen + 1);
+            if (j < wanted)
+                matches[j] = i;
+        }
+        seen++;
+    }
+
+    const size_t count = seen < wanted ? seen : wanted;
+
+    // the reservoir keeps the first ones in order while it fills up
+    for (size_t i = count; i > 1; i--) {
+        const size_t j = (size_t)rand() % i;
+        const size_t tmp = matches[i - 1];
+        matches[i - 1] = matches[j];
+        matches[j] = tmp;
+    }
+
+    char buffer[sizeof(struct tracker_message_t) + TRACKER_MAX_PEERS * sizeof(struct tracker_peer_t)];
+    struct tracker_message_t *answer = (struct tracker_message_t *)buffer;
+    struct tracker_peer_t *peers = (struct tracker_peer_t *)(buffer + sizeof(struct tracker_message_t));
+
+    *answer = *msg;
+    answer->message_code = MSG_TRACKER_PEERS;
+    answer->count = htons((uint16_t)count);
+
+    for (size_t i = 0; i < count; i++) {
+        peers[i] = table->entries[matches[i]].peer;
+    }
+
+    const size_t length = sizeof(struct tracker_message_t) + count * sizeof(struct tracker_peer_t);
+
+    if (sendto(sock, buffer, length, 0, (const struct sockaddr *)from, sizeof(struct sockaddr_in)) < 0) {
+        log_printf(LOG_DEBUG, "sendto failed: %s", strerror(errno));
+        errno = 0;
+    }
+
+    log_printf(LOG_DEBUG, "Sent %lu of %lu servers to %s:%d", count, seen, inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+}
+
+int tracker_run(uint16_t port, double ttl) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (s < 0) {
+        log_printf(LOG_DEBUG, "Socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_in hint;
+    memset(&hint, 0, sizeof(struct sockaddr_in));
+    hint.sin_family = AF_INET;
+    hint.sin_addr.s_addr = INADDR_ANY;
+    hint.sin_port = htons(port);
+
+    if (bind(s, (struct sockaddr *)&hint, sizeof(hint))) {
+        log_printf(LOG_DEBUG, "Bind failed: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    log_printf(LOG_INFO, "Tracker listening on UDP port %d, servers expire after %.0f s", port, ttl);
+
+    struct tracker__table_t table = {0};
+
+    while (1) {
+        struct tracker_message_t msg;
+        struct sockaddr_in from;
+        socklen_t from_length = sizeof(from);
+
+        const ssize_t r = recvfrom(s, &msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_length);
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                errno = 0;
+                continue;
+            }
+
+            log_printf(LOG_DEBUG, "recvfrom failed: %s", strerror(errno));
+            break;
+        }
+
+        if ((size_t)r < sizeof(msg) || ntohl(msg.magic_number) != MAGIC_NUMBER) {
+            log_printf(LOG_DEBUG, "Ignoring a bad datagram from %s", inet_ntoa(from.sin_addr));
+            continue;
+        }
+
+        tracker__expire(&table, ttl);
+
+        if (msg.message_code == MSG_TRACKER_ANNOUNCE)
+            tracker__announce(&table, &msg, &from);
+        else if (msg.message_code == MSG_TRACKER_QUERY)
+            tracker__answer(s, &table, &msg, &from);
+        else
+            log_printf(LOG_DEBUG, "Ignoring message %d from %s", msg.message_code, inet_ntoa(from.sin_addr));
+    }
+
+    free(table.entries);
+    close(s);
+    return -1;
+}
+
+int tracker_parse_address(const char *address, struct sockaddr_in *addr) {
+    char host[1024];
+
+    if (strlen(address) >= sizeof(host)) {
+        log_printf(LOG_INFO, "Tracker address %s is too long", address);
+        return -1;
+    }
+
+    strcpy(host, address);
+    char *const colon = strrchr(host, ':');
+
+    if (colon == NULL) {
+        log_printf(LOG_INFO, "Tracker address %s must be host:port", address);
+        return -1;
+    }
+
+    *colon = '\0';
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo *result;
+    const int r = getaddrinfo(host, colon + 1, &hints, &result);
+
+    if (r != 0) {
+        log_printf(LOG_INFO, "Cannot resolve tracker %s: %s", address, gai_strerror(r));
+        return -1;
+    }
+
+    memcpy(addr, result->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**
+ * Open a UDP socket connected to the tracker, so only its datagrams are received
+ */
+static int tracker__socket(const struct sockaddr_in *tracker) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (s < 0) {
+        log_printf(LOG_DEBUG, "Socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(s, (const struct sockaddr *)tracker, sizeof(struct sockaddr_in))) {
+        log_printf(LOG_DEBUG, "Connect failed: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+struct tracker__announcer_t {
+    int sock;
+    struct tracker_message_t msg;
+};
+
+static void *tracker__announcer(void *arg) {
+    struct tracker__announcer_t *a = arg;
+
+    while (1) {
+        // a lost or refused datagram is fine, the next heartbeat comes before the entry expires
+        if (send(a->sock, &a->msg, sizeof(a->msg), 0) < 0) {
+            log_printf(LOG_DEBUG, "Announce failed: %s", strerror(errno));
+            errno = 0;
+        }
+
+        utils_sleep(TRACKER_HEARTBEAT);
+    }
+
+    return NULL;
+}
+
+int tracker_start_announcer(const struct sockaddr_in *tracker, const struct fio_torrent_t *torrent, uint16_t port) {
+    struct tracker__announcer_t *a = malloc(sizeof(struct tracker__announcer_t));
+
+    if (a == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    a->sock = tracker__socket(tracker);
+
+    if (a->sock < 0) {
+        free(a);
+        return -1;
+    }
+
+    memset(&a->msg, 0, sizeof(a->msg));
+    a->msg.magic_number = htonl(MAGIC_NUMBER);
+    a->msg.message_code = MSG_TRACKER_ANNOUNCE;
+    memcpy(a->msg.torrent, torrent->downloaded_file_hash, sizeof(fio_sha256_hash_t));
+    a->msg.port = htons(port);
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, tracker__announcer, a)) {
+        log_message(LOG_DEBUG, "pthread_create failed");
+        close(a->sock);
+        free(a);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+int tracker_query(const struct sockaddr_in *tracker, const fio_sha256_hash_t id, struct fio_peer_information_t *peers,
+                  size_t max, size_t *count) {
+    assert(count != NULL);
+
+    int s = tracker__socket(tracker);
+
+    if (s < 0)
+        return -1;
+
+    struct tracker_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.magic_number = htonl(MAGIC_NUMBER);
+    msg.message_code = MSG_TRACKER_QUERY;
+    memcpy(msg.torrent, id, sizeof(fio_sha256_hash_t));
+    msg.count = htons((uint16_t)(max < TRACKER_MAX_PEERS ? max : TRACKER_MAX_PEERS));
+
+    char buffer[sizeof(struct tracker_message_t) + TRACKER_MAX_PEERS * sizeof(struct tracker_peer_t)];
+    const struct tracker_message_t *answer = (const struct tracker_message_t *)buffer;
+    const struct tracker_peer_t *list = (const struct tracker_peer_t *)(buffer + sizeof(struct tracker_message_t));
+    const double deadline = utils_now() + TRACKER__QUERY_TIMEOUT;
+    ssize_t r = -1;
+
+    if (send(s, &msg, sizeof(msg), 0) < 0) {
+        log_printf(LOG_DEBUG, "Query failed: %s", strerror(errno));
+    } else {
+        // skip late answers to earlier queries
+        while (utils_poll_deadline(s, POLLIN, deadline) == 0 && (r = recv(s, buffer, sizeof(buffer), 0)) >= 0) {
+            if ((size_t)r >= sizeof(struct tracker_message_t) && ntohl(answer->magic_number) == MAGIC_NUMBER &&
+                answer->message_code == MSG_TRACKER_PEERS && !memcmp(answer->torrent, id, sizeof(fio_sha256_hash_t)) &&
+                (size_t)r == sizeof(struct tracker_message_t) + ntohs(answer->count) * sizeof(struct tracker_peer_t))
+                break;
+            r = -1;
+        }
+    }
+
+    close(s);
+
+    if (r < 0) {
+        log_printf(LOG_INFO, "No answer from the tracker: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    *count = ntohs(answer->count) < max ? ntohs(answer->count) : max;
+
+    for (size_t i = 0; i < *count; i++) {
+        memcpy(peers[i].peer_address, list[i].address, sizeof(peers[i].peer_address));
+        peers[i].peer_port = list[i].port;
+        peers[i].locality[0] = '\0';
+        peers[i].unix_path[0] = '\0';
+    }
+
+    return 0;
+}
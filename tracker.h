@@ -0,0 +1,109 @@
+/**
+ * Tracker: a small UDP service that keeps the list of the servers of each torrent, so that seeders can
+ * come and go without regenerating the metainfo file.
+ *
+ * Servers announce themselves every TRACKER_HEARTBEAT seconds with MSG_TRACKER_ANNOUNCE. The tracker
+ * takes the address from the datagram and the port from the message, and forgets a server it has not
+ * heard of for TRACKER_DEFAULT_TTL seconds. Clients send MSG_TRACKER_QUERY and get MSG_TRACKER_PEERS back,
+ * a random subset of at most TRACKER_MAX_PEERS live servers. Torrents are identified by the SHA-256 of
+ * the whole file (downloaded_file_hash).
+ *
+ * Every datagram starts with a tracker_message_t; MSG_TRACKER_PEERS is followed by count tracker_peer_t.
+ *
+ * Usage:
+ *
+ *   tracker_run(6969, TRACKER_DEFAULT_TTL);    // the daemon, does not return
+ *
+ *   struct sockaddr_in tracker;
+ *   tracker_parse_address("localhost:6969", &tracker);
+ *   tracker_start_announcer(&tracker, &torrent, 8080);                    // on a server
+ *   tracker_query(&tracker, torrent.downloaded_file_hash, peers, 64, &n);  // on a client
+ */
+
+#ifndef TRACKER_H_
+#define TRACKER_H_
+
+#include "file_io.h"
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Seconds between two announces of a server
+ */
+#define TRACKER_HEARTBEAT 10.0
+
+/**
+ * Default seconds after the last announce when a server is forgotten, a few heartbeats so that a lost
+ * datagram does not drop it
+ */
+#define TRACKER_DEFAULT_TTL (3 * TRACKER_HEARTBEAT)
+
+/**
+ * Maximum number of peers in an answer
+ */
+#define TRACKER_MAX_PEERS 64
+
+/**
+ * How long a client waits for an answer, in seconds
+ */
+#define TRACKER__QUERY_TIMEOUT 1.0
+
+/**
+ * Header of every tracker datagram. Integers are in network byte order.
+ * Disable structure packing so we can use it as a buffer.
+ */
+struct tracker_message_t {
+    uint32_t magic_number;     // MAGIC_NUMBER
+    uint8_t message_code;      // MSG_TRACKER_*
+    fio_sha256_hash_t torrent; // SHA-256 of the whole file
+    uint16_t port;             // MSG_TRACKER_ANNOUNCE: port the server listens to
+    uint16_t count;            // MSG_TRACKER_QUERY: peers wanted, MSG_TRACKER_PEERS: peers that follow
+} __attribute__((packed));
+
+/**
+ * A server in MSG_TRACKER_PEERS
+ */
+struct tracker_peer_t {
+    uint8_t address[4]; // in network byte order
+    uint16_t port;      // in network byte order
+} __attribute__((packed));
+
+/**
+ * Run the tracker, forever
+ * @param port the UDP port to listen to
+ * @param ttl seconds after the last announce when a server is forgotten
+ * @return -1 on error, does not return otherwise
+ */
+int tracker_run(uint16_t port, double ttl);
+
+/**
+ * Resolve the address of a tracker
+ * @param address "host:port"
+ * @param addr where the address is stored
+ * @return 0 on success or -1 on error
+ */
+int tracker_parse_address(const char *address, struct sockaddr_in *addr);
+
+/**
+ * Announce a server from a new detached thread, every TRACKER_HEARTBEAT seconds, for as long as the process runs
+ * @param tracker address of the tracker
+ * @param torrent the torrent served
+ * @param port the port the server listens to
+ * @return 0 on success or -1 on error
+ */
+int tracker_start_announcer(const struct sockaddr_in *tracker, const struct fio_torrent_t *torrent, uint16_t port);
+
+/**
+ * Ask the tracker for live servers of a torrent, waiting at most TRACKER__QUERY_TIMEOUT
+ * @param tracker address of the tracker
+ * @param id SHA-256 of the whole file
+ * @param peers where the servers are stored, with an empty locality
+ * @param max capacity of peers
+ * @param count where the number of servers is stored
+ * @return 0 on success or -1 if the tracker did not answer
+ */
+int tracker_query(const struct sockaddr_in *tracker, const fio_sha256_hash_t id, struct fio_peer_information_t *peers,
+                  size_t max, size_t *count);
+
+#endif // TRACKER_H_
@@ -4,99 +4,366 @@
 #include "client.h"
 #include "file_io.h"
 #include "logger.h"
+#include "mcast.h"
+#include "metainfo.h"
 #include "server.h"
+#include "session.h"
+#include "tls.h"
+#include "tracker.h"
+#include "udp.h"
 #include "utils.h"
 #include <errno.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #ifdef ENABLE_FUZZING
 #include "sockets_harness.h"
 #endif
 
 // https://en.wikipedia.org/wiki/Magic_number_(programming)#In_protocols
 
+static const char HELP_MESSAGE[] =
+    "Usage:\n"
+    "Download a file: ttorrent [-b] [-p ranges] [-s out] [-A size] [-z] [-m size] [-w seconds] [-t seconds] [-r rate] [-R rate] [-f file] [-T file] [-N rate] [-k host:port] [-Z] [-M identifier@host:port] [-U] [-D loss,delay[,rate]] [-G group:port[,interface]] [-e ca.pem] file.ttorrent\n"
+    "  -b  check the blocks already in the file in the background while downloading the missing ones\n"
+    "  -p  only download these byte ranges, e.g. 0-4095,1G-2G,3G- (the rest of the file stays sparse)\n"
+    "  -s  write the file in order to out (\"-\" for stdout, or a FIFO) while it downloads\n"
+    "  -A  how far ahead of what was written to out blocks are requested (default 16M)\n"
+    "  -z  zero-copy receive: splice the blocks from the sockets into the file\n"
+    "  -m  memory to hold verified blocks and write them in order, 0 to disable (default 2M)\n"
+    "  -w  seconds a verified block may wait to be written with its neighbours (default 0.2)\n"
+    "  -t  keep retrying the peers for this many seconds, 0 for no limit (default 300)\n"
+    "  -r  global download limit in bytes per second, K, M and G suffixes allowed\n"
+    "  -R  download limit for each peer\n"
+    "  -f  read \"global per-peer\" limits from this file at startup and on SIGHUP\n"
+    "  -T  locality labels, one \"self zone/rack/host\" or \"host:port zone/rack/host\" per line; nearer peers are preferred\n"
+    "  -N  use farther peers when the nearest ones give less than this rate (default: only when they cannot serve)\n"
+    "  -k  ask this tracker for the live peers instead of trying every peer of the metainfo file\n"
+    "  -Z  ask the peers to send the blocks compressed (zlib) when it makes them smaller, for slow links\n"
+    "  -M  first fetch file.ttorrent from these peers: -M identifier@host:port[,host:port...], the identifier\n"
+    "      is logged by the servers; they become the peers of the file\n"
+    "  -U  download over UDP from the peers serving there (delay-based congestion control), TCP from the others\n"
+    "  -D  simulate a network on what is received over UDP: -D loss,delay[,rate], e.g. 0.01,0.02,10M for 1%% loss,\n"
+    "      20 ms and a 10 MB/s link, to test on loopback\n"
+    "  -G  first receive what a server sends to this multicast group, e.g. 239.1.2.3:9000[,interface address],\n"
+    "      then get the rest from the peers\n"
+    "  -e  connect to the peers over TLS, accepting the certificates signed by the authorities in ca.pem that name\n"
+    "      the peer: its address (IP subjectAltName), or the host given to -M\n"
+    "Download several files: ttorrent [-L list] [-j n] [-C n] [download options] [file.ttorrent...]\n"
+    "  -L  read more files from list, one \"file.ttorrent [priority]\" per line, highest priority first\n"
+    "  -j  number of files downloaded at the same time (default 4)\n"
+    "  -C  number of connections open at the same time for all the files (default 64)\n"
+    "  -r  is then the limit for all the files together\n"
+    "Upload a file: ttorrent -l 8080 [-k host:port] [-S] [-U] [-x path] [-G group:port[,interface] [-r rate]] [-E cert.pem[,key.pem]] file.ttorrent\n"
+    "  -k  announce the server to this tracker\n"
+    "  -S  super-seed: give each relay only a few blocks at a time until a full copy is spread among them\n"
+    "  -U  also serve over UDP, on the UDP port of the same number\n"
+    "  -x  also listen on a Unix socket at path: clients on this host listing \"unix:path\" as a peer copy the\n"
+    "      blocks from the file instead of receiving them\n"
+    "  -G  also send the file to this multicast group, at -r bytes per second (default 50M), repairing what the\n"
+    "      receivers miss\n"
+    "  -E  serve over TLS with this certificate and key (default: in cert.pem too); the kernel encrypts where it\n"
+    "      supports it (kTLS), so the blocks are still sent from the file without a copy; the certificate must\n"
+    "      name the addresses the clients reach the server at\n"
+    "Relay a file: ttorrent -u -l 8081 [-x path] [-E cert.pem[,key.pem]] [download options] file.ttorrent\n"
+    "  -u  download the file and serve each block as soon as it is verified, then keep serving\n"
+    "Run a tracker: ttorrent -K 6969\n"
+    "Create ttorrent file: ttorrent -c file\n";
+
 int main(int argc, char **argv) {
     set_log_level(LOG_DEBUG);
 
     log_printf(LOG_INFO, "Trivial Torrent (build %s %s)", __DATE__, __TIME__);
 
-    switch (argc) {
-    case 2: {
-        log_message(LOG_INFO, "Starting Client...");
-        struct fio_torrent_t t = {0};
+    struct client_config_t config;
+    client_config_init(&config);
+
+    char *create = NULL; // -c
+    int32_t port = -1;   // -l
+    char *list = NULL;   // -L
+    char relay = 0;      // -u
+    char super_seed = 0; // -S
+    char *fetch = NULL;  // -M
+    char *cert = NULL;   // -E
+    char *ca = NULL;     // -e
+    int32_t tracker_port = -1; // -K
+    long active = SESSION_DEFAULT_ACTIVE;           // -j
+    long connections = SESSION_DEFAULT_CONNECTIONS; // -C
 
-        if (utils_create_torrent_struct(argv[1], &t)) {
-            log_printf(LOG_DEBUG, "Failed to create torrent struct from for filename: %s", argv[1]);
+    int opt;
+    while ((opt = getopt(argc, argv, "A:bc:C:D:e:E:f:G:j:k:K:l:L:m:M:N:p:r:R:s:St:T:uUw:x:zZ")) != -1) {
+        switch (opt) {
+        case 'b':
+            config.background_check = 1;
             break;
-        }
+        case 'c':
+            create = optarg;
+            break;
+        case 'l':
+        case 'K':
+            *(opt == 'l' ? &port : &tracker_port) = atoi(optarg);
 
-        if (client_init(&t)) {
-            log_printf(LOG_INFO, "Somewthing went wrong with the client");
-        }
+            if (!(atoi(optarg) <= 65535 && atoi(optarg) > 0)) { // 65535 should be UINT16_MAX
+                log_printf(LOG_INFO, "Port must be a number between %i and %i", 65535, 1);
+                return 0;
+            }
+            break;
+        case 'k':
+            config.tracker = optarg;
+            break;
+        case 't':
+            config.deadline = atof(optarg);
+            break;
+        case 'r':
+        case 'R':
+        case 'N':
+            if (utils_parse_rate(optarg, opt == 'r' ? &config.rate : opt == 'R' ? &config.peer_rate : &config.near_rate)) {
+                log_printf(LOG_INFO, "Invalid rate %s", optarg);
+                return 0;
+            }
+            break;
+        case 'f':
+            config.control_file = optarg;
+            break;
+        case 'T':
+            config.locality = optarg;
+            break;
+        case 'p':
+            config.ranges = optarg;
+            break;
+        case 's':
+            config.stream = optarg;
+            break;
+        case 'A':
+            if (utils_parse_rate(optarg, &config.stream_ahead)) {
+                log_printf(LOG_INFO, "Invalid size %s", optarg);
+                return 0;
+            }
+            break;
+        case 'z':
+            config.zero_copy = 1;
+            break;
+        case 'Z':
+            config.compress = 1;
+            break;
+        case 'L':
+            list = optarg;
+            break;
+        case 'u':
+            relay = 1;
+            break;
+        case 'S':
+            super_seed = 1;
+            break;
+        case 'M':
+            fetch = optarg;
+            break;
+        case 'U':
+            config.udp = 1;
+            break;
+        case 'x':
+            config.unix_path = optarg;
+            break;
+        case 'E':
+            cert = optarg;
+            break;
+        case 'e':
+            ca = optarg;
+            break;
+        case 'G': {
+            struct sockaddr_in group;
+            struct in_addr interface;
+
+            if (mcast_parse(optarg, &group, &interface)) {
+                log_printf(LOG_INFO, "Invalid multicast group %s, expected group:port[,interface]", optarg);
+                return 0;
+            }
 
-        if (fio_destroy_torrent(&t)) {
-            log_printf(LOG_DEBUG, "Error while destroying the torrent struct: %s", strerror(errno));
+            config.multicast = optarg;
             break;
         }
+        case 'D': {
+            char *end;
+            const double loss = strtod(optarg, &end);
+            const double delay = *end == ',' ? strtod(end + 1, &end) : -1;
+            double rate = 0;
 
-        break;
-    }
-    case 3: {
-        if (strcmp(argv[1], "-c") != 0) { // create metainfo file
-            log_printf(LOG_INFO, "Invalid switch, run without arguments to get help");
+            if (loss < 0 || loss > 1 || delay < 0 || (*end != '\0' && (*end != ',' || utils_parse_rate(end + 1, &rate)))) {
+                log_printf(LOG_INFO, "Invalid network %s, expected loss,delay[,rate]", optarg);
+                return 0;
+            }
+
+            udp_simulate(loss, delay, rate);
             break;
         }
-
-        if (fio_create_metainfo(argv[2]) != 0) {
-            log_printf(LOG_INFO, "Failed to create ttorrent file for %s", argv[2]);
+        case 'j':
+        case 'C':
+            if (atol(optarg) <= 0) {
+                log_printf(LOG_INFO, "-%c needs a positive number", opt);
+                return 0;
+            }
+            *(opt == 'j' ? &active : &connections) = atol(optarg);
+            break;
+        case 'm':
+            if (utils_parse_rate(optarg, &config.reorder_bytes)) {
+                log_printf(LOG_INFO, "Invalid size %s", optarg);
+                return 0;
+            }
+            break;
+        case 'w':
+            config.flush_delay = atof(optarg);
             break;
+        default:
+            log_printf(LOG_INFO, "Invalid switch, run without arguments to get help");
+            return 0;
         }
+    }
 
-        break;
+    if (tracker_port > 0) {
+        tracker_run((uint16_t)tracker_port, TRACKER_DEFAULT_TTL);
+        log_message(LOG_INFO, "Somewthing went wrong with the tracker");
+        return 0;
     }
-    case 4: {
-        if (strcmp(argv[1], "-l") != 0) { // server
-            log_printf(LOG_INFO, "Invalid switch, run without arguments to get help");
-            break;
+
+    if (create != NULL) { // create metainfo file
+        if (fio_create_metainfo(create) != 0) {
+            log_printf(LOG_INFO, "Failed to create ttorrent file for %s", create);
         }
+        return 0;
+    }
 
-        log_message(LOG_INFO, "Starting server...");
+    struct tls_t server_tls = {0};
+    struct tls_t client_tls = {0};
 
-        int32_t port = atoi(argv[2]);
+    if (cert != NULL) { // "cert[,key]"
+        char *key = strchr(cert, ',');
 
-        if (!(port <= 65535 && port > 0)) { // 65535 should be UINT16_MAX
-            log_printf(LOG_INFO, "Port must be a number between %i and %i", 65535, 1);
-            break;
+        if (key != NULL)
+            *key++ = '\0';
+
+        if (tls_init_server(&server_tls, cert, key != NULL ? key : cert))
+            return 0;
+    }
+
+    if (ca != NULL) {
+        if (tls_init_client(&client_tls, ca))
+            return 0;
+
+        config.tls = &client_tls;
+    }
+
+    if ((cert != NULL || ca != NULL) && (config.udp || config.multicast != NULL)) {
+        log_message(LOG_INFO, "UDP and multicast are not encrypted, using TCP only");
+        config.udp = 0;
+        config.multicast = NULL;
+    }
+
+    client_setup(&config);
+
+    if (port <= 0 && (list != NULL || optind + 1 < argc)) { // several downloads
+        if (config.stream != NULL) {
+            log_message(LOG_INFO, "Only one file can be streamed");
+            return 0;
         }
 
-        struct fio_torrent_t t = {0};
+        struct session_t session;
 
-        if (utils_create_torrent_struct(argv[3], &t)) {
-            log_printf(LOG_DEBUG, "Failed to create torrent struct from for filename: %s", argv[3]);
-            break;
+        if (session_init(&session)) {
+            return 0;
         }
 
-        if (server_init((uint16_t)port, &t)) {
-            log_printf(LOG_INFO, "Somewthing went wrong with the server");
+        int r = list != NULL ? session_read_list(&session, list) : 0;
+
+        for (int i = optind; r == 0 && i < argc; i++) {
+            r = session_add(&session, argv[i], 0);
         }
 
-        if (fio_destroy_torrent(&t)) {
-            log_printf(LOG_DEBUG, "Error while destroying the torrent struct: %s", strerror(errno));
-            break;
+        if (r == 0 && session_run(&session, &config, (size_t)active, (size_t)connections)) {
+            log_message(LOG_INFO, "Some files are incomplete");
         }
 
-        break;
+        session_destroy(&session);
+        return 0;
     }
-    default: {
-
-        const char HELP_MESSAGE[] =
-            "Usage:\nDownload a file: ttorrent file.ttorrent\nUpload a file: ttorrent -l 8080 file.ttorrent\nCreate ttorrent file: ttorrent -c file\n";
 
+    if (optind + 1 != argc) {
         log_printf(LOG_INFO, "%s", HELP_MESSAGE);
-        break;
+        return 0;
+    }
+
+    char *metainfo = argv[optind];
+
+    if (fetch != NULL && access(metainfo, F_OK) == 0) {
+        log_printf(LOG_INFO, "%s is already there, not fetching it", metainfo);
+    } else if (fetch != NULL && metainfo_fetch(fetch, metainfo, config.tls)) {
+        log_printf(LOG_INFO, "Failed to fetch %s", metainfo);
+        return 0;
     }
+
+    struct fio_torrent_t t = {0};
+
+    if (utils_create_torrent_struct(metainfo, &t, config.background_check && (port <= 0 || relay))) {
+        log_printf(LOG_DEBUG, "Failed to create torrent struct from for filename: %s", metainfo);
+        return 0;
+    }
+
+    struct sockaddr_in tracker;
+
+    if (port > 0 && config.tracker != NULL &&
+        (tracker_parse_address(config.tracker, &tracker) || tracker_start_announcer(&tracker, &t, (uint16_t)port))) {
+        log_message(LOG_INFO, "Cannot announce the server to the tracker");
+    }
+
+    if (port > 0 && config.udp && udp_start_server((uint16_t)port, &t)) {
+        log_message(LOG_INFO, "Serving over TCP only");
     }
 
+    struct sockaddr_in group;
+    struct in_addr interface;
+
+    if (port > 0 && !relay && config.multicast != NULL &&
+        (mcast_parse(config.multicast, &group, &interface) ||
+         mcast_start_sender(&group, interface, config.rate > 0 ? config.rate : MCAST_DEFAULT_RATE, &t))) {
+        log_message(LOG_INFO, "Not multicasting");
+    }
+
+    if (port > 0 && relay) { // client and server on the same torrent
+        log_message(LOG_INFO, "Starting relay...");
+        pthread_t server;
+
+        if (server_start_relay((uint16_t)port, config.unix_path, cert != NULL ? &server_tls : NULL, &t, &server)) {
+            log_printf(LOG_INFO, "Somewthing went wrong with the server");
+        } else {
+            config.relay_port = (uint16_t)port;
+
+            if (client_init(&t, &config)) {
+                log_printf(LOG_INFO, "Somewthing went wrong with the client");
+            }
+
+            log_message(LOG_INFO, "Download finished, still serving");
+            pthread_join(server, NULL);
+        }
+    } else if (port > 0) { // server
+        log_message(LOG_INFO, "Starting server...");
+
+        if (server_init((uint16_t)port, config.unix_path, cert != NULL ? &server_tls : NULL, &t, super_seed)) {
+            log_printf(LOG_INFO, "Somewthing went wrong with the server");
+        }
+    } else {
+        log_message(LOG_INFO, "Starting Client...");
+
+        if (client_init(&t, &config)) {
+            log_printf(LOG_INFO, "Somewthing went wrong with the client");
+        }
+    }
+
+    if (fio_destroy_torrent(&t)) {
+        log_printf(LOG_DEBUG, "Error while destroying the torrent struct: %s", strerror(errno));
+    }
+
+    tls_destroy(&server_tls);
+    tls_destroy(&client_tls);
+
     return 0;
 }
@@ -0,0 +1,1346 @@
+/**
+ * This file implements the UDP transport specified in udp.h.
+ */
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#include "udp.h"
+#include "enum.h"
+#include "logger.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/udp.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * State of a packet at the server
+ */
+enum { UDP__UNSENT = 0, UDP__FLIGHT, UDP__LOST, UDP__ACKED };
+
+/**
+ * What the server knows of the network path to a client, kept from one session to the next
+ */
+struct udp__path_t {
+    struct sockaddr_in addr;
+    double used; // when a session of the path last ended (utils_now), 0 if the entry is free
+    double window;
+    double threshold;
+    double srtt;
+    double rttvar;
+    double loss_rate; // of the last UDP__LOSS_WINDOW packets or so
+    uint32_t base_delay;
+    char has_base;
+};
+
+/**
+ * A request being served
+ */
+struct udp__session_t {
+    char active;
+    struct sockaddr_in addr;
+    uint32_t id;
+    size_t count;                           // blocks of the request
+    uint8_t *data;                          // count blocks of FIO_MAX_BLOCK_SIZE bytes
+    uint64_t sizes[REQUEST_MAX_BLOCKS];     // of each block, 0 if it is not available
+    uint32_t first[REQUEST_MAX_BLOCKS + 1]; // first packet of each block, first[count] packets in all
+    uint8_t *state;                         // UDP__UNSENT, UDP__FLIGHT, UDP__LOST or UDP__ACKED for each packet
+    uint8_t *resent;                        // the packet was sent more than once, its round trip is ambiguous
+    double *sent_at;                        // last time each packet was sent (utils_now)
+    uint32_t cumulative;                    // packets before this one are acknowledged
+    uint32_t next;                          // first packet never sent
+    uint32_t flight;                        // packets in UDP__FLIGHT
+    uint32_t lost;                          // packets in UDP__LOST
+    char acked;                             // packets may have been overtaken since the last loss detection
+    char probed;                            // the last packet in flight was sent again since the last progress
+    struct udp__path_t path;                // window, round trip and base delay
+    double rto;
+    double rack_sent;     // latest sending time of the acknowledged packets
+    uint32_t rack_seq;    // the last packet sent at that time, packets of a burst leave at the same time
+    double rack_rtt;      // round trip of that packet
+    double recovery_end;  // losses before this time belong to the same congestion event
+    double progress_at;   // when something was last acknowledged, or first sent (utils_now)
+    double heard_at;      // when the client was last heard of (utils_now)
+    double started;
+    uint64_t packets;     // packets sent, with the retransmissions
+    uint64_t retransmits;
+    uint64_t timeouts;    // retransmission timeouts
+    double queueing;      // last queueing delay measured, in seconds
+};
+
+/**
+ * Datagrams being prepared for one sendmmsg
+ */
+struct udp__batch_t {
+    struct mmsghdr msgs[UDP__BATCH];
+    struct iovec iov[UDP__BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        size_t align; // as struct cmsghdr
+    } control[UDP__BATCH];
+    uint8_t *buffers; // UDP__BATCH buffers of UDP__GSO_SEGMENTS datagrams
+    size_t count;
+};
+
+/**
+ * State of the server thread
+ */
+struct udp__server_t {
+    struct udp_t u;
+    struct fio_torrent_t *torrent;
+    struct udp__session_t sessions[UDP__SESSIONS];
+    struct udp__path_t paths[UDP__PATHS];
+    struct {
+        struct sockaddr_in addr;
+        uint32_t id;
+    } closed[UDP__CLOSED]; // sessions ended recently, a late copy of their request is ignored
+    size_t closed_next;
+    struct udp__batch_t batch;
+    uint8_t secret[UDP__SECRET]; // key of the cookies, drawn when the server starts
+};
+
+static struct udp__sim_t udp__simulation; ///< copied by udp_open, see udp_simulate
+
+/**
+ * Sender clock of the timestamps, in microseconds
+ */
+static uint32_t udp__clock(const double now) {
+    return (uint32_t)(uint64_t)(now * 1e6);
+}
+
+static char udp__same_address(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+void udp_simulate(double loss, double delay, double rate) {
+    udp__simulation.loss = loss;
+    udp__simulation.delay = delay;
+    udp__simulation.rate = rate;
+}
+
+/**
+ * Open a UDP socket, see udp_open
+ * @param shared let other sockets bind the same port, to receive the same multicast group
+ */
+static int udp__open(struct udp_t *u, uint16_t port, const int shared) {
+    memset(u, 0, sizeof(struct udp_t));
+    u->sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (u->sock < 0) {
+        log_printf(LOG_DEBUG, "Socket failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if (shared && setsockopt(u->sock, SOL_SOCKET, SO_REUSEADDR, &shared, sizeof(shared))) {
+        log_printf(LOG_DEBUG, "Cannot share the port: %s", strerror(errno));
+        close(u->sock);
+        u->sock = -1;
+        return -1;
+    }
+
+    struct sockaddr_in hint;
+    memset(&hint, 0, sizeof(struct sockaddr_in));
+    hint.sin_family = AF_INET;
+    hint.sin_addr.s_addr = INADDR_ANY;
+    hint.sin_port = htons(port);
+
+    if (bind(u->sock, (struct sockaddr *)&hint, sizeof(hint))) {
+        log_printf(LOG_DEBUG, "Bind failed: %s", strerror(errno));
+        close(u->sock);
+        u->sock = -1;
+        return -1;
+    }
+
+    u->in = malloc(sizeof(struct udp_datagram_t) * UDP__BATCH);
+
+    if (u->in == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        close(u->sock);
+        u->sock = -1;
+        return -1;
+    }
+
+    // a window of data arrives at once, the kernel caps this to net.core.rmem_max and wmem_max
+    const int buffer = UDP__SOCKET_BUFFER;
+
+    if (setsockopt(u->sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer)) ||
+        setsockopt(u->sock, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer))) {
+        log_printf(LOG_DEBUG, "Cannot size the socket buffers: %s", strerror(errno));
+        errno = 0;
+    }
+
+#ifdef UDP_SEGMENT
+    const int segment = 0; // only probe, the size is given with each buffer
+    u->gso = setsockopt(u->sock, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+    errno = 0;
+#endif
+
+    u->sim = udp__simulation;
+    u->simulated = u->sim.loss > 0 || u->sim.delay > 0 || u->sim.rate > 0;
+    u->sim.seed = (unsigned int)getpid() ^ udp__clock(utils_now());
+    u->next_session = (uint32_t)rand_r(&u->sim.seed);
+
+    if (u->simulated)
+        log_printf(LOG_INFO, "UDP socket simulates %.1f%% loss, %.3f s delay, %.0f B/s", 100 * u->sim.loss,
+                   u->sim.delay, u->sim.rate);
+
+    return 0;
+}
+
+int udp_open(struct udp_t *u, uint16_t port) {
+    return udp__open(u, port, 0);
+}
+
+int udp_open_group(struct udp_t *u, const struct sockaddr_in *group, const struct in_addr interface) {
+    if (udp__open(u, ntohs(group->sin_port), 1))
+        return -1;
+
+    struct ip_mreq join;
+    join.imr_multiaddr = group->sin_addr;
+    join.imr_interface = interface;
+
+    if (setsockopt(u->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof(join))) {
+        log_printf(LOG_INFO, "Cannot join group %s: %s", inet_ntoa(group->sin_addr), strerror(errno));
+        udp_close(u);
+        return -1;
+    }
+
+    return 0;
+}
+
+void udp_close(struct udp_t *u) {
+    if (u->sock >= 0)
+        close(u->sock);
+
+    u->sock = -1;
+    free(u->in);
+    free(u->sim.held);
+    u->in = NULL;
+    u->sim.held = NULL;
+}
+
+/**
+ * Put the datagrams just received behind the simulated network
+ * @return 0 on success or -1 if there is no memory left
+ */
+static int udp__hold(struct udp_t *u, const struct udp_datagram_t *in, int count, const double now) {
+    struct udp__sim_t *sim = &u->sim;
+
+    for (int i = 0; i < count; i++) {
+        if ((double)rand_r(&sim->seed) / RAND_MAX < sim->loss)
+            continue;
+
+        double at = now;
+
+        if (sim->rate > 0) {
+            const double start = sim->link_free > now ? sim->link_free : now;
+
+            if (start - now > UDP__SIM_QUEUE) // the queue of the link is full
+                continue;
+
+            sim->link_free = start + (double)in[i].length / sim->rate;
+            at = sim->link_free;
+        }
+
+        if (sim->count == sim->allocated) {
+            const size_t allocated = sim->allocated ? 2 * sim->allocated : UDP__BATCH;
+            struct udp_datagram_t *held = malloc(sizeof(struct udp_datagram_t) * allocated);
+
+            if (held == NULL) {
+                log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+                return -1;
+            }
+
+            for (size_t j = 0; j < sim->count; j++) {
+                held[j] = sim->held[(sim->head + j) % sim->allocated];
+            }
+
+            free(sim->held);
+            sim->held = held;
+            sim->head = 0;
+            sim->allocated = allocated;
+        }
+
+        struct udp_datagram_t *d = &sim->held[(sim->head + sim->count) % sim->allocated];
+        *d = in[i];
+        d->at = at + sim->delay;
+        sim->count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Take the datagrams the simulated network delivers by now, at most UDP__BATCH
+ */
+static int udp__deliver(struct udp_t *u, struct udp_datagram_t *out, const double now) {
+    struct udp__sim_t *sim = &u->sim;
+    int n = 0;
+
+    while (sim->count > 0 && n < UDP__BATCH && sim->held[sim->head].at <= now) {
+        out[n++] = sim->held[sim->head];
+        sim->head = (sim->head + 1) % sim->allocated;
+        sim->count--;
+    }
+
+    return n;
+}
+
+/**
+ * Read the datagrams waiting on the socket, without blocking
+ * @return number of datagrams stored in out, at most UDP__BATCH, or -1 on error
+ */
+static int udp__recvmmsg(struct udp_t *u, struct udp_datagram_t *out) {
+    struct mmsghdr msgs[UDP__BATCH];
+    struct iovec iov[UDP__BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (int i = 0; i < UDP__BATCH; i++) {
+        iov[i].iov_base = out[i].data;
+        iov[i].iov_len = sizeof(out[i].data);
+        msgs[i].msg_hdr.msg_name = &out[i].from;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int n = recvmmsg(u->sock, msgs, UDP__BATCH, MSG_DONTWAIT, NULL);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED) {
+            errno = 0;
+            return 0;
+        }
+
+        log_printf(LOG_DEBUG, "recvmmsg failed: %s", strerror(errno));
+        return -1;
+    }
+
+    const double now = utils_now();
+
+    for (int i = 0; i < n; i++) {
+        out[i].length = msgs[i].msg_len;
+        out[i].at = now;
+    }
+
+    u->received += (uint64_t)n;
+    return n;
+}
+
+int udp_receive(struct udp_t *u, struct udp_datagram_t *out, const double wait) {
+    const double deadline = utils_now() + wait;
+
+    while (1) {
+        const double now = utils_now();
+        double timeout = deadline > now ? deadline - now : 0;
+
+        if (u->simulated && u->sim.count > 0 && u->sim.held[u->sim.head].at - now < timeout)
+            timeout = u->sim.held[u->sim.head].at > now ? u->sim.held[u->sim.head].at - now : 0;
+
+        struct pollfd pfd = {u->sock, POLLIN, 0};
+        const int r = poll(&pfd, 1, timeout > 0 ? (int)(timeout * 1000) + 1 : 0);
+
+        if (r < 0 && errno != EINTR) {
+            log_printf(LOG_DEBUG, "Poll failed: %s", strerror(errno));
+            return -1;
+        }
+
+        errno = 0;
+
+        if (r > 0) {
+            const int n = udp__recvmmsg(u, out);
+
+            if (n < 0)
+                return -1;
+
+            if (!u->simulated && n > 0)
+                return n;
+
+            if (u->simulated && udp__hold(u, out, n, utils_now()))
+                return -1;
+        }
+
+        if (u->simulated) {
+            const int n = udp__deliver(u, out, utils_now());
+
+            if (n > 0)
+                return n;
+        }
+
+        if (utils_now() >= deadline)
+            return 0;
+    }
+}
+
+/**
+ * Send one datagram, a lost one is recovered by the protocol
+ */
+static void udp__send(struct udp_t *u, const struct sockaddr_in *to, const void *data, const size_t length) {
+    if (sendto(u->sock, data, length, 0, (const struct sockaddr *)to, sizeof(struct sockaddr_in)) < 0) {
+        log_printf(LOG_DEBUG, "sendto failed: %s", strerror(errno));
+        errno = 0;
+        return;
+    }
+
+    u->sent++;
+}
+
+/**
+ * Send the datagrams of a batch
+ */
+static void udp__flush(struct udp_t *u, struct udp__batch_t *b) {
+    size_t done = 0;
+
+    while (done < b->count) {
+        const int r = sendmmsg(u->sock, b->msgs + done, (unsigned int)(b->count - done), 0);
+
+        if (r < 0 && errno == EINTR) {
+            errno = 0;
+            continue;
+        }
+
+        if (r < 0 && u->gso && (errno == EIO || errno == EINVAL)) {
+            // the packets of the batch are lost, they are sent again one by one
+            log_printf(LOG_INFO, "UDP_SEGMENT refused (%s), sending datagrams one by one", strerror(errno));
+            errno = 0;
+            u->gso = 0;
+            break;
+        }
+
+        if (r <= 0) {
+            log_printf(LOG_DEBUG, "sendmmsg failed: %s", strerror(errno));
+            errno = 0;
+            break;
+        }
+
+        for (size_t i = done; i < done + (size_t)r; i++) {
+            const size_t segment = sizeof(struct udp_data_t) + UDP_PAYLOAD;
+            u->sent += (b->msgs[i].msg_hdr.msg_iov->iov_len + segment - 1) / segment;
+        }
+
+        done += (size_t)r;
+    }
+
+    b->count = 0;
+}
+
+/**
+ * Block of the request a packet belongs to
+ */
+static size_t udp__block_of(const struct udp__session_t *x, const uint32_t seq) {
+    size_t low = 0;
+    size_t high = x->count;
+
+    while (high - low > 1) {
+        const size_t middle = (low + high) / 2;
+
+        if (x->first[middle] <= seq)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+/**
+ * Write a packet of a session into a buffer
+ * @return the size of the datagram
+ */
+static size_t udp__write_packet(const struct udp__session_t *x, const uint32_t seq, uint8_t *buffer, const double now) {
+    const size_t i = udp__block_of(x, seq);
+    const uint32_t offset = (seq - x->first[i]) * UDP_PAYLOAD;
+
+    struct udp_data_t data;
+    data.header.magic_number = MAGIC_NUMBER;
+    data.header.message_code = MSG_UDP_DATA;
+    data.header.session = x->id;
+    data.seq = seq;
+    data.index = (uint8_t)i;
+    data.flags = x->sizes[i] == 0 ? UDP_FLAG_NA : 0;
+    data.offset = offset;
+    data.timestamp = udp__clock(now);
+
+    const size_t length = x->sizes[i] == 0 ? 0 : x->sizes[i] - offset < UDP_PAYLOAD ? x->sizes[i] - offset : UDP_PAYLOAD;
+
+    memcpy(buffer, &data, sizeof(data));
+    memcpy(buffer + sizeof(data), x->data + i * FIO_MAX_BLOCK_SIZE + offset, length);
+
+    return sizeof(data) + length;
+}
+
+/**
+ * Add packets of a session to the batch: one, or with UDP_SEGMENT several consecutive ones of the same block
+ * @param seq the first packet
+ * @param count number of packets, all full but the last one
+ */
+static void udp__queue(struct udp__server_t *s, struct udp__session_t *x, const uint32_t seq, const uint32_t count,
+                       const double now) {
+    struct udp__batch_t *b = &s->batch;
+
+    if (b->count == UDP__BATCH)
+        udp__flush(&s->u, b);
+
+    uint8_t *buffer = b->buffers + b->count * UDP__GSO_SEGMENTS * UDP__DATAGRAM;
+    size_t length = 0;
+
+    for (uint32_t j = 0; j < count; j++) {
+        length += udp__write_packet(x, seq + j, buffer + length, now);
+        x->state[seq + j] = UDP__FLIGHT;
+        x->sent_at[seq + j] = now;
+    }
+
+    x->flight += count;
+    x->packets += count;
+
+    struct msghdr *h = &b->msgs[b->count].msg_hdr;
+    memset(h, 0, sizeof(struct msghdr));
+    b->iov[b->count].iov_base = buffer;
+    b->iov[b->count].iov_len = length;
+    h->msg_name = &x->addr;
+    h->msg_namelen = sizeof(struct sockaddr_in);
+    h->msg_iov = &b->iov[b->count];
+    h->msg_iovlen = 1;
+
+#ifdef UDP_SEGMENT
+    if (count > 1) {
+        h->msg_control = b->control[b->count].buf;
+        h->msg_controllen = sizeof(b->control[b->count].buf);
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const uint16_t segment = sizeof(struct udp_data_t) + UDP_PAYLOAD;
+        memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+    }
+#endif
+
+    b->count++;
+}
+
+/**
+ * Find the path of a client, or the entry to reuse for it
+ */
+static struct udp__path_t *udp__path(struct udp__server_t *s, const struct sockaddr_in *addr) {
+    struct udp__path_t *oldest = &s->paths[0];
+
+    for (size_t i = 0; i < UDP__PATHS; i++) {
+        if (s->paths[i].used > 0 && udp__same_address(&s->paths[i].addr, addr))
+            return &s->paths[i];
+
+        if (s->paths[i].used < oldest->used)
+            oldest = &s->paths[i];
+    }
+
+    return oldest;
+}
+
+/**
+ * Log what a session did, remember its path and free it
+ */
+static void udp__close_session(struct udp__server_t *s, struct udp__session_t *x, const char *why) {
+    const double now = utils_now();
+
+    log_printf(LOG_INFO, "UDP session %u of %s:%d %s after %.3f s: %u packets of %zu blocks, %lu sent again, %lu timeouts, "
+                         "window %.0f B, rtt %.6f s, queueing %.6f s",
+               x->id, inet_ntoa(x->addr.sin_addr), ntohs(x->addr.sin_port), why, now - x->started,
+               x->first[x->count], x->count, x->retransmits, x->timeouts, x->path.window, x->path.srtt, x->queueing);
+
+    struct udp__path_t *path = udp__path(s, &x->addr);
+    *path = x->path;
+    path->used = now;
+
+    s->closed[s->closed_next].addr = x->addr;
+    s->closed[s->closed_next].id = x->id;
+    s->closed_next = (s->closed_next + 1) % UDP__CLOSED;
+
+    free(x->data);
+    free(x->state);
+    free(x->resent);
+    free(x->sent_at);
+    memset(x, 0, sizeof(struct udp__session_t));
+}
+
+/**
+ * Find the session a datagram belongs to
+ * @return the session or NULL
+ */
+static struct udp__session_t *udp__find_session(struct udp__server_t *s, const struct udp_datagram_t *d) {
+    const struct udp_header_t *h = (const struct udp_header_t *)d->data;
+
+    for (size_t i = 0; i < UDP__SESSIONS; i++) {
+        if (s->sessions[i].active && s->sessions[i].id == h->session && udp__same_address(&s->sessions[i].addr, &d->from))
+            return &s->sessions[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Cookie of a client address and port, see MSG_UDP_COOKIE
+ * @param epoch the period of UDP__COOKIE_TTL seconds it is for
+ * @return the cookie, 0 (never taken) on error
+ */
+static uint64_t udp__cookie(const struct udp__server_t *s, const struct sockaddr_in *addr, const uint64_t epoch) {
+    uint8_t input[sizeof(addr->sin_addr.s_addr) + sizeof(addr->sin_port) + sizeof(epoch)];
+    memcpy(input, &addr->sin_addr.s_addr, sizeof(addr->sin_addr.s_addr));
+    memcpy(input + sizeof(addr->sin_addr.s_addr), &addr->sin_port, sizeof(addr->sin_port));
+    memcpy(input + sizeof(addr->sin_addr.s_addr) + sizeof(addr->sin_port), &epoch, sizeof(epoch));
+
+    uint8_t mac[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    uint64_t cookie = 0;
+
+    if (HMAC(EVP_sha256(), s->secret, (int)sizeof(s->secret), input, sizeof(input), mac, &length) != NULL)
+        memcpy(&cookie, mac, sizeof(cookie));
+
+    return cookie;
+}
+
+/**
+ * Tell whether a MSG_UDP_REQUEST carries the cookie of its source, and answer it with the cookie if it does not
+ * @return 1 if the request can be served, 0 otherwise
+ */
+static char udp__check_cookie(struct udp__server_t *s, const struct udp_datagram_t *d, const struct udp_request_t *request) {
+    const uint64_t epoch = (uint64_t)(utils_now() / UDP__COOKIE_TTL);
+    const uint64_t cookie = udp__cookie(s, &d->from, epoch);
+
+    if (request->cookie != 0 && (request->cookie == cookie || request->cookie == udp__cookie(s, &d->from, epoch - 1)))
+        return 1;
+
+    if (cookie == 0)
+        return 0;
+
+    struct udp_cookie_t answer;
+    answer.header.magic_number = MAGIC_NUMBER;
+    answer.header.message_code = MSG_UDP_COOKIE;
+    answer.header.session = request->header.session;
+    answer.cookie = cookie;
+    udp__send(&s->u, &d->from, &answer, sizeof(answer));
+
+    log_printf(LOG_DEBUG, "Sent a cookie to %s:%d", inet_ntoa(d->from.sin_addr), ntohs(d->from.sin_port));
+    return 0;
+}
+
+/**
+ * Start serving a MSG_UDP_REQUEST: read the blocks and set the packets up, once the client echoed its cookie
+ */
+static void udp__open_session(struct udp__server_t *s, const struct udp_datagram_t *d) {
+    struct fio_torrent_t *t = s->torrent;
+    struct udp_request_t request;
+    memcpy(&request, d->data, sizeof(request));
+
+    if (request.count == 0 || request.count > REQUEST_MAX_BLOCKS ||
+        d->length != sizeof(request) + request.count * sizeof(uint64_t)) {
+        log_printf(LOG_DEBUG, "Ignoring a bad request from %s", inet_ntoa(d->from.sin_addr));
+        return;
+    }
+
+    if (!udp__check_cookie(s, d, &request))
+        return;
+
+    for (size_t i = 0; i < UDP__CLOSED; i++) {
+        if (s->closed[i].id == request.header.session && udp__same_address(&s->closed[i].addr, &d->from))
+            return;
+    }
+
+    struct udp__session_t *x = NULL;
+    size_t same_source = 0;
+
+    for (size_t i = 0; i < UDP__SESSIONS; i++) {
+        if (!s->sessions[i].active && x == NULL)
+            x = &s->sessions[i];
+        else if (s->sessions[i].active && s->sessions[i].addr.sin_addr.s_addr == d->from.sin_addr.s_addr)
+            same_source++;
+    }
+
+    if (x == NULL || same_source >= UDP__SOURCE_SESSIONS) {
+        log_printf(LOG_INFO, "Too many UDP sessions%s, ignoring a request from %s", x == NULL ? "" : " from there",
+                   inet_ntoa(d->from.sin_addr));
+        return;
+    }
+
+    uint64_t blocks[REQUEST_MAX_BLOCKS];
+    memcpy(blocks, d->data + sizeof(request), request.count * sizeof(uint64_t));
+
+    x->count = request.count;
+    x->data = malloc(x->count * FIO_MAX_BLOCK_SIZE);
+
+    if (x->data == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        return;
+    }
+
+    for (size_t i = 0; i < x->count; i++) {
+        const uint64_t k = blocks[i];
+        x->sizes[i] = k < t->block_count && __atomic_load_n(&t->block_map[k], __ATOMIC_ACQUIRE) ? fio_get_block_size(t, k) : 0;
+    }
+
+    // consecutive available blocks are read with one preadv
+    for (size_t i = 0; i < x->count;) {
+        if (x->sizes[i] == 0) {
+            i++;
+            continue;
+        }
+
+        uint8_t *data[REQUEST_MAX_BLOCKS];
+        size_t run = 0;
+
+        do {
+            data[run] = x->data + (i + run) * FIO_MAX_BLOCK_SIZE;
+            run++;
+        } while (i + run < x->count && run < FIO_MAX_READ_BLOCKS && x->sizes[i + run] != 0 &&
+                 blocks[i + run] == blocks[i] + run);
+
+        if (fio_read_blocks(t, blocks[i], data, run)) {
+            log_printf(LOG_INFO, "Cannot read blocks %lu to %lu: %s", blocks[i], blocks[i] + run - 1, strerror(errno));
+            errno = 0;
+
+            for (size_t j = i; j < i + run; j++) {
+                x->sizes[j] = 0;
+            }
+        }
+
+        i += run;
+    }
+
+    x->first[0] = 0;
+
+    for (size_t i = 0; i < x->count; i++) {
+        const uint32_t packets = x->sizes[i] == 0 ? 1 : (uint32_t)((x->sizes[i] + UDP_PAYLOAD - 1) / UDP_PAYLOAD);
+        x->first[i + 1] = x->first[i] + packets;
+    }
+
+    const uint32_t total = x->first[x->count];
+    x->state = calloc(total, sizeof(uint8_t));
+    x->resent = calloc(total, sizeof(uint8_t));
+    x->sent_at = calloc(total, sizeof(double));
+
+    if (x->state == NULL || x->resent == NULL || x->sent_at == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        free(x->data);
+        free(x->state);
+        free(x->resent);
+        free(x->sent_at);
+        memset(x, 0, sizeof(struct udp__session_t));
+        return;
+    }
+
+    const double now = utils_now();
+    const struct udp__path_t *path = udp__path(s, &d->from);
+
+    if (path->used > 0 && now - path->used < UDP__PATH_TTL && udp__same_address(&path->addr, &d->from)) {
+        x->path = *path;
+    } else {
+        memset(&x->path, 0, sizeof(struct udp__path_t));
+        x->path.window = UDP__INITIAL_WINDOW;
+        x->path.threshold = UDP__MAX_WINDOW;
+    }
+
+    x->path.addr = d->from;
+    x->rto = x->path.srtt > 0 ? x->path.srtt + 4 * x->path.rttvar : UDP__INITIAL_RTO;
+    x->rto = x->rto < UDP__MIN_RTO ? UDP__MIN_RTO : x->rto > UDP__MAX_RTO ? UDP__MAX_RTO : x->rto;
+    x->addr = d->from;
+    x->id = request.header.session;
+    x->active = 1;
+    x->started = now;
+    x->heard_at = now;
+    x->progress_at = now;
+
+    log_printf(LOG_DEBUG, "UDP session %u of %s:%d: %zu blocks from %lu, %u packets", x->id,
+               inet_ntoa(d->from.sin_addr), ntohs(d->from.sin_port), x->count, blocks[0], total);
+}
+
+/**
+ * Mark a packet acknowledged
+ * @return bytes of block it carries, 0 if it was already acknowledged
+ */
+static double udp__acknowledge(struct udp__session_t *x, const uint32_t seq, double *rtt, const double now) {
+    if (x->state[seq] == UDP__ACKED)
+        return 0;
+
+    if (x->state[seq] == UDP__FLIGHT)
+        x->flight--;
+    else if (x->state[seq] == UDP__LOST)
+        x->lost--;
+
+    x->state[seq] = UDP__ACKED;
+    x->path.loss_rate -= x->path.loss_rate / UDP__LOSS_WINDOW;
+
+    if (x->sent_at[seq] > x->rack_sent || (x->sent_at[seq] == x->rack_sent && seq > x->rack_seq)) {
+        x->rack_sent = x->sent_at[seq];
+        x->rack_seq = seq;
+        x->rack_rtt = now - x->sent_at[seq];
+
+        if (!x->resent[seq])
+            *rtt = x->rack_rtt;
+    }
+
+    return UDP_PAYLOAD;
+}
+
+/**
+ * Halve the window, once per round trip. Losses with an empty queue are taken for noise on the link (radio,
+ * a faulty cable) unless there are many of them: a full queue would show as queueing delay first.
+ */
+static void udp__on_loss(struct udp__session_t *x, const double now) {
+    if (now < x->recovery_end)
+        return;
+
+    if (x->queueing < UDP__TARGET / 2 && x->path.loss_rate <= UDP__LOSS_TOLERANCE)
+        return;
+
+    x->path.window = x->path.window / 2 < UDP__MIN_WINDOW ? UDP__MIN_WINDOW : x->path.window / 2;
+    x->path.threshold = x->path.window;
+    x->recovery_end = now + (x->path.srtt > 0 ? x->path.srtt : x->rto);
+}
+
+/**
+ * Handle a MSG_UDP_ACK: mark the packets, measure the round trip and the queueing delay, and size the window
+ */
+static void udp__on_ack(struct udp__session_t *x, const struct udp_datagram_t *d, const double now) {
+    struct udp_ack_t ack;
+    memcpy(&ack, d->data, sizeof(ack));
+
+    if (ack.count > UDP_MAX_RANGES || d->length != sizeof(ack) + ack.count * sizeof(struct udp_range_t)) {
+        log_printf(LOG_DEBUG, "Ignoring a bad acknowledgement from %s", inet_ntoa(d->from.sin_addr));
+        return;
+    }
+
+    const uint32_t total = x->first[x->count];
+    double rtt = 0;
+    double bytes = 0;
+
+    for (uint32_t seq = x->cumulative; seq < ack.cumulative && seq < total; seq++) {
+        bytes += udp__acknowledge(x, seq, &rtt, now);
+    }
+
+    for (uint8_t r = 0; r < ack.count; r++) {
+        struct udp_range_t range;
+        memcpy(&range, d->data + sizeof(ack) + r * sizeof(range), sizeof(range));
+
+        for (uint32_t seq = range.first; seq <= range.last && seq < total; seq++) {
+            bytes += udp__acknowledge(x, seq, &rtt, now);
+        }
+    }
+
+    while (x->cumulative < total && x->state[x->cumulative] == UDP__ACKED) {
+        x->cumulative++;
+    }
+
+    if (bytes == 0)
+        return;
+
+    x->acked = 1;
+    x->probed = 0;
+    x->progress_at = now;
+
+    struct udp__path_t *path = &x->path;
+
+    if (rtt > 0) {
+        if (path->srtt == 0) {
+            path->srtt = rtt;
+            path->rttvar = rtt / 2;
+        } else {
+            path->rttvar = 0.75 * path->rttvar + 0.25 * fabs(path->srtt - rtt);
+            path->srtt = 0.875 * path->srtt + 0.125 * rtt;
+        }
+
+        x->rto = path->srtt + 4 * path->rttvar;
+        x->rto = x->rto < UDP__MIN_RTO ? UDP__MIN_RTO : x->rto > UDP__MAX_RTO ? UDP__MAX_RTO : x->rto;
+    }
+
+    // the clocks of both ends differ by an unknown offset, which the base delay takes away
+    if (!path->has_base || (int32_t)(ack.delay - path->base_delay) < 0) {
+        path->base_delay = ack.delay;
+        path->has_base = 1;
+    }
+
+    x->queueing = (double)(int32_t)(ack.delay - path->base_delay) / 1e6;
+
+    if (path->window < path->threshold && x->queueing < 0.75 * UDP__TARGET) {
+        path->window += bytes; // slow start
+    } else {
+        path->threshold = path->window < path->threshold ? path->window : path->threshold;
+        const double off_target = (UDP__TARGET - x->queueing) / UDP__TARGET;
+
+        // above the target the window shrinks in proportion to its size (LEDBAT++), by half per round trip at
+        // most, instead of one packet per round trip
+        if (off_target >= 0)
+            path->window += UDP__GAIN * off_target * bytes * UDP_PAYLOAD / path->window;
+        else
+            path->window -= (-off_target < 0.5 ? -off_target : 0.5) * bytes;
+    }
+
+    path->window = path->window < UDP__MIN_WINDOW ? UDP__MIN_WINDOW : path->window > UDP__MAX_WINDOW ? UDP__MAX_WINDOW : path->window;
+}
+
+/**
+ * Declare lost the packets sent long enough before one that was acknowledged, and all of them when nothing was
+ * acknowledged for a retransmission timeout
+ */
+/**
+ * How long after the last progress the last packet in flight is sent again, so that its acknowledgement shows
+ * the losses before it without waiting for the retransmission timeout
+ */
+static double udp__probe_time(const struct udp__session_t *x) {
+    const double probe = x->path.srtt > 0 ? 2 * x->path.srtt : x->rto;
+    return x->probed || probe > x->rto ? x->rto : probe;
+}
+
+static void udp__detect_losses(struct udp__session_t *x, const double now) {
+    if (x->flight > 0 && !x->probed && now - x->progress_at > udp__probe_time(x)) {
+        uint32_t seq = x->next;
+
+        while (x->state[--seq] != UDP__FLIGHT) {
+        }
+
+        x->state[seq] = UDP__LOST; // sent again by udp__pump, the window stays
+        x->flight--;
+        x->lost++;
+        x->probed = 1;
+        x->progress_at = now; // the retransmission timeout starts again from the probe
+        return;
+    }
+
+    if (x->flight > 0 && now - x->progress_at > x->rto) {
+        for (uint32_t seq = x->cumulative; seq < x->next; seq++) {
+            if (x->state[seq] == UDP__FLIGHT) {
+                x->state[seq] = UDP__LOST;
+                x->lost++;
+            }
+        }
+
+        x->flight = 0;
+        x->path.threshold = x->path.window / 2 < UDP__MIN_WINDOW ? UDP__MIN_WINDOW : x->path.window / 2;
+        x->path.window = UDP__MIN_WINDOW;
+        x->recovery_end = now + x->rto;
+        x->rto = 2 * x->rto > UDP__MAX_RTO ? UDP__MAX_RTO : 2 * x->rto;
+        x->progress_at = now;
+        x->timeouts++;
+        return;
+    }
+
+    if (!x->acked)
+        return;
+
+    x->acked = 0;
+    const double reorder = UDP__REORDER * (x->path.srtt > 0 ? x->path.srtt : x->rack_rtt);
+    char lost = 0;
+
+    for (uint32_t seq = x->cumulative; seq < x->next; seq++) {
+        if (x->state[seq] != UDP__FLIGHT || x->sent_at[seq] > x->rack_sent ||
+            (x->sent_at[seq] == x->rack_sent && seq > x->rack_seq))
+            continue;
+
+        if (now - x->sent_at[seq] >= x->rack_rtt + reorder) {
+            x->state[seq] = UDP__LOST;
+            x->flight--;
+            x->lost++;
+            x->path.loss_rate += (1 - x->path.loss_rate) / UDP__LOSS_WINDOW;
+            lost = 1;
+        } else {
+            x->acked = 1; // overtaken but not for long enough yet, look again later
+        }
+    }
+
+    if (lost)
+        udp__on_loss(x, now);
+}
+
+/**
+ * Send what the window of a session allows: the lost packets first, then new ones
+ * @return 1 if the session has more to send than its window allows, 0 otherwise
+ */
+static int udp__pump(struct udp__server_t *s, struct udp__session_t *x, const double now) {
+    const uint32_t total = x->first[x->count];
+    uint32_t seq = x->cumulative;
+
+    while (x->lost > 0 && (double)x->flight * UDP_PAYLOAD < x->path.window) {
+        while (x->state[seq] != UDP__LOST) {
+            seq++;
+        }
+
+        x->lost--;
+        x->resent[seq] = 1;
+        x->retransmits++;
+        udp__queue(s, x, seq, 1, now);
+    }
+
+    while (x->next < total && (double)x->flight * UDP_PAYLOAD < x->path.window) {
+        const size_t i = udp__block_of(x, x->next);
+        const uint32_t room = (uint32_t)((x->path.window - (double)x->flight * UDP_PAYLOAD) / UDP_PAYLOAD) + 1;
+        uint32_t count = s->u.gso ? UDP__GSO_SEGMENTS : 1;
+
+        count = count < x->first[i + 1] - x->next ? count : x->first[i + 1] - x->next;
+        count = count < room ? count : room;
+
+        udp__queue(s, x, x->next, count, now);
+        x->next += count;
+    }
+
+    return x->lost > 0 || x->next < total;
+}
+
+/**
+ * Serve the torrent, see udp_start_server
+ */
+static void *udp__serve(void *arg) {
+    struct udp__server_t *s = arg;
+
+    while (1) {
+        double wait = 1.0;
+        const double before = utils_now();
+
+        for (size_t i = 0; i < UDP__SESSIONS; i++) {
+            const struct udp__session_t *x = &s->sessions[i];
+
+            if (x->active && x->flight > 0) {
+                const double timer = x->progress_at + udp__probe_time(x) - before;
+                const double rack = x->acked ? UDP__REORDER * x->rack_rtt : wait;
+                wait = timer < wait ? timer : wait;
+                wait = rack < wait ? rack : wait;
+            }
+        }
+
+        const int n = udp_receive(&s->u, s->u.in, wait > 0 ? wait : 0);
+
+        if (n < 0)
+            break;
+
+        const double now = utils_now();
+
+        for (int j = 0; j < n; j++) {
+            const struct udp_datagram_t *d = &s->u.in[j];
+            const struct udp_header_t *h = (const struct udp_header_t *)d->data;
+
+            if (d->length < sizeof(struct udp_header_t) || h->magic_number != MAGIC_NUMBER) {
+                log_printf(LOG_DEBUG, "Ignoring a bad datagram from %s", inet_ntoa(d->from.sin_addr));
+                continue;
+            }
+
+            struct udp__session_t *x = udp__find_session(s, d);
+
+            if (x != NULL)
+                x->heard_at = now;
+
+            if (h->message_code == MSG_UDP_REQUEST && x == NULL && d->length >= sizeof(struct udp_request_t))
+                udp__open_session(s, d);
+            else if (h->message_code == MSG_UDP_ACK && x != NULL && d->length >= sizeof(struct udp_ack_t))
+                udp__on_ack(x, d, now);
+            else if (h->message_code == MSG_UDP_DONE && x != NULL)
+                udp__close_session(s, x, x->cumulative == x->first[x->count] ? "done" : "given up");
+        }
+
+        for (size_t i = 0; i < UDP__SESSIONS; i++) {
+            struct udp__session_t *x = &s->sessions[i];
+
+            if (!x->active)
+                continue;
+
+            if (now - x->heard_at > UDP__IDLE) {
+                udp__close_session(s, x, "timed out");
+                continue;
+            }
+
+            udp__detect_losses(x, now);
+            udp__pump(s, x, now);
+        }
+
+        udp__flush(&s->u, &s->batch);
+    }
+
+    log_message(LOG_INFO, "The UDP server stopped");
+    return NULL;
+}
+
+int udp_start_server(uint16_t port, struct fio_torrent_t *torrent) {
+    struct udp__server_t *s = calloc(1, sizeof(struct udp__server_t));
+
+    if (s == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        return -1;
+    }
+
+    s->torrent = torrent;
+
+    if (RAND_bytes(s->secret, (int)sizeof(s->secret)) != 1) {
+        log_message(LOG_DEBUG, "Cannot draw the secret of the cookies");
+        free(s);
+        return -1;
+    }
+
+    if (udp_open(&s->u, port)) {
+        log_printf(LOG_INFO, "Cannot open UDP port %u", port);
+        free(s);
+        return -1;
+    }
+
+    s->batch.buffers = malloc((size_t)UDP__BATCH * UDP__GSO_SEGMENTS * UDP__DATAGRAM);
+
+    if (s->batch.buffers == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        udp_close(&s->u);
+        free(s);
+        return -1;
+    }
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, udp__serve, s)) {
+        log_message(LOG_DEBUG, "pthread_create failed");
+        udp_close(&s->u);
+        free(s->batch.buffers);
+        free(s);
+        return -1;
+    }
+
+    pthread_detach(thread);
+    log_printf(LOG_INFO, "Serving over UDP on port %u%s", port, s->u.gso ? " with UDP_SEGMENT" : "");
+    return 0;
+}
+
+/**
+ * Acknowledge what a client received: the first packet missing and the ranges after it
+ */
+static void udp__send_ack(struct udp_t *u, const struct sockaddr_in *peer, const uint32_t session,
+                          const uint8_t *received, const uint32_t cumulative, const uint32_t end, const uint32_t delay) {
+    uint8_t buffer[sizeof(struct udp_ack_t) + UDP_MAX_RANGES * sizeof(struct udp_range_t)];
+    struct udp_ack_t ack;
+    ack.header.magic_number = MAGIC_NUMBER;
+    ack.header.message_code = MSG_UDP_ACK;
+    ack.header.session = session;
+    ack.cumulative = cumulative;
+    ack.delay = delay;
+    ack.count = 0;
+
+    for (uint32_t seq = cumulative; seq < end && ack.count < UDP_MAX_RANGES; seq++) {
+        if (!received[seq])
+            continue;
+
+        struct udp_range_t range = {seq, seq};
+
+        while (range.last + 1 < end && received[range.last + 1]) {
+            range.last++;
+        }
+
+        memcpy(buffer + sizeof(ack) + ack.count * sizeof(range), &range, sizeof(range));
+        ack.count++;
+        seq = range.last;
+    }
+
+    memcpy(buffer, &ack, sizeof(ack));
+    udp__send(u, peer, buffer, sizeof(ack) + ack.count * sizeof(struct udp_range_t));
+}
+
+/**
+ * Send a message made of the header only
+ */
+static void udp__send_header(struct udp_t *u, const struct sockaddr_in *peer, const uint8_t code, const uint32_t session) {
+    struct udp_header_t h;
+    h.magic_number = MAGIC_NUMBER;
+    h.message_code = code;
+    h.session = session;
+    udp__send(u, peer, &h, sizeof(h));
+}
+
+/**
+ * Cookie kept for a server, see MSG_UDP_COOKIE
+ * @return the cookie, 0 if there is none
+ */
+static uint64_t udp__known_cookie(const struct udp_t *u, const struct sockaddr_in *peer) {
+    for (size_t i = 0; i < UDP__COOKIES; i++) {
+        if (u->cookies[i].cookie != 0 && udp__same_address(&u->cookies[i].addr, peer))
+            return u->cookies[i].cookie;
+    }
+
+    return 0;
+}
+
+/**
+ * Keep the cookie a server sent, in place of the one it had or of the oldest entry
+ */
+static void udp__keep_cookie(struct udp_t *u, const struct sockaddr_in *peer, const uint64_t cookie) {
+    for (size_t i = 0; i < UDP__COOKIES; i++) {
+        if (u->cookies[i].cookie != 0 && udp__same_address(&u->cookies[i].addr, peer)) {
+            u->cookies[i].cookie = cookie;
+            return;
+        }
+    }
+
+    u->cookies[u->cookie_next].addr = *peer;
+    u->cookies[u->cookie_next].cookie = cookie;
+    u->cookie_next = (u->cookie_next + 1) % UDP__COOKIES;
+}
+
+int udp_fetch(struct udp_t *u, const struct fio_torrent_t *torrent, const struct sockaddr_in *peer,
+              const uint64_t *blocks, size_t count, uint8_t *const *data, double timeout, udp_block_cb done, void *arg) {
+    assert(count > 0 && count <= REQUEST_MAX_BLOCKS);
+
+    uint8_t request[sizeof(struct udp_request_t) + REQUEST_MAX_BLOCKS * sizeof(uint64_t)];
+    struct udp_request_t r;
+    r.header.magic_number = MAGIC_NUMBER;
+    r.header.message_code = MSG_UDP_REQUEST;
+    r.header.session = u->next_session++;
+    r.cookie = udp__known_cookie(u, peer);
+    r.count = (uint8_t)count;
+    memcpy(request, &r, sizeof(r));
+    memcpy(request + sizeof(r), blocks, count * sizeof(uint64_t));
+
+    const size_t request_length = sizeof(r) + count * sizeof(uint64_t);
+    const uint32_t most = (uint32_t)count * UDP_BLOCK_PACKETS;
+    uint8_t *received = calloc(most, sizeof(uint8_t));
+
+    if (received == NULL) {
+        log_printf(LOG_DEBUG, "Malloc failed: %s", strerror(errno));
+        errno = 0;
+        return -1;
+    }
+
+    uint64_t pieces[REQUEST_MAX_BLOCKS] = {0}; // bitmap of the packets of each block received
+    char settled[REQUEST_MAX_BLOCKS] = {0};
+    size_t settled_count = 0;
+    uint32_t cumulative = 0;
+    uint32_t end = 0; // one after the highest packet received
+    double heard_at = 0;
+    int tries = 1;
+
+    udp__send(u, peer, request, request_length);
+    double asked_at = utils_now();
+
+    while (settled_count < count) {
+        const double now = utils_now();
+        double wait;
+
+        if (heard_at == 0) {
+            if (now - asked_at >= UDP__REQUEST_RETRY) {
+                if (tries == UDP__REQUEST_TRIES)
+                    break;
+
+                udp__send(u, peer, request, request_length);
+                asked_at = now;
+                tries++;
+            }
+
+            wait = asked_at + UDP__REQUEST_RETRY - now;
+        } else {
+            if (now - heard_at >= timeout) {
+                log_printf(LOG_INFO, "UDP peer %s:%d stopped sending", inet_ntoa(peer->sin_addr), ntohs(peer->sin_port));
+                break;
+            }
+
+            wait = heard_at + timeout - now;
+        }
+
+        const int n = udp_receive(u, u->in, wait);
+
+        if (n < 0)
+            break;
+
+        char any = 0;
+        uint32_t delay = 0;
+
+        for (int j = 0; j < n; j++) {
+            const struct udp_datagram_t *d = &u->in[j];
+            struct udp_data_t msg;
+
+            if (!udp__same_address(&d->from, peer))
+                continue;
+
+            if (d->length == sizeof(struct udp_cookie_t) && heard_at == 0) { // ask again with the cookie
+                struct udp_cookie_t c;
+                memcpy(&c, d->data, sizeof(c));
+
+                if (c.header.magic_number == MAGIC_NUMBER && c.header.message_code == MSG_UDP_COOKIE &&
+                    c.header.session == r.header.session && c.cookie != 0 && c.cookie != r.cookie) {
+                    udp__keep_cookie(u, peer, c.cookie);
+                    r.cookie = c.cookie;
+                    memcpy(request, &r, sizeof(r));
+                    udp__send(u, peer, request, request_length);
+                    asked_at = utils_now();
+                }
+                continue;
+            }
+
+            if (d->length < sizeof(msg))
+                continue;
+
+            memcpy(&msg, d->data, sizeof(msg));
+
+            if (msg.header.magic_number != MAGIC_NUMBER || msg.header.message_code != MSG_UDP_DATA ||
+                msg.header.session != r.header.session || msg.seq >= most || msg.index >= count)
+                continue;
+
+            const uint32_t sample = udp__clock(d->at) - msg.timestamp;
+
+            if (!any || (int32_t)(sample - delay) < 0)
+                delay = sample;
+
+            any = 1;
+            heard_at = d->at;
+
+            if (received[msg.seq]) {
+                u->duplicates++;
+                continue;
+            }
+
+            received[msg.seq] = 1;
+            end = msg.seq + 1 > end ? msg.seq + 1 : end;
+
+            while (cumulative < end && received[cumulative]) {
+                cumulative++;
+            }
+
+            const size_t i = msg.index;
+
+            if (settled[i])
+                continue;
+
+            if (msg.flags & UDP_FLAG_NA) {
+                settled[i] = 1;
+                settled_count++;
+                done(arg, i, 0);
+                continue;
+            }
+
+            const uint64_t size = fio_get_block_size(torrent, blocks[i]);
+            const size_t length = d->length - sizeof(msg);
+            const size_t piece = msg.offset / UDP_PAYLOAD;
+
+            if (msg.offset % UDP_PAYLOAD || msg.offset + length > size ||
+                length != (size - msg.offset < UDP_PAYLOAD ? size - msg.offset : UDP_PAYLOAD)) {
+                log_printf(LOG_DEBUG, "Bad packet for block %lu at %u", blocks[i], msg.offset);
+                continue;
+            }
+
+            memcpy(data[i] + msg.offset, d->data + sizeof(msg), length);
+            pieces[i] |= (uint64_t)1 << piece;
+
+            if (pieces[i] == ((uint64_t)1 << ((size + UDP_PAYLOAD - 1) / UDP_PAYLOAD)) - 1) {
+                settled[i] = 1;
+                settled_count++;
+                done(arg, i, 1);
+            }
+        }
+
+        if (any)
+            udp__send_ack(u, peer, r.header.session, received, cumulative, end, delay);
+    }
+
+    udp__send_header(u, peer, MSG_UDP_DONE, r.header.session);
+    free(received);
+
+    return heard_at == 0 ? -1 : (int)settled_count;
+}
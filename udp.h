@@ -0,0 +1,334 @@
+/**
+ * UDP transport: an alternative to the TCP connections for the blocks, with delay-based congestion control so
+ * that bulk transfers yield to other traffic on a shared link, and without head-of-line blocking between the
+ * blocks of a request.
+ *
+ * A client sends MSG_UDP_REQUEST with a session number it chose and up to REQUEST_MAX_BLOCKS block numbers.
+ * It is only served once it showed that it receives at its address: a request without the right cookie is
+ * answered with MSG_UDP_COOKIE, a keyed hash of the address and port of the client under a secret of the
+ * server, valid for UDP__COOKIE_TTL to twice that. The client sends the request again with it, and keeps it for
+ * the next ones. The answer is smaller than the request and nothing is allocated or read before, so that
+ * requests from spoofed addresses neither amplify traffic nor hold memory, and a source address has at most
+ * UDP__SOURCE_SESSIONS sessions at a time.
+ * The server cuts each block into UDP_PAYLOAD byte packets (a block not available is one empty packet with
+ * UDP_FLAG_NA) and numbers all the packets of the session from 0, block after block. Each MSG_UDP_DATA says
+ * which block and offset it carries, so the client stores it right away and hands a block to the pipeline as
+ * soon as its last packet arrives, whatever happened to the others.
+ *
+ * The client answers the data with MSG_UDP_ACK: the first sequence number it misses, up to UDP_MAX_RANGES
+ * ranges received after it (selective acknowledgements) and the lowest one-way delay seen since the last
+ * acknowledgement, its clock minus the timestamp of the packet. The server:
+ * - keeps the lowest delay of the path as its base, the rest is time spent in queues;
+ * - sizes its window as LEDBAT (RFC 6817) does: it grows while the queueing delay is below UDP__TARGET and
+ *   shrinks when it is above, in proportion to the window as in LEDBAT++, after a slow start that stops at 3/4
+ *   of the target;
+ * - declares a packet lost when one sent UDP__REORDER round trips after it was acknowledged, or when nothing
+ *   was acknowledged for a retransmission timeout; after two round trips without progress, it first sends the
+ *   last packet again, whose acknowledgement shows what was lost before it;
+ * - halves the window once per round trip of losses, unless they are few and the queue is empty: random
+ *   losses alone do not slow the transfer down as they do with TCP.
+ * The window, base delay and round trip time of a path are kept from one session to the next.
+ *
+ * Datagrams are sent and received in batches of UDP__BATCH with sendmmsg and recvmmsg. Where the kernel
+ * supports UDP_SEGMENT, consecutive packets of a block leave as one buffer that the kernel (or the network
+ * card) cuts into datagrams.
+ *
+ * The client sends MSG_UDP_DONE when it has every block, or gives up. Sessions the server does not hear of
+ * for UDP__IDLE seconds are dropped. Integers are in host byte order, as in utils_message_t.
+ *
+ * udp_simulate makes the sockets opened afterwards drop and delay the datagrams they receive, and queue them
+ * behind a link of a given rate, to test on loopback.
+ *
+ * Usage:
+ *
+ *   udp_start_server(8080, &torrent);                  // next to the TCP server, on the same port number
+ *
+ *   struct udp_t u;
+ *   udp_open(&u, 0);
+ *   int n = udp_fetch(&u, &torrent, &peer, blocks, count, data, timeout, on_block, arg);
+ *   udp_close(&u);
+ */
+
+#ifndef UDP_H_
+#define UDP_H_
+
+#include "file_io.h"
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bytes of a block in each MSG_UDP_DATA: with the header, a datagram fits an Ethernet frame
+ */
+#define UDP_PAYLOAD 1400
+
+/**
+ * Packets of a block, at most
+ */
+#define UDP_BLOCK_PACKETS ((FIO_MAX_BLOCK_SIZE + UDP_PAYLOAD - 1) / UDP_PAYLOAD)
+
+/**
+ * Most ranges in a MSG_UDP_ACK
+ */
+#define UDP_MAX_RANGES 32
+
+/**
+ * MSG_UDP_DATA flags
+ */
+#define UDP_FLAG_NA 1 // the block is not available, the packet is empty
+
+/**
+ * Queueing delay LEDBAT aims at, in seconds, and its gain (window change per round trip at the target)
+ */
+#define UDP__TARGET 0.025
+#define UDP__GAIN 1.0
+
+/**
+ * Bounds and initial size of the congestion window, in bytes
+ */
+#define UDP__MIN_WINDOW (2.0 * UDP_PAYLOAD)
+#define UDP__INITIAL_WINDOW (10.0 * UDP_PAYLOAD)
+#define UDP__MAX_WINDOW (16.0 * 1024 * 1024)
+
+/**
+ * Bounds of the retransmission timeout, in seconds
+ */
+#define UDP__MIN_RTO 0.02
+#define UDP__MAX_RTO 2.0
+#define UDP__INITIAL_RTO 0.5
+
+/**
+ * Fraction of the packets that may be lost without shrinking the window, while the queueing delay is below
+ * half the target, and number of packets the fraction is averaged over
+ */
+#define UDP__LOSS_TOLERANCE 0.1
+#define UDP__LOSS_WINDOW 1000.0
+
+/**
+ * Fraction of the round trip time a packet may be overtaken by later ones before it is declared lost
+ */
+#define UDP__REORDER 0.25
+
+/**
+ * Datagrams per sendmmsg or recvmmsg, and most packets in one UDP_SEGMENT buffer
+ */
+#define UDP__BATCH 64
+#define UDP__GSO_SEGMENTS 44
+
+/**
+ * Room for any datagram of the protocol
+ */
+#define UDP__DATAGRAM 2048
+
+/**
+ * Size asked for the socket buffers, in bytes
+ */
+#define UDP__SOCKET_BUFFER (8 * 1024 * 1024)
+
+/**
+ * Seconds after which the server drops a session it does not hear of, and forgets a path
+ */
+#define UDP__IDLE 10.0
+#define UDP__PATH_TTL 60.0
+
+/**
+ * Sessions served at the same time, paths remembered, and sessions remembered after they end
+ */
+#define UDP__SESSIONS 256
+#define UDP__PATHS 64
+#define UDP__CLOSED 64
+
+/**
+ * Seconds the client waits for the first packet before asking again, and how many times it asks
+ */
+#define UDP__REQUEST_RETRY 0.2
+#define UDP__REQUEST_TRIES 5
+
+/**
+ * Seconds after which the server changes the cookies (the previous ones are still taken), bytes of its secret,
+ * cookies a client keeps, and sessions a source address may have at the server at the same time
+ */
+#define UDP__COOKIE_TTL 60.0
+#define UDP__SECRET 32
+#define UDP__COOKIES 64
+#define UDP__SOURCE_SESSIONS 8
+
+/**
+ * Most seconds a datagram waits behind the simulated link before it is dropped, as a router queue would
+ */
+#define UDP__SIM_QUEUE 0.2
+
+/**
+ * Header of every datagram
+ * Disable structure packing so we can use it as a buffer.
+ */
+struct udp_header_t {
+    uint32_t magic_number; // MAGIC_NUMBER
+    uint8_t message_code;  // MSG_UDP_*
+    uint32_t session;      // chosen by the client
+} __attribute__((packed));
+
+/**
+ * MSG_UDP_REQUEST, followed by count uint64_t block numbers
+ */
+struct udp_request_t {
+    struct udp_header_t header;
+    uint64_t cookie; // from the MSG_UDP_COOKIE of the server, 0 before the first
+    uint8_t count;
+} __attribute__((packed));
+
+/**
+ * MSG_UDP_COOKIE, with the session of the request it answers
+ */
+struct udp_cookie_t {
+    struct udp_header_t header;
+    uint64_t cookie;
+} __attribute__((packed));
+
+/**
+ * MSG_UDP_DATA, followed by the payload
+ */
+struct udp_data_t {
+    struct udp_header_t header;
+    uint32_t seq;       // position of the packet in the session
+    uint8_t index;      // block of the request
+    uint8_t flags;      // UDP_FLAG_*
+    uint32_t offset;    // in the block
+    uint32_t timestamp; // sender clock when the packet left, in microseconds
+} __attribute__((packed));
+
+/**
+ * A range of received packets in a MSG_UDP_ACK, both ends included
+ */
+struct udp_range_t {
+    uint32_t first;
+    uint32_t last;
+} __attribute__((packed));
+
+/**
+ * MSG_UDP_ACK, followed by count udp_range_t in increasing order
+ */
+struct udp_ack_t {
+    struct udp_header_t header;
+    uint32_t cumulative; // every packet before this one was received
+    uint32_t delay;      // lowest receiver clock minus timestamp since the last acknowledgement, in microseconds
+    uint8_t count;
+} __attribute__((packed));
+
+/**
+ * A datagram received, or held by the simulated network until it is due
+ */
+struct udp_datagram_t {
+    struct sockaddr_in from;
+    size_t length;
+    double at; // when it is delivered (utils_now)
+    uint8_t data[UDP__DATAGRAM];
+};
+
+/**
+ * Datagrams received by a socket and not delivered yet, see udp_simulate
+ */
+struct udp__sim_t {
+    double loss;       // probability of dropping a datagram
+    double delay;      // seconds added to each datagram
+    double rate;       // bytes per second of the simulated link, 0 for no limit
+    double link_free;  // when the simulated link has sent what it holds (utils_now)
+    unsigned int seed; // for rand_r
+    struct udp_datagram_t *held; // ring of count datagrams from head, by delivery time
+    size_t head;
+    size_t count;
+    size_t allocated;
+};
+
+/**
+ * A UDP socket, with the simulated network in front of it
+ */
+struct udp_t {
+    int sock;
+    char gso;       // UDP_SEGMENT works on this socket
+    char simulated; // sim is used
+    struct udp__sim_t sim;
+    struct udp_datagram_t *in; // UDP__BATCH datagrams being received
+    uint32_t next_session;      // for the next udp_fetch
+    struct {
+        struct sockaddr_in addr;
+        uint64_t cookie; // 0 if the entry is free
+    } cookies[UDP__COOKIES];    // of the servers udp_fetch asked, see MSG_UDP_COOKIE
+    size_t cookie_next;         // entry taken next for a new server
+    uint64_t sent;       // datagrams sent
+    uint64_t received;   // datagrams received, before the simulation
+    uint64_t duplicates; // MSG_UDP_DATA received twice, on a client
+};
+
+/**
+ * Called by udp_fetch for each block of the request as soon as it is settled
+ * @param arg as given to udp_fetch
+ * @param index of the block in the request
+ * @param available 1 if the block is in its buffer, 0 if the server does not have it
+ */
+typedef void (*udp_block_cb)(void *arg, size_t index, int available);
+
+/**
+ * Make the sockets opened from now on simulate a network on what they receive
+ * @param loss probability of dropping each datagram
+ * @param delay seconds added to each datagram
+ * @param rate bytes per second of the link the datagrams queue behind, 0 for no limit
+ */
+void udp_simulate(double loss, double delay, double rate);
+
+/**
+ * Open a UDP socket
+ * @param u where the socket is stored
+ * @param port to bind, 0 for any
+ * @return 0 on success or -1 on error
+ */
+int udp_open(struct udp_t *u, uint16_t port);
+
+/**
+ * Open a UDP socket that receives a multicast group, sharing its port with the other members on this host
+ * @param u where the socket is stored
+ * @param group address and port of the group
+ * @param interface address of the interface to join it on, INADDR_ANY to let the kernel choose
+ * @return 0 on success or -1 on error
+ */
+int udp_open_group(struct udp_t *u, const struct sockaddr_in *group, const struct in_addr interface);
+
+/**
+ * Close a socket opened with udp_open
+ */
+void udp_close(struct udp_t *u);
+
+/**
+ * Receive datagrams, through the simulated network if there is one
+ * @param u socket opened with udp_open
+ * @param out room for UDP__BATCH datagrams, usually u->in
+ * @param wait most seconds to wait for the first one, 0 to only take what is there
+ * @return number of datagrams stored in out, 0 if none came in time, or -1 on error
+ */
+int udp_receive(struct udp_t *u, struct udp_datagram_t *out, const double wait);
+
+/**
+ * Serve a torrent over UDP in a new thread, until the process exits
+ * @param port the UDP port, usually the one of the TCP server
+ * @param torrent the torrent, only the blocks in block_map are served
+ * @return 0 on success or -1 on error
+ */
+int udp_start_server(uint16_t port, struct fio_torrent_t *torrent);
+
+/**
+ * Download blocks from a server over UDP
+ * @param u socket opened with udp_open
+ * @param torrent the torrent the blocks belong to
+ * @param peer address of the server
+ * @param blocks the block numbers
+ * @param count number of blocks, at most REQUEST_MAX_BLOCKS
+ * @param data the buffers where the blocks are stored, each of fio_get_block_size bytes
+ * @param timeout seconds without any packet from the server after which the blocks left are given up
+ * @param done called for each block once it is received or known not to be available
+ * @param arg given to done
+ * @return number of blocks settled, or -1 if the server never answered
+ */
+int udp_fetch(struct udp_t *u, const struct fio_torrent_t *torrent, const struct sockaddr_in *peer,
+              const uint64_t *blocks, size_t count, uint8_t *const *data, double timeout, udp_block_cb done, void *arg);
+
+#endif
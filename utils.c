@@ -2,13 +2,17 @@
 #include "file_io.h"
 #include "logger.h"
 #include "server.h"
+#include "tls.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
-int utils_create_torrent_struct(char *metainfo, struct fio_torrent_t *torrent) {
+int utils_create_torrent_struct(char *metainfo, struct fio_torrent_t *torrent, char unchecked) {
     assert(metainfo != NULL);
     assert(torrent != NULL);
 
@@ -33,7 +37,10 @@ int utils_create_torrent_struct(char *metainfo, struct fio_torrent_t *torrent) {
 
     strncpy(filename, metainfo, charcount);
 
-    if (fio_create_torrent_from_metainfo_file(metainfo, torrent, filename)) {
+    const int r = unchecked ? fio_create_torrent_unchecked(metainfo, torrent, filename)
+                            : fio_create_torrent_from_metainfo_file(metainfo, torrent, filename);
+
+    if (r) {
         log_printf(LOG_INFO, "Failed to load metainfo: %s", strerror(errno));
         errno = 0;
         return -1;
@@ -75,6 +82,7 @@ int utils_array_rcv_add(struct utils_array_rcv_data_t *this, const int sockd,
             this->content[i].data.block_number = buffer->block_number;
             this->content[i].data.magic_number = buffer->magic_number;
             this->content[i].data.message_code = buffer->message_code;
+            this->content[i].received = utils_now();
             log_printf(LOG_DEBUG, "Socket %i found in rcv array, updating message: magic_number = %x; message_code = %i; block_number = %i;",
                        sockd, buffer->magic_number, buffer->message_code, buffer->block_number);
             return 0;
@@ -98,6 +106,7 @@ int utils_array_rcv_add(struct utils_array_rcv_data_t *this, const int sockd,
     t->data.block_number = buffer->block_number;
     t->data.magic_number = buffer->magic_number;
     t->data.message_code = buffer->message_code;
+    t->received = utils_now();
     this->size++;
 
     log_printf(LOG_DEBUG, "Socket %i not found, added message: magic_number = %x; message_code = %i; block_number = %i;",
@@ -194,6 +203,15 @@ struct utils_message_t *utils_array_rcv_find(struct utils_array_rcv_data_t *this
     return NULL;
 }
 
+double utils_array_rcv_received(const struct utils_array_rcv_data_t *this, const int sockd) {
+    for (size_t i = 0; i < this->size; i++) {
+        if (this->content[i].from == sockd) {
+            return this->content[i].received;
+        }
+    }
+    return -1;
+}
+
 int utils_array_rcv_destroy(struct utils_array_rcv_data_t *this) {
     assert(this->content != NULL);
     free(this->content);
@@ -210,7 +228,11 @@ ssize_t utils_send_all(int socket, void *buffer, size_t length) {
     char *ptr = (char *)buffer;
     size_t total_lenth = 0;
     while (length > 0) {
-        ssize_t i = send(socket, ptr, length, MSG_NOSIGNAL);
+        ssize_t i = tls_send(socket, ptr, length);
+        if (i < 0 && errno == EINTR) { // a signal, e.g. SIGHUP, arrived first
+            errno = 0;
+            continue;
+        }
         if (i < 1)
             return i;
         ptr += (uint64_t)i;
@@ -224,7 +246,11 @@ ssize_t utils_recv_all(int socket, void *buffer, size_t length) {
     char *ptr = (char *)buffer;
     size_t total_lenth = 0;
     while (length > 0) {
-        ssize_t i = recv(socket, ptr, length, MSG_NOSIGNAL);
+        ssize_t i = tls_recv(socket, ptr, length);
+        if (i < 0 && errno == EINTR) { // a signal, e.g. SIGHUP, arrived first
+            errno = 0;
+            continue;
+        }
         if (i < 1)
             return i;
         ptr += (uint64_t)i;
@@ -233,3 +259,171 @@ ssize_t utils_recv_all(int socket, void *buffer, size_t length) {
     }
     return (ssize_t)total_lenth;
 }
+
+ssize_t utils_send_fd(int socket, void *buffer, size_t length, int fd) {
+    assert(length > 0);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    const ssize_t i = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (i < 1 || (size_t)i == length)
+        return i;
+
+    // the descriptor went with the first byte, send the rest as usual
+    const ssize_t rest = utils_send_all(socket, (char *)buffer + i, length - (size_t)i);
+    return rest < 1 ? rest : i + rest;
+}
+
+ssize_t utils_recv_fd_deadline(int socket, void *buffer, size_t length, double deadline, int *fd) {
+    *fd = -1;
+
+    if (utils_poll_deadline(socket, POLLIN, deadline))
+        return -1;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    const ssize_t i = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    if (i < 1)
+        return i;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if ((size_t)i == length)
+        return i;
+
+    const ssize_t rest = utils_recv_all_deadline(socket, (char *)buffer + i, length - (size_t)i, deadline, NULL);
+
+    if (rest < 1 && *fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+
+    return rest < 1 ? rest : i + rest;
+}
+
+int utils_poll_deadline(int socket, short events, double deadline) {
+    while (1) {
+        const double left = deadline - utils_now();
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        struct pollfd pfd = {.fd = socket, .events = events, .revents = 0};
+        int r = poll(&pfd, 1, (int)(left * 1000) + 1);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (r > 0)
+            return 0;
+    }
+}
+
+ssize_t utils_recv_all_deadline(int socket, void *buffer, size_t length, double deadline, size_t *received) {
+    char *ptr = (char *)buffer;
+    size_t total_lenth = 0;
+    while (length > 0) {
+        if (received != NULL)
+            *received = total_lenth;
+
+        // what TLS already decrypted does not make the socket readable
+        if (!tls_pending(socket) && utils_poll_deadline(socket, POLLIN, deadline))
+            return -1;
+
+        ssize_t i = tls_recv(socket, ptr, length);
+        if (i < 0 && (errno == EAGAIN || errno == EINTR)) { // the rest of a TLS record, or a signal
+            errno = 0;
+            continue;
+        }
+        if (i < 1)
+            return i;
+        ptr += (uint64_t)i;
+        length -= (size_t)i;
+        total_lenth += (size_t)i;
+    }
+    if (received != NULL)
+        *received = total_lenth;
+    return (ssize_t)total_lenth;
+}
+
+double utils_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int utils_parse_rate(const char *str, double *value) {
+    char *end;
+    double v = strtod(str, &end);
+
+    if (end == str || v < 0)
+        return -1;
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        v *= 1024;
+        // fall through
+    case 'M':
+    case 'm':
+        v *= 1024;
+        // fall through
+    case 'K':
+    case 'k':
+        v *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    *value = v;
+    return 0;
+}
+
+void utils_sleep(double seconds) {
+    if (seconds <= 0)
+        return;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        errno = 0;
+}
@@ -25,12 +25,24 @@ struct utils_message_payload_t {
     uint8_t data[FIO_MAX_BLOCK_SIZE];
 } __attribute__((packed));
 
+/**
+ * Body of MSG_HELLO, after a utils_message_t whose block_number is 0.
+ * Disable structure packing so we can use it as a buffer for recieving messages.
+ * */
+struct utils_hello_t {
+    uint16_t version;      // PROTOCOL_VERSION of the client, the lower of both in the answer
+    uint32_t capabilities; // CAP_* the client supports, those both support in the answer
+    uint16_t depth;        // most blocks the client asks for in a request, the lower of both in the answer
+    uint32_t block_size;   // FIO_MAX_BLOCK_SIZE, the same on both sides
+} __attribute__((packed));
+
 /**
  * Struct to store the data recieved
  */
 struct utils__rcv_data_t {
     int from;                    // socket
     struct utils_message_t data; // data
+    double received;             // when the message arrived (utils_now)
 };
 
 struct utils_array_rcv_data_t {
@@ -53,9 +65,10 @@ struct utils_array_pollfd_t {
  * structure pointed by torrent with fio_create_torrent_from_metainfo_file
  * @param metainfo string with .ttorrent extension 
  * @param ttorent Non null pointer to an allocated fio_torrent_t struct
+ * @param unchecked use fio_create_torrent_unchecked instead, leaving the blocks of the file to check
  * @return -1 if error 0 on success
  */
-int utils_create_torrent_struct(char *metainfo, struct fio_torrent_t *torrent);
+int utils_create_torrent_struct(char *metainfo, struct fio_torrent_t *torrent, char unchecked);
 
 
 /**
@@ -103,6 +116,14 @@ int utils_array_rcv_add(struct utils_array_rcv_data_t *this, const int sockd,
 struct utils_message_t *utils_array_rcv_find(struct utils_array_rcv_data_t *this,
                                              const int sockd);
 
+/**
+ * Find when the last message from sockd arrived
+ * @param this pointer to the structure
+ * @param socketd socket to find
+ * @return time of arrival (utils_now) or -1 if there is no message from sockd
+ */
+double utils_array_rcv_received(const struct utils_array_rcv_data_t *this, const int sockd);
+
 /**
  * Find inside the array the data recieved from sockd
  * @param this pointer to the structure
@@ -143,7 +164,7 @@ int utils_array_pollfd_destroy(struct utils_array_pollfd_t *this);
 int utils_array_rcv_destroy(struct utils_array_rcv_data_t *this);
 
 /**
- * Wrappers for send and recieving fragmented data 
+ * Wrappers for send and recieving fragmented data, through TLS on the sockets registered in tls.h
  * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
  * @param socket descriptor to send or recieve data from
  * @param buffer Buffer containing the data to send
@@ -158,7 +179,7 @@ int utils_array_rcv_destroy(struct utils_array_rcv_data_t *this);
 ssize_t utils_send_all(int socket, void *buffer, size_t length);
 
 /**
- * Wrappers for send and recieving fragmented data 
+ * Wrappers for send and recieving fragmented data, through TLS on the sockets registered in tls.h
  * https://stackoverflow.com/questions/13479760/c-socket-recv-and-send-all-data
  * @param socket descriptor to send or recieve data from
  * @param buffer Buffer containing the data to send
@@ -173,4 +194,65 @@ ssize_t utils_send_all(int socket, void *buffer, size_t length);
  */
 ssize_t utils_recv_all(int socket, void *buffer, size_t length);
 
+/**
+ * Wait until a socket is ready
+ * @param socket the descriptor
+ * @param events events to wait for, as in poll
+ * @param deadline absolute time, as returned by utils_now, when we stop waiting
+ * @return 0 if the socket is ready or -1 with errno set (ETIMEDOUT if the deadline passed)
+ */
+int utils_poll_deadline(int socket, short events, double deadline);
+
+/**
+ * Same as utils_recv_all but gives up when the deadline passes
+ * @param socket descriptor to recieve data from
+ * @param buffer Buffer where the data is stored
+ * @param length of the buffer
+ * @param deadline absolute time, as returned by utils_now, when we stop waiting
+ * @param received if not NULL, where the number of bytes recieved is stored, even on error
+ * @return Same as utils_recv_all, or -1 with errno set to ETIMEDOUT if the deadline passed
+ */
+ssize_t utils_recv_all_deadline(int socket, void *buffer, size_t length, double deadline, size_t *received);
+
+/**
+ * Send a whole buffer over a Unix socket with a descriptor attached to its first byte (SCM_RIGHTS)
+ * @param socket a connected AF_UNIX socket
+ * @param buffer the data, at least one byte
+ * @param length of the buffer
+ * @param fd the descriptor to pass, the receiver gets a duplicate of it
+ * @return Same as utils_send_all
+ */
+ssize_t utils_send_fd(int socket, void *buffer, size_t length, int fd);
+
+/**
+ * Same as utils_recv_all_deadline, also taking the descriptor attached with utils_send_fd
+ * @param socket a connected AF_UNIX socket
+ * @param buffer Buffer where the data is stored
+ * @param length of the buffer
+ * @param deadline absolute time, as returned by utils_now, when we stop waiting
+ * @param fd where the descriptor is stored, -1 if none came with the data
+ * @return Same as utils_recv_all_deadline
+ */
+ssize_t utils_recv_fd_deadline(int socket, void *buffer, size_t length, double deadline, int *fd);
+
+/**
+ * Monotonic clock
+ * @return seconds since an arbitrary point in the past
+ */
+double utils_now(void);
+
+/**
+ * Parse a rate or a size such as "512", "64K", "10M" or "1G" (powers of 1024)
+ * @param str the string
+ * @param value where the result is stored
+ * @return 0 on success or -1 if the string is not valid
+ */
+int utils_parse_rate(const char *str, double *value);
+
+/**
+ * Sleep, resuming after signals
+ * @param seconds time to sleep
+ */
+void utils_sleep(double seconds);
+
 #endif
\ No newline at end of file